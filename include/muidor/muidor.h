@@ -22,7 +22,9 @@
 #include <mooon/utils/exception.h>
 #include <mooon/utils/string_utils.h>
 #include <stdint.h>
+#include <time.h>
 #include <atomic>
+#include <map>
 #include <vector>
 namespace muidor {
 
@@ -31,7 +33,7 @@ enum
 {
     MU_BASE_YEAR = 2016,  // 基数年份，计时开始的年份
     MU_MAJOR_VERSION = 0, // 主版本号
-    MU_MINOR_VERSION = 4  // 次版本号
+    MU_MINOR_VERSION = 6  // 次版本号
 };
 
 // 出错代码（不要超过int32_t取值范围）
@@ -48,7 +50,11 @@ enum
     MUE_PARAMETER = 201600009,      // 参数错误
     MUE_MISMATCH = 201600010,       // 不匹配的响应
     MUE_UNEXCEPTED = 201600011,     // 非期望的响应，响应来自非请求的Agent
-    MUE_ILLEGAL = 201600012         // 非法的数据包
+    MUE_ILLEGAL = 201600012,        // 非法的数据包
+    MUE_NO_TAG = 201600013,         // 业务标签不存在
+    MUE_NO_SEGMENT = 201600014,     // 业务标签暂无可用的号段，稍后重试即可
+    MUE_TOO_MANY_COUNTERS = 201600015, // 命名计数器个数达到agent的上限
+    MUE_VERSION = 201600016         // 客户端版本过低，agent不再支持该请求
 };
 
 // 度量数据
@@ -68,6 +74,9 @@ struct Metric
     std::atomic<uint32_t> sys_exception; // 系统异常数
     std::atomic<uint32_t> exception; // 异常数
     std::atomic<uint32_t> retry_times; // 重试次数
+    std::atomic<uint32_t> hedge_requests; // 发出的对冲请求数
+    std::atomic<uint32_t> hedge_wins; // 对冲请求先于原请求应答的次数
+    std::atomic<uint32_t> circuit_opens; // agent被熔断的次数
 
     Metric();
 };
@@ -87,7 +96,7 @@ union UniqID
         uint64_t month:4;  // 当前月份
         uint64_t day:5;    // 当前月份的天
         uint64_t hour:5;   // 当前的小时数
-        uint64_t seq:29;   // 循环递增的序列号，最大为536870911，注意1小时内的数量不能超过这个值，否则会重！
+        uint64_t seq:29;   // 每小时从0开始递增的序列号，最大为536870911，1小时内用完时agent报错MUE_OVERFLOW
 
         std::string str() const
         {
@@ -97,21 +106,156 @@ union UniqID
     }id;
 };
 
+// ID的编码方式
+enum
+{
+    MU_ENCODING_UNIQ_ID = 0, // UniqID，seq在最高位
+    MU_ENCODING_SORTABLE = 1 // SortableID，时间在最高位，按时间有序
+};
+
+// 按时间有序（k-sortable）的64位唯一ID结构
+// 和UniqID由相同的user、label、seq和时间组成，只是位序不同：时间在最高位，接着是seq，然后是label和user，
+// 这样同一Agent产生的ID在数值上按时间递增，用作InnoDB等B-tree的主键时插入集中在尾部页，可避免随机的页分裂。
+//
+// 注意SortableID和UniqID的数值空间是重叠的，同一张表中不要混用两种编码。
+union SortableID
+{
+    uint64_t value;
+
+    struct ID
+    {
+        uint64_t user:6;   // 用户定义的前缀，默认为0，最大为63
+        uint64_t label:8;  // 机器的唯一标识，最多支持255台机器
+        uint64_t seq:29;   // 每小时从0开始递增的序列号，最大为536870911，1小时内用完时agent报错MUE_OVERFLOW
+        uint64_t hour:21;  // 本地时间从MU_BASE_YEAR年1月1日0时起经过的小时数，可支持到2255年
+
+        std::string str() const
+        {
+            return mooon::utils::CStringUtils::format_string("sortable://U%d/L%02X/H%u/S%u",
+                    (int)user, (int)label, (unsigned int)hour, (unsigned int)seq);
+        }
+    }id;
+};
+
+// 返回本地时间从MU_BASE_YEAR年1月1日0时起经过的小时数，即SortableID的hour值
+// current_seconds 通常为time(NULL)的返回值，为0时取当前时间
+uint32_t get_base_hours(uint64_t current_seconds=0);
+// 由年（4位数字）、月、日和小时计算从MU_BASE_YEAR年1月1日0时起经过的小时数，
+// 只做日历计算，不涉及时区
+uint32_t get_base_hours(int year, int month, int day, int hour);
+
+// SortableID的编码和解码，hour为get_base_hours的返回值
+uint64_t encode_sortable_id(uint8_t user, uint8_t label, uint32_t seq, uint32_t hour);
+void decode_sortable_id(uint64_t sortable_id, uint8_t* user, uint8_t* label, uint32_t* seq, uint32_t* hour);
+
+// UniqID和SortableID间的相互转换，转换前后的user、label、seq和小时均保持不变
+uint64_t uniq_id2sortable_id(uint64_t uniq_id);
+uint64_t sortable_id2uniq_id(uint64_t sortable_id);
+
+// 128位按时间有序的唯一ID，布局兼容UUIDv7（RFC 9562），也可编码为ULID文本，bytes为网络字节序（大端）：
+//   0~47位  毫秒时间戳（unix_ts_ms）
+//   48~51位 版本号，固定为7
+//   52~63位 高8位为label，低4位为随机数
+//   64~65位 变体，固定为二进制10
+//   66~127位 高32位为seq，低30位为随机数
+//
+// 唯一性由label和seq保证，随机数只用来增加不可猜测性，
+// 同一Agent产生的UUID在同一毫秒内按seq递增，因此也是按时间有序的。
+struct UUID128
+{
+    uint8_t bytes[16];
+
+    std::string str() const;
+};
+
+// UUID128的编码和解码，milliseconds为从1970-01-01 00:00:00 UTC起经过的毫秒数
+void encode_uuid(uint8_t label, uint32_t seq, uint64_t milliseconds, uint64_t random, struct UUID128* uuid);
+void decode_uuid(const struct UUID128& uuid, uint8_t* label, uint32_t* seq, uint64_t* milliseconds);
+
+// 转成标准UUID格式的字符串，如：0189c6a2-4f4b-7a10-8000-1e240dcb2f11，str至少要有37字节
+const char* uuid2string(const struct UUID128& uuid, char str[37], bool uppercase=false);
+std::string uuid2string(const struct UUID128& uuid, bool uppercase=false);
+// 转成ULID格式（Crockford's Base32）的字符串，如：01H72A4KTB7A80003R901VJBRH，str至少要有27字节
+const char* uuid2ulid(const struct UUID128& uuid, char str[27]);
+std::string uuid2ulid(const struct UUID128& uuid);
+
 const char* label2string(uint8_t label, char str[3], bool uppercase=true);
 std::string label2string(uint8_t label, bool uppercase=true);
 
+// 不抛异常的接口（try_*）出错时的上下文，出错时只记录这几个值，出错信息在调用str()时才生成，
+// 因此出错的路径上没有字符串的格式化和异常的栈展开
+struct MuError
+{
+    int errcode;          // 同异常的错误码：MUE_*，或系统调用的errno（超时为ETIMEDOUT）
+    const char* what;     // 出错的环节，如"receive timeout"，为静态字符串
+    const char* syscall;  // 系统调用出错时为它的名字（对应异常mooon::sys::CSyscallException），否则为NULL（mooon::utils::CException）
+    struct sockaddr_in agent_addr; // 出错时请求的agent，和agent无关的出错（如参数错误）时sin_family为0
+    uint16_t response_type; // 期望的应答类型
+    bool has_response;    // response中是否为出错的应答
+    char response[32];    // 出错的应答的消息头
+
+    MuError(): errcode(0), what(""), syscall(NULL), response_type(0), has_response(false)
+    {
+        agent_addr.sin_family = 0;
+    }
+
+    // 生成和异常相同的出错信息，如：[muidor][127.0.0.1:6200] receive timeout
+    std::string str() const;
+};
+
+struct MessageHead;
+struct ThreadContext;
+struct AgentStats;
+class CDatagramBatch;
+class CDatagramSocket;
+class CIdCache;
+class CAsyncMuidor;
+class CTransactionIdFormat;
+class CTransactionIdBatch;
+
 class CMuidor
 {
+    friend class CIdCache;
+    friend class CAsyncMuidor;
+
 public:
     // agent_nodes 以逗号分隔的agent节点字符串，如：192.168.31.21:6200,192.168.31.22:6200,192.168.31.23:6200
     // timeout_milliseconds 接收agent返回超时值
-    // retry_times 从一个agent取失败时，改从多少其它agent取，如果值为0表示不重试
+    // retry_times 从一个agent取失败时，改从多少其它agent取，如果值为0表示不重试，
+    //             重试时echo不变，重试到同一agent时由agent的应答缓存回复相同的结果，不会浪费seq
     // polling 是否轮询取agent，效率会比随机高一点
     //
+    // 实例记录各agent的延迟（EWMA）、超时率和agent应答中附带的负载，连续超时、发送失败或被对冲请求抢先应答3次的agent被熔断，
+    // 熔断期间不再选择，到期后只放一个请求做半开探测，成功则恢复，失败则熔断时长加倍（1秒起，最多16秒）。
+    // 随机方式为“二选一”：随机取两个agent，选延迟、超时率和负载综合代价小的，因此流量会在几秒内从慢、丢包或忙的agent移走；
+    // 轮询方式只跳过熔断中的agent。所有agent都被熔断时，仍选熔断最早到期的。
+    //
+    // 一个实例可被多个线程共用（如进程内共用一个），各线程有独立的socket和轮询游标，取ID时不加锁，
+    // 线程首次发往一个agent时创建发往它的socket（connect到该agent，内核过滤掉其它来源的报文），这些socket在线程退出或实例析构时关闭。
+    // 之前超时的请求迟到的应答按echo丢弃，不会使之后的请求失败。
+    //
     // 出错抛异常mooon::utils::CException
     CMuidor(const std::string& agent_nodes, uint32_t timeout_milliseconds=300, uint8_t retry_times=3, bool polling=false);
     ~CMuidor();
 
+    // 开启本地ID缓存，由后台线程批量预取seq，之后取单个且current_seconds为0的get_local_uniq_id和get_local_sortable_id
+    // 多数时候只在本线程内分配，不再访问agent，每批的大小随消耗速度在64到max_batch之间调整，
+    // UniqAgent的steps参数值最好是max_batch的10倍或以上。
+    // 缓存的seq在进程退出或跨小时后被丢弃，因此会有空洞，同一线程取得的ID也不再按时间顺序连续。
+    //
+    // 须在多个线程使用实例之前调用，重复调用无效
+    void enable_id_cache(uint16_t max_batch=4096);
+
+    // 开启对冲请求，用于降低单个agent慢或丢包时的长尾延迟：
+    // 发给一个agent的请求在delay_milliseconds毫秒内没有应答时，将同一请求（echo不变）再发给下一个agent，
+    // 两者中先到的有效应答胜出，都没有应答时在timeout_milliseconds后照常重试。
+    // use_p95为true时，延迟取该agent最近的p95应答延迟（不超过delay_milliseconds，样本不够时为delay_milliseconds）。
+    // 对冲的次数和对冲请求胜出的次数见mu_metric的hedge_requests和hedge_wins。
+    //
+    // 消耗seq的请求被对冲时两个agent都会分配，未被采用的成为空洞；只有一个agent或delay_milliseconds为0时不对冲。
+    // 须在多个线程使用实例之前调用
+    void enable_hedging(uint32_t delay_milliseconds, bool use_p95=false);
+
     // 取得机器Label（标签），用于唯一区分机器，同一时间两台机器不会出现相同的Label
     // 出错抛异常mooon::utils::CException和mooon::sys::CSyscallException
     uint8_t get_label() const;
@@ -130,7 +274,10 @@ public:
     // 取得一个唯一的无符号8字节的整数，可用来唯一标识一个消息等
     // current_seconds 通常为time(NULL)的返回值，user可以为用户定义的值，但最大只能为63
     //                 函数实现会取s的年份、月份、天和小时，具体可以参考UniqID的定义。
-    // 由于seq一小时内只有10亿的容量，如果不够用，则可以将分钟设置到user参数，这样就扩容1分钟10亿的容量。
+    // 由于seq一小时内只有5亿（2^29）的容量，如果不够用，则可以将分钟设置到user参数，这样就扩容1分钟5亿的容量。
+    // agent为每个小时单独分配seq（每小时从0开始），一小时内用完时报错MUE_OVERFLOW，而不是回绕产生重复的ID；
+    // current_seconds不在agent当前小时的前后1小时内时报错MUE_PARAMETER（0.6之前的agent接受任意的值），
+    // 因此客户端和agent须使用相同的时区。
     //
     // 出错抛异常mooon::utils::CException和mooon::sys::CSyscallException
     uint64_t get_uniq_id(uint8_t user=0, uint64_t current_seconds=0) const;
@@ -141,11 +288,44 @@ public:
     // UniqAgent的steps参数值，不能比num值小，最好是num的10倍或以上
     void get_local_uniq_id(uint16_t num, std::vector<uint64_t>* id_vec, uint8_t user=0, uint64_t current_seconds=0) const;
 
+    // 和get_uniq_id、get_local_uniq_id相同，只是返回的是按时间有序的SortableID，适合用作B-tree索引的主键
+    // 出错抛异常mooon::utils::CException和mooon::sys::CSyscallException
+    uint64_t get_sortable_id(uint8_t user=0, uint64_t current_seconds=0) const;
+    uint64_t get_local_sortable_id(uint8_t user=0, uint64_t current_seconds=0) const;
+    void get_local_sortable_id(uint16_t num, std::vector<uint64_t>* id_vec, uint8_t user=0, uint64_t current_seconds=0) const;
+
+    // 取得128位的UUIDv7/ULID，只从agent取得Label和Seq，组装在本地完成
+    // 批量时填充调用者提供的uuid_buffer，uuid_buffer至少要能存放num个UUID128，
+    // UniqAgent的steps参数值不能比num值小，最好是num的10倍或以上
+    // 出错抛异常mooon::utils::CException和mooon::sys::CSyscallException
+    void get_uuid(struct UUID128* uuid) const;
+    void get_uuid(uint16_t num, struct UUID128* uuid_buffer) const;
+
     // 同时取得机器Label和seq值，可用这两者来组装交易流水号等
     // UniqAgent的steps参数值不能比num值小，最好是num的10倍或以上
     // 出错抛异常mooon::utils::CException和mooon::sys::CSyscallException
     void get_label_and_seq(uint8_t* label, uint32_t* seq, uint16_t num=1) const;
 
+    // 号段模式，按业务标签（tag）取稠密且单调递增的整数，如发票号等，
+    // 号段由master统一管理（t_segment表），agent预取号段并在本地分配，不同agent之间的号段互不重叠。
+    //
+    // 参数num指定连续取多少个，返回值为起始值，count返回实际取得的个数，
+    // 为避免空洞，当前号段剩余不足num个时只返回剩余的部分，因此count可能小于num
+    //
+    // 出错抛异常mooon::utils::CException和mooon::sys::CSyscallException，
+    // 错误码为MUE_NO_TAG表示业务标签不存在，为MUE_NO_SEGMENT表示agent正在加载号段
+    uint64_t get_tag_seq(uint32_t tag, uint16_t num=1, uint16_t* count=NULL) const;
+
+    // 命名计数器，由agent在本地维护（如每个队列的消息序号、每个分区的偏移量等），从1开始单调递增，
+    // 计数器名不超过64字节，不同agent上的同名计数器是互相独立的。
+    //
+    // 参数num指定连续取多少个，返回值为起始值，count返回实际取得的个数，
+    // agent的counter_steps参数值比num小时只返回counter_steps个
+    //
+    // 出错抛异常mooon::utils::CException和mooon::sys::CSyscallException，
+    // 错误码为MUE_TOO_MANY_COUNTERS表示agent上的计数器个数已达上限
+    uint64_t inc_counter(const std::string& name, uint16_t num=1, uint16_t* count=NULL) const;
+
     // 取流水号、交易号等便利函数
     // format 取值：
     //   %Y 年份 4位数字，如：2016
@@ -160,7 +340,7 @@ public:
     //   %X 十六进制，可指定宽度，但总是以0填充
     //
     // 注意，只有%S、%d和%X有宽度参数，如：%4S%d，并且不足时统一填充0，不能指定填充数字，而且宽长参数不能超过9
-    // 使用示例：%9S, %2d, %5X，不能为%09S、%02d和%05X等，%10S等超过9的宽度是无效的。
+    // 使用示例：%9S, %2d, %5X，不能为%09S、%02d和%05X等，%0S和%10S等超过9的宽度是无效的。
     //
     // 出错抛异常mooon::utils::CException和mooon::sys::CSyscallException
     std::string get_transaction_id(const char* format, ...) const;
@@ -171,17 +351,272 @@ public:
     void get_transaction_id(uint16_t num, std::vector<std::string>* id_vec, const char* format, ...) const;
     void vget_transaction_id(uint16_t num, std::vector<std::string>* id_vec, const char* format, va_list& va) const;
 
+    // 用已取得的label和seq组装流水号，format同get_transaction_id，如用于CAsyncMuidor取得的label和seq
+    // 出错抛异常mooon::utils::CException
+    static std::string format_transaction_id(uint8_t label, uint32_t seq, const char* format, ...);
+
+    // 批量取流水号，format为预编译的格式（见CTransactionIdFormat），其它参数同上，
+    // 结果写入batch（覆盖原有内容），所有流水号存放在一块连续的内存中，batch重复使用时组装不再分配内存
+    // 出错抛异常mooon::utils::CException和mooon::sys::CSyscallException
+    void get_transaction_id(uint16_t num, CTransactionIdBatch* batch, const CTransactionIdFormat* format, ...) const;
+    void vget_transaction_id(uint16_t num, CTransactionIdBatch* batch, const CTransactionIdFormat* format, va_list& va) const;
+
+public:
+    // 以上接口的不抛异常的版本，参数和结果的含义同去掉try_的同名函数，结果由第一个（或num之后的）指针参数返回，
+    // 成功返回0，出错返回错误码（同对应异常的错误码），出错的详情见get_last_error()。
+    // 出错时只记录几个值，不格式化出错信息、不构造和抛出异常，适合在agent故障时仍要保持低开销的调用者；
+    // 内存不足时（std::bad_alloc）终止进程
+    int try_get_label(uint8_t* label) const noexcept;
+    int try_get_unqi_seq(uint32_t* seq, uint16_t num=1) const noexcept;
+    int try_get_uniq_id(uint64_t* uniq_id, uint8_t user=0, uint64_t current_seconds=0) const noexcept;
+    int try_get_local_uniq_id(uint64_t* uniq_id, uint8_t user=0, uint64_t current_seconds=0) const noexcept;
+    int try_get_local_uniq_id(uint16_t num, std::vector<uint64_t>* id_vec, uint8_t user=0, uint64_t current_seconds=0) const noexcept;
+    int try_get_sortable_id(uint64_t* sortable_id, uint8_t user=0, uint64_t current_seconds=0) const noexcept;
+    int try_get_local_sortable_id(uint64_t* sortable_id, uint8_t user=0, uint64_t current_seconds=0) const noexcept;
+    int try_get_local_sortable_id(uint16_t num, std::vector<uint64_t>* id_vec, uint8_t user=0, uint64_t current_seconds=0) const noexcept;
+    int try_get_uuid(struct UUID128* uuid) const noexcept;
+    int try_get_uuid(uint16_t num, struct UUID128* uuid_buffer) const noexcept;
+    int try_get_label_and_seq(uint8_t* label, uint32_t* seq, uint16_t num=1) const noexcept;
+    int try_get_tag_seq(uint64_t* value, uint32_t tag, uint16_t num=1, uint16_t* count=NULL) const noexcept;
+    int try_inc_counter(uint64_t* value, const std::string& name, uint16_t num=1, uint16_t* count=NULL) const noexcept;
+    int try_get_transaction_id(std::string* transaction_id, const char* format, ...) const noexcept;
+    int try_vget_transaction_id(std::string* transaction_id, const char* format, va_list& va) const noexcept;
+    int try_get_transaction_id(uint16_t num, std::vector<std::string>* id_vec, const char* format, ...) const noexcept;
+    int try_vget_transaction_id(uint16_t num, std::vector<std::string>* id_vec, const char* format, va_list& va) const noexcept;
+    int try_get_transaction_id(uint16_t num, CTransactionIdBatch* batch, const CTransactionIdFormat* format, ...) const noexcept;
+    int try_vget_transaction_id(uint16_t num, CTransactionIdBatch* batch, const CTransactionIdFormat* format, va_list& va) const noexcept;
+
+    // 本线程最近一次出错的详情（包括抛异常的接口），需要出错信息时调用它的str()，
+    // 只在下一次出错时被覆盖，因此应在出错后立即取用
+    static const struct MuError& get_last_error() noexcept;
+
 private:
-    const struct sockaddr_in& pick_agent() const;
+    uint32_t get_echo() const;
+    uint32_t pick_agent(uint32_t* cursor) const;
+    uint32_t pick_hedge_agent(uint32_t agent_index) const;
+    int check_agent(uint32_t agent_index, uint64_t now) const;
+    uint64_t get_agent_cost(uint32_t agent_index, uint64_t now) const;
+    uint32_t get_hedge_milliseconds(uint32_t agent_index) const;
+    void record_latency(uint32_t agent_index, uint32_t microseconds) const;
+    void record_success(uint32_t agent_index, uint16_t load) const;
+    void record_failure(uint32_t agent_index) const;
+    struct ThreadContext* get_thread_context() const;
+    CDatagramSocket* get_agent_socket(struct ThreadContext* context, uint32_t agent_index) const;
+    void release_thread_context(struct ThreadContext* context) const;
+    static void release_thread_contexts(void* contexts);
+    int call_agent(struct MessageHead* request, struct MessageHead* response, uint16_t response_type, struct MuError* error) const;
+    int call_agent_once(struct ThreadContext* context, const struct MessageHead* request, struct MessageHead* response,
+                        uint16_t response_type, uint8_t retry, struct MuError* error) const;
+    int get_uniq_id(uint64_t* uniq_id, uint8_t user, uint64_t current_seconds, uint32_t encoding) const;
+    int get_label_and_hour_seq(uint8_t* label, uint32_t* seq, uint16_t num, uint32_t hour, struct MuError* error) const;
 
 private:
-    mutable uint32_t _echo;
+    const uint64_t _instance; // 实例的唯一编号，用于查找线程的上下文
+    mutable std::atomic<uint32_t> _echo;
     const std::string& _agent_nodes;
     uint32_t _timeout_milliseconds;
     uint8_t _retry_times;
     bool _polling; // 是否轮询选择UniqAgent，否则随机方式，轮询方式选择开销小
     std::vector<struct sockaddr_in> _agents_addr;
-    mooon::net::CUdpSocket* _udp_socket;
+    mutable std::vector<CDatagramSocket*> _udp_sockets; // 各线程发往各agent的socket
+    CIdCache* _id_cache; // 本地ID缓存，未开启时为NULL
+    uint32_t _hedge_milliseconds; // 对冲的延迟，为0表示不对冲
+    bool _hedge_p95; // 对冲的延迟是否取agent最近的p95
+    struct AgentStats* _agent_stats; // 各agent的延迟、出错率、负载和熔断状态，和_agents_addr一一对应
+};
+
+// 预编译的流水号格式，format同CMuidor::get_transaction_id，
+// 编译时将format解析为操作的列表（相邻的普通字符合并为一个），之后组装时不再解析format。
+// 组装一批流水号时，seq之外的部分（普通字符、参数、Label和时间）只生成一次，每个流水号只复制它们并写seq的数字，
+// 时间的部分缓存在CTransactionIdBatch中，到下一分钟（format中没有%m时为下一小时）才重新取localtime。
+//
+// 编译后只读，可被多个线程共用，但每个线程须用自己的CTransactionIdBatch
+class CTransactionIdFormat
+{
+public:
+    CTransactionIdFormat();
+
+    // format无效时抛异常mooon::utils::CException，错误码为MUE_PARAMETER
+    explicit CTransactionIdFormat(const char* format);
+
+    // 重新编译，成功返回0，format无效时返回MUE_PARAMETER（详情见CMuidor::get_last_error()），并清空原来的内容
+    int compile(const char* format);
+
+    // 用已取得的label和起始seq组装num个流水号，写入batch（覆盖原有内容），如用于CAsyncMuidor取得的label和seq，
+    // 可变参数同CMuidor::get_transaction_id，num个流水号共用同一组参数，seq依次加1
+    void render(uint8_t label, uint32_t seq, uint16_t num, CTransactionIdBatch* batch, ...) const;
+    void vrender(uint8_t label, uint32_t seq, uint16_t num, CTransactionIdBatch* batch, va_list& va) const;
+
+private:
+    struct Op
+    {
+        uint8_t type;    // OP_*
+        uint8_t width;   // %S、%d和%X的宽度，为0表示未指定
+        uint32_t offset; // OP_LITERAL在_literals中的位置
+        uint32_t length;
+    };
+
+    enum
+    {
+        OP_LITERAL,
+        OP_SEQ_DEC,      // %S和%NS
+        OP_SEQ_HEX,      // 跟在%L或%X之后的%S，兼容原来以std::stringstream实现时沿用十六进制的输出
+        OP_LABEL,        // %L
+        OP_INT_DEC,      // %d和%Nd
+        OP_INT_HEX,      // %X和%NX
+        OP_STRING,       // %s
+        OP_YEAR,         // %Y
+        OP_MONTH,        // %M
+        OP_DAY,          // %D
+        OP_HOUR,         // %H
+        OP_MINUTE        // %m
+    };
+
+    void reset();
+
+private:
+    std::vector<struct Op> _ops;
+    std::string _literals; // 所有OP_LITERAL的字符
+    bool _has_time;        // 是否有%Y、%M、%D、%H或%m
+    bool _has_minute;      // 是否有%m
+};
+
+// 一批流水号，存放在一块连续的内存中，各以'\0'结尾，
+// 重复使用时只在容量不够时分配内存，因此适合一次组装成千上万个
+class CTransactionIdBatch
+{
+    friend class CTransactionIdFormat;
+
+public:
+    CTransactionIdBatch();
+
+    // 流水号的个数
+    size_t size() const { return _size; }
+
+    // 第index个流水号，以'\0'结尾，在batch下次被写入前有效
+    const char* data(size_t index) const { return &_buffer[_offsets[index]]; }
+    size_t length(size_t index) const { return _offsets[index+1] - _offsets[index] - 1; }
+    std::string str(size_t index) const { return std::string(data(index), length(index)); }
+
+    // 所有流水号所在的内存及其字节数（含各流水号的'\0'），第index个的起始位置为offset(index)
+    const char* data() const { return _buffer.empty()? NULL: &_buffer[0]; }
+    size_t bytes() const { return (0 == _size)? 0: _offsets[_size]; }
+    uint32_t offset(size_t index) const { return _offsets[index]; }
+
+    void clear() { _size = 0; }
+
+private:
+    // 一批中seq所在的位置：_stage中到stage_end为止的部分之后，写一个seq
+    struct SeqSlot
+    {
+        uint32_t stage_end;
+        uint8_t type;  // CTransactionIdFormat的OP_SEQ_DEC或OP_SEQ_HEX
+        uint8_t width;
+    };
+
+    const char* get_time_text(bool minute);
+
+private:
+    size_t _size;
+    std::vector<char> _buffer;
+    std::vector<uint32_t> _offsets; // 第index个流水号的起始位置，多一个元素为结尾
+    std::string _stage; // 本批中seq之外的部分
+    std::vector<struct SeqSlot> _slots;
+    time_t _time_begin;  // 缓存的时间是在这个时间取得的
+    time_t _minute_end;  // 含%m时，缓存的时间在此之前有效
+    time_t _hour_end;    // 不含%m时，缓存的时间在此之前有效
+    char _time_text[16]; // 缓存的时间，格式为YYYYMMDDHHmm
+};
+
+// 异步请求的结果
+struct AsyncResult
+{
+    uint32_t token;   // submit_*的返回值
+    int errcode;      // 为0表示成功，否则为出错代码（如MUE_*，超时为ETIMEDOUT）
+    uint16_t type;    // 应答类型，同protocol.h中的RESPONSE_*
+    uint8_t label;    // submit_label和submit_label_and_seq的Label
+    uint16_t count;   // submit_tag_seq和submit_counter实际取得的个数
+    uint64_t value;   // seq、ID、号段或计数器的（起始）值
+};
+
+// 非阻塞的CMuidor，用于epoll等事件循环：
+// submit_*发出请求后立即返回token，将get_fd()加入事件循环，可读或get_timeout()毫秒到期时调用complete()，
+// complete()收取应答（按echo匹配）并处理超时和重试，已完成的请求的结果追加到results中。
+// 多个请求可同时在途，分散在各agent上，超时和重试由时间轮驱动，重试规则同CMuidor（echo不变）。
+//
+// 使用CMuidor的agent、超时、重试次数和选择方式，一个实例只能由一个线程（事件循环）使用，
+// 不同线程可各自创建实例，共用一个CMuidor，CMuidor须比它后析构
+class CAsyncMuidor
+{
+public:
+    enum
+    {
+        TICK_MILLISECONDS = 10, // 时间轮的精度
+        WHEEL_SIZE = 256        // 时间轮的槽数，超时超过一轮的在到期前重新放入
+    };
+
+    // 出错抛异常mooon::sys::CSyscallException
+    explicit CAsyncMuidor(const CMuidor& muidor);
+    ~CAsyncMuidor();
+
+    // 非阻塞的socket，可读时调用complete()
+    int get_fd() const;
+
+    // 距下次需要调用complete()的毫秒数，没有在途的请求时返回-1，可直接作为epoll_wait等的超时参数
+    int get_timeout() const;
+
+    // 在途的请求数
+    size_t num_pending() const { return _requests.size(); }
+
+    // 收取应答、处理到期的超时和重试，将已完成的请求（成功或最终失败）的结果追加到results，返回追加的个数
+    int complete(std::vector<struct AsyncResult>* results);
+
+    // 发出请求，返回用于匹配结果的token，参数和结果的含义同CMuidor的同名函数，
+    // 发送失败不会抛异常，而是在超时后重试
+    uint32_t submit_label();
+    uint32_t submit_unqi_seq(uint16_t num=1);
+    uint32_t submit_uniq_id(uint8_t user=0, uint64_t current_seconds=0);
+    uint32_t submit_sortable_id(uint8_t user=0, uint64_t current_seconds=0);
+    uint32_t submit_label_and_seq(uint16_t num=1);
+    // 从hour（get_base_hours的值）小时的seq中取，用于在本地组装UniqID和SortableID，同get_local_uniq_id
+    uint32_t submit_label_and_hour_seq(uint16_t num, uint32_t hour);
+    uint32_t submit_tag_seq(uint32_t tag, uint16_t num=1);
+    // 计数器名无效时抛异常mooon::utils::CException
+    uint32_t submit_counter(const std::string& name, uint16_t num=1);
+
+private:
+    struct Request
+    {
+        std::string data; // 请求的报文，重试时原样发出
+        uint16_t response_type;
+        uint8_t attempts; // 已发送的次数
+        uint32_t agent_index; // 本次发往的agent
+        uint64_t send_time; // 本次发送的时间（单调时钟的微秒数），用于统计agent的延迟
+        uint64_t deadline; // 本次发送的超时时间（单调时钟的毫秒数）
+    };
+    struct Timer
+    {
+        uint32_t echo;
+        uint8_t attempts; // 和Request的attempts不同时，表示这次发送已有结果或已重试，忽略
+    };
+
+    uint32_t submit(struct MessageHead* request, uint16_t response_type);
+    void send(uint32_t echo, struct Request* request);
+    void add_timer(uint32_t echo, const struct Request& request);
+    void handle_response(const struct MessageHead* response, size_t size, const struct sockaddr_in& from_addr,
+                         std::vector<struct AsyncResult>* results);
+    void expire(uint64_t now, std::vector<struct AsyncResult>* results);
+    void retry_or_fail(std::map<uint32_t, struct Request>::iterator iter, int errcode, std::vector<struct AsyncResult>* results);
+
+private:
+    const CMuidor& _muidor;
+    uint8_t _max_attempts;
+    uint32_t _cursor; // 轮询选择agent的游标
+    CDatagramSocket* _udp_socket;
+    CDatagramBatch* _responses;
+    std::map<uint32_t, struct Request> _requests; // 在途的请求，以echo为键
+    std::vector<std::vector<struct Timer> > _wheel;
+    uint64_t _wheel_time; // 时间轮已处理到的时间（单调时钟的毫秒数）
 };
 
 } // namespace muidor {
@@ -0,0 +1,298 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#ifndef MUIDOR_COROUTINE_H
+#define MUIDOR_COROUTINE_H
+#include "muidor/muidor.h"
+// C++20协程版本的接口，只有头文件，编译器支持协程（g++ 10以上加-std=c++20，或-std=c++17加-fcoroutines）时才有效
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define MUIDOR_HAVE_COROUTINE 1
+#endif
+#endif
+
+#if MUIDOR_HAVE_COROUTINE == 1
+#include <coroutine>
+#include <exception>
+#include <mooon/sys/syscall_exception.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <tuple>
+namespace muidor {
+
+// 协程的执行器，在一个线程内驱动一个CAsyncMuidor：
+// co_await它的get_*时协程挂起，应答到达后由dispatch()在本线程恢复，
+// 因此一个线程上可同时有成千上万个协程在等待ID，不需要为每个请求占用一个线程。
+//
+// 可用内置的run()循环，也可接入外部的事件循环（如epoll、asio）：
+// 将get_fd()加入外部的事件循环，可读或get_timeout()毫秒到期时调用dispatch()。
+// 协程在调用dispatch()的线程中恢复，执行器只能由一个线程使用，析构时仍在等待的协程不会被恢复。
+//
+// get_*在返回awaiter时就已发出请求，而不是在co_await时，因此可先取得多个awaiter再逐个co_await，
+// 使这些请求同时在途；取得的awaiter都应co_await，否则它的结果会一直留在执行器中。
+//
+// co_await出错抛异常mooon::utils::CException和mooon::sys::CSyscallException，同CMuidor
+class CCoroutineExecutor
+{
+public:
+    // 等待一个异步请求的结果，在co_await时挂起，由执行器的dispatch()恢复
+    class CAwaiter
+    {
+    public:
+        CAwaiter(CCoroutineExecutor* executor, uint32_t token)
+            : _executor(executor), _token(token)
+        {
+        }
+
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> handle) { return _executor->wait(_token, handle, &_result); }
+
+        // 出错时抛异常
+        const struct AsyncResult& await_resume() const
+        {
+            if (ETIMEDOUT == _result.errcode)
+            {
+                THROW_SYSCALL_EXCEPTION("[muidor] receive timeout", ETIMEDOUT, "timed_receive_from");
+            }
+            if (_result.errcode != 0)
+            {
+                THROW_EXCEPTION(
+                        mooon::utils::CStringUtils::format_string("[muidor] error response: %d", _result.errcode),
+                        _result.errcode);
+            }
+            return _result;
+        }
+
+    private:
+        CCoroutineExecutor* _executor;
+        uint32_t _token;
+        struct AsyncResult _result;
+    };
+
+    class CValueAwaiter: public CAwaiter
+    {
+    public:
+        using CAwaiter::CAwaiter;
+        uint64_t await_resume() const { return CAwaiter::await_resume().value; }
+    };
+
+    struct LabelAndSeq
+    {
+        uint8_t label;
+        uint32_t seq;
+    };
+
+    class CLabelAndSeqAwaiter: public CAwaiter
+    {
+    public:
+        using CAwaiter::CAwaiter;
+        struct LabelAndSeq await_resume() const
+        {
+            const struct AsyncResult& result = CAwaiter::await_resume();
+            struct LabelAndSeq label_and_seq;
+            label_and_seq.label = result.label;
+            label_and_seq.seq = static_cast<uint32_t>(result.value);
+            return label_and_seq;
+        }
+    };
+
+    // 同CMuidor::get_local_uniq_id，在本地组装UniqID
+    class CLocalUniqIdAwaiter: public CAwaiter
+    {
+    public:
+        CLocalUniqIdAwaiter(CCoroutineExecutor* executor, uint32_t token, uint8_t user, const struct tm& now)
+            : CAwaiter(executor, token), _user(user), _now(now)
+        {
+        }
+
+        uint64_t await_resume() const
+        {
+            const struct AsyncResult& result = CAwaiter::await_resume();
+            union UniqID uniq_id;
+            uniq_id.id.user = _user;
+            uniq_id.id.label = result.label;
+            uniq_id.id.year = (_now.tm_year+1900) - MU_BASE_YEAR;
+            uniq_id.id.month = _now.tm_mon+1;
+            uniq_id.id.day = _now.tm_mday;
+            uniq_id.id.hour = _now.tm_hour;
+            uniq_id.id.seq = static_cast<uint32_t>(result.value);
+            return uniq_id.value;
+        }
+
+    private:
+        uint8_t _user;
+        struct tm _now;
+    };
+
+    // 同CMuidor::get_transaction_id，参数在co_await之前复制，只能是整数和字符串指针等可作为可变参数的类型，
+    // 字符串指针指向的内容须在co_await完成前有效
+    template <typename... Args>
+    class CTransactionIdAwaiter: public CAwaiter
+    {
+    public:
+        CTransactionIdAwaiter(CCoroutineExecutor* executor, uint32_t token, const char* format, Args... args)
+            : CAwaiter(executor, token), _format(format), _args(args...)
+        {
+        }
+
+        std::string await_resume() const
+        {
+            const struct AsyncResult& result = CAwaiter::await_resume();
+            return std::apply([&](Args... args) {
+                    return CMuidor::format_transaction_id(result.label, static_cast<uint32_t>(result.value), _format, args...);
+                }, _args);
+        }
+
+    private:
+        const char* _format;
+        std::tuple<Args...> _args;
+    };
+
+    // 无返回值、创建后立即执行的协程，用于在执行器上启动协程（也可用其它协程库的任务类型），
+    // 协程内未捕获的异常会终止进程
+    struct Task
+    {
+        struct promise_type
+        {
+            Task get_return_object() noexcept { return Task(); }
+            std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+            std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+            void return_void() noexcept {}
+            void unhandled_exception() noexcept { std::terminate(); }
+        };
+    };
+
+public:
+    // 出错抛异常mooon::sys::CSyscallException
+    explicit CCoroutineExecutor(const CMuidor& muidor)
+        : _async_muidor(muidor)
+    {
+    }
+
+    int get_fd() const { return _async_muidor.get_fd(); }
+    int get_timeout() const { return _async_muidor.get_timeout(); }
+    size_t num_waiting() const { return _waiters.size(); }
+
+    // 收取已完成的请求并恢复等待它们的协程，返回恢复的个数，
+    // 被恢复的协程可再次co_await，新的请求在下一次dispatch()时处理
+    int dispatch()
+    {
+        std::vector<struct AsyncResult> results;
+        int num_resumed = 0;
+
+        _async_muidor.complete(&results);
+        for (std::vector<struct AsyncResult>::size_type i=0; i<results.size(); ++i)
+        {
+            std::map<uint32_t, struct Waiter>::iterator iter = _waiters.find(results[i].token);
+            if (iter != _waiters.end())
+            {
+                const struct Waiter waiter = iter->second;
+                _waiters.erase(iter);
+                *waiter.result = results[i];
+                waiter.handle.resume();
+                ++num_resumed;
+            }
+            else
+            {
+                // 已发出但还未co_await的请求
+                _completed[results[i].token] = results[i];
+            }
+        }
+
+        return num_resumed;
+    }
+
+    // 内置的事件循环，直到没有在途的请求
+    void run()
+    {
+        while (_async_muidor.num_pending() > 0)
+        {
+            struct pollfd fds[1];
+            fds[0].fd = get_fd();
+            fds[0].events = POLLIN;
+            fds[0].revents = 0;
+            (void)poll(fds, 1, get_timeout());
+            (void)dispatch();
+        }
+    }
+
+    CLabelAndSeqAwaiter get_label_and_seq(uint16_t num=1)
+    {
+        return CLabelAndSeqAwaiter(this, _async_muidor.submit_label_and_seq(num));
+    }
+
+    CValueAwaiter get_uniq_id(uint8_t user=0, uint64_t current_seconds=0)
+    {
+        return CValueAwaiter(this, _async_muidor.submit_uniq_id(user, current_seconds));
+    }
+
+    CValueAwaiter get_sortable_id(uint8_t user=0, uint64_t current_seconds=0)
+    {
+        return CValueAwaiter(this, _async_muidor.submit_sortable_id(user, current_seconds));
+    }
+
+    CLocalUniqIdAwaiter get_local_uniq_id(uint8_t user=0, uint64_t current_seconds=0)
+    {
+        struct tm now;
+        const time_t current_time = (0 == current_seconds)? time(NULL): static_cast<time_t>(current_seconds);
+        localtime_r(&current_time, &now);
+
+        const uint32_t hour = get_base_hours(now.tm_year+1900, now.tm_mon+1, now.tm_mday, now.tm_hour);
+        return CLocalUniqIdAwaiter(this, _async_muidor.submit_label_and_hour_seq(1, hour), user, now);
+    }
+
+    template <typename... Args>
+    CTransactionIdAwaiter<Args...> get_transaction_id(const char* format, Args... args)
+    {
+        return CTransactionIdAwaiter<Args...>(this, _async_muidor.submit_label_and_seq(1), format, args...);
+    }
+
+private:
+    struct Waiter
+    {
+        std::coroutine_handle<> handle;
+        struct AsyncResult* result;
+    };
+
+    // 返回false表示结果已到，不需要挂起
+    bool wait(uint32_t token, std::coroutine_handle<> handle, struct AsyncResult* result)
+    {
+        std::map<uint32_t, struct AsyncResult>::iterator iter = _completed.find(token);
+        if (iter != _completed.end())
+        {
+            *result = iter->second;
+            _completed.erase(iter);
+            return false;
+        }
+
+        struct Waiter& waiter = _waiters[token];
+        waiter.handle = handle;
+        waiter.result = result;
+        return true;
+    }
+
+private:
+    CAsyncMuidor _async_muidor;
+    std::map<uint32_t, struct Waiter> _waiters; // 以请求的token为键
+    std::map<uint32_t, struct AsyncResult> _completed; // 结果先于co_await到达的请求
+};
+
+} // namespace muidor {
+#endif // MUIDOR_HAVE_COROUTINE
+#endif // MUIDOR_COROUTINE_H
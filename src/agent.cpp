@@ -16,10 +16,15 @@
  *
  * Author: eyjian@qq.com or eyjian@gmail.com
  */
+#include "counter_table.h"
+#include "datagram_socket.h"
+#include "fast_log.h"
+#include "flight_recorder.h"
+#include "monotonic_clock.h"
+#include "probes.h"
 #include "protocol.h"
 #include "muidor/muidor.h"
 #include <fcntl.h>
-#include <mooon/net/epoller.h>
 #include <mooon/net/udp_socket.h>
 #include <mooon/net/utils.h>
 #include <mooon/sys/atomic.h>
@@ -29,13 +34,18 @@
 #include <mooon/sys/lock.h>
 #include <mooon/sys/main_template.h>
 #include <mooon/sys/safe_logger.h>
+#include <mooon/sys/signal_handler.h>
 #include <mooon/sys/thread_engine.h>
 #include <mooon/sys/utils.h>
 #include <mooon/utils/args_parser.h>
 #include <mooon/utils/string_utils.h>
 #include <mooon/utils/tokener.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <algorithm>
+#include <map>
 #include <vector>
 
 // 是否检查magic
@@ -45,6 +55,13 @@
 // 可通过设置环境变量MOOON_LOG_LEVEL和MOOON_LOG_SCREEN来控制日志级别和是否在屏幕上输出日志
 // 1) MOOON_LOG_LEVEL可以取值debug,info,error,warn,fatal
 // 2) MOOON_LOG_SCREEN取值为1表示在屏幕输出日志，其它则表示不输出
+// 处理请求的路径上使用FASTLOG_*，由后台线程格式化，每个日志站点每秒最多输出log_rate条
+
+// 用于FASTLOG_*输出消息头，同MessageHead::str()
+#define MESSAGE_HEAD_FORMAT "message://V:%d.%d/L:%d/T:%d/E:%u/M:%u/V1:%u/V2:%u/V3:%" PRIu64
+#define MESSAGE_HEAD_ARGS(head) \
+    (head)->major_ver.to_int(), (head)->minor_ver.to_int(), (head)->len.to_int(), (head)->type.to_int(), \
+    (head)->echo.to_int(), (head)->magic.to_int(), (head)->value1.to_int(), (head)->value2.to_int(), (head)->value3.to_int()
 
 STRING_ARG_DEFINE(master_nodes, "", "master nodes, e.g., 192.168.31.66:2016,192.168.31.88:2016");
 STRING_ARG_DEFINE(ip, "0.0.0.0", "listen IP");
@@ -64,17 +81,66 @@ INTEGER_ARG_DEFINE(uint32_t, expire, muidor::LABEL_EXPIRED_SECONDS, 10, 42949672
 // 多长间隔向master发一次租赁Lable请求
 INTEGER_ARG_DEFINE(uint32_t, interval, 600, 1, 7200, "rent label interval in seconds");
 
+// 号段模式，需要master，号段从master的t_segment表分配
+// tags为启动时即预加载号段的业务标签，其它业务标签在第一次请求时加载
+STRING_ARG_DEFINE(tags, "", "business tags to preload segments, e.g., 1,2,3");
+// 当前号段使用到多少百分比时，异步加载下一个号段
+INTEGER_ARG_DEFINE(uint8_t, segment_threshold, 20, 1, 99, "percent of the current segment used before loading the next one");
+
+// 命名计数器每次预留的步长，也是一次最多可取的个数
+INTEGER_ARG_DEFINE(uint32_t, counter_steps, 10000, 1, 10000000, "steps of named counters to store");
+
+// 命名计数器的最大个数
+INTEGER_ARG_DEFINE(uint32_t, max_counters, 100000, 1, 10000000, "max number of named counters");
+
+// 复制sequence上限的peer agent，如：192.168.31.67:6200，
+// 设置后以peer的确认代替fdatasync，peer不可达时才fdatasync，启动时取本地和peer上的较大值
+STRING_ARG_DEFINE(peer, "", "peer agent to replicate sequence to, e.g., 192.168.31.67:6200");
+
+// 等待peer确认的超时毫秒数，超时则改为fdatasync
+INTEGER_ARG_DEFINE(uint32_t, peer_timeout, 100, 1, 10000, "milliseconds to wait for the acknowledgement of peer");
+
+// 重试应答缓存的槽数（向上取2的幂），为0表示不缓存
+INTEGER_ARG_DEFINE(uint32_t, reply_cache_size, 4096, 0, 1048576, "slots of the reply cache for retried requests, 0 to disable");
+
+// 应答缓存的有效秒数，应比客户端的超时乘以重试次数大
+INTEGER_ARG_DEFINE(uint32_t, reply_cache_seconds, 3, 1, 60, "seconds a reply is kept for retried requests");
+
+// 处理请求的路径上每个日志站点每秒最多输出的日志条数，多出的被抑制（只汇报条数）
+INTEGER_ARG_DEFINE(uint32_t, log_rate, 100, 1, 1000000, "max logs per second of each log site on the request path");
+
+// 服务socket的收发缓冲区大小，为0表示使用系统默认值（受net.core.rmem_max和net.core.wmem_max限制）
+INTEGER_ARG_DEFINE(uint32_t, receive_buffer_size, 0, 0, 1073741824, "SO_RCVBUF of the service socket, 0 to use the system default");
+INTEGER_ARG_DEFINE(uint32_t, send_buffer_size, 0, 0, 1073741824, "SO_SNDBUF of the service socket, 0 to use the system default");
+
+// 内核因接收队列满丢弃请求（SO_RXQ_OVFL）时，自动将SO_RCVBUF加倍（每秒最多一次），直到这个上限，为0表示不自动调整，
+// 实际能设置的值还受net.core.rmem_max限制，被它挡住时会告警
+INTEGER_ARG_DEFINE(uint32_t, max_receive_buffer_size, 16777216, 0, 1073741824, "max SO_RCVBUF to grow to when datagrams are dropped, 0 to disable");
+
+// 处理一个请求（从收到到应答发出）超过多少微秒记为慢请求，为0表示不记录，
+// 收到SIGUSR1时将各阶段的延迟直方图和最近的慢请求写入日志
+INTEGER_ARG_DEFINE(uint32_t, slow_request_us, 1000, 0, 10000000, "microseconds a request takes to be recorded as slow, 0 to disable");
+
 ////////////////////////////////////////////////////////////////////////////////
 namespace muidor {
 
 // 常量
 enum
 {
-    SEQUENCE_BLOCK_VERSION = 1
+    SEQUENCE_BLOCK_VERSION_1 = 1,
+    SEQUENCE_BLOCK_VERSION_2 = 2,
+    SEQUENCE_BLOCK_VERSION = 3,
+    SEQUENCE_SLOT_SIZE = 512, // 每个槽独占一个扇区，写一个槽时不会破坏另一个槽
+    MESSAGE_BATCH_SIZE = 64,  // 一次recvmmsg最多接收的请求数，应答也一次sendmmsg发出
+    SEGMENT_RETRY_SECONDS = 1,      // 号段请求无应答或master回复出错时，重新请求的初始间隔
+    SEGMENT_RETRY_MAX_SECONDS = 64, // 间隔每次加倍，最多这么久，收到号段后复位
+    MAX_TAG_PROBES = 1024,          // 未经master确认的tag最多记录这么多个
+    MAX_SEGMENT_ECHOES = 4096       // 控制线程最多记录这么多个未应答的号段请求
 };
 
 #pragma pack(4)
-struct SeqBlock
+// 老版本（版本1）的序列文件，只用于升级
+struct SeqBlockV1
 {
     uint32_t version;
     uint32_t label;
@@ -82,15 +148,67 @@ struct SeqBlock
     uint64_t timestamp;
     uint64_t magic;
 
+    bool valid_magic() const
+    {
+        if (timestamp >= sequence+label+version)
+            return magic == timestamp - (sequence+label+version);
+        else
+            return magic == (sequence+label+version) - timestamp;
+    }
+};
+
+// 老版本（版本2）的槽，只用于升级，升级后没有按小时的seq
+struct SeqBlockV2
+{
+    uint32_t version;
+    uint32_t label;
+    uint64_t generation;
+    uint64_t sequence;
+    uint64_t timestamp;
+    uint32_t crc;
+
+    bool valid_crc() const
+    {
+        return (SEQUENCE_BLOCK_VERSION_2 == version) && (crc == crc32(0, this, offsetof(struct SeqBlockV2, crc)));
+    }
+};
+
+// 一个小时的seq，UniqID和SortableID只需在同一小时内唯一，因此seq每小时从0开始，
+// 每小时都有完整的HOUR_SEQ_MAX个，用完时报错而不会回绕
+struct HourSeq
+{
+    uint32_t hour;     // get_base_hours的值
+    uint32_t sequence; // 这个小时已预留的上限，小于它的值都可能已分配出去
+};
+
+// 序列文件由A、B两个槽组成，按代数（generation）的奇偶轮流写入，
+// 每个槽带crc32，写入时进程退出或掉电导致的半写只会破坏正在写的槽，恢复时取代数最大的有效槽。
+//
+// sequence为64位的逻辑值（低32位即为seq），是已预留的上限，即小于它的值都可能已分配出去，
+// 只有写入的槽落盘后才会分配超过上一个上限的值，因此重启时从sequence开始即可，最多浪费一个steps。
+// hour_seqs同样为已预留的上限，保留最近的两个小时，以容纳小时交替时时钟稍慢的客户端。
+struct SeqBlock
+{
+    uint32_t version;
+    uint32_t label;
+    uint64_t generation;
+    uint64_t sequence;
+    uint64_t timestamp;
+    struct HourSeq hour_seqs[2];
+    uint32_t crc;
+
     SeqBlock()
-        : version(SEQUENCE_BLOCK_VERSION), label(0), sequence(0), timestamp(0), magic(0)
+        : version(SEQUENCE_BLOCK_VERSION), label(0), generation(0), sequence(0), timestamp(0), crc(0)
     {
+        memset(hour_seqs, 0, sizeof(hour_seqs));
     }
 
     std::string str() const
     {
-        return mooon::utils::CStringUtils::format_string("block://V%u/L%u/S%u/D%s/M%" PRId64,
-                version, label, sequence, mooon::sys::CDatetimeUtils::to_datetime(timestamp).c_str(), magic);
+        return mooon::utils::CStringUtils::format_string("block://V%u/L%u/G%" PRIu64"/S%" PRIu64"/H%u:%u,%u:%u/D%s/C%u",
+                version, label, generation, sequence,
+                hour_seqs[0].hour, hour_seqs[0].sequence, hour_seqs[1].hour, hour_seqs[1].sequence,
+                mooon::sys::CDatetimeUtils::to_datetime(timestamp).c_str(), crc);
     }
 
     void update_label(uint32_t label_)
@@ -99,24 +217,88 @@ struct SeqBlock
         label = label_;
     }
 
-    void update_magic()
+    uint32_t calc_crc() const
     {
-        if (timestamp >= sequence+label+version)
-            magic = timestamp - (sequence+label+version);
-        else
-            magic = (sequence+label+version) - timestamp;
+        return crc32(0, this, offsetof(struct SeqBlock, crc));
     }
 
-    bool valid_magic() const
+    void update_crc()
     {
-        if (timestamp >= sequence+label+version)
-            return magic == timestamp - (sequence+label+version);
-        else
-            return magic == (sequence+label+version) - timestamp;
+        crc = calc_crc();
+    }
+
+    bool valid_crc() const
+    {
+        return (SEQUENCE_BLOCK_VERSION == version) && (crc == calc_crc());
     }
 };
 #pragma pack()
 
+// 号段，可分配的区间为[cursor, end)
+struct Segment
+{
+    uint64_t start;
+    uint64_t end;
+    uint64_t cursor;
+
+    Segment()
+        : start(0), end(0), cursor(0)
+    {
+    }
+
+    uint64_t remaining() const
+    {
+        return (cursor < end)? end - cursor: 0;
+    }
+
+    // 已使用的百分比
+    uint32_t used_percent() const
+    {
+        return (end > start)? static_cast<uint32_t>((cursor - start) * 100 / (end - start)): 100;
+    }
+};
+
+// 号段双缓冲，当前号段使用到一定比例时异步向master加载下一个号段，
+// 这样当前号段用完时可立即切换，不用等待master
+struct SegmentBuffer
+{
+    uint32_t tag;
+    struct Segment segments[2];
+    int current;      // 当前使用的号段下标
+    bool next_ready;  // 另一个号段是否已加载好
+    bool loading;     // 是否正在加载
+    bool no_tag;      // master回复tag不存在，retry_time之前直接回复MUE_NO_TAG
+    time_t retry_time; // 加载中未收到应答或master回复出错时，到这个时间才重新请求，每个tag对master的请求因此有退避
+    uint32_t retry_seconds; // 下一次的重试间隔
+
+    SegmentBuffer()
+        : tag(0), current(0), next_ready(false), loading(false), no_tag(false), retry_time(0), retry_seconds(SEGMENT_RETRY_SECONDS)
+    {
+    }
+};
+
+// 重试应答缓存项，客户端重试时echo不变，
+// 因此来源地址、echo和请求的magic均相同即为同一个请求的重试，直接回复缓存的应答，不重复分配
+struct CachedReply
+{
+    uint32_t ip;
+    uint16_t port;
+    uint16_t size;  // 应答的大小，为0表示空槽
+    uint32_t echo;
+    uint32_t magic; // 请求的magic，区分echo相同但内容不同的请求
+    time_t time;    // 缓存的时间
+    char response[sizeof(struct MessageHead)];
+};
+
+// 控制线程从master取到的号段，交给数据线程装入SegmentBuffer
+struct LoadedSegment
+{
+    uint32_t tag;
+    uint32_t step;
+    uint64_t start;
+    int errcode; // 不为0时为master的出错应答（如MUE_NO_TAG），step和start无效
+};
+
 class CUidAgent: public mooon::sys::CMainHelper
 {
 public:
@@ -131,21 +313,61 @@ private:
 private:
     virtual bool on_check_parameter();
     virtual void on_terminated();
+    virtual void on_block_signal();
+    virtual void on_signal_handler(int signo);
 
 private:
     void sync_thread();
+    bool handle_request(size_t bytes_received);
+    int64_t get_queue_nanoseconds(uint32_t index, const struct timespec& received_time) const;
+    void check_receive_drops(uint32_t num_requests);
+    void grow_receive_buffer();
+    void update_load(uint64_t now);
+    void append_load_hint();
+    void send_responses(uint32_t num_responses);
     std::string get_sequence_path() const;
-    int get_label(bool asynchronous);
+    std::string get_counter_path() const;
     bool parse_master_nodes();
+    bool parse_tags();
+    bool parse_peer();
     bool restore_sequence();
-    bool store_sequence();
-    void inc_num_sequence(int n);
+    bool read_sequence(int fd, bool* empty);
+    bool store_sequence(bool sync=false);
+    bool sync_sequence();
+    bool wait_durable();
+    void update_durable();
+    void upgrade_hour_seqs();
+    bool replicate_sequence(uint64_t sequence, uint64_t* peer_sequence);
     uint32_t inc_sequence(uint16_t deta=1);
-    uint64_t get_uniq_id(const struct MessageHead* request);
-    void rent_label();
+    void reserve_sequences(uint32_t num_requests);
+    int alloc_hour_seq(uint32_t hour, uint16_t num, uint32_t* seq);
+    uint32_t get_current_hour();
+    const struct tm& get_hour(time_t current_time, uint32_t* base_hour);
+    int get_uniq_id(const struct MessageHead* request, uint64_t* id);
     bool label_expired() const;
     bool io_error() const { return _io_error; }
+    void sync_lease();
+    void load_segment(struct SegmentBuffer* segment_buffer);
+    bool can_load_segment(const struct SegmentBuffer& segment_buffer) const;
+    void install_segments();
+    int alloc_tag_seq(uint32_t tag, uint16_t num, uint64_t* start, uint16_t* count);
+    int probe_tag(uint32_t tag);
+    void expire_tag_probes();
+    struct CachedReply* get_reply_slot();
+    bool get_cached_reply();
+    void cache_reply();
+
+private:
+    // 控制面：和master之间的通讯（租赁Label和取号段）均在控制线程中通过独立的socket进行，
+    // 数据线程只通过租约快照和号段队列和控制线程交互，不会因为master而阻塞，也不共用收发缓冲
+    void control_thread();
+    int get_label(uint32_t label, bool asynchronous);
+    void rent_label();
+    void publish_lease(uint32_t label, uint64_t timestamp);
+    uint32_t get_lease_label() const;
     const struct sockaddr_in& get_master_addr() const;
+    void send_segment_requests();
+    void on_control_message();
 
 private:
     void prepare_response_error(int errcode);
@@ -153,42 +375,89 @@ private:
     int prepare_response_get_uniq_id();
     int prepare_response_get_uniq_seq();
     int prepare_response_get_label_and_seq();
+    int prepare_response_get_tag_seq();
+    int prepare_response_inc_counter();
+    int prepare_response_replicate();
 
 private:
-    int on_response_error();
-    int on_response_label();
+    void on_response_error(const struct MessageHead* response);
+    void on_response_label(const struct MessageHead* response);
+    void on_response_segment(const struct MessageHead* response);
+    void on_segment_loaded(const struct LoadedSegment& loaded_segment);
 
 private:
     mooon::sys::CThreadEngine* _sync_thread;
     mooon::sys::CEvent _event;
     mooon::sys::CLock _lock;
+
+private:
+    // 控制线程使用
+    mooon::sys::CThreadEngine* _control_thread;
+    mooon::net::CUdpSocket* _control_socket; // 和master通讯专用的socket
+    int _control_eventfd; // 有号段请求时唤醒控制线程
     uint32_t _echo;
     std::vector<struct sockaddr_in> _masters_addr;
-    mooon::net::CEpoller _epoller;
-    mooon::net::CUdpSocket* _udp_socket;
-    uint32_t _sequence_start;
-    struct SeqBlock _seq_block;
+    mooon::sys::CAtomic<int64_t> _lease; // 租约快照，高16位为Label，低48位为租约时间，由控制线程发布
+    mooon::sys::CLock _control_lock; // 保护下面两个队列
+    std::vector<uint32_t> _segment_requests; // 待向master请求号段的tag
+    std::vector<struct LoadedSegment> _loaded_segments; // 已取到的号段
+    std::map<uint32_t, uint32_t> _segment_echoes; // 已发出未应答的号段请求，echo到tag，master的出错应答中没有tag，靠它交回对应的tag
+    mooon::sys::CAtomic<int> _num_loaded_segments; // _loaded_segments的大小，数据线程不加锁检查
+
+private:
+    // 数据线程使用
+    CDatagramSocket* _udp_socket;
+    CDatagramBatch* _request_batch;
+    CDatagramBatch* _response_batch;
+    CFlightRecorder* _flight_recorder;
+    uint64_t _dispatch_ticks[MESSAGE_BATCH_SIZE]; // 一批中各请求处理完成的时间，为0表示不需要应答
+    int64_t _queue_nanoseconds[MESSAGE_BATCH_SIZE]; // 一批中各请求在接收队列中等待的时间，为-1表示没有内核时间戳
+    uint32_t _kernel_drops; // 内核报告的累计丢弃数（SO_RXQ_OVFL，32位会回绕）
+    mooon::sys::CAtomic<int64_t> _num_drops; // 累计被内核丢弃的请求数，信号线程读取
+    mooon::sys::CAtomic<int> _receive_buffer_size; // 当前SO_RCVBUF的设置值（getsockopt得到的值的一半），信号线程读取
+    time_t _receive_buffer_grown_time; // 上次调大SO_RCVBUF的时间
+    bool _receive_buffer_capped; // 已被net.core.rmem_max挡住，不再调大
+    uint64_t _load_begin; // 当前统计周期的开始时间（CLOCK_MONOTONIC的纳秒数）
+    uint64_t _busy_nanoseconds; // 当前统计周期内处理请求的时间
+    bool _load_saturated; // 当前统计周期内接收队列有丢弃
+    uint16_t _load; // 附加在应答中的负载（千分比）
+    uint64_t _sequence; // 下一个可分配的64位逻辑值，低32位为seq
+    uint64_t _durable_sequence; // 已落盘的上限，分配的值不能超过它
+    uint32_t _reserved_seq; // 为一批中只取一个seq的请求预留的下一个seq
+    uint32_t _num_reserved_seqs; // 预留的剩余个数
+    struct SeqBlock _seq_block; // 最近写入的槽
     std::string _sequence_path;
     int _sequence_fd;
-    mooon::sys::CAtomic<int> _num_sequences; // 当前累计增加数，影响fsync的调用
+    mooon::sys::CAtomic<int64_t> _written_generation; // 最近写入的槽的代数，由sync线程落盘
+    mooon::sys::CAtomic<int64_t> _written_sequence; // 最近写入的槽的上限，先于_written_generation更新
+    mooon::sys::CAtomic<int64_t> _synced_generation; // 已落盘或已被peer确认的槽的代数
+    mooon::sys::CAtomic<int64_t> _written_hour_generation; // 最近改变了hour_seqs的槽的代数，它们不复制到peer，总是需要落盘
+    uint32_t _hour_seqs[2]; // _seq_block.hour_seqs对应小时下一个可分配的seq
+    uint32_t _durable_hour_seqs[2]; // 已落盘的上限
+    uint32_t _hour_floor; // 早于这个小时的不能再分配（序列文件丢失时，当前小时已分配到哪里未知）
+    uint32_t _current_hour;     // _current_hour_time所在小时（get_base_hours的值）
+    time_t _current_hour_time;
+    struct tm _hour_tm; // 缓存最近一次get_hour的结果
+    time_t _hour_begin;
+    uint32_t _base_hour;
+    struct sockaddr_in _peer_addr;
+    mooon::net::CUdpSocket* _peer_socket; // 只在启动时和sync线程中使用
+    uint32_t _peer_echo;
+    std::map<uint64_t, uint64_t> _peer_sequences; // 作为peer时保存的其它agent的上限，key为IP和端口
     time_t _current_time; // 当前时间
-    time_t _last_rent_time; // 最后一次向master发起rent_label的时间
     bool _io_error; // IO出错标记，将不能继续服务
-
-private:
-    // old系列变量用来解决seq用完问题，
-    // 一个小时内全部用完，则不能再提供服务，因为会导致重复的ID
-    uint32_t _old_seq;
-    int _old_hour;
-    int _old_day;
-    int _old_month;
-    int _old_year;
+    std::map<uint32_t, struct SegmentBuffer> _segment_buffers; // 已由master确认（或由--tags指定）的业务标签，key为业务标签
+    std::map<uint32_t, struct SegmentBuffer> _tag_probes; // 客户端请求的、尚未经master确认的业务标签，个数不超过MAX_TAG_PROBES
+    CCounterTable* _counter_table;
+    std::vector<struct CachedReply> _reply_cache; // 直接映射，冲突时覆盖
+    uint32_t _reply_cache_mask;
+    uint64_t _reply_cache_hits; // 命中次数
 
 private:
     struct sockaddr_in _from_addr;
     const struct MessageHead* _message_head;
-    char _request_buffer[SOCKET_BUFFER_SIZE];
-    char _response_buffer[SOCKET_BUFFER_SIZE];
+    char* _request_buffer;  // 指向_request_batch中正在处理的请求
+    char* _response_buffer; // 指向_response_batch中下一个待填的应答
     size_t _response_size;
 };
 
@@ -200,27 +469,45 @@ extern "C" int main(int argc, char* argv[])
 
 CUidAgent::CUidAgent()
     : _sync_thread(NULL),
-      _echo(0), _udp_socket(NULL),
-      _sequence_fd(-1), _num_sequences(0),
-      _current_time(0), _last_rent_time(0), _io_error(false),
-      _old_seq(0), _old_hour(-1), _old_day(-1), _old_month(-1), _old_year(-1),
-      _message_head(NULL)
+      _control_thread(NULL), _control_socket(NULL), _control_eventfd(-1), _echo(0), _lease(0), _num_loaded_segments(0),
+      _udp_socket(NULL), _request_batch(NULL), _response_batch(NULL), _flight_recorder(NULL),
+      _kernel_drops(0), _num_drops(0), _receive_buffer_size(0), _receive_buffer_grown_time(0), _receive_buffer_capped(false),
+      _load_begin(0), _busy_nanoseconds(0), _load_saturated(false), _load(0),
+      _sequence(0), _durable_sequence(0), _reserved_seq(0), _num_reserved_seqs(0),
+      _sequence_fd(-1), _written_generation(0), _written_sequence(0), _synced_generation(0), _written_hour_generation(0),
+      _hour_floor(0), _current_hour(0), _current_hour_time(0), _hour_begin(0), _base_hour(0),
+      _peer_socket(NULL), _peer_echo(ECHO_START),
+      _current_time(0), _io_error(false), _counter_table(NULL),
+      _reply_cache_mask(0), _reply_cache_hits(0),
+      _message_head(NULL), _request_buffer(NULL), _response_buffer(NULL)
 {
-    _sequence_start = 0;
     _sequence_path = get_sequence_path();
 
     memset(&_from_addr, 0, sizeof(_from_addr));
-    memset(&_request_buffer, 0, sizeof(_request_buffer));
-    memset(&_response_buffer, 0, sizeof(_response_buffer));
+    memset(&_peer_addr, 0, sizeof(_peer_addr));
+    memset(_dispatch_ticks, 0, sizeof(_dispatch_ticks));
+    memset(_queue_nanoseconds, 0, sizeof(_queue_nanoseconds));
+    memset(_hour_seqs, 0, sizeof(_hour_seqs));
+    memset(_durable_hour_seqs, 0, sizeof(_durable_hour_seqs));
+    memset(&_hour_tm, 0, sizeof(_hour_tm));
     _response_size = 0;
 }
 
 CUidAgent::~CUidAgent()
 {
     delete _udp_socket;
+    delete _request_batch;
+    delete _response_batch;
+    delete _flight_recorder;
+    delete _control_socket;
+    delete _peer_socket;
+    if (_control_eventfd != -1)
+        close(_control_eventfd);
     if (_sequence_fd != -1)
         close(_sequence_fd);
     delete _sync_thread;
+    delete _control_thread;
+    delete _counter_table;
 }
 
 bool CUidAgent::on_init(int argc, char* argv[])
@@ -252,24 +539,100 @@ bool CUidAgent::on_init(int argc, char* argv[])
     {
         return false;
     }
+    if (!parse_tags())
+    {
+        return false;
+    }
+    if (!parse_peer())
+    {
+        return false;
+    }
+    if (mooon::argument::reply_cache_size->value() > 0)
+    {
+        uint32_t reply_cache_size = 1;
+        while (reply_cache_size < mooon::argument::reply_cache_size->value())
+            reply_cache_size <<= 1;
+        _reply_cache.resize(reply_cache_size);
+        memset(&_reply_cache[0], 0, sizeof(struct CachedReply) * reply_cache_size);
+        _reply_cache_mask = reply_cache_size - 1;
+    }
 
     try
     {
         mooon::sys::g_logger = mooon::sys::create_safe_logger();
+        start_fast_log(mooon::argument::log_rate->value());
         _current_time = time(NULL);
 
-        _epoller.create(10);
-        _udp_socket = new mooon::net::CUdpSocket;
-        _udp_socket->listen(mooon::argument::ip->value(), mooon::argument::port->value(), true);
-        MYLOG_INFO("Listen on %s:%d\n", mooon::argument::ip->c_value(), mooon::argument::port->value());
-        _epoller.set_events(_udp_socket, EPOLLIN);
+        _udp_socket = new CDatagramSocket;
+        if (-1 == _udp_socket->listen(mooon::argument::ip->value(), mooon::argument::port->value(), true))
+        {
+            THROW_SYSCALL_EXCEPTION(NULL, errno, "listen");
+        }
+        if (-1 == _udp_socket->set_buffer_size(mooon::argument::receive_buffer_size->value(), mooon::argument::send_buffer_size->value()))
+        {
+            THROW_SYSCALL_EXCEPTION(NULL, errno, "setsockopt");
+        }
+        else
+        {
+            int receive_buffer_size = 0;
+            int send_buffer_size = 0;
+            (void)_udp_socket->get_buffer_size(&receive_buffer_size, &send_buffer_size);
+            _receive_buffer_size = receive_buffer_size / 2; // 内核返回的是设置值的两倍（含簿记开销）
+            MYLOG_INFO("Listen on %s:%d, rcvbuf: %d, sndbuf: %d\n",
+                    mooon::argument::ip->c_value(), mooon::argument::port->value(), receive_buffer_size, send_buffer_size);
+        }
+        // 让内核为每个请求带上收到的时间，以计算在接收队列中等待的时间，不支持时只是没有queue阶段的统计
+        if (-1 == _udp_socket->set_option(SOL_SOCKET, SO_TIMESTAMPNS, 1))
+        {
+            MYLOG_WARN("Enable SO_TIMESTAMPNS failed: %s\n", strerror(errno));
+        }
+        // 让内核带上接收队列的累计丢弃数，以发现过载（否则客户端只看到超时）
+        if (-1 == _udp_socket->set_option(SOL_SOCKET, SO_RXQ_OVFL, 1))
+        {
+            MYLOG_WARN("Enable SO_RXQ_OVFL failed: %s\n", strerror(errno));
+        }
+        _request_batch = new CDatagramBatch(MESSAGE_BATCH_SIZE, SOCKET_BUFFER_SIZE,
+                CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t)));
+        _response_batch = new CDatagramBatch(MESSAGE_BATCH_SIZE, SOCKET_BUFFER_SIZE);
+        _flight_recorder = new CFlightRecorder(mooon::argument::slow_request_us->value());
+        _flight_recorder->calibrate();
+
+        if (!mooon::argument::peer->value().empty())
+        {
+            _peer_socket = new mooon::net::CUdpSocket;
+        }
+        if (!mooon::argument::master_nodes->value().empty())
+        {
+            _control_socket = new mooon::net::CUdpSocket;
+            _control_eventfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+            if (-1 == _control_eventfd)
+            {
+                THROW_SYSCALL_EXCEPTION(NULL, errno, "eventfd");
+            }
+        }
 
         // 从文件恢复sequence
         if (!restore_sequence()) {
             return false;
         }
         else {
+            // 从日志恢复命名计数器
+            _counter_table = new CCounterTable(mooon::argument::counter_steps->value(), mooon::argument::max_counters->value());
+            if (!_counter_table->open(get_counter_path()))
+            {
+                return false;
+            }
+
+            // 预加载号段，由控制线程发送请求和接收响应
+            for (std::map<uint32_t, struct SegmentBuffer>::iterator iter=_segment_buffers.begin(); iter!=_segment_buffers.end(); ++iter)
+            {
+                load_segment(&iter->second);
+            }
+
+            publish_lease(_seq_block.label, _seq_block.timestamp);
             _sync_thread = new mooon::sys::CThreadEngine(mooon::sys::bind(&CUidAgent::sync_thread, this));
+            if (_control_socket != NULL)
+                _control_thread = new mooon::sys::CThreadEngine(mooon::sys::bind(&CUidAgent::control_thread, this));
             return true;
         }
     }
@@ -289,265 +652,490 @@ bool CUidAgent::on_run()
     while (!to_stop())
     {
         const int milliseconds = 10000;
-        int n = _epoller.timed_wait(milliseconds);
+        struct pollfd fds[1];
+        fds[0].fd = _udp_socket->get_fd();
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        const int n = poll(fds, 1, milliseconds);
+        const uint64_t wakeup_nanoseconds = get_monotonic_nanoseconds();
 
         // 不需要那么精确的时间
         _current_time = time(NULL);
-        if (_current_time - _last_rent_time > static_cast<time_t>(mooon::argument::interval->value()))
-        {
-            // 间隔的向master发一个续租请求
-            rent_label();
-            _last_rent_time = _current_time;
-        }
+        update_load(wakeup_nanoseconds);
 
-        if (0 == n)
+        if (-1 == n)
         {
-            // timeout, do nothing
+            if (errno != EINTR)
+                FASTLOG_ERROR("Poll failed: %E\n", errno);
         }
-        else
+        else if (n > 0)
         {
-            // 循环，可以减少对CEpoller::timed_wait的调用
+            // 循环，可以减少对poll的调用
             for (int i=0; i<10000; ++i)
             {
-                try
+                // 一次系统调用接收一批请求，应答也一次发出（Linux 2.6.33和glibc 2.12开始支持recvmmsg）
+                const int num_requests = _udp_socket->receive_batch(_request_batch);
+                if (-1 == num_requests)
                 {
-                    // Linux 2.6.33开始支持recvmsg
-                    // glibc 2.12开始支持recvmmsg
-//#if __GLIBC__ == 2 && __GLIBC_MINOR__ == 12
-//                    int k;
-//                    const unsigned int vlen = 100;
-//                    char bufs[vlen][SOCKET_BUFFER_SIZE];
-//                    struct mmsghdr msgs[vlen];
-//                    int n = recvmmsg(_udp_socket->get_fd(), msgs, vlen, MSG_DONTWAIT, NULL);
-//#else
-                    int bytes_received = _udp_socket->receive_from(_request_buffer, sizeof(_request_buffer), &_from_addr);
-//#endif
-                    if (-1 == bytes_received)
-                    {
-                        // WOULDBLOCK
-                        break;
-                    }
-                    else if (bytes_received < static_cast<int>(sizeof(struct MessageHead)))
+                    if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+                        FASTLOG_ERROR("Receive failed: %E\n", errno);
+                    break;
+                }
+
+                const uint64_t received_ticks = flight_clock();
+                struct timespec received_time;
+                clock_gettime(CLOCK_REALTIME, &received_time);
+                check_receive_drops(static_cast<uint32_t>(num_requests));
+                reserve_sequences(static_cast<uint32_t>(num_requests));
+
+                uint32_t num_responses = 0;
+                for (int j=0; j<num_requests; ++j)
+                {
+                    _queue_nanoseconds[j] = get_queue_nanoseconds(j, received_time);
+                    _request_buffer = _request_batch->buffer(j);
+                    _response_buffer = _response_batch->buffer(num_responses);
+                    _from_addr = _request_batch->addr(j);
+                    if (!handle_request(_request_batch->length(j)))
                     {
-                        MYLOG_ERROR("Invalid size (%d) from %s: %s\n", bytes_received, mooon::net::to_string(_from_addr).c_str(), strerror(errno));
+                        _dispatch_ticks[j] = 0;
                     }
                     else
                     {
-                        _message_head = reinterpret_cast<struct MessageHead*>(_request_buffer);
-                        MYLOG_DEBUG("%s from %s", _message_head->str().c_str(), mooon::net::to_string(_from_addr).c_str());
-
-                        if (bytes_received != _message_head->len)
-                        {
-                            MYLOG_ERROR("Invalid size (%d/%d/%zd) from %s: %s\n",
-                                    bytes_received, _message_head->len.to_int(), sizeof(struct MessageHead),
-                                    mooon::net::to_string(_from_addr).c_str(), strerror(errno));
-                        }
-                        else
-                        {
-                            int errcode = 0;
-                            std::string errmsg;
-
-#if _CHECK_MAGIC_ == 1
-                            const uint32_t magic_ = _message_head->calc_magic();
-                            if (magic_ != _message_head->magic)
-                            {
-                                //errcode = ERROR_ILLEGAL; // 非法来源，直接丢弃
-                                MYLOG_ERROR("[%s] illegal request: %s|%u\n", mooon::net::to_string(_from_addr).c_str(), _message_head->str().c_str(), magic_);
-                            }
-#endif // _CHECK_MAGIC_
+                        _dispatch_ticks[j] = flight_clock();
+                        append_load_hint();
+                        _response_batch->set(num_responses++, _response_size, _from_addr);
+                    }
+                }
 
-                            // 如果errcode在这里为非0，
-                            // 则表示一个非法的包，这种情形不需做出响应
-                            if (0 == errcode)
-                            {
-                                // Request from client
-                                if (REQUEST_LABEL == _message_head->type)
-                                {
-                                    errcode = prepare_response_get_label();
-                                }
-                                else if (REQUEST_UNIQ_ID == _message_head->type)
-                                {
-                                    errcode = prepare_response_get_uniq_id();
-                                }
-                                else if (REQUEST_UNIQ_SEQ == _message_head->type)
-                                {
-                                    errcode = prepare_response_get_uniq_seq();
-                                }
-                                else if (REQUEST_LABEL_AND_SEQ == _message_head->type)
-                                {
-                                    errcode = prepare_response_get_label_and_seq();
-                                }
-                                // Response from master
-                                else if (RESPONSE_ERROR == _message_head->type)
-                                {
-                                    if (magic_ != _message_head->magic)
-                                        errcode = -1;
-                                    else
-                                        errcode = on_response_error();
-                                }
-                                else if (RESPONSE_LABEL == _message_head->type)
-                                {
-                                    if (magic_ != _message_head->magic)
-                                        errcode = -1;
-                                    else
-                                        errcode = on_response_label();
-                                }
-                                else
-                                {
-                                    errcode = MUE_INVALID_TYPE;
-                                    MYLOG_ERROR("Invalid message type: %s\n", _message_head->str().c_str());
-                                }
-                                if ((errcode != 0) && (errcode != -1))
-                                {
-                                    prepare_response_error(errcode);
-                                }
-
-                                // -1为Master回给Agent的响应，
-                                // 其它为Client向Agent的请求，这种情形Agent需要回响应给Client
-                                if (errcode != -1)
-                                {
-                                    try
-                                    {
-                                        _udp_socket->send_to(_response_buffer, _response_size, _from_addr);
-                                        MYLOG_DEBUG("Send to %s ok\n", mooon::net::to_string(_from_addr).c_str());
-                                    }
-                                    catch (mooon::sys::CSyscallException& ex)
-                                    {
-                                        MYLOG_ERROR("Send to %s failed: %s\n", mooon::net::to_string(_from_addr).c_str(), ex.str().c_str());
-                                    }
-                                }
-                            }
-                        }
+                send_responses(num_responses);
+                const uint64_t sent_ticks = flight_clock();
+                for (int j=0; j<num_requests; ++j)
+                {
+                    if (_dispatch_ticks[j] != 0)
+                    {
+                        const struct MessageHead* request = reinterpret_cast<const struct MessageHead*>(_request_batch->buffer(j));
+                        _flight_recorder->record(request, _request_batch->addr(j), _queue_nanoseconds[j], received_ticks, _dispatch_ticks[j], sent_ticks);
                     }
                 }
-                catch (mooon::sys::CSyscallException& ex)
+                if (num_requests < static_cast<int>(_request_batch->capacity()))
                 {
-                    MYLOG_ERROR("Receive_from failed: %s\n", ex.str().c_str());
+                    // 已收完
                     break;
                 }
-            } // while (true)
-        } // if (0 == n)
-    } // while (true)
+            }
+
+            _busy_nanoseconds += get_monotonic_nanoseconds() - wakeup_nanoseconds;
+        }
+    }
 
     return true;
 }
 
-void CUidAgent::on_fini()
+// 处理_request_buffer中的请求，需要回应答时返回true，应答在_response_buffer中
+bool CUidAgent::handle_request(size_t bytes_received)
 {
-    if (_sync_thread != NULL)
-        _sync_thread->join();
-}
+    if (bytes_received < sizeof(struct MessageHead))
+    {
+        FASTLOG_ERROR("Invalid size (%zd) from %A:%P\n", bytes_received, _from_addr.sin_addr.s_addr, _from_addr.sin_port);
+        return false;
+    }
 
-bool CUidAgent::on_check_parameter()
-{
+    _message_head = reinterpret_cast<struct MessageHead*>(_request_buffer);
+    MU_PROBE5(request_receive, _message_head->type.to_int(), _message_head->echo.to_int(), _from_addr.sin_addr.s_addr, _from_addr.sin_port, bytes_received);
+    FASTLOG_DEBUG(MESSAGE_HEAD_FORMAT " from %A:%P\n", MESSAGE_HEAD_ARGS(_message_head), _from_addr.sin_addr.s_addr, _from_addr.sin_port);
+
+    if (bytes_received != _message_head->len.to_int())
+    {
+        FASTLOG_ERROR("Invalid size (%zd/%d/%zd) from %A:%P\n",
+                bytes_received, _message_head->len.to_int(), sizeof(struct MessageHead),
+                _from_addr.sin_addr.s_addr, _from_addr.sin_port);
+        return false;
+    }
+
+#if _CHECK_MAGIC_ == 1
+    const uint32_t magic_ = _message_head->calc_magic();
+    if (magic_ != _message_head->magic)
+    {
+        // 非法来源，这里只记录，仍然响应
+        FASTLOG_ERROR("[%A:%P] illegal request: " MESSAGE_HEAD_FORMAT "|%u\n", _from_addr.sin_addr.s_addr, _from_addr.sin_port, MESSAGE_HEAD_ARGS(_message_head), magic_);
+    }
+#endif // _CHECK_MAGIC_
+
+    // 只保存--peer指定的agent复制来的上限，其它来源的直接丢弃（不回应答），
+    // 对方从临时端口发出复制请求，因此只比较IP
+    if ((REQUEST_REPLICATE == _message_head->type) &&
+        ((_peer_socket == NULL) || (_from_addr.sin_addr.s_addr != _peer_addr.sin_addr.s_addr)))
+    {
+        FASTLOG_ERROR("[%A:%P] replicate not from peer: " MESSAGE_HEAD_FORMAT "\n", _from_addr.sin_addr.s_addr, _from_addr.sin_port, MESSAGE_HEAD_ARGS(_message_head));
+        return false;
+    }
+
+    // 控制线程可能更新了Label或续了租约
+    sync_lease();
+
+    int errcode = 0;
+    if (get_cached_reply())
+    {
+        // 重试的请求，回复和上次相同的应答
+        MU_PROBE3(request_dispatch, _message_head->type.to_int(), _message_head->echo.to_int(), 0);
+        return true;
+    }
+    else if (REQUEST_LABEL == _message_head->type)
+    {
+        errcode = prepare_response_get_label();
+    }
+    else if (REQUEST_UNIQ_ID == _message_head->type)
+    {
+        errcode = prepare_response_get_uniq_id();
+    }
+    else if (REQUEST_UNIQ_SEQ == _message_head->type)
+    {
+        errcode = prepare_response_get_uniq_seq();
+    }
+    else if (REQUEST_LABEL_AND_SEQ == _message_head->type)
+    {
+        errcode = prepare_response_get_label_and_seq();
+    }
+    else if (REQUEST_TAG_SEQ == _message_head->type)
+    {
+        errcode = prepare_response_get_tag_seq();
+    }
+    else if (REQUEST_COUNTER == _message_head->type)
+    {
+        errcode = prepare_response_inc_counter();
+    }
+    else if (REQUEST_REPLICATE == _message_head->type)
+    {
+        errcode = prepare_response_replicate();
+    }
+    else
+    {
+        errcode = MUE_INVALID_TYPE;
+        FASTLOG_ERROR("Invalid message type: " MESSAGE_HEAD_FORMAT "\n", MESSAGE_HEAD_ARGS(_message_head));
+    }
+    if (errcode != 0)
+    {
+        prepare_response_error(errcode);
+    }
+    else if ((_message_head->type != REQUEST_LABEL) && (_message_head->type != REQUEST_REPLICATE))
+    {
+        // 只缓存成功分配的应答，出错时重试可能成功
+        cache_reply();
+    }
+    MU_PROBE3(request_dispatch, _message_head->type.to_int(), _message_head->echo.to_int(), errcode);
+
+    // master的响应由控制线程处理，这里只有Client向Agent的请求，总是需要回响应给Client
     return true;
 }
 
-void CUidAgent::on_terminated()
+// 第index个请求从内核收到到被recvmmsg取走的纳秒数，没有时间戳时返回-1，
+// 内核的时间戳为CLOCK_REALTIME，因此同一批只需取一次当前时间
+int64_t CUidAgent::get_queue_nanoseconds(uint32_t index, const struct timespec& received_time) const
 {
-    CMainHelper::on_terminated();
+    const void* data = _request_batch->find_control(index, SOL_SOCKET, SCM_TIMESTAMPNS);
+    if (NULL == data)
+    {
+        return -1;
+    }
+
+    struct timespec kernel_time;
+    memcpy(&kernel_time, data, sizeof(kernel_time));
+    const int64_t nanoseconds = static_cast<int64_t>(received_time.tv_sec - kernel_time.tv_sec) * 1000000000 +
+                                (received_time.tv_nsec - kernel_time.tv_nsec);
+    return (nanoseconds > 0)? nanoseconds: 0; // 时钟被调整时可能为负
 }
 
-void CUidAgent::sync_thread()
+// 检查内核是否因接收队列满丢弃了请求，
+// SO_RXQ_OVFL的值为累计数，只在不为0时才带上，取这批中最后一个带了的即可
+void CUidAgent::check_receive_drops(uint32_t num_requests)
 {
-    while (!to_stop())
+    for (uint32_t j=num_requests; j>0; --j)
     {
-        // Sleep 1s
+        const void* data = _request_batch->find_control(j-1, SOL_SOCKET, SO_RXQ_OVFL);
+        if (data != NULL)
         {
-            mooon::sys::LockHelper<mooon::sys::CLock> lh(_lock);
-            _event.timed_wait(_lock, 1000);
-        }
+            uint32_t kernel_drops;
+            memcpy(&kernel_drops, data, sizeof(kernel_drops));
 
-        if (_sequence_fd>0 && -1==fdatasync(_sequence_fd))
-        {
-            MYLOG_ERROR("fdatasync failed: %s\n", strerror(errno));
-            exit(1); // Fatal error
+            const uint32_t num_drops = kernel_drops - _kernel_drops; // 无符号相减，回绕也正确
+            if (num_drops > 0)
+            {
+                _kernel_drops = kernel_drops;
+                _num_drops = _num_drops.get_value() + num_drops; // 只有数据线程写
+                _load_saturated = true;
+                MU_PROBE2(request_drop, num_drops, kernel_drops);
+                FASTLOG_WARN("%u requests dropped by kernel (total: %u), rcvbuf: %d\n",
+                        num_drops, static_cast<uint64_t>(_num_drops.get_value()), _receive_buffer_size.get_value());
+                grow_receive_buffer();
+            }
+            break;
         }
     }
 }
 
-std::string CUidAgent::get_sequence_path() const
+// 每秒计算一次负载：处理请求的时间占比（千分比），和上一周期的值取平均以平滑，
+// 周期内接收队列有丢弃时为1000，空闲（poll超时）后的第一次计算也会反映出来
+void CUidAgent::update_load(uint64_t now)
 {
-    return mooon::sys::CUtils::get_program_path() + std::string("/.uniq.seq");
+    if (0 == _load_begin)
+    {
+        _load_begin = now;
+        return;
+    }
+
+    const uint64_t elapsed = now - _load_begin;
+    if (elapsed >= 1000000000)
+    {
+        const uint64_t busy = _load_saturated? 1000: std::min<uint64_t>(_busy_nanoseconds * 1000 / elapsed, 1000);
+        _load = static_cast<uint16_t>((_load + busy) / 2);
+        _load_begin = now;
+        _busy_nanoseconds = 0;
+        _load_saturated = false;
+    }
 }
 
-int CUidAgent::get_label(bool asynchronous)
+// 新版本客户端的请求，在应答后附加负载提示，
+// 应答缓存中的是不带负载提示的，命中时重新附加当前的负载
+void CUidAgent::append_load_hint()
 {
-	if (mooon::argument::master_nodes->value().empty())
-	{
-		return mooon::argument::label->value();
-	}
-	else
-	{
-		struct MessageHead* request = reinterpret_cast<struct MessageHead*>(_request_buffer);
-		struct MessageHead* response = reinterpret_cast<struct MessageHead*>(_response_buffer);
-		const struct sockaddr_in& master_addr = get_master_addr();
+    if ((_message_head->minor_ver.to_int() < LOAD_HINT_MINOR_VERSION) ||
+        (REQUEST_REPLICATE == _message_head->type) ||
+        (_response_size != sizeof(struct MessageHead)))
+    {
+        return;
+    }
 
-        // 遇到错误ERROR_LABEL_NOT_HOLD时，需要重试一次
-        for (int k=0; k<2; ++k)
-        {
-            try
-            {
-                request->major_ver = MU_MAJOR_VERSION;
-                request->minor_ver = MU_MINOR_VERSION;
-                request->len = sizeof(struct MessageHead);
-                request->type = REQUEST_LABEL;
-                request->echo = _echo++;
-                request->value1 = _seq_block.label;
-                request->value2 = 0;
-                request->update_magic();
-                _udp_socket->send_to(_request_buffer, sizeof(struct MessageHead), master_addr);
+    struct MessageHead* response = reinterpret_cast<struct MessageHead*>(_response_buffer);
+    struct LoadHint* load_hint = reinterpret_cast<struct LoadHint*>(_response_buffer + sizeof(struct MessageHead));
+    load_hint->busy = _load;
+    load_hint->reserved = 0;
+    response->len = sizeof(struct MessageHead) + sizeof(struct LoadHint);
+    response->update_magic();
+    _response_size = sizeof(struct MessageHead) + sizeof(struct LoadHint);
+}
 
-                if (asynchronous)
-                {
-                    return 0;
-                }
-                else
-                {
-                    int bytes = _udp_socket->timed_receive_from(_response_buffer, sizeof(struct MessageHead), &_from_addr, 2000);
-                    if (bytes != sizeof(struct MessageHead))
-                    {
-                        MYLOG_ERROR("timed_receive_from return %d(%d)\n", bytes, static_cast<int>(sizeof(struct MessageHead)));
-                        break;
-                    }
+// 有丢弃时加倍SO_RCVBUF，不超过参数max_receive_buffer_size，
+// 每秒最多一次，给调大后的缓冲区发挥作用的时间
+void CUidAgent::grow_receive_buffer()
+{
+    const int max_receive_buffer_size = static_cast<int>(mooon::argument::max_receive_buffer_size->value());
+    const int receive_buffer_size = _receive_buffer_size.get_value();
+    if (_receive_buffer_capped || (receive_buffer_size >= max_receive_buffer_size) || (_current_time == _receive_buffer_grown_time))
+    {
+        return;
+    }
 
-                    if (RESPONSE_ERROR == response->type)
-                    {
-                        MYLOG_ERROR("(%d)get label[%u] error: %s\n", k, _seq_block.label, response->str().c_str());
-                        if (response->value1.to_int() != MUE_LABEL_NOT_HOLD)
-                            break;
+    const int wanted = (receive_buffer_size > max_receive_buffer_size / 2)? max_receive_buffer_size: receive_buffer_size * 2;
+    int actual = 0;
+    _receive_buffer_grown_time = _current_time;
+    if ((-1 == _udp_socket->set_buffer_size(wanted, 0)) ||
+        (-1 == _udp_socket->get_buffer_size(&actual, NULL)))
+    {
+        FASTLOG_ERROR("Grow rcvbuf to %d failed: %E\n", wanted, errno);
+        return;
+    }
 
-                        // 需要重新租赁Label，故重置
-                        _seq_block.update_label(0);
-                        continue;
-                    }
-                    else if ((RESPONSE_LABEL == response->type) && (response->echo == _echo-1))
-                    {
-                        if (response->value1.to_int() > 0)
+    _receive_buffer_size = actual / 2;
+    if (actual / 2 < wanted)
+    {
+        // 非特权进程设置的值被net.core.rmem_max截断
+        _receive_buffer_capped = true;
+        FASTLOG_WARN("Rcvbuf is capped to %d by net.core.rmem_max (wanted: %d), raise it to absorb bursts\n", actual / 2, wanted);
+    }
+    else
+    {
+        FASTLOG_INFO("Rcvbuf grown to %d\n", actual / 2);
+    }
+}
+
+// 一次sendmmsg发出_response_batch中的应答，发送失败的跳过（客户端会重试）
+void CUidAgent::send_responses(uint32_t num_responses)
+{
+    uint32_t first = 0;
+    while (first < num_responses)
+    {
+        const int n = _udp_socket->send_batch(_response_batch, first, num_responses-first);
+        MU_PROBE2(reply_send, num_responses-first, n);
+        if (-1 == n)
+        {
+            const struct sockaddr_in& to_addr = _response_batch->addr(first);
+            FASTLOG_ERROR("Send to %A:%P failed: %E\n", to_addr.sin_addr.s_addr, to_addr.sin_port, errno);
+            ++first;
+        }
+        else
+        {
+            FASTLOG_DEBUG("Send %d responses ok\n", n);
+            first += static_cast<uint32_t>(n);
+        }
+    }
+}
+
+void CUidAgent::on_fini()
+{
+    if (_sync_thread != NULL)
+        _sync_thread->join();
+    if (_control_thread != NULL)
+        _control_thread->join();
+    stop_fast_log();
+}
+
+bool CUidAgent::on_check_parameter()
+{
+    return true;
+}
+
+void CUidAgent::on_terminated()
+{
+    CMainHelper::on_terminated();
+}
+
+void CUidAgent::on_block_signal()
+{
+    mooon::sys::CSignalHandler::block_signal(SIGUSR1);
+}
+
+void CUidAgent::on_signal_handler(int signo)
+{
+    CMainHelper::on_signal_handler(signo);
+
+    // 在信号线程中dump，不影响数据线程
+    if ((SIGUSR1 == signo) && (_flight_recorder != NULL))
+    {
+        _flight_recorder->dump();
+        MYLOG_INFO("Requests dropped by kernel: %" PRId64", rcvbuf: %d\n", _num_drops.get_value(), _receive_buffer_size.get_value());
+    }
+}
+
+void CUidAgent::sync_thread()
+{
+    while (!to_stop())
+    {
+        // Sleep 1s
+        {
+            mooon::sys::LockHelper<mooon::sys::CLock> lh(_lock);
+            _event.timed_wait(_lock, 1000);
+        }
+
+        if (_sequence_fd > 0)
+        {
+            // 先取代数再落盘，落盘后该代数及之前写入的槽均已持久化
+            // 设置了peer时，由peer确认代替落盘，peer不可达时才落盘，
+            // 没有新写入时也定期复制一次，这样peer重启后能很快恢复
+            // hour_seqs不复制到peer，它们有变化时即使peer确认了也要落盘
+            const int64_t generation = _written_generation.get_value();
+            const uint64_t sequence = static_cast<uint64_t>(_written_sequence.get_value());
+            const int64_t hour_generation = _written_hour_generation.get_value();
+            uint64_t peer_sequence = 0;
+            if (generation > _synced_generation.get_value())
+            {
+                const bool replicated = replicate_sequence(sequence, &peer_sequence);
+                if ((!replicated || (hour_generation > _synced_generation.get_value())) && (-1 == fdatasync(_sequence_fd)))
+                {
+                    MYLOG_ERROR("fdatasync failed: %s\n", strerror(errno));
+                    exit(1); // Fatal error
+                }
+                _synced_generation = generation;
+            }
+            else if (_peer_socket != NULL)
+            {
+                (void)replicate_sequence(sequence, &peer_sequence);
+            }
+        }
+        if ((_counter_table != NULL) && !_counter_table->sync_and_compact())
+        {
+            exit(1); // Fatal error
+        }
+    }
+}
+
+std::string CUidAgent::get_sequence_path() const
+{
+    return mooon::sys::CUtils::get_program_path() + std::string("/.uniq.seq");
+}
+
+std::string CUidAgent::get_counter_path() const
+{
+    return mooon::sys::CUtils::get_program_path() + std::string("/.uniq.counter");
+}
+
+// 向master租赁或续租label，label为0表示租一个新的，
+// 同步方式只在启动时调用（控制线程还未启动），异步方式只在控制线程中调用，响应由on_control_message处理
+int CUidAgent::get_label(uint32_t label, bool asynchronous)
+{
+	if (mooon::argument::master_nodes->value().empty())
+	{
+		return mooon::argument::label->value();
+	}
+	else
+	{
+		struct MessageHead request;
+		struct MessageHead response;
+		struct sockaddr_in from_addr;
+		const struct sockaddr_in& master_addr = get_master_addr();
+
+        // 遇到错误ERROR_LABEL_NOT_HOLD时，需要重试一次
+        for (int k=0; k<2; ++k)
+        {
+            try
+            {
+                request.len = sizeof(struct MessageHead);
+                request.type = REQUEST_LABEL;
+                request.echo = _echo++;
+                request.value1 = label;
+                request.value2 = 0;
+                request.value3 = 0;
+                request.update_magic();
+                _control_socket->send_to(&request, sizeof(struct MessageHead), master_addr);
+
+                if (asynchronous)
+                {
+                    return 0;
+                }
+                else
+                {
+                    int bytes = _control_socket->timed_receive_from(&response, sizeof(struct MessageHead), &from_addr, 2000);
+                    if (bytes != sizeof(struct MessageHead))
+                    {
+                        MYLOG_ERROR("timed_receive_from return %d(%d)\n", bytes, static_cast<int>(sizeof(struct MessageHead)));
+                        break;
+                    }
+
+                    if (RESPONSE_ERROR == response.type)
+                    {
+                        MYLOG_ERROR("(%d)get label[%u] error: %s\n", k, label, response.str().c_str());
+                        if (response.value1.to_int() != MUE_LABEL_NOT_HOLD)
+                            break;
+
+                        // 需要重新租赁Label，故重置
+                        label = 0;
+                        continue;
+                    }
+                    else if ((RESPONSE_LABEL == response.type) && (response.echo == _echo-1))
+                    {
+                        if (response.value1.to_int() > 0)
                         {
                             // 续成功
-                            _seq_block.timestamp = static_cast<uint64_t>(_current_time);
-                            int label = static_cast<int>(response->value1.to_int());
-                            MYLOG_INFO("rent label[%d] ok\n", label);
-                            return label;
+                            int label_ = static_cast<int>(response.value1.to_int());
+                            MYLOG_INFO("rent label[%d] ok\n", label_);
+                            return label_;
                         }
                         else
                         {
-                            MYLOG_ERROR("Invalid label[%d] from %s\n", (int)response->value1.to_int(), mooon::net::to_string(_from_addr).c_str());
+                            MYLOG_ERROR("Invalid label[%d] from %s\n", (int)response.value1.to_int(), mooon::net::to_string(from_addr).c_str());
                             break;
                         }
                     }
                     else
                     {
                         MYLOG_ERROR("Invalid response[%s] for request[%s] from %s\n",
-                                response->str().c_str(), request->str().c_str(), mooon::net::to_string(_from_addr).c_str());
+                                response.str().c_str(), request.str().c_str(), mooon::net::to_string(from_addr).c_str());
                         break;
                     }
                 }
             }
             catch (mooon::sys::CSyscallException& ex)
             {
-                MYLOG_ERROR("Rent label from %s faield: %s\n", mooon::net::to_string(_from_addr).c_str(), ex.str().c_str());
+                MYLOG_ERROR("Rent label from %s faield: %s\n", mooon::net::to_string(master_addr).c_str(), ex.str().c_str());
                 break;
             }
         } // for
@@ -593,9 +1181,60 @@ bool CUidAgent::parse_master_nodes()
     return true;
 }
 
+bool CUidAgent::parse_tags()
+{
+    std::vector<std::string> tags;
+    mooon::utils::CTokener::split(&tags, mooon::argument::tags->value(), ",", true);
+
+    if (!tags.empty() && mooon::argument::master_nodes->value().empty())
+    {
+        fprintf(stderr, "Parameter[--tags] requires parameter[--master_nodes]\n");
+        return false;
+    }
+    for (std::vector<std::string>::size_type i=0; i<tags.size(); ++i)
+    {
+        uint32_t tag = 0;
+        if (!mooon::utils::CStringUtils::string2int(tags[i].c_str(), tag))
+        {
+            fprintf(stderr, "Parameter[--tags] error: %s\n", mooon::argument::tags->c_value());
+            return false;
+        }
+
+        _segment_buffers[tag].tag = tag;
+    }
+
+    return true;
+}
+
+bool CUidAgent::parse_peer()
+{
+    const std::string& peer = mooon::argument::peer->value();
+    if (peer.empty())
+    {
+        return true;
+    }
+
+    std::vector<std::string> tokens;
+    int port = 0;
+    if ((mooon::utils::CTokener::split(&tokens, peer, ":") != 2) ||
+        !mooon::utils::CStringUtils::string2int(tokens[1].c_str(), port) ||
+        (port < 1000) || (port > 65535) ||
+        (0 == mooon::net::string2ipv4(tokens[0])))
+    {
+        fprintf(stderr, "Parameter[--peer] error: %s\n", peer.c_str());
+        return false;
+    }
+
+    _peer_addr.sin_family = AF_INET;
+    _peer_addr.sin_addr.s_addr = mooon::net::string2ipv4(tokens[0]);
+    _peer_addr.sin_port = mooon::net::CUtils::host2net(static_cast<uint16_t>(port));
+    return true;
+}
+
 bool CUidAgent::restore_sequence()
 {
     int label = 0;
+    bool empty = false;
 
     int fd = open(_sequence_path.c_str(), O_RDWR|O_CREAT, FILE_DEFAULT_PERM);
     if (-1 == fd)
@@ -605,261 +1244,752 @@ bool CUidAgent::restore_sequence()
     }
 
     mooon::sys::CloseHelper<int> ch(fd);
-    ssize_t bytes_read = pread(fd, &_seq_block, sizeof(_seq_block), 0);
-    if (0 == bytes_read)
+    if (!read_sequence(fd, &empty))
+    {
+        return false;
+    }
+    if (empty)
     {
         MYLOG_INFO("%s empty\n", _sequence_path.c_str());
 
-        label = get_label(false);
+        label = get_label(0, false);
         if ((label < 1) || (label > LABEL_MAX))
         {
             MYLOG_ERROR("Invalid label[%d]\n", label);
             return false;
         }
+        if (!mooon::argument::master_nodes->value().empty())
+        {
+            _seq_block.timestamp = static_cast<uint64_t>(_current_time);
+        }
 
-        _sequence_fd = ch.release();
-        _sequence_start = mooon::argument::steps->value();
-        _seq_block.sequence = _sequence_start;
-        _seq_block.update_label(static_cast<uint32_t>(label));
-        return store_sequence();
+        _seq_block.sequence = 1;
     }
-    else if (-1 == bytes_read)
+    else
+    {
+        if (mooon::argument::master_nodes->value().empty())
+        {
+            // 本地模式
+            label = mooon::argument::label->value();
+        }
+        else if (label_expired())
+        {
+            // 如果已过期，则需要重新租赁一个
+            label = get_label(_seq_block.label, false);
+            if ((label < 1) || (label > LABEL_MAX))
+            {
+                MYLOG_ERROR("Invalid label[%d] from master to store\n", label);
+                return false;
+            }
+            _seq_block.timestamp = static_cast<uint64_t>(_current_time);
+        }
+        else
+        {
+            // 租约未过期，继续使用原来的Label，由控制线程续租
+            label = static_cast<int>(_seq_block.label);
+        }
+    }
+
+    // 本地磁盘丢失或落盘前机器掉电时，peer上的值可能更大
+    uint64_t peer_sequence = 0;
+    if ((_peer_socket != NULL) && replicate_sequence(0, &peer_sequence) && (peer_sequence > _seq_block.sequence))
+    {
+        MYLOG_INFO("Sequence from peer %s: %" PRIu64" > %" PRIu64"\n",
+                mooon::net::to_string(_peer_addr).c_str(), peer_sequence, _seq_block.sequence);
+        _seq_block.sequence = peer_sequence;
+
+        if (empty)
+        {
+            // 序列文件丢失了（按小时的seq不复制到peer），不知道当前小时已分配到哪里，只能从下一个小时开始
+            _hour_floor = get_base_hours() + 1;
+            MYLOG_WARN("%s lost, hourly seq is unavailable until hour %u\n", _sequence_path.c_str(), _hour_floor);
+        }
+    }
+
+    // 从上次预留的上限开始，并同步预留下一个steps
+    _sequence_fd = ch.release();
+    _sequence = _seq_block.sequence;
+    _durable_sequence = _sequence;
+    for (int i=0; i<2; ++i)
+    {
+        _hour_seqs[i] = _seq_block.hour_seqs[i].sequence;
+        _durable_hour_seqs[i] = _hour_seqs[i];
+    }
+    _seq_block.sequence = _sequence + mooon::argument::steps->value();
+    _seq_block.update_label(static_cast<uint32_t>(label));
+    return store_sequence(true);
+}
+
+// 读取序列文件到_seq_block，文件为空时empty为true，
+// 版本1的文件按原来的方式跳过两个steps后升级
+bool CUidAgent::read_sequence(int fd, bool* empty)
+{
+    char buffer[SEQUENCE_SLOT_SIZE * 2];
+    ssize_t bytes_read = pread(fd, buffer, sizeof(buffer), 0);
+    if (-1 == bytes_read)
     {
         // IO error
         MYLOG_ERROR("Read %s failed: %s\n", _sequence_path.c_str(), strerror(errno));
         return false;
     }
-    else if (bytes_read != sizeof(_seq_block))
+
+    *empty = (0 == bytes_read);
+    if (*empty)
     {
-        // invalid block
-        MYLOG_ERROR("Read %s failed: (%zd/%zd)%s\n", _sequence_path.c_str(), bytes_read, sizeof(_seq_block), strerror(errno));
-        return false;
+        return true;
     }
-    else
+    if ((bytes_read == static_cast<ssize_t>(sizeof(struct SeqBlockV1))) &&
+        (SEQUENCE_BLOCK_VERSION_1 == reinterpret_cast<struct SeqBlockV1*>(buffer)->version))
     {
-        // check block
-        if (!_seq_block.valid_magic())
+        struct SeqBlockV1 seq_block_v1;
+        memcpy(&seq_block_v1, buffer, sizeof(seq_block_v1));
+        if (!seq_block_v1.valid_magic())
         {
-            MYLOG_ERROR("%s invalid: %s\n", _seq_block.str().c_str(), _sequence_path.c_str());
+            MYLOG_ERROR("%s invalid: version %u\n", _sequence_path.c_str(), seq_block_v1.version);
             return false;
         }
+
+        // 版本1的写入不保证落盘，所以需要多跳过一个steps
+        _seq_block.label = seq_block_v1.label;
+        _seq_block.timestamp = seq_block_v1.timestamp;
+        _seq_block.sequence = static_cast<uint64_t>(seq_block_v1.sequence) + 2 * mooon::argument::steps->value();
+        upgrade_hour_seqs();
+        MYLOG_INFO("Upgrade %s from version 1: %s\n", _sequence_path.c_str(), _seq_block.str().c_str());
+        return true;
+    }
+
+    // 取代数最大的有效槽，只有一个有效时可能是上次写入时半写了，
+    // 版本2的槽比现在的小，两个版本都试一下
+    int valid_slots = 0;
+    bool upgrade = false;
+    for (int i=0; i<2; ++i)
+    {
+        struct SeqBlock seq_block;
+        struct SeqBlockV2 seq_block_v2;
+        if (bytes_read < static_cast<ssize_t>(i*SEQUENCE_SLOT_SIZE + sizeof(seq_block_v2)))
+        {
+            break;
+        }
+
+        memcpy(&seq_block_v2, buffer+i*SEQUENCE_SLOT_SIZE, sizeof(seq_block_v2));
+        if (bytes_read >= static_cast<ssize_t>(i*SEQUENCE_SLOT_SIZE + sizeof(seq_block)))
+        {
+            memcpy(&seq_block, buffer+i*SEQUENCE_SLOT_SIZE, sizeof(seq_block));
+        }
+        if (seq_block_v2.valid_crc())
+        {
+            seq_block.version = SEQUENCE_BLOCK_VERSION;
+            seq_block.label = seq_block_v2.label;
+            seq_block.generation = seq_block_v2.generation;
+            seq_block.sequence = seq_block_v2.sequence;
+            seq_block.timestamp = seq_block_v2.timestamp;
+            memset(seq_block.hour_seqs, 0, sizeof(seq_block.hour_seqs));
+            seq_block.update_crc();
+        }
+        if (!seq_block.valid_crc())
+        {
+            MYLOG_WARN("Slot %d of %s invalid: %s\n", i, _sequence_path.c_str(), seq_block.str().c_str());
+        }
         else
         {
-            if (mooon::argument::master_nodes->value().empty())
+            if ((0 == valid_slots) || (seq_block.generation > _seq_block.generation))
             {
-                // 本地模式
-                label = mooon::argument::label->value();
+                _seq_block = seq_block;
+                upgrade = seq_block_v2.valid_crc();
             }
-            else if (label_expired())
-            {
-                // 如果已过期，则需要重新租赁一个
-                label = get_label(false);
-                if ((label < 1) || (label > LABEL_MAX))
-                {
-                    MYLOG_ERROR("Invalid label[%d] from master to store\n", label);
-                    return false;
-                }
-            }
-
-            _sequence_fd = ch.release();
-            // 多加一次steps，原因是store时未调用fsync（由sync线程异步调用）
-            _sequence_start = _seq_block.sequence + (2 * mooon::argument::steps->value());
-            _seq_block.sequence = _sequence_start;
-            _seq_block.update_label(static_cast<uint32_t>(label));
-
-            return store_sequence();
+            ++valid_slots;
         }
     }
+    if (0 == valid_slots)
+    {
+        // 两个槽均损坏，不能确定上限，需人工处理
+        MYLOG_ERROR("%s corrupted\n", _sequence_path.c_str());
+        return false;
+    }
+
+    if (upgrade)
+    {
+        upgrade_hour_seqs();
+        MYLOG_INFO("Upgrade %s from version 2\n", _sequence_path.c_str());
+    }
+    MYLOG_INFO("Restore %s from %s\n", _seq_block.str().c_str(), _sequence_path.c_str());
+    return true;
 }
 
-bool CUidAgent::store_sequence()
+// 老版本的UniqID取sequence的低29位，从它开始分配当前小时和上一个小时的seq，以免和升级前分配的重复
+void CUidAgent::upgrade_hour_seqs()
 {
-    _seq_block.update_magic();
+    const uint32_t hour = get_base_hours();
+    const uint32_t sequence = static_cast<uint32_t>(_seq_block.sequence % HOUR_SEQ_MAX);
 
-    ssize_t byes_written = pwrite(_sequence_fd, &_seq_block, sizeof(_seq_block), 0);
+    _seq_block.hour_seqs[0].hour = hour - 1;
+    _seq_block.hour_seqs[0].sequence = sequence;
+    _seq_block.hour_seqs[1].hour = hour;
+    _seq_block.hour_seqs[1].sequence = sequence;
+}
+
+// 写入下一个槽，sync为true时同步落盘，否则通知sync线程尽快落盘
+bool CUidAgent::store_sequence(bool sync)
+{
+    ++_seq_block.generation;
+    _seq_block.update_crc();
+    MU_PROBE3(sequence_store, _seq_block.generation, _seq_block.sequence, sync);
+
+    const off_t offset = static_cast<off_t>(_seq_block.generation % 2) * SEQUENCE_SLOT_SIZE;
+    ssize_t byes_written = pwrite(_sequence_fd, &_seq_block, sizeof(_seq_block), offset);
     if (byes_written != sizeof(_seq_block))
     {
         _io_error = true; // 遇到IO错误时，标记为不可继续服务
         MYLOG_ERROR("Store %s to %s failed: %s\n", _seq_block.str().c_str(), _sequence_path.c_str(), strerror(errno));
+        MU_PROBE2(sequence_stored, _seq_block.generation, false);
         return false;
     }
     else
     {
         MYLOG_DEBUG("Store %s ok\n", _seq_block.str().c_str());
+        _written_sequence = static_cast<int64_t>(_seq_block.sequence);
+        _written_generation = static_cast<int64_t>(_seq_block.generation);
 
-#if 1
-        _sequence_start = _seq_block.sequence;
-        return true;
-#else
-        // fsync严重影响性能
-        if (-1 == fsync(_sequence_fd))
+        if (sync)
         {
-            _io_error = true;
-            MYLOG_ERROR("fsync %s to %s failed: %s\n", _seq_block.str().c_str(), _sequence_path.c_str(), strerror(errno));
-            return false;
+            const bool ok = sync_sequence();
+            MU_PROBE2(sequence_stored, _seq_block.generation, ok);
+            return ok;
         }
         else
         {
-            _sequence_start = _seq_block.sequence;
-            MYLOG_INFO("Store %s to %s ok\n", _seq_block.str().c_str(), _sequence_path.c_str());
+            _event.signal();
+            MU_PROBE2(sequence_stored, _seq_block.generation, true);
+            return true;
+        }
+    }
+}
+
+// 在数据线程中同步落盘，只在sync线程来不及落盘时才会发生
+bool CUidAgent::sync_sequence()
+{
+    if (-1 == fdatasync(_sequence_fd))
+    {
+        _io_error = true;
+        MYLOG_ERROR("fdatasync %s to %s failed: %s\n", _seq_block.str().c_str(), _sequence_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    update_durable();
+    return true;
+}
+
+// 等最近写入的槽持久化，sync线程已落盘或已被peer确认时直接返回，否则在数据线程中同步落盘
+bool CUidAgent::wait_durable()
+{
+    if (_synced_generation.get_value() < static_cast<int64_t>(_seq_block.generation))
+    {
+        return sync_sequence();
+    }
+
+    update_durable();
+    return true;
+}
+
+// 最近写入的槽已持久化，其中的上限均可分配
+void CUidAgent::update_durable()
+{
+    _durable_sequence = _seq_block.sequence;
+    _durable_hour_seqs[0] = _seq_block.hour_seqs[0].sequence;
+    _durable_hour_seqs[1] = _seq_block.hour_seqs[1].sequence;
+}
+
+// 将上限复制到peer并等待确认，sequence为0时只查询peer上保存的值，
+// 只在启动时和sync线程中调用，peer_sequence返回peer上保存的值
+bool CUidAgent::replicate_sequence(uint64_t sequence, uint64_t* peer_sequence)
+{
+    if (NULL == _peer_socket)
+    {
+        return false;
+    }
+
+    // 启动时查询多试几次，sync线程中超时则改为fdatasync
+    const int retry_times = (0 == sequence)? 3: 1;
+    for (int i=0; i<retry_times; ++i)
+    {
+        struct MessageHead request;
+        char response_buffer[1 + sizeof(struct MessageHead)];
+        struct MessageHead* response = reinterpret_cast<struct MessageHead*>(response_buffer);
+        struct sockaddr_in from_addr;
+
+        request.len = sizeof(struct MessageHead);
+        request.type = REQUEST_REPLICATE;
+        request.echo = _peer_echo++;
+        request.value1 = mooon::argument::port->value();
+        request.value2 = 0;
+        request.value3 = sequence;
+        request.update_magic();
+
+        try
+        {
+            _peer_socket->send_to(&request, sizeof(request), _peer_addr);
+            const int bytes = _peer_socket->timed_receive_from(response_buffer, sizeof(response_buffer), &from_addr, mooon::argument::peer_timeout->value());
+            if ((bytes != sizeof(struct MessageHead)) ||
+                (response->type != RESPONSE_REPLICATE) ||
+                (response->echo != request.echo) ||
+                (response->calc_magic() != response->magic) ||
+                (response->value3.to_int() < sequence))
+            {
+                MYLOG_ERROR("Invalid response from peer %s: %d, %s\n", mooon::net::to_string(from_addr).c_str(), bytes, response->str().c_str());
+                continue;
+            }
+
+            *peer_sequence = response->value3.to_int();
             return true;
         }
-#endif
+        catch (mooon::sys::CSyscallException& ex)
+        {
+            MYLOG_ERROR("Replicate %" PRIu64" to peer %s failed: %s\n", sequence, mooon::net::to_string(_peer_addr).c_str(), ex.str().c_str());
+        }
+    }
+
+    return false;
+}
+
+// 统计这批中只取一个seq的请求（value1不大于1的REQUEST_UNIQ_SEQ，REQUEST_UNIQ_ID用按小时的seq），
+// 一次预留一段连续的seq，由inc_sequence逐个分给它们，这样边界检查、落盘判断等每批只做一次。
+// 出错、命中应答缓存等原因没用完的在下一批丢弃，seq只保证唯一不保证连续（重启也会跳过预留的steps）
+void CUidAgent::reserve_sequences(uint32_t num_requests)
+{
+    uint32_t num_singles = 0;
+
+    _num_reserved_seqs = 0;
+    for (uint32_t j=0; j<num_requests; ++j)
+    {
+        const struct MessageHead* request = reinterpret_cast<const struct MessageHead*>(_request_batch->buffer(j));
+        if ((_request_batch->length(j) == sizeof(struct MessageHead)) &&
+            (REQUEST_UNIQ_SEQ == request->type) && (request->value1.to_int() <= 1))
+        {
+            ++num_singles;
+        }
+    }
+    if ((num_singles < 2) || io_error())
+    {
+        return;
+    }
+
+    // 出错时不预留，各请求单独调用inc_sequence时会得到同样的错误
+    const uint32_t seq = inc_sequence(static_cast<uint16_t>(num_singles));
+    if (seq != 0)
+    {
+        _reserved_seq = seq;
+        _num_reserved_seqs = num_singles;
+    }
+}
+
+uint32_t CUidAgent::inc_sequence(uint16_t deta)
+{
+    if ((deta <= 1) && (_num_reserved_seqs > 0))
+    {
+        // 从这批预留的中取
+        --_num_reserved_seqs;
+        return _reserved_seq++;
+    }
+
+    // 参数deta值为0或1均表示只取一个
+    const uint64_t n = (0 == deta)? 1: deta;
+    uint64_t sequence = _sequence;
+
+    if (0 == static_cast<uint32_t>(sequence))
+    {
+        // 排除0，原因是返回0时被当作出错
+        ++sequence;
+    }
+    else if ((sequence & 0xFFFFFFFFULL) + n > 0x100000000ULL)
+    {
+        // 批量时不跨越32位的边界，从下一轮的1开始
+        MYLOG_INFO("Sequence overflow: %u(%d)\n", static_cast<uint32_t>(sequence), (int)deta);
+        sequence = (sequence | 0xFFFFFFFFULL) + 2;
+    }
+
+    const uint64_t end = sequence + n;
+    if (end + mooon::argument::steps->value() / 2 > _seq_block.sequence)
+    {
+        // 余量不足半个steps时预留下一个steps，由sync线程异步落盘
+        MYLOG_DEBUG("sequence=%" PRIu64", seq_block.sequence=%" PRIu64", steps=%u\n", end, _seq_block.sequence, mooon::argument::steps->value());
+        _seq_block.sequence = end + mooon::argument::steps->value();
+        if (!store_sequence())
+            return 0;
+    }
+    if ((end > _durable_sequence) && !wait_durable())
+    {
+        return 0;
+    }
+
+    _sequence = end;
+    MU_PROBE3(sequence_inc, sequence, n, _seq_block.sequence);
+    return static_cast<uint32_t>(sequence);
+}
+
+// 从hour小时的seq中分配num个，成功返回0，seq为起始值
+int CUidAgent::alloc_hour_seq(uint32_t hour, uint16_t num, uint32_t* seq)
+{
+    // 参数num值为0或1均表示只取一个
+    const uint32_t n = (0 == num)? 1: num;
+    struct HourSeq* hour_seqs = _seq_block.hour_seqs;
+    int i = 0;
+
+    // 小时由客户端指定，只接受agent当前小时的前后一小时，
+    // 否则一个未来的小时会替换掉当前小时的槽，之后当前小时只能返回MUE_OVERFLOW
+    const uint32_t current_hour = get_current_hour();
+    if ((hour + 1 < current_hour) || (hour > current_hour + 1))
+    {
+        FASTLOG_ERROR("Hour %u out of range, current: %u\n", hour, current_hour);
+        return MUE_PARAMETER;
+    }
+    if (hour < _hour_floor)
+    {
+        FASTLOG_ERROR("Hour %u unavailable, floor: %u\n", hour, _hour_floor);
+        return MUE_OVERFLOW;
+    }
+    if (hour == hour_seqs[0].hour)
+    {
+        i = 0;
+    }
+    else if (hour == hour_seqs[1].hour)
+    {
+        i = 1;
+    }
+    else
+    {
+        // 新的小时替换较早的那个，比两个都早的已不知道分配到哪里了
+        // 不论请求的是哪个小时，都不替换agent当前小时的槽（agent的时钟回拨后可能出现）
+        i = (hour_seqs[0].hour < hour_seqs[1].hour)? 0: 1;
+        if ((hour < hour_seqs[i].hour) || (current_hour == hour_seqs[i].hour))
+        {
+            FASTLOG_ERROR("Hour %u too old: %u, %u\n", hour, hour_seqs[0].hour, hour_seqs[1].hour);
+            return MUE_OVERFLOW;
+        }
+
+        hour_seqs[i].hour = hour;
+        hour_seqs[i].sequence = 0;
+        _hour_seqs[i] = 0;
+        _durable_hour_seqs[i] = 0;
+    }
+
+    const uint32_t next = _hour_seqs[i];
+    if (n > HOUR_SEQ_MAX - next)
+    {
+        // 这个小时的seq已用完，不能回绕，否则会重
+        FASTLOG_ERROR("Hour %u sequence overflow: %u(%u)\n", hour, next, n);
+        return MUE_OVERFLOW;
+    }
+
+    const uint32_t end = next + n;
+    const uint64_t steps = mooon::argument::steps->value();
+    if ((end + steps / 2 > hour_seqs[i].sequence) && (hour_seqs[i].sequence < HOUR_SEQ_MAX))
+    {
+        // 余量不足半个steps时预留下一个steps，同inc_sequence
+        hour_seqs[i].sequence = static_cast<uint32_t>(std::min<uint64_t>(end + steps, HOUR_SEQ_MAX));
+        _written_hour_generation = static_cast<int64_t>(_seq_block.generation + 1);
+        if (!store_sequence())
+            return MUE_STORE_SEQ;
+    }
+    if ((end > _durable_hour_seqs[i]) && !wait_durable())
+    {
+        return MUE_STORE_SEQ;
+    }
+
+    _hour_seqs[i] = end;
+    *seq = next;
+    MU_PROBE4(hour_seq_inc, hour, next, n, hour_seqs[i].sequence);
+    return 0;
+}
+
+// agent当前所在的小时（get_base_hours的值），每秒最多计算一次，不影响get_hour按请求时间的缓存
+uint32_t CUidAgent::get_current_hour()
+{
+    if (_current_hour_time != _current_time)
+    {
+        _current_hour = get_base_hours(static_cast<uint64_t>(_current_time));
+        _current_hour_time = _current_time;
+    }
+    return _current_hour;
+}
+
+// 取current_time所在小时的本地时间和get_base_hours的值，同一小时内只调用一次localtime_r（开销较大）
+const struct tm& CUidAgent::get_hour(time_t current_time, uint32_t* base_hour)
+{
+    if ((0 == _hour_begin) || (current_time < _hour_begin) || (current_time >= _hour_begin + 3600))
+    {
+        localtime_r(&current_time, &_hour_tm);
+        _hour_begin = current_time - _hour_tm.tm_min * 60 - _hour_tm.tm_sec;
+        _base_hour = get_base_hours(_hour_tm.tm_year+1900, _hour_tm.tm_mon+1, _hour_tm.tm_mday, _hour_tm.tm_hour);
+    }
+
+    *base_hour = _base_hour;
+    return _hour_tm;
+}
+
+// 分配一个UniqID，请求的次版本号不小于ENCODING_MINOR_VERSION且value2为MU_ENCODING_SORTABLE时返回SortableID，成功返回0
+int CUidAgent::get_uniq_id(const struct MessageHead* request, uint64_t* id)
+{
+    time_t current_time = static_cast<time_t>(request->value3.to_int());
+    if (0 == current_time)
+    {
+        current_time = _current_time;
+    }
+
+    uint32_t base_hour = 0;
+    uint32_t seq = 0;
+    const struct tm& now = get_hour(current_time, &base_hour);
+    const int errcode = alloc_hour_seq(base_hour, 1, &seq);
+    if (errcode != 0)
+    {
+        return errcode;
+    }
+
+    union UniqID uniq_id;
+    uniq_id.id.user = static_cast<uint8_t>(request->value1.to_int());
+    uniq_id.id.label = static_cast<uint8_t>(_seq_block.label);
+    uniq_id.id.year = (now.tm_year+1900) - MU_BASE_YEAR;
+    uniq_id.id.month = now.tm_mon+1;
+    uniq_id.id.day = now.tm_mday;
+    uniq_id.id.hour = now.tm_hour;
+    uniq_id.id.seq = seq;
+
+    // value2为ID的编码方式，老版本的客户端未设置value2（值不确定），只能按UniqID处理
+    if ((request->minor_ver.to_int() >= ENCODING_MINOR_VERSION) && (MU_ENCODING_SORTABLE == request->value2.to_int()))
+        *id = uniq_id2sortable_id(uniq_id.value);
+    else
+        *id = uniq_id.value;
+    return 0;
+}
+
+bool CUidAgent::label_expired() const
+{
+    if (mooon::argument::master_nodes->value().empty())
+        return false;
+
+    bool expired = _current_time - static_cast<time_t>(_seq_block.timestamp) > static_cast<time_t>(mooon::argument::expire->value());
+    if (expired)
+    {
+        MYLOG_ERROR("Label[%u] expired(%u): %s\n",
+                _seq_block.label, mooon::argument::expire->value(),
+                mooon::sys::CDatetimeUtils::to_datetime(static_cast<time_t>(_seq_block.timestamp)).c_str());
     }
+    return expired;
 }
 
-void CUidAgent::inc_num_sequence(int n)
+// 数据线程调用，将控制线程发布的租约快照同步到_seq_block，
+// Label发生变化时需先保存，保证重启后不会使用已不再持有的Label
+void CUidAgent::sync_lease()
 {
-    if (n != -1)
+    const uint64_t lease = static_cast<uint64_t>(_lease.get_value());
+    const uint32_t label = static_cast<uint32_t>(lease >> 48);
+    const uint64_t timestamp = lease & 0xFFFFFFFFFFFFULL;
+
+    if (timestamp != _seq_block.timestamp)
     {
-        ++_num_sequences;
+        _seq_block.timestamp = timestamp;
     }
-    if (-1==n || _num_sequences>=static_cast<int>(mooon::argument::steps->value()))
+    if (label != _seq_block.label)
     {
-        _event.signal();
-        _num_sequences = 0;
+        MYLOG_DEBUG("Label change from %u to %u\n", _seq_block.label, label);
+        MU_PROBE2(label_change, _seq_block.label, label);
+        _seq_block.update_label(label);
+        (void)store_sequence(true);
     }
 }
 
-uint32_t CUidAgent::inc_sequence(uint16_t deta)
+// 异步取号段，请求交给控制线程发送，取到的号段由install_segments装入
+void CUidAgent::load_segment(struct SegmentBuffer* segment_buffer)
 {
-    bool stored = true;
-	uint32_t sequence = 0;
+    segment_buffer->loading = true;
+    segment_buffer->retry_time = _current_time + segment_buffer->retry_seconds;
+    if (segment_buffer->retry_seconds < SEGMENT_RETRY_MAX_SECONDS)
+        segment_buffer->retry_seconds *= 2;
 
-	if ((_seq_block.sequence < _sequence_start) ||
-	    (_seq_block.sequence - _sequence_start > mooon::argument::steps->value()))
-	{
-	    MYLOG_DEBUG("seq_block.sequence=%u, sequence_start=%u, steps=%u\n", _seq_block.sequence, _sequence_start, mooon::argument::steps->value());
-	    stored = store_sequence();
-	    inc_num_sequence(-1);
-	}
+    {
+        mooon::sys::LockHelper<mooon::sys::CLock> lh(_control_lock);
+        _segment_requests.push_back(segment_buffer->tag);
+    }
 
-	if (stored)
-	{
-	    if (deta <= 1)
-	    {
-	        // 单个时
-            sequence = _seq_block.sequence++;
-            if (0 == sequence)
-            {
-                MYLOG_INFO("sequence overflow: %u->%u\n", sequence, _seq_block.sequence);
-                sequence = _seq_block.sequence++; // 排除0，原因是返回0时被当作出错
-            }
+    const uint64_t one = 1;
+    if (write(_control_eventfd, &one, sizeof(one)) != sizeof(one))
+    {
+        MYLOG_ERROR("Wake control thread for tag[%u] failed: %s\n", segment_buffer->tag, strerror(errno));
+    }
+    MYLOG_DEBUG("Load segment of tag[%u]\n", segment_buffer->tag);
+}
 
-            inc_num_sequence(1);
-	    }
-	    else
-	    {
-	        // 批量时
-	    	if (_seq_block.sequence < _seq_block.sequence+deta)
-	    	{
-	    	    sequence = _seq_block.sequence;
-	    	    _seq_block.sequence += deta;
-	    	    inc_num_sequence(deta);
-	    	}
-	    	else
-	    	{
-	    	    sequence = 1;
-	    	    _seq_block.sequence = sequence + deta;
-	    	    MYLOG_INFO("Sequence overflow: %u->%u(%d)\n", sequence, _seq_block.sequence, (int)deta);
-	    	    inc_num_sequence(-1);
-	    	}
-	    }
-	}
+// 是否可以（重新）向master请求号段：没有在途的请求且tag未被否认，或已到重试的时间
+bool CUidAgent::can_load_segment(const struct SegmentBuffer& segment_buffer) const
+{
+    return (!segment_buffer.loading && !segment_buffer.no_tag) || (_current_time >= segment_buffer.retry_time);
+}
+
+// 装入控制线程取到的号段
+void CUidAgent::install_segments()
+{
+    std::vector<struct LoadedSegment> loaded_segments;
+    {
+        mooon::sys::LockHelper<mooon::sys::CLock> lh(_control_lock);
+        loaded_segments.swap(_loaded_segments);
+        _num_loaded_segments = 0;
+    }
 
-    return sequence;
+    for (std::vector<struct LoadedSegment>::size_type i=0; i<loaded_segments.size(); ++i)
+    {
+        on_segment_loaded(loaded_segments[i]);
+    }
 }
 
-uint64_t CUidAgent::get_uniq_id(const struct MessageHead* request)
+// 从tag的号段中分配num个连续的值，
+// 当前号段剩余不足num个时只分配剩余的部分，不跨号段分配，这样号段间不会留下空洞
+int CUidAgent::alloc_tag_seq(uint32_t tag, uint16_t num, uint64_t* start, uint16_t* count)
 {
-    uint32_t seq = inc_sequence();
+    if (mooon::argument::master_nodes->value().empty())
+    {
+        return MUE_NO_TAG;
+    }
 
-    if (0 == seq)
+    if (_num_loaded_segments > 0)
     {
-        return 0; // store sequence block failed
+        install_segments();
     }
-    else
+
+    std::map<uint32_t, struct SegmentBuffer>::iterator iter = _segment_buffers.find(tag);
+    if (iter == _segment_buffers.end())
     {
-    	static struct tm old_tm;
-    	static time_t old_time = 0;
+        return probe_tag(tag);
+    }
 
-    	struct tm* now = &old_tm;
-        time_t current_time = static_cast<time_t>(request->value3.to_int());
-        if (0 == current_time)
-        {
-        	current_time = _current_time;
-        }
-        if (current_time - old_time > 30) // current_time != old_time
-        {
-        	// 由于只取小时，因此理论上每小时调用一次localtime即可
-        	now = localtime(&current_time); // localtime和localtime_r开销较大
-        	old_tm = *now; // Rember
-        	old_time = current_time; // Rember
-        }
+    struct SegmentBuffer& segment_buffer = iter->second;
+    if (segment_buffer.no_tag)
+    {
+        // --tags指定的tag被master否认
+        if (can_load_segment(segment_buffer))
+            load_segment(&segment_buffer);
+        return MUE_NO_TAG;
+    }
 
-        union UniqID uniq_id;
-        uniq_id.id.user = static_cast<uint8_t>(request->value1.to_int());
-        uniq_id.id.label = static_cast<uint8_t>(_seq_block.label);
-        uniq_id.id.year = (now->tm_year+1900) - MU_BASE_YEAR;
-        uniq_id.id.month = now->tm_mon+1;
-        uniq_id.id.day = now->tm_mday;
-        uniq_id.id.hour = now->tm_hour;
-        uniq_id.id.seq = seq;
-
-        if ((_old_seq > seq) &&
-            (_old_hour == static_cast<int>(uniq_id.id.hour)) &&
-            (_old_day == static_cast<int>(uniq_id.id.day)) &&
-            (_old_month == static_cast<int>(uniq_id.id.month)) &&
-            (_old_year == static_cast<int>(uniq_id.id.year)))
+    struct Segment* segment = &segment_buffer.segments[segment_buffer.current];
+    if (0 == segment->remaining())
+    {
+        if (segment_buffer.next_ready)
         {
-            MYLOG_ERROR("sequence overflow\n");
-            return 1; // overflow
+            // 切换到已加载好的号段
+            segment_buffer.current = 1 - segment_buffer.current;
+            segment_buffer.next_ready = false;
+            segment = &segment_buffer.segments[segment_buffer.current];
         }
         else
         {
-            _old_seq = seq;
-            _old_hour = uniq_id.id.hour;
-            _old_day = uniq_id.id.day;
-            _old_month = uniq_id.id.month;
-            _old_year = uniq_id.id.year;
-            return uniq_id.value;
+            // 两个号段均不可用，未收到master的响应时按退避的间隔重发
+            if (can_load_segment(segment_buffer))
+                load_segment(&segment_buffer);
+            return MUE_NO_SEGMENT;
         }
     }
+
+    const uint64_t n = (0 == num)? 1: num;
+    *start = segment->cursor;
+    *count = static_cast<uint16_t>((segment->remaining() < n)? segment->remaining(): n);
+    segment->cursor += *count;
+
+    if (!segment_buffer.next_ready &&
+        (segment->used_percent() >= mooon::argument::segment_threshold->value()) &&
+        can_load_segment(segment_buffer))
+    {
+        load_segment(&segment_buffer);
+    }
+
+    return 0;
 }
 
-void CUidAgent::rent_label()
+// 未经master确认的tag，向master请求号段，取到后才移入_segment_buffers，
+// master回复不存在的，在退避的间隔内直接回复MUE_NO_TAG，不再请求master。
+// 记录的个数有上限，满时先清除不在等待应答或退避中的，仍满时直接回复MUE_NO_TAG，因此任意的tag不会使内存无限增长
+int CUidAgent::probe_tag(uint32_t tag)
 {
-    if (!mooon::argument::master_nodes->value().empty())
+    std::map<uint32_t, struct SegmentBuffer>::iterator iter = _tag_probes.find(tag);
+    if (iter == _tag_probes.end())
     {
-        int label = get_label(true);
-
-        if (label > 0)
+        if (_tag_probes.size() >= MAX_TAG_PROBES)
         {
-            _seq_block.update_label(label);
+            expire_tag_probes();
+            if (_tag_probes.size() >= MAX_TAG_PROBES)
+                return MUE_NO_TAG;
         }
+
+        struct SegmentBuffer& probe = _tag_probes[tag];
+        probe.tag = tag;
+        load_segment(&probe);
+        return MUE_NO_SEGMENT;
     }
+
+    struct SegmentBuffer& probe = iter->second;
+    if (can_load_segment(probe))
+        load_segment(&probe);
+    return probe.no_tag? MUE_NO_TAG: MUE_NO_SEGMENT;
 }
 
-bool CUidAgent::label_expired() const
+void CUidAgent::expire_tag_probes()
 {
-    if (mooon::argument::master_nodes->value().empty())
+    for (std::map<uint32_t, struct SegmentBuffer>::iterator iter=_tag_probes.begin(); iter!=_tag_probes.end();)
+    {
+        if (_current_time >= iter->second.retry_time)
+            _tag_probes.erase(iter++);
+        else
+            ++iter;
+    }
+}
+
+struct CachedReply* CUidAgent::get_reply_slot()
+{
+    const uint32_t ip = _from_addr.sin_addr.s_addr;
+    const uint32_t port = _from_addr.sin_port;
+    const uint32_t echo = _message_head->echo.to_int();
+    const uint32_t hash = ((ip ^ echo) * 2654435761U) ^ (port * 40503U);
+    return &_reply_cache[hash & _reply_cache_mask];
+}
+
+// 如果是重试的请求，则将缓存的应答放入_response_buffer并返回true
+bool CUidAgent::get_cached_reply()
+{
+    if (_reply_cache.empty())
+    {
         return false;
+    }
 
-    bool expired = _current_time - static_cast<time_t>(_seq_block.timestamp) > static_cast<time_t>(mooon::argument::expire->value());
-    if (expired)
+    const struct CachedReply* cached_reply = get_reply_slot();
+    if ((0 == cached_reply->size) ||
+        (cached_reply->ip != _from_addr.sin_addr.s_addr) ||
+        (cached_reply->port != _from_addr.sin_port) ||
+        (cached_reply->echo != _message_head->echo.to_int()) ||
+        (cached_reply->magic != _message_head->magic.to_int()) ||
+        (_current_time - cached_reply->time > static_cast<time_t>(mooon::argument::reply_cache_seconds->value())))
     {
-        MYLOG_ERROR("Label[%u] expired(%u): %s\n",
-                _seq_block.label, mooon::argument::expire->value(),
-                mooon::sys::CDatetimeUtils::to_datetime(static_cast<time_t>(_seq_block.timestamp)).c_str());
+        return false;
     }
-    return expired;
+
+    memcpy(_response_buffer, cached_reply->response, cached_reply->size);
+    _response_size = cached_reply->size;
+    ++_reply_cache_hits;
+    FASTLOG_DEBUG("Reply cache hit(%" PRIu64"): " MESSAGE_HEAD_FORMAT " from %A:%P\n",
+            _reply_cache_hits, MESSAGE_HEAD_ARGS(_message_head), _from_addr.sin_addr.s_addr, _from_addr.sin_port);
+    return true;
 }
 
-// 轮询方式
-const struct sockaddr_in& CUidAgent::get_master_addr() const
+void CUidAgent::cache_reply()
 {
-    static uint32_t i = 0;
-    return _masters_addr[i++ % _masters_addr.size()];
+    if (!_reply_cache.empty() && (_response_size <= sizeof(struct MessageHead)))
+    {
+        struct CachedReply* cached_reply = get_reply_slot();
+        cached_reply->ip = _from_addr.sin_addr.s_addr;
+        cached_reply->port = _from_addr.sin_port;
+        cached_reply->size = static_cast<uint16_t>(_response_size);
+        cached_reply->echo = _message_head->echo.to_int();
+        cached_reply->magic = _message_head->magic.to_int();
+        cached_reply->time = _current_time;
+        memcpy(cached_reply->response, _response_buffer, _response_size);
+    }
 }
 
 void CUidAgent::prepare_response_error(int errcode)
@@ -878,7 +2008,7 @@ void CUidAgent::prepare_response_error(int errcode)
     response->value3 = 0;
     response->update_magic();
 
-    MYLOG_DEBUG("prepare %s ok\n", response->str().c_str());
+    FASTLOG_DEBUG("prepare " MESSAGE_HEAD_FORMAT " ok\n", MESSAGE_HEAD_ARGS(response));
 }
 
 int CUidAgent::prepare_response_get_label()
@@ -907,7 +2037,7 @@ int CUidAgent::prepare_response_get_label()
         response->value3 = 0;
         response->update_magic();
 
-        MYLOG_DEBUG("prepare %s ok\n", response->str().c_str());
+        FASTLOG_DEBUG("prepare " MESSAGE_HEAD_FORMAT " ok\n", MESSAGE_HEAD_ARGS(response));
         return 0;
     }
 }
@@ -927,14 +2057,11 @@ int CUidAgent::prepare_response_get_uniq_id()
         struct MessageHead* request = reinterpret_cast<struct MessageHead*>(_request_buffer);
         struct MessageHead* response = reinterpret_cast<struct MessageHead*>(_response_buffer);
 
-        uint64_t uniq_id = get_uniq_id(request);
-        if (0 == uniq_id)
-        {
-            return MUE_STORE_SEQ;
-        }
-        else if (1 == uniq_id)
+        uint64_t uniq_id = 0;
+        const int errcode = get_uniq_id(request, &uniq_id);
+        if (errcode != 0)
         {
-            return MUE_OVERFLOW;
+            return errcode;
         }
         else
         {
@@ -949,7 +2076,7 @@ int CUidAgent::prepare_response_get_uniq_id()
             response->value3 = uniq_id; // value1和value2均为uint32_t类型，存不下uniq_id
             response->update_magic();
 
-            MYLOG_DEBUG("Prepare %s ok\n", response->str().c_str());
+            FASTLOG_DEBUG("prepare " MESSAGE_HEAD_FORMAT " ok\n", MESSAGE_HEAD_ARGS(response));
             return 0;
         }
     }
@@ -989,7 +2116,7 @@ int CUidAgent::prepare_response_get_uniq_seq()
             response->value3 = 0;
             response->update_magic();
 
-            MYLOG_DEBUG("prepare %s ok\n", response->str().c_str());
+            FASTLOG_DEBUG("prepare " MESSAGE_HEAD_FORMAT " ok\n", MESSAGE_HEAD_ARGS(response));
             return 0;
         }
     }
@@ -1010,63 +2137,398 @@ int CUidAgent::prepare_response_get_label_and_seq()
         struct MessageHead* request = reinterpret_cast<struct MessageHead*>(_request_buffer);
         struct MessageHead* response = reinterpret_cast<struct MessageHead*>(_response_buffer);
         uint16_t deta = static_cast<uint16_t>(request->value1.to_int());
-        uint32_t seq = inc_sequence(deta);
+        uint32_t seq = 0;
 
-        if (0 == seq)
+        // 老版本的客户端在本地用这里的seq（低29位）和它自己的小时组装UniqID，
+        // 无法和按小时分配的seq区分开，会产生重复的ID，因此只能拒绝，须先升级全部的客户端
+        if (request->minor_ver.to_int() < HOUR_SEQ_MINOR_VERSION)
+        {
+            FASTLOG_ERROR("Refuse old client: " MESSAGE_HEAD_FORMAT "\n", MESSAGE_HEAD_ARGS(request));
+            return MUE_VERSION;
+        }
+
+        // 用于组装UniqID和SortableID时，从客户端指定小时的seq中分配
+        if (SEQ_HOURLY == request->value2.to_int())
+        {
+            const int errcode = alloc_hour_seq(static_cast<uint32_t>(request->value3.to_int()), deta, &seq);
+            if (errcode != 0)
+                return errcode;
+        }
+        else if (0 == (seq = inc_sequence(deta)))
         {
             return MUE_STORE_SEQ;
         }
-        else
+
+        _response_size = sizeof(struct MessageHead);
+        response->major_ver = MU_MAJOR_VERSION;
+        response->minor_ver = MU_MINOR_VERSION;
+        response->len = sizeof(struct MessageHead);
+        response->type = RESPONSE_LABEL_AND_SEQ;
+        response->echo = request->echo;
+        response->value1 = _seq_block.label;
+        response->value2 = seq;
+        response->value3 = 0;
+        response->update_magic();
+
+        FASTLOG_DEBUG("prepare " MESSAGE_HEAD_FORMAT " ok\n", MESSAGE_HEAD_ARGS(response));
+        return 0;
+    }
+}
+
+int CUidAgent::prepare_response_get_tag_seq()
+{
+    struct MessageHead* request = reinterpret_cast<struct MessageHead*>(_request_buffer);
+    struct MessageHead* response = reinterpret_cast<struct MessageHead*>(_response_buffer);
+    const uint32_t tag = request->value1.to_int();
+    const uint16_t num = static_cast<uint16_t>(request->value2.to_int());
+    uint64_t start = 0;
+    uint16_t count = 0;
+
+    int errcode = alloc_tag_seq(tag, num, &start, &count);
+    if (errcode != 0)
+    {
+        return errcode;
+    }
+    else
+    {
+        _response_size = sizeof(struct MessageHead);
+        response->major_ver = MU_MAJOR_VERSION;
+        response->minor_ver = MU_MINOR_VERSION;
+        response->len = sizeof(struct MessageHead);
+        response->type = RESPONSE_TAG_SEQ;
+        response->echo = request->echo;
+        response->value1 = tag;
+        response->value2 = count;
+        response->value3 = start;
+        response->update_magic();
+
+        FASTLOG_DEBUG("prepare " MESSAGE_HEAD_FORMAT " ok\n", MESSAGE_HEAD_ARGS(response));
+        return 0;
+    }
+}
+
+int CUidAgent::prepare_response_inc_counter()
+{
+    const struct CounterRequest* request = reinterpret_cast<struct CounterRequest*>(_request_buffer);
+    struct MessageHead* response = reinterpret_cast<struct MessageHead*>(_response_buffer);
+    const size_t name_len = request->head.len.to_int() - sizeof(struct MessageHead);
+    const uint32_t hash = request->head.value1.to_int();
+    const uint16_t num = static_cast<uint16_t>(request->head.value2.to_int());
+
+    // magic只覆盖消息头，计数器名由value1中的crc32校验
+    if ((0 == name_len) || (name_len > COUNTER_NAME_MAX) || (hash != crc32(0, request->name, name_len)))
+    {
+        FASTLOG_ERROR("Invalid counter request: " MESSAGE_HEAD_FORMAT "\n", MESSAGE_HEAD_ARGS(&request->head));
+        return MUE_PARAMETER;
+    }
+
+    uint64_t start = 0;
+    uint16_t count = 0;
+    const int64_t generation = _counter_table->get_generation();
+    int errcode = _counter_table->inc(request->name, static_cast<uint8_t>(name_len), hash, num, &start, &count);
+    if (_counter_table->get_generation() != generation)
+    {
+        _event.signal(); // 追加了记录，通知sync线程尽快落盘（和压缩）
+    }
+    if (errcode != 0)
+    {
+        return errcode;
+    }
+
+    _response_size = sizeof(struct MessageHead);
+    response->major_ver = MU_MAJOR_VERSION;
+    response->minor_ver = MU_MINOR_VERSION;
+    response->len = sizeof(struct MessageHead);
+    response->type = RESPONSE_COUNTER;
+    response->echo = request->head.echo;
+    response->value1 = hash;
+    response->value2 = count;
+    response->value3 = start;
+    response->update_magic();
+
+    FASTLOG_DEBUG("prepare " MESSAGE_HEAD_FORMAT " ok\n", MESSAGE_HEAD_ARGS(response));
+    return 0;
+}
+
+// 作为peer时保存其它agent复制来的上限，只增不减
+int CUidAgent::prepare_response_replicate()
+{
+    const struct MessageHead* request = reinterpret_cast<struct MessageHead*>(_request_buffer);
+    struct MessageHead* response = reinterpret_cast<struct MessageHead*>(_response_buffer);
+    const uint64_t key = (static_cast<uint64_t>(_from_addr.sin_addr.s_addr) << 16) | (request->value1.to_int() & 0xFFFF);
+    const uint64_t sequence = request->value3.to_int();
+
+    uint64_t& peer_sequence = _peer_sequences[key];
+    if (sequence > peer_sequence)
+    {
+        peer_sequence = sequence;
+    }
+
+    _response_size = sizeof(struct MessageHead);
+    response->major_ver = MU_MAJOR_VERSION;
+    response->minor_ver = MU_MINOR_VERSION;
+    response->len = sizeof(struct MessageHead);
+    response->type = RESPONSE_REPLICATE;
+    response->echo = request->echo;
+    response->value1 = request->value1;
+    response->value2 = 0;
+    response->value3 = peer_sequence;
+    response->update_magic();
+
+    FASTLOG_DEBUG("prepare " MESSAGE_HEAD_FORMAT " ok\n", MESSAGE_HEAD_ARGS(response));
+    return 0;
+}
+
+void CUidAgent::on_segment_loaded(const struct LoadedSegment& loaded_segment)
+{
+    std::map<uint32_t, struct SegmentBuffer>::iterator iter = _segment_buffers.find(loaded_segment.tag);
+    std::map<uint32_t, struct SegmentBuffer>::iterator probe_iter = _tag_probes.find(loaded_segment.tag);
+    if ((iter == _segment_buffers.end()) && (probe_iter == _tag_probes.end()))
+    {
+        MYLOG_ERROR("Invalid segment of tag[%u]\n", loaded_segment.tag);
+        return;
+    }
+
+    if (loaded_segment.errcode != 0)
+    {
+        // master回复出错，在退避的间隔后才重新请求，tag不存在时期间直接回复MUE_NO_TAG
+        struct SegmentBuffer& segment_buffer = (iter != _segment_buffers.end())? iter->second: probe_iter->second;
+        MYLOG_WARN("Load segment of tag[%u] failed: %d, retry after %u seconds\n",
+                loaded_segment.tag, loaded_segment.errcode, segment_buffer.retry_seconds);
+        segment_buffer.loading = false;
+        segment_buffer.no_tag = (MUE_NO_TAG == loaded_segment.errcode);
+        segment_buffer.retry_time = _current_time + segment_buffer.retry_seconds;
+        return;
+    }
+    if (iter == _segment_buffers.end())
+    {
+        // master确认了tag，从_tag_probes移入_segment_buffers
+        iter = _segment_buffers.insert(std::make_pair(loaded_segment.tag, probe_iter->second)).first;
+        _tag_probes.erase(probe_iter);
+    }
+
+    struct SegmentBuffer& segment_buffer = iter->second;
+    segment_buffer.no_tag = false;
+    segment_buffer.retry_seconds = SEGMENT_RETRY_SECONDS;
+    if (!segment_buffer.loading || segment_buffer.next_ready)
+    {
+        // 重发导致的重复响应，丢弃这个号段（会留下一个空洞，但不会重复）
+        MYLOG_WARN("Discard segment of tag[%u]: %" PRIu64"/%u\n", loaded_segment.tag, loaded_segment.start, loaded_segment.step);
+        return;
+    }
+
+    // 当前号段已用完则直接替换当前号段，否则作为下一个号段
+    const int index = (0 == segment_buffer.segments[segment_buffer.current].remaining())?
+            segment_buffer.current: 1 - segment_buffer.current;
+    struct Segment& segment = segment_buffer.segments[index];
+    segment.start = loaded_segment.start;
+    segment.cursor = loaded_segment.start;
+    segment.end = loaded_segment.start + loaded_segment.step;
+    segment_buffer.next_ready = (index != segment_buffer.current);
+    segment_buffer.loading = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// 控制线程
+
+void CUidAgent::control_thread()
+{
+    time_t last_rent_time = 0; // 最后一次向master发起rent_label的时间
+
+    while (!to_stop())
+    {
+        const time_t current_time = time(NULL);
+        if (current_time - last_rent_time > static_cast<time_t>(mooon::argument::interval->value()))
         {
-            _response_size = sizeof(struct MessageHead);
-            response->major_ver = MU_MAJOR_VERSION;
-            response->minor_ver = MU_MINOR_VERSION;
-            response->len = sizeof(struct MessageHead);
-            response->type = RESPONSE_LABEL_AND_SEQ;
-            response->echo = request->echo;
-            response->value1 = _seq_block.label;
-            response->value2 = seq;
-            response->value3 = 0;
-            response->update_magic();
+            // 间隔的向master发一个续租请求
+            rent_label();
+            last_rent_time = current_time;
+        }
 
-            MYLOG_DEBUG("prepare %s ok\n", response->str().c_str());
-            return 0;
+        send_segment_requests();
+
+        struct pollfd fds[2];
+        fds[0].fd = _control_socket->get_fd();
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = _control_eventfd;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        const int n = poll(fds, 2, 1000);
+        if (-1 == n)
+        {
+            if (errno != EINTR)
+                MYLOG_ERROR("Poll control socket failed: %s\n", strerror(errno));
+            continue;
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            uint64_t value;
+            (void)read(_control_eventfd, &value, sizeof(value));
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            on_control_message();
+        }
+    }
+}
+
+void CUidAgent::rent_label()
+{
+    get_label(get_lease_label(), true);
+}
+
+void CUidAgent::publish_lease(uint32_t label, uint64_t timestamp)
+{
+    _lease = static_cast<int64_t>((static_cast<uint64_t>(label) << 48) | (timestamp & 0xFFFFFFFFFFFFULL));
+}
+
+uint32_t CUidAgent::get_lease_label() const
+{
+    return static_cast<uint32_t>(static_cast<uint64_t>(_lease.get_value()) >> 48);
+}
+
+// 轮询方式
+const struct sockaddr_in& CUidAgent::get_master_addr() const
+{
+    static uint32_t i = 0;
+    return _masters_addr[i++ % _masters_addr.size()];
+}
+
+void CUidAgent::send_segment_requests()
+{
+    std::vector<uint32_t> segment_requests;
+    {
+        mooon::sys::LockHelper<mooon::sys::CLock> lh(_control_lock);
+        segment_requests.swap(_segment_requests);
+    }
+
+    for (std::vector<uint32_t>::size_type i=0; i<segment_requests.size(); ++i)
+    {
+        struct MessageHead request;
+        request.len = sizeof(struct MessageHead);
+        request.type = REQUEST_SEGMENT;
+        request.echo = _echo++;
+        request.value1 = segment_requests[i];
+        if (_segment_echoes.size() >= MAX_SEGMENT_ECHOES)
+            _segment_echoes.clear(); // 多是丢失了应答的请求，丢弃它们只是使这些请求的出错应答不能交回tag
+        _segment_echoes[request.echo.to_int()] = segment_requests[i];
+        request.value2 = get_lease_label();
+        request.value3 = 0;
+        request.update_magic();
+
+        try
+        {
+            _control_socket->send_to(&request, sizeof(request), get_master_addr());
+        }
+        catch (mooon::sys::CSyscallException& ex)
+        {
+            MYLOG_ERROR("Load segment of tag[%u] failed: %s\n", segment_requests[i], ex.str().c_str());
         }
     }
 }
 
-int CUidAgent::on_response_error()
+void CUidAgent::on_control_message()
 {
-    struct MessageHead* response = reinterpret_cast<struct MessageHead*>(_request_buffer);
-    MYLOG_ERROR("%s from %s\n", response->str().c_str(), mooon::net::to_string(_from_addr).c_str());
+    char buffer[SOCKET_BUFFER_SIZE];
+    struct sockaddr_in from_addr;
+    const struct MessageHead* response = reinterpret_cast<struct MessageHead*>(buffer);
 
+    try
+    {
+        int bytes_received = _control_socket->receive_from(buffer, sizeof(buffer), &from_addr);
+        if ((bytes_received != static_cast<int>(sizeof(struct MessageHead))) || (bytes_received != response->len))
+        {
+            MYLOG_ERROR("Invalid size (%d) from %s\n", bytes_received, mooon::net::to_string(from_addr).c_str());
+        }
+        else if (response->calc_magic() != response->magic)
+        {
+            MYLOG_ERROR("[%s] illegal response: %s\n", mooon::net::to_string(from_addr).c_str(), response->str().c_str());
+        }
+        else if (RESPONSE_ERROR == response->type)
+        {
+            MYLOG_ERROR("%s from %s\n", response->str().c_str(), mooon::net::to_string(from_addr).c_str());
+            on_response_error(response);
+        }
+        else if (RESPONSE_LABEL == response->type)
+        {
+            MYLOG_INFO("%s from %s\n", response->str().c_str(), mooon::net::to_string(from_addr).c_str());
+            on_response_label(response);
+        }
+        else if (RESPONSE_SEGMENT == response->type)
+        {
+            MYLOG_INFO("%s from %s\n", response->str().c_str(), mooon::net::to_string(from_addr).c_str());
+            on_response_segment(response);
+        }
+        else
+        {
+            MYLOG_ERROR("Invalid message type: %s\n", response->str().c_str());
+        }
+    }
+    catch (mooon::sys::CSyscallException& ex)
+    {
+        MYLOG_ERROR("Receive from master failed: %s\n", ex.str().c_str());
+    }
+}
+
+void CUidAgent::on_response_error(const struct MessageHead* response)
+{
     if (MUE_LABEL_NOT_HOLD == response->value1.to_int())
     {
         // 需要重新租赁Label，故重置
-        _seq_block.update_label(0);
-        get_label(true);
+        const uint64_t lease = static_cast<uint64_t>(_lease.get_value());
+        publish_lease(0, lease & 0xFFFFFFFFFFFFULL);
+        get_label(0, true);
     }
 
-    return -1;
+    // 号段请求的出错应答（如MUE_NO_TAG）交回对应的tag，由数据线程退避
+    std::map<uint32_t, uint32_t>::iterator iter = _segment_echoes.find(response->echo.to_int());
+    if (iter != _segment_echoes.end())
+    {
+        struct LoadedSegment loaded_segment;
+        loaded_segment.tag = iter->second;
+        loaded_segment.step = 0;
+        loaded_segment.start = 0;
+        loaded_segment.errcode = static_cast<int>(response->value1.to_int());
+        _segment_echoes.erase(iter);
+
+        mooon::sys::LockHelper<mooon::sys::CLock> lh(_control_lock);
+        _loaded_segments.push_back(loaded_segment);
+        _num_loaded_segments = static_cast<int>(_loaded_segments.size());
+    }
 }
 
-int CUidAgent::on_response_label()
+void CUidAgent::on_response_label(const struct MessageHead* response)
 {
-    struct MessageHead* response = reinterpret_cast<struct MessageHead*>(_request_buffer);
-    MYLOG_INFO("%s from %s\n", response->str().c_str(), mooon::net::to_string(_from_addr).c_str());
-
-    uint32_t old_label = _seq_block.label;
-    _seq_block.update_label(static_cast<uint32_t>(response->value1.to_int()));
-    _seq_block.timestamp = static_cast<uint64_t>(_current_time);
+    const uint32_t label = static_cast<uint32_t>(response->value1.to_int());
+    if ((label < 1) || (label > LABEL_MAX))
+    {
+        MYLOG_ERROR("Invalid label[%u]\n", label);
+    }
+    else
+    {
+        // 续租成功，Label可能发生变化，由数据线程在sync_lease中保存
+        publish_lease(label, static_cast<uint64_t>(time(NULL)));
+    }
+}
 
-    // Lable发生变化时，立即保存
-    if (old_label != _seq_block.label)
+void CUidAgent::on_response_segment(const struct MessageHead* response)
+{
+    struct LoadedSegment loaded_segment;
+    loaded_segment.tag = response->value1.to_int();
+    loaded_segment.step = response->value2.to_int();
+    loaded_segment.start = response->value3.to_int();
+    loaded_segment.errcode = 0;
+    _segment_echoes.erase(response->echo.to_int());
+    if ((0 == loaded_segment.step) || (0 == loaded_segment.start))
     {
-        MYLOG_DEBUG("Label change from %u to %u\n", old_label, _seq_block.label);
-        (void)store_sequence();
+        MYLOG_ERROR("Invalid segment: %s\n", response->str().c_str());
+        return;
     }
 
-    return -1;
+    mooon::sys::LockHelper<mooon::sys::CLock> lh(_control_lock);
+    _loaded_segments.push_back(loaded_segment);
+    _num_loaded_segments = static_cast<int>(_loaded_segments.size());
 }
 
 } // namespace muidor {
@@ -0,0 +1,432 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#include "datagram_socket.h"
+#include "monotonic_clock.h"
+#include "probes.h"
+#include "protocol.h"
+#include "muidor/muidor.h"
+#include <mooon/sys/utils.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+namespace muidor {
+
+static const uint32_t RESPONSE_BATCH_SIZE = 64; // 一次最多收取的应答数
+static const int RECEIVE_BUFFER_SIZE = 4194304; // 在途的请求多时应答是突发的，调大接收缓冲区（受net.core.rmem_max限制）
+
+CAsyncMuidor::CAsyncMuidor(const CMuidor& muidor)
+    : _muidor(muidor),
+      _max_attempts((0 == muidor._retry_times)? 1: muidor._retry_times),
+      _cursor(mooon::sys::CUtils::get_random_number(0, 0x7FFFFFFFU)),
+      _udp_socket(new CDatagramSocket),
+      _responses(new CDatagramBatch(RESPONSE_BATCH_SIZE, 1 + sizeof(struct MessageHead) + sizeof(struct LoadHint))), // 多出一字节，以过滤掉包大小不同的脏数据
+      _wheel(WHEEL_SIZE)
+{
+    _wheel_time = get_monotonic_milliseconds() / TICK_MILLISECONDS * TICK_MILLISECONDS;
+    if (-1 == _udp_socket->open(true))
+    {
+        const int errcode = errno;
+        delete _responses;
+        delete _udp_socket;
+        THROW_SYSCALL_EXCEPTION("[muidor] create socket failed", errcode, "socket");
+    }
+
+    (void)_udp_socket->set_buffer_size(RECEIVE_BUFFER_SIZE, 0);
+}
+
+CAsyncMuidor::~CAsyncMuidor()
+{
+    delete _responses;
+    delete _udp_socket;
+}
+
+int CAsyncMuidor::get_fd() const
+{
+    return _udp_socket->get_fd();
+}
+
+int CAsyncMuidor::get_timeout() const
+{
+    if (_requests.empty())
+    {
+        return -1;
+    }
+
+    const uint64_t now = get_monotonic_milliseconds();
+    const uint64_t next = _wheel_time + TICK_MILLISECONDS;
+    return (next > now)? static_cast<int>(next - now): 0;
+}
+
+int CAsyncMuidor::complete(std::vector<struct AsyncResult>* results)
+{
+    const std::vector<struct AsyncResult>::size_type num_results = results->size();
+
+    while (true)
+    {
+        const int n = _udp_socket->receive_batch(_responses);
+        if (n <= 0)
+        {
+            break;
+        }
+
+        for (int i=0; i<n; ++i)
+        {
+            handle_response(reinterpret_cast<const struct MessageHead*>(_responses->buffer(i)),
+                            _responses->length(i), _responses->addr(i), results);
+        }
+        if (static_cast<uint32_t>(n) < _responses->capacity())
+        {
+            break;
+        }
+    }
+
+    expire(get_monotonic_milliseconds(), results);
+    return static_cast<int>(results->size() - num_results);
+}
+
+uint32_t CAsyncMuidor::submit_label()
+{
+    struct MessageHead request;
+    request.len = sizeof(request);
+    request.type = REQUEST_LABEL;
+    request.value1 = 0;
+    request.value2 = 0;
+    request.value3 = 0;
+    return submit(&request, RESPONSE_LABEL);
+}
+
+uint32_t CAsyncMuidor::submit_unqi_seq(uint16_t num)
+{
+    struct MessageHead request;
+    request.len = sizeof(request);
+    request.type = REQUEST_UNIQ_SEQ;
+    request.value1 = num;
+    request.value2 = 0;
+    request.value3 = 0;
+    return submit(&request, RESPONSE_UNIQ_SEQ);
+}
+
+uint32_t CAsyncMuidor::submit_uniq_id(uint8_t user, uint64_t current_seconds)
+{
+    struct MessageHead request;
+    request.len = sizeof(request);
+    request.type = REQUEST_UNIQ_ID;
+    request.value1 = user;
+    request.value2 = MU_ENCODING_UNIQ_ID;
+    request.value3 = current_seconds;
+    return submit(&request, RESPONSE_UNIQ_ID);
+}
+
+uint32_t CAsyncMuidor::submit_sortable_id(uint8_t user, uint64_t current_seconds)
+{
+    struct MessageHead request;
+    request.len = sizeof(request);
+    request.type = REQUEST_UNIQ_ID;
+    request.value1 = user;
+    request.value2 = MU_ENCODING_SORTABLE;
+    request.value3 = current_seconds;
+    return submit(&request, RESPONSE_UNIQ_ID);
+}
+
+uint32_t CAsyncMuidor::submit_label_and_seq(uint16_t num)
+{
+    struct MessageHead request;
+    request.len = sizeof(request);
+    request.type = REQUEST_LABEL_AND_SEQ;
+    request.value1 = num;
+    request.value2 = 0;
+    request.value3 = 0;
+    return submit(&request, RESPONSE_LABEL_AND_SEQ);
+}
+
+uint32_t CAsyncMuidor::submit_label_and_hour_seq(uint16_t num, uint32_t hour)
+{
+    struct MessageHead request;
+    request.len = sizeof(request);
+    request.type = REQUEST_LABEL_AND_SEQ;
+    request.value1 = num;
+    request.value2 = SEQ_HOURLY;
+    request.value3 = hour;
+    return submit(&request, RESPONSE_LABEL_AND_SEQ);
+}
+
+uint32_t CAsyncMuidor::submit_tag_seq(uint32_t tag, uint16_t num)
+{
+    struct MessageHead request;
+    request.len = sizeof(request);
+    request.type = REQUEST_TAG_SEQ;
+    request.value1 = tag;
+    request.value2 = num;
+    request.value3 = 0;
+    return submit(&request, RESPONSE_TAG_SEQ);
+}
+
+uint32_t CAsyncMuidor::submit_counter(const std::string& name, uint16_t num)
+{
+    if (name.empty() || (name.size() > COUNTER_NAME_MAX))
+    {
+        THROW_EXCEPTION(
+                mooon::utils::CStringUtils::format_string("[muidor] invalid counter name: %s", name.c_str()),
+                MUE_PARAMETER);
+    }
+
+    struct CounterRequest request;
+    request.head.len = static_cast<uint16_t>(sizeof(request.head) + name.size());
+    request.head.type = REQUEST_COUNTER;
+    request.head.value1 = crc32(0, name.data(), name.size());
+    request.head.value2 = num;
+    request.head.value3 = 0;
+    memcpy(request.name, name.data(), name.size());
+    return submit(&request.head, RESPONSE_COUNTER);
+}
+
+// 请求的消息头后可能还跟着数据（如计数器名），大小以len为准
+uint32_t CAsyncMuidor::submit(struct MessageHead* request, uint16_t response_type)
+{
+    const uint32_t echo = _muidor.get_echo();
+    request->echo = echo;
+    request->update_magic();
+
+    if (_requests.empty())
+    {
+        // 空闲期间时间轮没有推进，直接跳到当前时间
+        _wheel_time = get_monotonic_milliseconds() / TICK_MILLISECONDS * TICK_MILLISECONDS;
+    }
+
+    struct Request& request_ = _requests[echo];
+    request_.data.assign(reinterpret_cast<const char*>(request), request->len.to_int());
+    request_.response_type = response_type;
+    request_.attempts = 0;
+    send(echo, &request_);
+    return echo;
+}
+
+// 发送失败时只计数，超时后重试
+void CAsyncMuidor::send(uint32_t echo, struct Request* request)
+{
+    request->agent_index = _muidor.pick_agent(&_cursor);
+    const struct sockaddr_in& agent_addr = _muidor._agents_addr[request->agent_index];
+
+    MU_PROBE5(client_request, reinterpret_cast<const struct MessageHead*>(request->data.data())->type.to_int(), echo,
+              agent_addr.sin_addr.s_addr, agent_addr.sin_port, request->attempts);
+    const ssize_t bytes = _udp_socket->send_to(request->data.data(), request->data.size(), agent_addr);
+    if (bytes != static_cast<ssize_t>(request->data.size()))
+    {
+        ++mu_metric.send_error;
+    }
+
+    ++request->attempts;
+    request->send_time = get_monotonic_microseconds();
+    request->deadline = request->send_time / 1000 + _muidor._timeout_milliseconds;
+    add_timer(echo, *request);
+}
+
+// 放入不早于deadline的第一个槽，这样槽到期时其中的请求均已超时（超过一轮的除外）
+void CAsyncMuidor::add_timer(uint32_t echo, const struct Request& request)
+{
+    uint64_t slot_time = (request.deadline + TICK_MILLISECONDS - 1) / TICK_MILLISECONDS * TICK_MILLISECONDS;
+    if (slot_time <= _wheel_time)
+    {
+        slot_time = _wheel_time + TICK_MILLISECONDS;
+    }
+
+    struct Timer timer;
+    timer.echo = echo;
+    timer.attempts = request.attempts;
+    _wheel[(slot_time / TICK_MILLISECONDS) % WHEEL_SIZE].push_back(timer);
+}
+
+// 校验同CMuidor::call_agent，
+// 大小不对、不是来自agent、echo不匹配（如重试前的请求的迟到应答）或magic错误的应答直接丢弃，
+// 出错应答和类型不对的应答立即重试或失败
+void CAsyncMuidor::handle_response(const struct MessageHead* response, size_t size, const struct sockaddr_in& from_addr,
+                                   std::vector<struct AsyncResult>* results)
+{
+    if (((size != sizeof(struct MessageHead)) && (size != sizeof(struct MessageHead) + sizeof(struct LoadHint))) ||
+        (size != response->len.to_int()))
+    {
+        ++mu_metric.invalid_size;
+        return;
+    }
+
+    std::map<uint32_t, struct Request>::iterator iter = _requests.find(response->echo.to_int());
+    if (iter == _requests.end())
+    {
+        ++mu_metric.mismatch_echo;
+        return;
+    }
+
+    // 重试前的请求的应答也接受，因此不一定来自最近一次发往的agent
+    uint32_t agent_index = 0;
+    for (; agent_index<_muidor._agents_addr.size(); ++agent_index)
+    {
+        if (0 == memcmp(&_muidor._agents_addr[agent_index], &from_addr, sizeof(struct sockaddr_in)))
+        {
+            break;
+        }
+    }
+    if (agent_index == _muidor._agents_addr.size())
+    {
+        ++mu_metric.error_sockaddr;
+        return;
+    }
+#if _CHECK_MAGIC_ == 1
+    if (response->calc_magic() != response->magic)
+    {
+        ++mu_metric.illegal_magic;
+        return;
+    }
+#endif // _CHECK_MAGIC_
+
+    const uint16_t response_type = iter->second.response_type;
+    if (RESPONSE_ERROR == response->type)
+    {
+        ++mu_metric.response_error;
+        retry_or_fail(iter, static_cast<int>(response->value1.to_int()), results);
+        return;
+    }
+    if (response->type != response_type)
+    {
+        if (RESPONSE_LABEL == response_type)
+            ++mu_metric.response_not_label;
+        else if (RESPONSE_UNIQ_ID == response_type)
+            ++mu_metric.error_uniqid;
+        else
+            ++mu_metric.error_sequence;
+        retry_or_fail(iter, response->type.to_int(), results);
+        return;
+    }
+    if ((RESPONSE_LABEL == response_type) || (RESPONSE_LABEL_AND_SEQ == response_type))
+    {
+        const uint32_t label = response->value1.to_int();
+        if ((label >= 0xFF) || (label < 1))
+        {
+            ++mu_metric.invalid_label;
+            retry_or_fail(iter, MUE_INVALID_LABEL, results);
+            return;
+        }
+    }
+
+    // 新版本的agent在消息头之后附带负载提示
+    const uint16_t load = (size > sizeof(struct MessageHead))?
+            reinterpret_cast<const struct LoadHint*>(reinterpret_cast<const char*>(response) + sizeof(struct MessageHead))->busy.to_int(): 0;
+    if (agent_index == iter->second.agent_index)
+    {
+        _muidor.record_latency(agent_index, static_cast<uint32_t>(get_monotonic_microseconds() - iter->second.send_time));
+    }
+    _muidor.record_success(agent_index, load);
+
+    struct AsyncResult result;
+    result.token = iter->first;
+    result.errcode = 0;
+    result.type = response_type;
+    result.label = 0;
+    result.count = 0;
+    result.value = 0;
+    switch (response_type)
+    {
+    case RESPONSE_LABEL:
+        result.label = static_cast<uint8_t>(response->value1.to_int());
+        break;
+    case RESPONSE_UNIQ_SEQ:
+        result.value = response->value1.to_int();
+        break;
+    case RESPONSE_UNIQ_ID:
+        result.value = response->value3.to_int();
+        break;
+    case RESPONSE_LABEL_AND_SEQ:
+        result.label = static_cast<uint8_t>(response->value1.to_int());
+        result.value = response->value2.to_int();
+        break;
+    default: // RESPONSE_TAG_SEQ和RESPONSE_COUNTER
+        result.count = static_cast<uint16_t>(response->value2.to_int());
+        result.value = response->value3.to_int();
+        break;
+    }
+
+    MU_PROBE3(client_response, response_type, iter->first, 0);
+    results->push_back(result);
+    _requests.erase(iter);
+}
+
+// 推进时间轮到now，处理经过的槽中超时的请求，
+// 落后超过一轮时（如事件循环被阻塞）每个槽只处理一次
+void CAsyncMuidor::expire(uint64_t now, std::vector<struct AsyncResult>* results)
+{
+    for (uint32_t ticks=0; (_wheel_time + TICK_MILLISECONDS <= now) && (ticks < WHEEL_SIZE); ++ticks)
+    {
+        std::vector<struct Timer> timers;
+        _wheel_time += TICK_MILLISECONDS;
+        timers.swap(_wheel[(_wheel_time / TICK_MILLISECONDS) % WHEEL_SIZE]);
+
+        for (std::vector<struct Timer>::size_type i=0; i<timers.size(); ++i)
+        {
+            std::map<uint32_t, struct Request>::iterator iter = _requests.find(timers[i].echo);
+            if ((iter == _requests.end()) || (iter->second.attempts != timers[i].attempts))
+            {
+                continue;
+            }
+            if (iter->second.deadline > now)
+            {
+                add_timer(iter->first, iter->second); // 超时超过一轮
+                continue;
+            }
+
+            if (iter->second.attempts >= _max_attempts)
+                ++mu_metric.receive_timeout;
+            else
+                ++mu_metric.sys_exception;
+            _muidor.record_failure(iter->second.agent_index);
+            retry_or_fail(iter, ETIMEDOUT, results);
+        }
+    }
+    if (_wheel_time + TICK_MILLISECONDS <= now)
+    {
+        _wheel_time = now / TICK_MILLISECONDS * TICK_MILLISECONDS;
+    }
+}
+
+// 还有重试次数时改从其它agent取（echo不变），否则以errcode结束
+void CAsyncMuidor::retry_or_fail(std::map<uint32_t, struct Request>::iterator iter, int errcode, std::vector<struct AsyncResult>* results)
+{
+    struct Request& request = iter->second;
+
+    if (request.attempts < _max_attempts)
+    {
+        ++mu_metric.retry_times;
+        MU_PROBE4(client_retry, request.response_type, iter->first, request.attempts - 1, errcode);
+        send(iter->first, &request);
+    }
+    else
+    {
+        struct AsyncResult result;
+        result.token = iter->first;
+        result.errcode = errcode;
+        result.type = request.response_type;
+        result.label = 0;
+        result.count = 0;
+        result.value = 0;
+
+        MU_PROBE3(client_response, request.response_type, iter->first, errcode);
+        results->push_back(result);
+        _requests.erase(iter);
+    }
+}
+
+} // namespace muidor {
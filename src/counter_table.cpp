@@ -0,0 +1,461 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#include "counter_table.h"
+#include <fcntl.h>
+#include <libgen.h>
+#include <mooon/sys/close_helper.h>
+#include <mooon/sys/config.h>
+#include <mooon/sys/log.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+namespace muidor {
+
+enum
+{
+    COUNTER_INIT_CAPACITY = 1024, // 初始槽数，必须为2的幂
+    COMPACT_MIN_RECORDS = 1024    // 日志中多出的记录数超过这个值才压缩，避免计数器少时频繁压缩
+};
+
+// 日志记录，后面紧跟name_len字节的计数器名
+#pragma pack(4)
+struct CounterRecord
+{
+    uint32_t magic;    // value、name_len和计数器名的crc32
+    uint32_t name_len;
+    uint64_t value;    // 计数器的上限
+
+    uint32_t calc_magic(const char* name) const
+    {
+        uint32_t magic_ = 0;
+        magic_ = crc32(magic_, &value, sizeof(value));
+        magic_ = crc32(magic_, &name_len, sizeof(name_len));
+        magic_ = crc32(magic_, name, name_len);
+        return magic_;
+    }
+};
+#pragma pack()
+
+// 将计数器编码成一条日志记录，返回记录的大小
+static size_t encode_record(const struct Counter* counter, char* buffer)
+{
+    struct CounterRecord* record = reinterpret_cast<struct CounterRecord*>(buffer);
+    record->name_len = counter->name_len;
+    record->value = counter->reserved;
+    memcpy(buffer+sizeof(struct CounterRecord), counter->name, counter->name_len);
+    record->magic = record->calc_magic(counter->name);
+    return sizeof(struct CounterRecord) + counter->name_len;
+}
+
+static bool write_all(int fd, const char* buffer, size_t size)
+{
+    while (size > 0)
+    {
+        const ssize_t bytes_written = write(fd, buffer, size);
+        if (-1 == bytes_written)
+        {
+            if (EINTR == errno)
+                continue;
+            return false;
+        }
+
+        buffer += bytes_written;
+        size -= static_cast<size_t>(bytes_written);
+    }
+
+    return true;
+}
+
+CCounterTable::CCounterTable(uint32_t steps, uint32_t max_counters)
+    : _steps(steps), _max_counters(max_counters), _fd(-1), _io_error(false),
+      _capacity(COUNTER_INIT_CAPACITY), _size(0), _num_records(0),
+      _written_generation(0), _synced_generation(0), _compacting(false), _compact_records(0)
+{
+    _slots = new struct Counter[_capacity];
+    memset(_slots, 0, sizeof(struct Counter) * _capacity);
+}
+
+CCounterTable::~CCounterTable()
+{
+    if (_fd != -1)
+        close(_fd);
+    delete []_slots;
+}
+
+bool CCounterTable::open(const std::string& path)
+{
+    _path = path;
+    _fd = ::open(_path.c_str(), O_RDWR|O_CREAT|O_APPEND, FILE_DEFAULT_PERM);
+    if (-1 == _fd)
+    {
+        MYLOG_ERROR("Open %s failed: %s\n", _path.c_str(), strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (-1 == fstat(_fd, &st))
+    {
+        MYLOG_ERROR("Stat %s failed: %s\n", _path.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::string data(static_cast<size_t>(st.st_size), '\0');
+    size_t bytes_read = 0;
+    while (bytes_read < data.size())
+    {
+        const ssize_t n = pread(_fd, &data[bytes_read], data.size()-bytes_read, static_cast<off_t>(bytes_read));
+        if (-1 == n)
+        {
+            if (EINTR == errno)
+                continue;
+            MYLOG_ERROR("Read %s failed: %s\n", _path.c_str(), strerror(errno));
+            return false;
+        }
+        if (0 == n)
+            break;
+        bytes_read += static_cast<size_t>(n);
+    }
+
+    size_t valid_size = 0;
+    if (!restore(data.data(), bytes_read, &valid_size))
+    {
+        return false;
+    }
+    if (valid_size < bytes_read)
+    {
+        // 写日志时进程退出或机器掉电，最后一条记录可能不完整，丢弃即可（压缩时会重写整个文件）
+        MYLOG_WARN("%s truncated at %zd/%zd\n", _path.c_str(), valid_size, bytes_read);
+    }
+
+    // 最后一条记录之后还可能有未落盘的记录丢失了，但分配的值不会超过已落盘的上限加两个步长
+    for (uint32_t i=0; i<_capacity; ++i)
+    {
+        struct Counter* counter = &_slots[i];
+        if (counter->name_len > 0)
+        {
+            counter->value = counter->reserved + 2 * static_cast<uint64_t>(_steps);
+            counter->reserved = counter->value;
+            counter->durable = counter->reserved; // 下面的压缩会落盘
+        }
+    }
+
+    MYLOG_INFO("Restore %u counters from %s\n", _size, _path.c_str());
+    {
+        mooon::sys::LockHelper<mooon::sys::CLock> lh(_lock);
+        prepare_compact();
+    }
+    return compact();
+}
+
+int CCounterTable::inc(const char* name, uint8_t name_len, uint32_t hash, uint16_t num, uint64_t* start, uint16_t* count)
+{
+    if (_io_error)
+    {
+        return MUE_STORE_SEQ;
+    }
+
+    struct Counter* counter = find(name, name_len, hash, true);
+    if (NULL == counter)
+    {
+        MYLOG_ERROR("Too many counters: %u\n", _size);
+        return MUE_TOO_MANY_COUNTERS;
+    }
+
+    // 参数num值为0或1均表示只取一个，一次最多取steps个
+    uint64_t n = (0 == num)? 1: num;
+    if (n > _steps)
+        n = _steps;
+
+    if (counter->value + n > counter->reserved)
+    {
+        const uint64_t reserved = counter->reserved;
+        counter->reserved = counter->value + n + _steps;
+        if (!append(counter))
+        {
+            counter->reserved = reserved;
+            return MUE_STORE_SEQ;
+        }
+    }
+
+    // 超过已落盘的上限加两个步长的值，要等日志落盘后才能分配，否则重启后会被再次分配，
+    // 通常sync线程已经落盘，来不及时（连续多次预留或新计数器）在主线程中同步落盘
+    if ((0 == counter->durable) || (counter->value + n > counter->durable + 2 * static_cast<uint64_t>(_steps)))
+    {
+        if ((counter->generation > _synced_generation.get_value()) && !sync())
+        {
+            return MUE_STORE_SEQ;
+        }
+        counter->durable = counter->reserved;
+    }
+
+    *start = counter->value;
+    *count = static_cast<uint16_t>(n);
+    counter->value += n;
+    return 0;
+}
+
+struct Counter* CCounterTable::find(const char* name, uint8_t name_len, uint32_t hash, bool create)
+{
+    uint32_t i = hash & (_capacity - 1);
+    while (true)
+    {
+        struct Counter* counter = &_slots[i];
+        if (0 == counter->name_len)
+        {
+            if (!create || (_size >= _max_counters))
+                return NULL;
+            if ((_size+1) * 2 > _capacity)
+            {
+                // 扩容后槽的位置发生变化，需要重新查找
+                grow();
+                return find(name, name_len, hash, create);
+            }
+
+            counter->hash = hash;
+            counter->name_len = name_len;
+            memcpy(counter->name, name, name_len);
+            counter->value = 1; // 从1开始，同seq一样0不是有效值
+            counter->reserved = 0;
+            counter->durable = 0;
+            counter->generation = 0;
+            ++_size;
+            return counter;
+        }
+        if ((counter->hash == hash) && (counter->name_len == name_len) && (0 == memcmp(counter->name, name, name_len)))
+        {
+            return counter;
+        }
+
+        i = (i + 1) & (_capacity - 1);
+    }
+}
+
+void CCounterTable::grow()
+{
+    struct Counter* old_slots = _slots;
+    const uint32_t old_capacity = _capacity;
+
+    _capacity *= 2;
+    _slots = new struct Counter[_capacity];
+    memset(_slots, 0, sizeof(struct Counter) * _capacity);
+    for (uint32_t i=0; i<old_capacity; ++i)
+    {
+        const struct Counter* counter = &old_slots[i];
+        if (counter->name_len > 0)
+        {
+            uint32_t j = counter->hash & (_capacity - 1);
+            while (_slots[j].name_len != 0)
+                j = (j + 1) & (_capacity - 1);
+            _slots[j] = *counter;
+        }
+    }
+
+    delete []old_slots;
+    MYLOG_INFO("Counter table grows to %u slots with %u counters\n", _capacity, _size);
+}
+
+bool CCounterTable::restore(const char* data, size_t size, size_t* valid_size)
+{
+    size_t offset = 0;
+    while (offset + sizeof(struct CounterRecord) <= size)
+    {
+        struct CounterRecord record;
+        memcpy(&record, data+offset, sizeof(record));
+
+        const char* name = data + offset + sizeof(record);
+        if ((0 == record.name_len) || (record.name_len > COUNTER_NAME_MAX) ||
+            (offset + sizeof(record) + record.name_len > size) ||
+            (record.magic != record.calc_magic(name)))
+        {
+            break;
+        }
+
+        const uint8_t name_len = static_cast<uint8_t>(record.name_len);
+        struct Counter* counter = find(name, name_len, crc32(0, name, name_len), true);
+        if (NULL == counter)
+        {
+            MYLOG_ERROR("Too many counters in %s: %u\n", _path.c_str(), _size);
+            return false;
+        }
+
+        // 同一个计数器以最后一条记录为准
+        counter->reserved = record.value;
+        offset += sizeof(record) + record.name_len;
+        ++_num_records;
+    }
+
+    *valid_size = offset;
+    return true;
+}
+
+bool CCounterTable::append(struct Counter* counter)
+{
+    char buffer[sizeof(struct CounterRecord) + COUNTER_NAME_MAX];
+    const size_t record_size = encode_record(counter, buffer);
+
+    mooon::sys::LockHelper<mooon::sys::CLock> lh(_lock);
+    if (!write_all(_fd, buffer, record_size))
+    {
+        _io_error = true; // 遇到IO错误时，标记为不可继续服务
+        MYLOG_ERROR("Append counter[%.*s] to %s failed: %s\n", (int)counter->name_len, counter->name, _path.c_str(), strerror(errno));
+        return false;
+    }
+    if (_compacting)
+    {
+        // 快照中没有这条记录，替换前要补写到新文件
+        _compact_tail.append(buffer, record_size);
+        ++_compact_records;
+    }
+
+    counter->generation = ++_written_generation;
+    if ((++_num_records > 2 * static_cast<uint64_t>(_size) + COMPACT_MIN_RECORDS) && !_compacting)
+    {
+        prepare_compact();
+    }
+    return true;
+}
+
+// 在主线程中同步落盘，持锁使得不会和sync线程替换文件交错
+bool CCounterTable::sync()
+{
+    mooon::sys::LockHelper<mooon::sys::CLock> lh(_lock);
+    const int64_t generation = _written_generation;
+    if (-1 == fdatasync(_fd))
+    {
+        _io_error = true;
+        MYLOG_ERROR("fdatasync %s failed: %s\n", _path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (generation > _synced_generation.get_value())
+        _synced_generation = generation;
+    return true;
+}
+
+bool CCounterTable::sync_and_compact()
+{
+    int64_t generation;
+    bool compacting;
+    {
+        mooon::sys::LockHelper<mooon::sys::CLock> lh(_lock);
+        generation = _written_generation;
+        compacting = _compacting;
+    }
+
+    // 先取代数再压缩和落盘，该代数及之前的记录要么已在新文件中落盘，要么在替换后追加到新文件中
+    // 压缩失败时保留老文件，主线程下次追加记录时重新生成快照
+    if (compacting)
+    {
+        (void)compact();
+    }
+    if (generation > _synced_generation.get_value())
+    {
+        if (-1 == fdatasync(_fd))
+        {
+            MYLOG_ERROR("fdatasync %s failed: %s\n", _path.c_str(), strerror(errno));
+            return false;
+        }
+
+        mooon::sys::LockHelper<mooon::sys::CLock> lh(_lock);
+        if (generation > _synced_generation.get_value())
+            _synced_generation = generation;
+    }
+
+    return true;
+}
+
+// 将每个计数器的当前上限编码成快照，调用时已持有_lock
+void CCounterTable::prepare_compact()
+{
+    _compact_data.clear();
+    _compact_data.reserve(static_cast<size_t>(_size) * (sizeof(struct CounterRecord) + COUNTER_NAME_MAX));
+    for (uint32_t i=0; i<_capacity; ++i)
+    {
+        const struct Counter* counter = &_slots[i];
+        if (counter->name_len > 0)
+        {
+            char buffer[sizeof(struct CounterRecord) + COUNTER_NAME_MAX];
+            const size_t record_size = encode_record(counter, buffer);
+            _compact_data.append(buffer, record_size);
+        }
+    }
+
+    _compact_tail.clear();
+    _compact_records = _size;
+    _compacting = true;
+}
+
+// 写快照时不持锁，主线程可继续追加记录；补写快照之后追加的记录、替换文件和同步目录时持锁
+bool CCounterTable::compact()
+{
+    const std::string tmp_path = _path + std::string(".tmp");
+    int fd = ::open(tmp_path.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, FILE_DEFAULT_PERM);
+    if (-1 == fd)
+    {
+        MYLOG_ERROR("Open %s failed: %s\n", tmp_path.c_str(), strerror(errno));
+        mooon::sys::LockHelper<mooon::sys::CLock> lh(_lock);
+        _compacting = false;
+        return false;
+    }
+
+    mooon::sys::CloseHelper<int> ch(fd);
+    if (!write_all(fd, _compact_data.data(), _compact_data.size()) || (-1 == fdatasync(fd)))
+    {
+        MYLOG_ERROR("Write %s failed: %s\n", tmp_path.c_str(), strerror(errno));
+        mooon::sys::LockHelper<mooon::sys::CLock> lh(_lock);
+        _compacting = false;
+        return false;
+    }
+
+    mooon::sys::LockHelper<mooon::sys::CLock> lh(_lock);
+    _compacting = false;
+    // 这些记录在老文件中可能已落盘，替换前在新文件中也要落盘
+    if (!_compact_tail.empty() && (!write_all(fd, _compact_tail.data(), _compact_tail.size()) || (-1 == fdatasync(fd))))
+    {
+        MYLOG_ERROR("Write %s failed: %s\n", tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+    if (-1 == rename(tmp_path.c_str(), _path.c_str()))
+    {
+        MYLOG_ERROR("Rename %s to %s failed: %s\n", tmp_path.c_str(), _path.c_str(), strerror(errno));
+        return false;
+    }
+
+    // rename需要同步目录才能保证掉电后不回到老文件，否则之后追加的记录会丢失
+    std::string dir_path = _path;
+    const int dir_fd = ::open(dirname(&dir_path[0]), O_RDONLY);
+    if (dir_fd != -1)
+    {
+        (void)fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    // 用dup2替换，使得主线程和sync线程持有的句柄值始终有效，
+    // 失败时老文件已被替换，再追加的记录会丢失，不能继续服务
+    if (-1 == dup2(fd, _fd))
+    {
+        MYLOG_ERROR("dup2 %s failed: %s\n", _path.c_str(), strerror(errno));
+        exit(1); // Fatal error
+    }
+
+    MYLOG_INFO("Compact %s: %" PRIu64" records => %" PRIu64"\n", _path.c_str(), _num_records, _compact_records);
+    _num_records = _compact_records;
+    return true;
+}
+
+} // namespace muidor {
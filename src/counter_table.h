@@ -0,0 +1,105 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#ifndef MOOON_MUIDOR_COUNTER_TABLE_H
+#define MOOON_MUIDOR_COUNTER_TABLE_H
+#include "protocol.h"
+#include <mooon/sys/atomic.h>
+#include <mooon/sys/lock.h>
+#include <string>
+namespace muidor {
+
+// 命名计数器
+struct Counter
+{
+    uint32_t hash;       // 计数器名的crc32
+    uint8_t name_len;    // 为0表示空槽
+    char name[COUNTER_NAME_MAX];
+    uint64_t value;      // 下一个可分配的值
+    uint64_t reserved;   // 已记录到日志的上限，value达到reserved前不用写日志
+    uint64_t durable;    // 已落盘的上限，为0表示还没有落盘的记录
+    int64_t generation;  // 最后一条记录的写入代数，不超过已落盘的代数时reserved即已落盘
+};
+
+// 计数器表，agent本地维护的命名计数器，只在agent的主线程中访问，
+// 落盘和压缩日志由sync线程调用sync_and_compact完成。
+//
+// 采用开放寻址（线性探测）的哈希表，槽数总是2的幂，装载因子不超过一半，
+// 因此查找只需计算一次下标和比较少数几个槽，和计数器个数无关。
+//
+// 持久化和主sequence一样按步长预留：只有当计数器用完预留的值时，才向日志追加一条记录（计数器名和新的上限），
+// 恢复时每个计数器取日志中的最后一条记录，并再跳过两个步长。日志由sync线程异步fdatasync，
+// 因此分配的值不能超过已落盘的上限加两个步长，否则在主线程中同步落盘（和主sequence的wait_durable相同），
+// 新计数器的第一条记录也要落盘后才能分配，否则恢复时计数器不存在又会从1开始。
+// 日志记录数超过计数器数的两倍时压缩：主线程将每个计数器的当前上限编码成快照，
+// 由sync线程写入新文件后替换老文件，其间追加的记录同时暂存，替换前补写到新文件。
+class CCounterTable
+{
+public:
+    CCounterTable(uint32_t steps, uint32_t max_counters);
+    ~CCounterTable();
+
+    // 打开日志文件并恢复所有计数器，在sync线程启动前调用
+    bool open(const std::string& path);
+
+    uint32_t size() const { return _size; }
+    bool io_error() const { return _io_error; }
+
+    // 日志的写入代数，每追加一条记录加1，主线程据此判断是否需要通知sync线程
+    int64_t get_generation() const { return _written_generation; }
+
+    // 从计数器中连续取num个值，start为起始值，count为实际取得的个数（不超过steps），
+    // 成功返回0，否则返回错误码
+    int inc(const char* name, uint8_t name_len, uint32_t hash, uint16_t num, uint64_t* start, uint16_t* count);
+
+    // 由sync线程调用：有待压缩的快照时先压缩，然后落盘，
+    // 返回false表示出现了不可恢复的IO错误（压缩失败不算，保留老文件下次重试）
+    bool sync_and_compact();
+
+private:
+    struct Counter* find(const char* name, uint8_t name_len, uint32_t hash, bool create);
+    void grow();
+    bool restore(const char* data, size_t size, size_t* valid_size);
+    bool append(struct Counter* counter);
+    bool sync();
+    void prepare_compact();
+    bool compact();
+
+private:
+    const uint32_t _steps;
+    const uint32_t _max_counters;
+    std::string _path;
+    int _fd;
+    bool _io_error;
+    struct Counter* _slots;
+    uint32_t _capacity;    // 槽数，为2的幂
+    uint32_t _size;        // 计数器个数
+
+    // 以下成员由主线程和sync线程共享，除_synced_generation可无锁读外，均在_lock保护下访问
+    mooon::sys::CLock _lock;
+    uint64_t _num_records;                            // 日志中的记录数
+    int64_t _written_generation;                      // 已追加的记录数
+    mooon::sys::CAtomic<int64_t> _synced_generation; // 已落盘的记录数
+    bool _compacting;           // 是否有待sync线程压缩的快照
+    std::string _compact_data;  // 快照，sync线程写入新文件期间主线程不会修改
+    std::string _compact_tail;  // 快照之后追加的记录，替换前补写到新文件
+    uint64_t _compact_records;  // 快照及之后追加的记录数，替换后即为新文件中的记录数
+};
+
+} // namespace muidor {
+#endif // MOOON_MUIDOR_COUNTER_TABLE_H
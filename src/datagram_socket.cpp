@@ -0,0 +1,336 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#include "datagram_socket.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+namespace muidor {
+
+CDatagramBatch::CDatagramBatch(uint32_t capacity, size_t buffer_size, size_t control_size)
+    : _capacity(capacity), _buffer_size(buffer_size), _control_size(control_size), _controls(NULL)
+{
+    _buffers = new char[_buffer_size * _capacity];
+    if (_control_size > 0)
+        _controls = new char[_control_size * _capacity];
+    _addrs = new struct sockaddr_in[_capacity];
+    _iovecs = new struct iovec[_capacity];
+    _messages = new struct mmsghdr[_capacity];
+
+    memset(_addrs, 0, sizeof(struct sockaddr_in) * _capacity);
+    memset(_messages, 0, sizeof(struct mmsghdr) * _capacity);
+    for (uint32_t i=0; i<_capacity; ++i)
+    {
+        _iovecs[i].iov_base = buffer(i);
+        _iovecs[i].iov_len = _buffer_size;
+        _messages[i].msg_hdr.msg_name = &_addrs[i];
+        _messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        _messages[i].msg_hdr.msg_iov = &_iovecs[i];
+        _messages[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+CDatagramBatch::~CDatagramBatch()
+{
+    delete []_messages;
+    delete []_iovecs;
+    delete []_addrs;
+    delete []_controls;
+    delete []_buffers;
+}
+
+void CDatagramBatch::set(uint32_t index, size_t length, const struct sockaddr_in& addr)
+{
+    struct msghdr* msg = &_messages[index].msg_hdr;
+
+    _addrs[index] = addr;
+    _iovecs[index].iov_len = length;
+    _messages[index].msg_len = static_cast<unsigned int>(length);
+    msg->msg_name = &_addrs[index];
+    msg->msg_namelen = sizeof(struct sockaddr_in);
+    msg->msg_control = NULL;
+    msg->msg_controllen = 0;
+    msg->msg_flags = 0;
+}
+
+const void* CDatagramBatch::find_control(uint32_t index, int level, int type, size_t* data_size) const
+{
+    struct msghdr* msg = &_messages[index].msg_hdr;
+
+    for (struct cmsghdr* cmsg=CMSG_FIRSTHDR(msg); cmsg!=NULL; cmsg=CMSG_NXTHDR(msg, cmsg))
+    {
+        if ((cmsg->cmsg_level == level) && (cmsg->cmsg_type == type))
+        {
+            if (data_size != NULL)
+                *data_size = cmsg->cmsg_len - CMSG_LEN(0);
+            return CMSG_DATA(cmsg);
+        }
+    }
+
+    return NULL;
+}
+
+void CDatagramBatch::prepare_receive(uint32_t num)
+{
+    for (uint32_t i=0; i<num; ++i)
+    {
+        struct msghdr* msg = &_messages[i].msg_hdr;
+
+        _iovecs[i].iov_len = _buffer_size;
+        msg->msg_name = &_addrs[i];
+        msg->msg_namelen = sizeof(struct sockaddr_in);
+        msg->msg_control = (0 == _control_size)? NULL: _controls + _control_size * i;
+        msg->msg_controllen = _control_size;
+        msg->msg_flags = 0;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+CDatagramSocket::CDatagramSocket()
+    : _fd(-1), _connected(false)
+{
+}
+
+CDatagramSocket::~CDatagramSocket()
+{
+    close();
+}
+
+int CDatagramSocket::open(bool nonblock)
+{
+    close();
+    _fd = socket(AF_INET, SOCK_DGRAM|SOCK_CLOEXEC|(nonblock? SOCK_NONBLOCK: 0), 0);
+    return (-1 == _fd)? -1: 0;
+}
+
+void CDatagramSocket::close()
+{
+    if (_fd != -1)
+    {
+        (void)::close(_fd);
+        _fd = -1;
+        _connected = false;
+    }
+}
+
+int CDatagramSocket::listen(const std::string& ip, uint16_t port, bool nonblock)
+{
+    struct sockaddr_in listen_addr;
+    const int on = 1;
+
+    memset(&listen_addr, 0, sizeof(listen_addr));
+    listen_addr.sin_family = AF_INET;
+    listen_addr.sin_port = htons(port);
+    listen_addr.sin_addr.s_addr = ip.empty()? htonl(INADDR_ANY): inet_addr(ip.c_str());
+    if (INADDR_NONE == listen_addr.sin_addr.s_addr)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (-1 == open(nonblock))
+    {
+        return -1;
+    }
+    if ((-1 == setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))) ||
+        (-1 == bind(_fd, reinterpret_cast<const struct sockaddr*>(&listen_addr), sizeof(listen_addr))))
+    {
+        const int errcode = errno;
+        close();
+        errno = errcode;
+        return -1;
+    }
+
+    return 0;
+}
+
+int CDatagramSocket::connect(const struct sockaddr_in& addr)
+{
+    if (-1 == ::connect(_fd, reinterpret_cast<const struct sockaddr*>(&addr), sizeof(addr)))
+    {
+        return -1;
+    }
+
+    _connected = true;
+    return 0;
+}
+
+int CDatagramSocket::set_buffer_size(int receive_buffer_size, int send_buffer_size)
+{
+    if ((receive_buffer_size > 0) &&
+        (-1 == setsockopt(_fd, SOL_SOCKET, SO_RCVBUF, &receive_buffer_size, sizeof(receive_buffer_size))))
+    {
+        return -1;
+    }
+    if ((send_buffer_size > 0) &&
+        (-1 == setsockopt(_fd, SOL_SOCKET, SO_SNDBUF, &send_buffer_size, sizeof(send_buffer_size))))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+int CDatagramSocket::get_buffer_size(int* receive_buffer_size, int* send_buffer_size) const
+{
+    socklen_t len = sizeof(int);
+    if ((receive_buffer_size != NULL) &&
+        (-1 == getsockopt(_fd, SOL_SOCKET, SO_RCVBUF, receive_buffer_size, &len)))
+    {
+        return -1;
+    }
+
+    len = sizeof(int);
+    if ((send_buffer_size != NULL) &&
+        (-1 == getsockopt(_fd, SOL_SOCKET, SO_SNDBUF, send_buffer_size, &len)))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+int CDatagramSocket::set_option(int level, int name, int value)
+{
+    return setsockopt(_fd, level, name, &value, sizeof(value));
+}
+
+ssize_t CDatagramSocket::send(const void* buffer, size_t buffer_size)
+{
+    while (true)
+    {
+        const ssize_t bytes_sent = ::send(_fd, buffer, buffer_size, 0);
+        if ((-1 == bytes_sent) && (EINTR == errno))
+            continue;
+        return bytes_sent;
+    }
+}
+
+ssize_t CDatagramSocket::send_to(const void* buffer, size_t buffer_size, const struct sockaddr_in& to_addr)
+{
+    while (true)
+    {
+        const ssize_t bytes_sent = sendto(_fd, buffer, buffer_size, 0,
+                reinterpret_cast<const struct sockaddr*>(&to_addr), sizeof(to_addr));
+        if ((-1 == bytes_sent) && (EINTR == errno))
+            continue;
+        return bytes_sent;
+    }
+}
+
+ssize_t CDatagramSocket::receive(void* buffer, size_t buffer_size)
+{
+    while (true)
+    {
+        const ssize_t bytes_received = recv(_fd, buffer, buffer_size, 0);
+        if ((-1 == bytes_received) && (EINTR == errno))
+            continue;
+        return bytes_received;
+    }
+}
+
+ssize_t CDatagramSocket::receive_from(void* buffer, size_t buffer_size, struct sockaddr_in* from_addr)
+{
+    while (true)
+    {
+        socklen_t addr_len = sizeof(struct sockaddr_in);
+        const ssize_t bytes_received = recvfrom(_fd, buffer, buffer_size, 0,
+                reinterpret_cast<struct sockaddr*>(from_addr), &addr_len);
+        if ((-1 == bytes_received) && (EINTR == errno))
+            continue;
+        return bytes_received;
+    }
+}
+
+ssize_t CDatagramSocket::timed_receive_from(void* buffer, size_t buffer_size, struct sockaddr_in* from_addr, uint32_t milliseconds)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    const int64_t deadline = static_cast<int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000 + milliseconds;
+
+    while (true)
+    {
+        // 先不等待地收一次，有数据时省掉一次poll
+        socklen_t addr_len = sizeof(struct sockaddr_in);
+        const ssize_t bytes_received = recvfrom(_fd, buffer, buffer_size, MSG_DONTWAIT,
+                reinterpret_cast<struct sockaddr*>(from_addr), &addr_len);
+        if (bytes_received != -1)
+            return bytes_received;
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+            return -1;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        const int64_t now = static_cast<int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+        if (now >= deadline)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        struct pollfd fds[1];
+        fds[0].fd = _fd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        const int n = poll(fds, 1, static_cast<int>(deadline - now));
+        if ((-1 == n) && (errno != EINTR))
+        {
+            return -1;
+        }
+    }
+}
+
+int CDatagramSocket::receive_batch(CDatagramBatch* batch)
+{
+    batch->prepare_receive(batch->capacity());
+    while (true)
+    {
+        const int n = recvmmsg(_fd, batch->messages(), batch->capacity(), MSG_DONTWAIT, NULL);
+        if ((-1 == n) && (EINTR == errno))
+            continue;
+        return n;
+    }
+}
+
+int CDatagramSocket::send_batch(CDatagramBatch* batch, uint32_t first, uint32_t num)
+{
+    struct mmsghdr* messages = batch->messages() + first;
+
+    if (_connected)
+    {
+        // 已连接的socket不能再指定地址
+        for (uint32_t i=0; i<num; ++i)
+        {
+            messages[i].msg_hdr.msg_name = NULL;
+            messages[i].msg_hdr.msg_namelen = 0;
+        }
+    }
+    while (true)
+    {
+        const int n = sendmmsg(_fd, messages, num, 0);
+        if ((-1 == n) && (EINTR == errno))
+            continue;
+        return n;
+    }
+}
+
+} // namespace muidor {
@@ -0,0 +1,128 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#ifndef MOOON_MUIDOR_DATAGRAM_SOCKET_H
+#define MOOON_MUIDOR_DATAGRAM_SOCKET_H
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/types.h>
+namespace muidor {
+
+// 一批报文，对应recvmmsg和sendmmsg的参数，
+// 每个报文有自己的数据缓冲区、地址和（可选的）辅助数据缓冲区，创建后不再分配内存
+class CDatagramBatch
+{
+public:
+    // capacity为最多的报文个数，buffer_size为每个报文的缓冲区大小，
+    // control_size为每个报文的辅助数据缓冲区大小，为0表示不接收辅助数据
+    CDatagramBatch(uint32_t capacity, size_t buffer_size, size_t control_size=0);
+    ~CDatagramBatch();
+
+    uint32_t capacity() const { return _capacity; }
+    size_t buffer_size() const { return _buffer_size; }
+
+    // 第index个报文的缓冲区、实际大小（接收或设置的字节数）和地址
+    char* buffer(uint32_t index) const { return _buffers + _buffer_size * index; }
+    size_t length(uint32_t index) const { return _messages[index].msg_len; }
+    const struct sockaddr_in& addr(uint32_t index) const { return _addrs[index]; }
+
+    // 设置待发送的第index个报文，数据须已写入buffer(index)
+    void set(uint32_t index, size_t length, const struct sockaddr_in& addr);
+
+    // 在第index个报文的辅助数据中查找指定的项，找不到返回NULL，data_size不为NULL时返回数据的大小
+    const void* find_control(uint32_t index, int level, int type, size_t* data_size=NULL) const;
+
+    // 第index个报文的接收标志，如MSG_TRUNC
+    int flags(uint32_t index) const { return _messages[index].msg_hdr.msg_flags; }
+
+private:
+    friend class CDatagramSocket;
+    struct mmsghdr* messages() const { return _messages; }
+    void prepare_receive(uint32_t num); // 接收前恢复各缓冲区的大小
+
+private:
+    const uint32_t _capacity;
+    const size_t _buffer_size;
+    const size_t _control_size;
+    char* _buffers;
+    char* _controls;
+    struct sockaddr_in* _addrs;
+    struct iovec* _iovecs;
+    struct mmsghdr* _messages;
+};
+
+// 精简的UDP socket，只用于IPv4，
+// 和mooon::net::CUdpSocket不同，出错时不抛异常，而是同系统调用一样返回-1并设置errno，
+// 这样请求路径上不用构造异常对象（包括格式化错误信息），
+// 另外支持批量收发（recvmmsg和sendmmsg）、connect、缓冲区大小设置和辅助数据。
+class CDatagramSocket
+{
+public:
+    CDatagramSocket();
+    ~CDatagramSocket();
+
+    int get_fd() const { return _fd; }
+    bool is_connected() const { return _connected; }
+
+    // 创建socket，成功返回0，出错返回-1（下同）
+    int open(bool nonblock=false);
+    void close();
+
+    // 创建socket并绑定到指定的IP和端口，ip为空时同0.0.0.0
+    int listen(const std::string& ip, uint16_t port, bool nonblock=false);
+
+    // 连接后只收来自addr的报文，并可使用send，内核也不必每次查路由
+    int connect(const struct sockaddr_in& addr);
+
+    // 设置收发缓冲区的大小，为0的不设置，
+    // 内核会将设置的值翻倍，且受net.core.rmem_max和net.core.wmem_max限制
+    int set_buffer_size(int receive_buffer_size, int send_buffer_size);
+    int get_buffer_size(int* receive_buffer_size, int* send_buffer_size) const;
+
+    // 设置整数类型的socket选项，如SO_TIMESTAMPNS
+    int set_option(int level, int name, int value);
+
+    // 成功返回发送或接收的字节数，出错返回-1，
+    // 非阻塞时没有数据可收返回-1且errno为EAGAIN
+    ssize_t send(const void* buffer, size_t buffer_size);
+    ssize_t send_to(const void* buffer, size_t buffer_size, const struct sockaddr_in& to_addr);
+    ssize_t receive(void* buffer, size_t buffer_size);
+    ssize_t receive_from(void* buffer, size_t buffer_size, struct sockaddr_in* from_addr);
+
+    // 最多等待milliseconds毫秒，超时返回-1且errno为ETIMEDOUT
+    ssize_t timed_receive_from(void* buffer, size_t buffer_size, struct sockaddr_in* from_addr, uint32_t milliseconds);
+
+    // 一次系统调用最多接收batch->capacity()个报文（不等待），返回接收的个数，出错返回-1
+    int receive_batch(CDatagramBatch* batch);
+
+    // 一次系统调用发送batch中从first开始的num个报文，返回发送的个数（可能少于num），出错返回-1
+    int send_batch(CDatagramBatch* batch, uint32_t first, uint32_t num);
+
+private:
+    CDatagramSocket(const CDatagramSocket&);
+    CDatagramSocket& operator =(const CDatagramSocket&);
+
+private:
+    int _fd;
+    bool _connected;
+};
+
+} // namespace muidor {
+#endif // MOOON_MUIDOR_DATAGRAM_SOCKET_H
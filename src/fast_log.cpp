@@ -0,0 +1,307 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#include "fast_log.h"
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <mooon/sys/lock.h>
+#include <mooon/sys/thread_engine.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+namespace muidor {
+
+// 每个线程一个，生产者为写日志的线程，消费者为后台线程，
+// 线程退出后队列不释放（muidor的线程均和进程同生命周期）
+struct FastLogRing
+{
+    std::atomic<uint32_t> head; // 下一个写入的位置，只由生产者修改
+    char padding1[64 - sizeof(std::atomic<uint32_t>)];
+    std::atomic<uint32_t> tail; // 下一个读取的位置，只由消费者修改
+    char padding2[64 - sizeof(std::atomic<uint32_t>)];
+    struct FastLogRecord records[FAST_LOG_RING_SIZE];
+};
+
+std::atomic<int> g_fast_log_level(::mooon::sys::LOG_LEVEL_BIN + 1); // 未启动时不输出
+static std::atomic<uint32_t> g_fast_log_rate(100);
+static std::atomic<uint64_t> g_fast_log_drops(0); // 队列满时丢弃的条数
+static std::atomic<bool> g_fast_log_stop(false);
+static mooon::sys::CThreadEngine* g_fast_log_thread = NULL;
+static mooon::sys::CLock g_fast_log_lock; // 保护g_fast_log_rings
+static std::vector<struct FastLogRing*> g_fast_log_rings;
+static __thread struct FastLogRing* tls_fast_log_ring = NULL;
+
+bool CFastLogSite::admit(uint32_t second, uint32_t* suppressed)
+{
+    uint32_t current_second = _second.load(std::memory_order_relaxed);
+    if ((second != current_second) && _second.compare_exchange_strong(current_second, second))
+    {
+        // 新的一秒，带上上一秒被抑制的条数
+        *suppressed = _suppressed.exchange(0);
+        _count.store(1, std::memory_order_relaxed);
+        return true;
+    }
+    if (_count.fetch_add(1, std::memory_order_relaxed) < g_fast_log_rate.load(std::memory_order_relaxed))
+    {
+        *suppressed = 0;
+        return true;
+    }
+
+    _suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+struct FastLogRecord* alloc_fast_log_record()
+{
+    struct FastLogRing* ring = tls_fast_log_ring;
+    if (NULL == ring)
+    {
+        ring = new struct FastLogRing;
+        ring->head.store(0);
+        ring->tail.store(0);
+        tls_fast_log_ring = ring;
+
+        mooon::sys::LockHelper<mooon::sys::CLock> lh(g_fast_log_lock);
+        g_fast_log_rings.push_back(ring);
+    }
+
+    const uint32_t head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) >= FAST_LOG_RING_SIZE)
+    {
+        g_fast_log_drops.fetch_add(1, std::memory_order_relaxed);
+        return NULL;
+    }
+
+    return &ring->records[head & (FAST_LOG_RING_SIZE - 1)];
+}
+
+void commit_fast_log_record()
+{
+    struct FastLogRing* ring = tls_fast_log_ring;
+    ring->head.store(ring->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// 按printf的格式将记录格式化到buffer，参数不足或不支持的转换原样输出
+static void format_record(const struct FastLogRecord* record, char* buffer, size_t buffer_size)
+{
+    const char* format = record->site->format();
+    size_t offset = 0;
+    uint32_t i = 0;
+
+    while ((*format != '\0') && (offset+1 < buffer_size))
+    {
+        if (*format != '%')
+        {
+            buffer[offset++] = *format++;
+            continue;
+        }
+        if ('%' == format[1])
+        {
+            buffer[offset++] = '%';
+            format += 2;
+            continue;
+        }
+
+        // 标志、宽度和精度原样保留，长度修饰符忽略
+        char spec[32] = { '%' };
+        size_t spec_len = 1;
+        const char* p = format + 1;
+        while ((strchr("-+ #0123456789.", *p) != NULL) && (*p != '\0') && (spec_len < sizeof(spec)-4))
+            spec[spec_len++] = *p++;
+        while ((strchr("hlLqjzt", *p) != NULL) && (*p != '\0'))
+            ++p;
+        const char conversion = *p;
+        if (('\0' == conversion) || (i >= record->num_args))
+        {
+            break;
+        }
+
+        const uint64_t arg = record->args[i++];
+        const size_t left = buffer_size - offset;
+        int n = 0;
+        if (strchr("diuxXoc", conversion) != NULL)
+        {
+            if ('c' != conversion)
+            {
+                spec[spec_len++] = 'l';
+                spec[spec_len++] = 'l';
+            }
+            spec[spec_len++] = conversion;
+            spec[spec_len] = '\0';
+            if ('c' == conversion)
+                n = snprintf(buffer+offset, left, spec, static_cast<int>(arg));
+            else if (('d' == conversion) || ('i' == conversion))
+                n = snprintf(buffer+offset, left, spec, static_cast<long long>(arg));
+            else
+                n = snprintf(buffer+offset, left, spec, static_cast<unsigned long long>(arg));
+        }
+        else if ('s' == conversion)
+        {
+            const char* str = reinterpret_cast<const char*>(static_cast<uintptr_t>(arg));
+            spec[spec_len++] = 's';
+            spec[spec_len] = '\0';
+            n = snprintf(buffer+offset, left, spec, (NULL == str)? "(null)": str);
+        }
+        else if ('A' == conversion)
+        {
+            struct in_addr in;
+            char ip[INET_ADDRSTRLEN];
+            in.s_addr = static_cast<uint32_t>(arg);
+            n = snprintf(buffer+offset, left, "%s", inet_ntop(AF_INET, &in, ip, sizeof(ip)));
+        }
+        else if ('P' == conversion)
+        {
+            n = snprintf(buffer+offset, left, "%u", (unsigned int)ntohs(static_cast<uint16_t>(arg)));
+        }
+        else if ('E' == conversion)
+        {
+            n = snprintf(buffer+offset, left, "%s", strerror(static_cast<int>(arg)));
+        }
+        else
+        {
+            break;
+        }
+
+        if (n > 0)
+            offset += (static_cast<size_t>(n) < left)? static_cast<size_t>(n): left-1;
+        format = p + 1;
+    }
+
+    buffer[offset] = '\0';
+}
+
+static void write_record(const struct FastLogRecord* record)
+{
+    ::mooon::sys::ILogger* logger = ::mooon::sys::g_logger;
+    const CFastLogSite* site = record->site;
+    char buffer[1024];
+
+    if (NULL == logger)
+    {
+        return;
+    }
+    if (record->suppressed > 0)
+    {
+        logger->log_warn(site->filename(), site->lineno(), NULL, "%u logs suppressed in the last second\n", record->suppressed);
+    }
+
+    // 后台线程积压时，标出日志产生到输出之间的延迟
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    const uint64_t nanoseconds = static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    const uint64_t delay_milliseconds = (nanoseconds > record->nanoseconds)? (nanoseconds - record->nanoseconds) / 1000000: 0;
+    size_t offset = 0;
+    if (delay_milliseconds > 10)
+        offset = snprintf(buffer, sizeof(buffer), "[delayed %" PRIu64"ms]", delay_milliseconds);
+    format_record(record, buffer+offset, sizeof(buffer)-offset);
+    switch (site->level())
+    {
+    case ::mooon::sys::LOG_LEVEL_DEBUG:
+        logger->log_debug(site->filename(), site->lineno(), NULL, "%s", buffer);
+        break;
+    case ::mooon::sys::LOG_LEVEL_INFO:
+        logger->log_info(site->filename(), site->lineno(), NULL, "%s", buffer);
+        break;
+    case ::mooon::sys::LOG_LEVEL_WARN:
+        logger->log_warn(site->filename(), site->lineno(), NULL, "%s", buffer);
+        break;
+    default:
+        logger->log_error(site->filename(), site->lineno(), NULL, "%s", buffer);
+        break;
+    }
+}
+
+// 输出所有队列中的日志，返回输出的条数
+static uint32_t drain_rings()
+{
+    std::vector<struct FastLogRing*> rings;
+    {
+        mooon::sys::LockHelper<mooon::sys::CLock> lh(g_fast_log_lock);
+        rings = g_fast_log_rings;
+    }
+
+    uint32_t num_records = 0;
+    for (std::vector<struct FastLogRing*>::size_type i=0; i<rings.size(); ++i)
+    {
+        struct FastLogRing* ring = rings[i];
+        const uint32_t head = ring->head.load(std::memory_order_acquire);
+        uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+
+        for (; tail!=head; ++tail, ++num_records)
+        {
+            write_record(&ring->records[tail & (FAST_LOG_RING_SIZE - 1)]);
+        }
+        ring->tail.store(tail, std::memory_order_release);
+    }
+
+    return num_records;
+}
+
+static void fast_log_thread()
+{
+    uint64_t reported_drops = 0;
+    time_t last_time = 0;
+
+    while (!g_fast_log_stop.load())
+    {
+        // 级别可被信号SIGUSR2等修改，这里同步过来
+        if (::mooon::sys::g_logger != NULL)
+            g_fast_log_level.store(::mooon::sys::g_logger->get_log_level(), std::memory_order_relaxed);
+
+        const uint32_t num_records = drain_rings();
+        const time_t current_time = time(NULL);
+        if (current_time != last_time)
+        {
+            const uint64_t drops = g_fast_log_drops.load(std::memory_order_relaxed);
+            if ((drops != reported_drops) && (::mooon::sys::g_logger != NULL))
+            {
+                MYLOG_WARN("%" PRIu64" logs dropped because of full ring\n", drops - reported_drops);
+                reported_drops = drops;
+            }
+            last_time = current_time;
+        }
+        if (0 == num_records)
+        {
+            usleep(1000);
+        }
+    }
+
+    (void)drain_rings();
+}
+
+void start_fast_log(uint32_t rate)
+{
+    g_fast_log_rate = rate;
+    if (::mooon::sys::g_logger != NULL)
+        g_fast_log_level = ::mooon::sys::g_logger->get_log_level();
+    g_fast_log_stop = false;
+    g_fast_log_thread = new mooon::sys::CThreadEngine(mooon::sys::bind(&fast_log_thread));
+}
+
+void stop_fast_log()
+{
+    if (g_fast_log_thread != NULL)
+    {
+        g_fast_log_stop = true;
+        g_fast_log_thread->join();
+        delete g_fast_log_thread;
+        g_fast_log_thread = NULL;
+    }
+}
+
+} // namespace muidor {
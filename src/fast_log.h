@@ -0,0 +1,165 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#ifndef MOOON_MUIDOR_FAST_LOG_H
+#define MOOON_MUIDOR_FAST_LOG_H
+#include <atomic>
+#include <mooon/sys/log.h>
+#include <stdint.h>
+#include <time.h>
+#include <type_traits>
+namespace muidor {
+
+// 热路径日志：写日志的线程只将日志站点、时间和参数写入本线程的无锁环形队列（SPSC），
+// 由后台线程格式化后再写入mooon的g_logger，因此请求路径上写日志的开销和日志内容无关。
+// 级别不够时只需一次原子读，每个日志站点每秒最多输出rate条，多出的被抑制并在下一秒汇报被抑制的条数。
+//
+// 格式和printf相同，但参数只能为整数或指针，支持的转换为：
+//   %d %i %u %x %X %o %c 整数，可带标志和宽度，长度修饰符（如l、ll、z）被忽略
+//   %s 字符串，只能为常量字符串（格式化时才读取）
+//   %A 网络字节序的IPv4地址（sockaddr_in.sin_addr.s_addr）
+//   %P 网络字节序的端口（sockaddr_in.sin_port）
+//   %E errno值，输出strerror的结果
+enum
+{
+    FAST_LOG_MAX_ARGS = 12,     // 一条日志最多的参数个数（消息头9个加上地址）
+    FAST_LOG_RING_SIZE = 4096   // 每个线程的环形队列大小，必须为2的幂，满时丢弃
+};
+
+// 日志站点，每个FASTLOG_*调用处一个
+class CFastLogSite
+{
+public:
+    CFastLogSite(int level, const char* filename, int lineno, const char* format)
+        : _level(level), _filename(filename), _lineno(lineno), _format(format),
+          _second(0), _count(0), _suppressed(0)
+    {
+    }
+
+    int level() const { return _level; }
+    const char* filename() const { return _filename; }
+    int lineno() const { return _lineno; }
+    const char* format() const { return _format; }
+
+    // 级别是否达到输出要求
+    bool enabled() const;
+
+    // 限速，允许输出时返回true，suppressed返回上一秒被抑制的条数
+    bool admit(uint32_t second, uint32_t* suppressed);
+
+private:
+    const int _level;
+    const char* _filename;
+    const int _lineno;
+    const char* _format;
+    std::atomic<uint32_t> _second;     // 限速的当前秒
+    std::atomic<uint32_t> _count;      // 当前秒已输出的条数
+    std::atomic<uint32_t> _suppressed; // 当前秒被抑制的条数
+};
+
+// 固定大小的二进制日志记录
+struct FastLogRecord
+{
+    const CFastLogSite* site;
+    uint64_t nanoseconds; // 写日志时的时间
+    uint32_t suppressed;  // 上一秒被抑制的条数
+    uint32_t num_args;
+    uint64_t args[FAST_LOG_MAX_ARGS];
+};
+
+// 启动后台格式化线程，rate为每个日志站点每秒最多输出的条数，须在g_logger创建之后调用
+void start_fast_log(uint32_t rate);
+
+// 停止后台线程，停止前输出队列中剩余的日志
+void stop_fast_log();
+
+// 从本线程的环形队列中分配一条记录，队列满时返回NULL，
+// 填好后须调用commit_fast_log_record
+struct FastLogRecord* alloc_fast_log_record();
+void commit_fast_log_record();
+
+// 当前级别，由后台线程从g_logger同步
+extern std::atomic<int> g_fast_log_level;
+
+inline bool CFastLogSite::enabled() const
+{
+    return _level >= g_fast_log_level.load(std::memory_order_relaxed);
+}
+
+template <typename T>
+inline uint64_t fast_log_arg(T value, typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type* = 0)
+{
+    return static_cast<uint64_t>(static_cast<int64_t>(value));
+}
+
+template <typename T>
+inline uint64_t fast_log_arg(const T* value)
+{
+    return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(value));
+}
+
+inline void fast_log_fill(uint64_t*)
+{
+}
+
+template <typename T, typename... Args>
+inline void fast_log_fill(uint64_t* args, T value, Args... rest)
+{
+    *args = fast_log_arg(value);
+    fast_log_fill(args+1, rest...);
+}
+
+template <typename... Args>
+inline void fast_log(CFastLogSite* site, Args... args)
+{
+    static_assert(sizeof...(Args) <= FAST_LOG_MAX_ARGS, "too many arguments for FASTLOG");
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts); // vdso，开销很小
+
+    uint32_t suppressed = 0;
+    if (site->admit(static_cast<uint32_t>(ts.tv_sec), &suppressed))
+    {
+        struct FastLogRecord* record = alloc_fast_log_record();
+        if (record != NULL)
+        {
+            record->site = site;
+            record->nanoseconds = static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+            record->suppressed = suppressed;
+            record->num_args = sizeof...(Args);
+            fast_log_fill(record->args, args...);
+            commit_fast_log_record();
+        }
+    }
+}
+
+} // namespace muidor {
+
+#define FASTLOG(level, format, ...) \
+do { \
+    static ::muidor::CFastLogSite fast_log_site_(level, __FILE__, __LINE__, format); \
+    if (fast_log_site_.enabled()) \
+        ::muidor::fast_log(&fast_log_site_, ##__VA_ARGS__); \
+} while(false)
+
+#define FASTLOG_DEBUG(format, ...) FASTLOG(::mooon::sys::LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+#define FASTLOG_INFO(format, ...)  FASTLOG(::mooon::sys::LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#define FASTLOG_WARN(format, ...)  FASTLOG(::mooon::sys::LOG_LEVEL_WARN, format, ##__VA_ARGS__)
+#define FASTLOG_ERROR(format, ...) FASTLOG(::mooon::sys::LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+
+#endif // MOOON_MUIDOR_FAST_LOG_H
@@ -0,0 +1,264 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#include "flight_recorder.h"
+#include <mooon/net/utils.h>
+#include <mooon/sys/datetime_utils.h>
+#include <math.h>
+#include <mooon/sys/log.h>
+#include <string.h>
+#include <unistd.h>
+namespace muidor {
+
+static const char* get_stage_name(uint32_t stage)
+{
+    static const char* stage_names[CFlightRecorder::NUM_STAGES] = { "queue", "dispatch", "send", "total" };
+    return stage_names[stage];
+}
+
+static const char* get_type_name(uint32_t type)
+{
+    switch (type)
+    {
+    case REQUEST_LABEL:
+        return "label";
+    case REQUEST_UNIQ_ID:
+        return "uniq_id";
+    case REQUEST_UNIQ_SEQ:
+        return "uniq_seq";
+    case REQUEST_LABEL_AND_SEQ:
+        return "label_and_seq";
+    case REQUEST_TAG_SEQ:
+        return "tag_seq";
+    case REQUEST_COUNTER:
+        return "counter";
+    case REQUEST_REPLICATE:
+        return "replicate";
+    default:
+        return "other";
+    }
+}
+
+CFlightRecorder::CFlightRecorder(uint32_t slow_microseconds)
+    : _slow_nanoseconds(static_cast<uint64_t>(slow_microseconds) * 1000),
+      _nanoseconds_per_tick(1.0),
+      _num_slow_requests(0), _dumped_slow_requests(0)
+{
+    for (uint32_t i=0; i<NUM_TYPES; ++i)
+    {
+        for (uint32_t j=0; j<NUM_STAGES; ++j)
+        {
+            for (uint32_t k=0; k<NUM_BUCKETS; ++k)
+                _counts[i][j][k].store(0, std::memory_order_relaxed);
+            _max_nanoseconds[i][j].store(0, std::memory_order_relaxed);
+        }
+    }
+    for (uint32_t i=0; i<NUM_SLOW_REQUESTS; ++i)
+    {
+        _slow_requests[i].version.store(0, std::memory_order_relaxed);
+    }
+    memset(_dumped_counts, 0, sizeof(_dumped_counts));
+}
+
+void CFlightRecorder::calibrate()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec ts1, ts2;
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    const uint64_t ticks1 = flight_clock();
+    usleep(10000);
+    clock_gettime(CLOCK_MONOTONIC, &ts2);
+    const uint64_t ticks2 = flight_clock();
+
+    const int64_t nanoseconds = static_cast<int64_t>(ts2.tv_sec - ts1.tv_sec) * 1000000000 + (ts2.tv_nsec - ts1.tv_nsec);
+    if ((ticks2 > ticks1) && (nanoseconds > 0))
+        _nanoseconds_per_tick = static_cast<double>(nanoseconds) / static_cast<double>(ticks2 - ticks1);
+#endif // __x86_64__
+    MYLOG_INFO("Flight recorder: %.3f ticks per nanosecond\n", 1.0 / _nanoseconds_per_tick);
+}
+
+void CFlightRecorder::record(const struct MessageHead* head, const struct sockaddr_in& from_addr, int64_t queue_nanoseconds,
+                             uint64_t received, uint64_t dispatched, uint64_t sent)
+{
+    uint32_t type = head->type.to_int();
+    if (type >= NUM_TYPES)
+        type = 0;
+
+    uint64_t nanoseconds[NUM_STAGES];
+    nanoseconds[STAGE_QUEUE] = (queue_nanoseconds > 0)? static_cast<uint64_t>(queue_nanoseconds): 0;
+    nanoseconds[STAGE_DISPATCH] = to_nanoseconds(dispatched - received);
+    nanoseconds[STAGE_SEND] = to_nanoseconds(sent - dispatched);
+    nanoseconds[STAGE_TOTAL] = nanoseconds[STAGE_QUEUE] + to_nanoseconds(sent - received);
+    for (uint32_t stage=(queue_nanoseconds < 0)? STAGE_DISPATCH: STAGE_QUEUE; stage<NUM_STAGES; ++stage)
+    {
+        // 只有数据线程写，不需要原子的加
+        std::atomic<uint64_t>& count = _counts[type][stage][get_bucket(nanoseconds[stage])];
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if (nanoseconds[stage] > _max_nanoseconds[type][stage].load(std::memory_order_relaxed))
+            _max_nanoseconds[type][stage].store(nanoseconds[stage], std::memory_order_relaxed);
+    }
+
+    if ((_slow_nanoseconds > 0) && (nanoseconds[STAGE_TOTAL] >= _slow_nanoseconds))
+    {
+        const uint64_t num_slow_requests = _num_slow_requests.load(std::memory_order_relaxed);
+        struct SlowRequest* slow_request = &_slow_requests[num_slow_requests % NUM_SLOW_REQUESTS];
+        const uint32_t version = slow_request->version.load(std::memory_order_relaxed);
+
+        slow_request->version.store(version + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slow_request->head = *head;
+        slow_request->ip = from_addr.sin_addr.s_addr;
+        slow_request->port = from_addr.sin_port;
+        slow_request->time = time(NULL);
+        memcpy(slow_request->nanoseconds, nanoseconds, sizeof(nanoseconds));
+        slow_request->version.store(version + 2, std::memory_order_release);
+        _num_slow_requests.store(num_slow_requests + 1, std::memory_order_release);
+    }
+}
+
+void CFlightRecorder::dump()
+{
+    MYLOG_INFO("Flight recorder dump begin (since last dump, in microseconds)\n");
+    for (uint32_t type=0; type<NUM_TYPES; ++type)
+    {
+        for (uint32_t stage=0; stage<NUM_STAGES; ++stage)
+        {
+            dump_histogram(type, stage);
+        }
+    }
+
+    // 从最老的开始输出上次dump以来的慢请求，输出过程中被覆盖的跳过
+    const uint64_t num_slow_requests = _num_slow_requests.load(std::memory_order_acquire);
+    uint64_t first = _dumped_slow_requests;
+    if (num_slow_requests - first > NUM_SLOW_REQUESTS)
+    {
+        MYLOG_INFO("%" PRIu64" slow requests overwritten\n", num_slow_requests - first - NUM_SLOW_REQUESTS);
+        first = num_slow_requests - NUM_SLOW_REQUESTS;
+    }
+    for (uint64_t i=first; i<num_slow_requests; ++i)
+    {
+        const struct SlowRequest* slow_request = &_slow_requests[i % NUM_SLOW_REQUESTS];
+        const uint32_t version1 = slow_request->version.load(std::memory_order_acquire);
+        struct MessageHead head;
+        uint32_t ip;
+        uint16_t port;
+        time_t time_;
+        uint64_t nanoseconds[NUM_STAGES];
+
+        head = slow_request->head;
+        ip = slow_request->ip;
+        port = slow_request->port;
+        time_ = slow_request->time;
+        memcpy(nanoseconds, slow_request->nanoseconds, sizeof(nanoseconds));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const uint32_t version2 = slow_request->version.load(std::memory_order_relaxed);
+        if ((version1 != version2) || (version1 % 2 != 0))
+        {
+            continue;
+        }
+
+        struct sockaddr_in from_addr;
+        memset(&from_addr, 0, sizeof(from_addr));
+        from_addr.sin_family = AF_INET;
+        from_addr.sin_addr.s_addr = ip;
+        from_addr.sin_port = port;
+        MYLOG_INFO("slow request at %s from %s: %s, queue: %.1f, dispatch: %.1f, send: %.1f, total: %.1f\n",
+                mooon::sys::CDatetimeUtils::to_datetime(time_).c_str(), mooon::net::to_string(from_addr).c_str(), head.str().c_str(),
+                nanoseconds[STAGE_QUEUE]/1000.0, nanoseconds[STAGE_DISPATCH]/1000.0, nanoseconds[STAGE_SEND]/1000.0, nanoseconds[STAGE_TOTAL]/1000.0);
+    }
+
+    _dumped_slow_requests = num_slow_requests;
+    MYLOG_INFO("Flight recorder dump end\n");
+}
+
+uint32_t CFlightRecorder::get_bucket(uint64_t nanoseconds)
+{
+    if (nanoseconds < (1U << SUB_BUCKET_BITS))
+    {
+        return static_cast<uint32_t>(nanoseconds);
+    }
+
+    // 最高位所在的位置决定桶组，紧接着的SUB_BUCKET_BITS位决定组内的桶
+    const uint32_t exponent = 63 - __builtin_clzll(nanoseconds);
+    const uint32_t bucket = ((exponent - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS) +
+                            static_cast<uint32_t>((nanoseconds >> (exponent - SUB_BUCKET_BITS)) & ((1U << SUB_BUCKET_BITS) - 1));
+    return (bucket < NUM_BUCKETS)? bucket: NUM_BUCKETS - 1;
+}
+
+uint64_t CFlightRecorder::get_bucket_value(uint32_t bucket)
+{
+    if (bucket < (1U << SUB_BUCKET_BITS))
+    {
+        return bucket;
+    }
+
+    const uint32_t shift = (bucket >> SUB_BUCKET_BITS) - 1;
+    const uint64_t mantissa = (1U << SUB_BUCKET_BITS) + (bucket & ((1U << SUB_BUCKET_BITS) - 1));
+    return ((mantissa + 1) << shift) - 1;
+}
+
+uint64_t CFlightRecorder::to_nanoseconds(uint64_t ticks) const
+{
+    // TSC在不同CPU间可能有少许偏差，差值为“负”时当作0
+    if (static_cast<int64_t>(ticks) < 0)
+        return 0;
+    return static_cast<uint64_t>(static_cast<double>(ticks) * _nanoseconds_per_tick);
+}
+
+void CFlightRecorder::dump_histogram(uint32_t type, uint32_t stage)
+{
+    uint64_t counts[NUM_BUCKETS];
+    uint64_t total = 0;
+
+    for (uint32_t i=0; i<NUM_BUCKETS; ++i)
+    {
+        const uint64_t count = _counts[type][stage][i].load(std::memory_order_relaxed);
+        counts[i] = count - _dumped_counts[type][stage][i];
+        _dumped_counts[type][stage][i] = count;
+        total += counts[i];
+    }
+
+    // 最大值为上次dump以来的近似值（和数据线程的更新之间没有同步）
+    const uint64_t max_nanoseconds = _max_nanoseconds[type][stage].exchange(0, std::memory_order_relaxed);
+    if (0 == total)
+    {
+        return;
+    }
+
+    const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    double values[sizeof(quantiles)/sizeof(quantiles[0])];
+    for (size_t q=0; q<sizeof(quantiles)/sizeof(quantiles[0]); ++q)
+    {
+        const uint64_t rank = static_cast<uint64_t>(ceil(quantiles[q] * static_cast<double>(total)));
+        uint64_t accumulated = 0;
+        uint32_t i = 0;
+        for (; i<NUM_BUCKETS-1; ++i)
+        {
+            accumulated += counts[i];
+            if (accumulated >= rank)
+                break;
+        }
+        values[q] = get_bucket_value(i) / 1000.0;
+    }
+
+    MYLOG_INFO("%s[%u] %s: count: %" PRIu64", p50: %.1f, p90: %.1f, p99: %.1f, p999: %.1f, max: %.1f\n",
+            get_type_name(type), type, get_stage_name(stage), total,
+            values[0], values[1], values[2], values[3], max_nanoseconds/1000.0);
+}
+
+} // namespace muidor {
@@ -0,0 +1,112 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#ifndef MOOON_MUIDOR_FLIGHT_RECORDER_H
+#define MOOON_MUIDOR_FLIGHT_RECORDER_H
+#include "protocol.h"
+#include <atomic>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+namespace muidor {
+
+// 飞行记录器的时钟，x86上为TSC（需constant_tsc，现代CPU均支持），其它平台为CLOCK_MONOTONIC的纳秒数，
+// 只用于计算时间差，由CFlightRecorder::calibrate换算成纳秒
+inline uint64_t flight_clock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// 请求的延迟记录器，分阶段统计agent内的耗时：
+//   queue    从内核收到报文（SO_TIMESTAMPNS）到recvmmsg返回，即在socket接收队列中等待的时间，
+//            持续偏大说明数据线程忙不过来，应增加agent，而dispatch或send偏大则应优化处理
+//   dispatch 从recvmmsg返回到请求处理完成，含同一批中排在前面的请求的处理时间及store_sequence等
+//   send     从请求处理完成到这批应答由sendmmsg发出
+//   total    以上之和，即从内核收到请求到应答发出
+// 每种请求类型每个阶段一个对数线性（HDR风格）直方图，每2的幂分为8个桶，相对误差不超过12.5%；
+// 另外用环形队列保留最近的慢请求（total超过阈值）及其消息头。
+//
+// 只有数据线程写（record），直方图的计数为原子变量，慢请求的每项带序号（seqlock），
+// 因此其它线程（如信号线程）可随时dump而不用加锁，也不影响数据线程。
+class CFlightRecorder
+{
+public:
+    enum
+    {
+        STAGE_QUEUE = 0,
+        STAGE_DISPATCH = 1,
+        STAGE_SEND = 2,
+        STAGE_TOTAL = 3,
+        NUM_STAGES = 4,
+        NUM_TYPES = 16,        // 请求类型取值均小于16，更大的归到0
+        SUB_BUCKET_BITS = 3,   // 每2的幂分为2^3个桶
+        NUM_BUCKETS = 320,     // 可记录到2^42纳秒（约73分钟），更大的计入最后一个桶
+        NUM_SLOW_REQUESTS = 64 // 保留的慢请求条数
+    };
+
+    // slow_microseconds为慢请求的阈值，为0表示不记录慢请求
+    explicit CFlightRecorder(uint32_t slow_microseconds);
+
+    // 测量时钟频率，须在记录前调用一次，会休眠约10毫秒
+    void calibrate();
+
+    // 数据线程调用，记录一个请求的三个时间点（flight_clock的值）和在接收队列中等待的纳秒数，
+    // 没有内核时间戳时queue_nanoseconds为-1，这时不计入queue，total也不含排队时间
+    void record(const struct MessageHead* head, const struct sockaddr_in& from_addr, int64_t queue_nanoseconds,
+                uint64_t received, uint64_t dispatched, uint64_t sent);
+
+    // 任意线程调用，将上次dump以来的各直方图和最近的慢请求写入日志，
+    // 同一时间只能有一个线程调用（信号线程）
+    void dump();
+
+private:
+    struct SlowRequest
+    {
+        std::atomic<uint32_t> version; // 奇数表示正在写
+        struct MessageHead head;
+        uint32_t ip;
+        uint16_t port;
+        time_t time;
+        uint64_t nanoseconds[NUM_STAGES];
+    };
+
+    static uint32_t get_bucket(uint64_t nanoseconds);
+    static uint64_t get_bucket_value(uint32_t bucket); // 桶的上界
+    uint64_t to_nanoseconds(uint64_t ticks) const;
+    void dump_histogram(uint32_t type, uint32_t stage);
+
+private:
+    const uint64_t _slow_nanoseconds;
+    double _nanoseconds_per_tick;
+    std::atomic<uint64_t> _counts[NUM_TYPES][NUM_STAGES][NUM_BUCKETS];
+    std::atomic<uint64_t> _max_nanoseconds[NUM_TYPES][NUM_STAGES];
+    uint64_t _dumped_counts[NUM_TYPES][NUM_STAGES][NUM_BUCKETS]; // 上次dump时的计数，只由dump的线程访问
+    struct SlowRequest _slow_requests[NUM_SLOW_REQUESTS];
+    std::atomic<uint64_t> _num_slow_requests; // 累计的慢请求数，也是下一个写入的位置
+    uint64_t _dumped_slow_requests; // 上次dump时的慢请求数
+};
+
+} // namespace muidor {
+#endif // MOOON_MUIDOR_FLIGHT_RECORDER_H
@@ -0,0 +1,178 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#include "id_cache.h"
+#include "monotonic_clock.h"
+#include "muidor/muidor.h"
+#include <algorithm>
+namespace muidor {
+
+CIdCache::CIdCache(const CMuidor* muidor, uint16_t max_batch)
+    : _muidor(muidor), _max_batch(std::max<uint32_t>(max_batch, MIN_BATCH)), _stop(false),
+      _hour(0), _batch(MIN_BATCH), _slice_size(MIN_BATCH / 16),
+      _num_taken(0), _last_taken(0), _last_milliseconds(get_monotonic_milliseconds())
+{
+    _refill_thread = new mooon::sys::CThreadEngine(mooon::sys::bind(&CIdCache::refill_thread, this));
+}
+
+CIdCache::~CIdCache()
+{
+    {
+        mooon::sys::LockHelper<mooon::sys::CLock> lh(_lock);
+        _stop = true;
+        _event.signal();
+    }
+
+    _refill_thread->join();
+    delete _refill_thread;
+}
+
+// 进入新的小时，丢弃上一小时剩余的seq
+void CIdCache::reset_hour(struct IdSlice* slice, time_t now)
+{
+    struct tm tm;
+    localtime_r(&now, &tm);
+
+    slice->hour_begin = now - tm.tm_min * 60 - tm.tm_sec;
+    slice->hour_end = slice->hour_begin + 3600;
+    tm.tm_min = 0;
+    tm.tm_sec = 0;
+    slice->tm = tm;
+    slice->hour = get_base_hours(tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday, tm.tm_hour);
+    slice->seq = 0;
+    slice->end = 0;
+}
+
+// 线程的slice用完时调用，从池中取一段，池中没有时同步从agent取
+int CIdCache::take(struct IdSlice* slice, struct MuError* error)
+{
+    uint32_t num;
+
+    {
+        mooon::sys::LockHelper<mooon::sys::CLock> lh(_lock);
+
+        while (!_ranges.empty() && (_ranges.front().hour < slice->hour))
+            _ranges.pop_front();
+        if (slice->hour > _hour)
+            _hour = slice->hour;
+
+        num = _slice_size;
+        _num_taken += num;
+        if (!_ranges.empty() && (_ranges.front().hour == slice->hour))
+        {
+            struct Range& range = _ranges.front();
+            num = std::min(num, range.end - range.seq);
+            slice->label = range.label;
+            slice->seq = range.seq;
+            slice->end = range.seq + num;
+
+            range.seq += num;
+            if (range.seq == range.end)
+                _ranges.pop_front();
+            if (get_remaining(slice->hour) < _batch / 2)
+                _event.signal();
+            return 0;
+        }
+
+        _event.signal();
+    }
+
+    uint8_t label = 0;
+    uint32_t seq = 0;
+    const int errcode = _muidor->get_label_and_hour_seq(&label, &seq, static_cast<uint16_t>(num), slice->hour, error);
+    if (errcode != 0)
+        return errcode;
+
+    slice->label = label;
+    slice->seq = seq;
+    slice->end = seq + num;
+    return 0;
+}
+
+uint32_t CIdCache::get_remaining(uint32_t hour) const
+{
+    uint32_t remaining = 0;
+    for (std::deque<struct Range>::const_iterator iter=_ranges.begin(); iter!=_ranges.end(); ++iter)
+    {
+        if (iter->hour == hour)
+            remaining += iter->end - iter->seq;
+    }
+    return remaining;
+}
+
+// 按上次调整以来的消耗速度，将每批的大小调整为约1秒的用量，
+// 为避免突发的抖动，新值取目标值和当前值的平均
+void CIdCache::adapt_batch()
+{
+    const uint64_t now = get_monotonic_milliseconds();
+    const uint64_t elapsed = now - _last_milliseconds;
+    if (elapsed < REFILL_INTERVAL_MILLISECONDS)
+    {
+        return;
+    }
+
+    const uint64_t target = (_num_taken - _last_taken) * 1000 / elapsed;
+    const uint64_t batch = (_batch + target) / 2;
+    _batch = static_cast<uint32_t>(std::min<uint64_t>(std::max<uint64_t>(batch, MIN_BATCH), _max_batch));
+    _slice_size = std::min<uint32_t>(std::max<uint32_t>(_batch / 16, 1), MAX_SLICE);
+    _last_taken = _num_taken;
+    _last_milliseconds = now;
+}
+
+void CIdCache::refill_thread()
+{
+    while (true)
+    {
+        uint32_t hour;
+        uint32_t num;
+
+        {
+            mooon::sys::LockHelper<mooon::sys::CLock> lh(_lock);
+            if (!_stop)
+                (void)_event.timed_wait(_lock, REFILL_INTERVAL_MILLISECONDS);
+            if (_stop)
+                break;
+
+            adapt_batch();
+            hour = _hour;
+            if ((0 == hour) || (get_remaining(hour) >= _batch / 2))
+                continue;
+            num = _batch;
+        }
+
+        // 出错时不处理，池空时由调用线程同步取，错误也就由调用线程得到
+        struct MuError error;
+        uint8_t label = 0;
+        uint32_t seq = 0;
+        if (0 == _muidor->get_label_and_hour_seq(&label, &seq, static_cast<uint16_t>(num), hour, &error))
+        {
+            mooon::sys::LockHelper<mooon::sys::CLock> lh(_lock);
+            if (_ranges.empty() || (_ranges.back().hour <= hour))
+            {
+                struct Range range;
+                range.hour = hour;
+                range.label = label;
+                range.seq = seq;
+                range.end = seq + num;
+                _ranges.push_back(range);
+            }
+        }
+    }
+}
+
+} // namespace muidor {
@@ -0,0 +1,118 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#ifndef MOOON_MUIDOR_ID_CACHE_H
+#define MOOON_MUIDOR_ID_CACHE_H
+#include <mooon/sys/event.h>
+#include <mooon/sys/lock.h>
+#include <mooon/sys/thread_engine.h>
+#include <stdint.h>
+#include <time.h>
+#include <deque>
+namespace muidor {
+
+class CMuidor;
+struct MuError;
+
+// 线程从缓存中取得的一小段seq，在线程的上下文（ThreadContext）中，只由所属线程访问
+struct IdSlice
+{
+    uint32_t hour;     // get_base_hours的值，为0表示还未初始化
+    time_t hour_begin; // hour对应的时间范围[hour_begin, hour_end)
+    time_t hour_end;
+    struct tm tm;      // hour_begin的本地时间，用于组装UniqID
+    uint8_t label;
+    uint32_t seq;      // 下一个可用的seq
+    uint32_t end;      // seq等于end时这段已用完
+
+    IdSlice(): hour(0), hour_begin(0), hour_end(0), label(0), seq(0), end(0) {}
+};
+
+// CMuidor的本地ID缓存（预取），用于get_local_uniq_id和get_local_sortable_id：
+// 后台线程按小时从agent批量取seq（get_label_and_hour_seq）放入池中，剩余不足半批时再取，
+// 每批的大小按最近的消耗速度调整为约1秒的用量（在MIN_BATCH和max_batch之间）；
+// 各线程每次从池中取一小段（slice）到自己的上下文，之后在本线程内分配，不加锁也没有原子操作，
+// 池中没有当前小时的seq时（如刚启动、跨小时或agent出错）由调用线程同步地从agent取一段。
+//
+// 缓存中的seq在进程退出或跨小时后即被丢弃，不会重复，但会有空洞，也不再按分配顺序单调
+class CIdCache
+{
+public:
+    enum
+    {
+        MIN_BATCH = 64,                 // 每批最少取的个数
+        MAX_SLICE = 256,                // 线程每次最多取的个数
+        REFILL_INTERVAL_MILLISECONDS = 100
+    };
+
+    // max_batch为每批最多取的个数，UniqAgent的steps参数值最好是它的10倍或以上
+    CIdCache(const CMuidor* muidor, uint16_t max_batch);
+    ~CIdCache();
+
+    // 取一个seq，now为当前时间（time(NULL)），
+    // 返回后slice->hour和slice->tm为这个seq所属的小时
+    // 成功返回0，出错返回错误码，出错的上下文记录在error中
+    int get(struct IdSlice* slice, time_t now, uint8_t* label, uint32_t* seq, struct MuError* error)
+    {
+        if ((now < slice->hour_begin) || (now >= slice->hour_end))
+            reset_hour(slice, now);
+        if (slice->seq == slice->end)
+        {
+            const int errcode = take(slice, error);
+            if (errcode != 0)
+                return errcode;
+        }
+
+        *label = slice->label;
+        *seq = slice->seq++;
+        return 0;
+    }
+
+private:
+    struct Range
+    {
+        uint32_t hour;
+        uint8_t label;
+        uint32_t seq;
+        uint32_t end;
+    };
+
+    void reset_hour(struct IdSlice* slice, time_t now);
+    int take(struct IdSlice* slice, struct MuError* error);
+    uint32_t get_remaining(uint32_t hour) const;
+    void adapt_batch();
+    void refill_thread();
+
+private:
+    const CMuidor* _muidor;
+    const uint32_t _max_batch;
+    volatile bool _stop;
+    mooon::sys::CLock _lock; // 保护以下成员
+    mooon::sys::CEvent _event;
+    std::deque<struct Range> _ranges; // 按小时递增
+    uint32_t _hour;        // 线程最近取过的最大小时数，后台线程为它预取
+    uint32_t _batch;       // 当前每批取的个数
+    uint32_t _slice_size;  // 当前线程每次取的个数
+    uint64_t _num_taken;   // 累计被线程取走的个数，用于计算消耗速度
+    uint64_t _last_taken;
+    uint64_t _last_milliseconds;
+    mooon::sys::CThreadEngine* _refill_thread;
+};
+
+} // namespace muidor {
+#endif // MOOON_MUIDOR_ID_CACHE_H
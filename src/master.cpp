@@ -114,6 +114,21 @@ CREATE TABLE t_label_log (
 );
 */
 
+/*
+ * 号段表，用于号段模式，每个业务标签（tag）一行，需要事先插入
+ * f_max_id为已分配出去的最大值，每次分配f_step个，即分配的号段为(f_max_id, f_max_id+f_step]
+DROP TABLE IF EXISTS t_segment;
+CREATE TABLE t_segment (
+    f_tag INT UNSIGNED NOT NULL,
+    f_max_id BIGINT UNSIGNED NOT NULL DEFAULT 0,
+    f_step INT UNSIGNED NOT NULL DEFAULT 1000,
+    f_desc VARCHAR(255) NOT NULL DEFAULT '',
+    f_time DATETIME NOT NULL,
+    PRIMARY KEY (f_tag)
+);
+INSERT INTO t_segment (f_tag,f_max_id,f_step,f_desc,f_time) VALUES (1,0,1000,"invoice",NOW());
+*/
+
 // 常量
 enum
 {
@@ -169,6 +184,7 @@ private:
     bool generate_labels();
     bool load_labels();
     int alloc_label();
+    int alloc_segment(uint32_t tag, uint64_t* start, uint32_t* step);
     int get_label() const;
     bool hold_valid_label(uint8_t label) const;
 
@@ -177,6 +193,7 @@ private:
     time_t get_expire_time() const;
     void prepare_response_error(int errcode);
     int prepare_response_get_label();
+    int prepare_response_get_segment();
 
 private:
     time_t _current_time;
@@ -304,6 +321,10 @@ bool CUidMaster::run()
                         {
                             errocode = prepare_response_get_label();
                         }
+                        else if (REQUEST_SEGMENT == _message_head->type)
+                        {
+                            errocode = prepare_response_get_segment();
+                        }
                         else
                         {
                             errocode = MUE_INVALID_TYPE;
@@ -497,6 +518,71 @@ int CUidMaster::alloc_label()
     }
 }
 
+// 分配号段，通过UPDATE的行锁保证多个master同时运行时号段也不会重叠
+// 成功返回0，tag不存在返回MUE_NO_TAG，DB错误返回MUE_DATABASE
+int CUidMaster::alloc_segment(uint32_t tag, uint64_t* start, uint32_t* step)
+{
+    bool need_rollback = false;
+
+    try
+    {
+        const std::string time_str = mooon::sys::CDatetimeUtils::to_datetime(_current_time);
+        int n = _mysql->update("UPDATE t_segment SET f_max_id=f_max_id+f_step,f_time=\"%s\" WHERE f_tag=%u AND f_step>0",
+                time_str.c_str(), tag);
+        if (n != 1)
+        {
+            MYLOG_ERROR("Tag[%u] return %d for %s\n", tag, n, mooon::net::to_string(_from_addr).c_str());
+            if (n > 0)
+                _mysql->rollback();
+            return (0 == n)? MUE_NO_TAG: MUE_DATABASE;
+        }
+
+        need_rollback = true;
+        mooon::sys::DBTable db_table;
+        _mysql->query(db_table, "SELECT f_max_id,f_step FROM t_segment WHERE f_tag=%u", tag);
+        if (db_table.size() != 1)
+        {
+            MYLOG_ERROR("Tag[%u] return %d rows\n", tag, static_cast<int>(db_table.size()));
+            _mysql->rollback();
+            return MUE_DATABASE;
+        }
+
+        uint64_t max_id = 0;
+        const mooon::sys::DBRow& db_row = db_table[0];
+        if (!mooon::utils::CStringUtils::string2int(db_row[0].c_str(), max_id) ||
+            !mooon::utils::CStringUtils::string2int(db_row[1].c_str(), *step) ||
+            (max_id < *step))
+        {
+            MYLOG_ERROR("Tag[%u] invalid: %s,%s\n", tag, db_row[0].c_str(), db_row[1].c_str());
+            _mysql->rollback();
+            return MUE_DATABASE;
+        }
+
+        _mysql->commit();
+        *start = max_id - *step + 1;
+        MYLOG_INFO("Tag[%u] segment[%" PRIu64",%" PRIu64"] => %s\n", tag, *start, max_id, mooon::net::to_string(_from_addr).c_str());
+        return 0;
+    }
+    catch (mooon::sys::CDBException& ex)
+    {
+        MYLOG_ERROR("%s\n", ex.str().c_str());
+
+        if (need_rollback)
+        {
+            try
+            {
+                _mysql->rollback();
+            }
+            catch (mooon::sys::CDBException& ex)
+            {
+                MYLOG_ERROR("Rollback failed: %s\n", ex.str().c_str());
+            }
+        }
+
+        return MUE_DATABASE;
+    }
+}
+
 // 根据IP取它的未过期的Label
 // 成功返回Lable， 没找到则返回0，DB错误返回-1
 int CUidMaster::get_label() const
@@ -708,6 +794,7 @@ void CUidMaster::prepare_response_error(int errcode)
     response->echo = request->echo;
     response->value1 = errcode;
     response->value2 = 0;
+    response->value3 = 0;
     response->update_magic();
 
     MYLOG_DEBUG("prepare %s ok for %s\n", response->str().c_str(), mooon::net::to_string(_from_addr).c_str());
@@ -764,6 +851,7 @@ int CUidMaster::prepare_response_get_label()
         response->echo = request->echo;
         response->value1 = label;
         response->value2 = 0;
+        response->value3 = 0;
         response->update_magic();
         MYLOG_INFO("%s => %s\n", response->str().c_str(), mooon::net::to_string(_from_addr).c_str());
 
@@ -780,4 +868,34 @@ int CUidMaster::prepare_response_get_label()
     return 0;
 }
 
+int CUidMaster::prepare_response_get_segment()
+{
+    struct MessageHead* request = reinterpret_cast<struct MessageHead*>(_request_buffer);
+    struct MessageHead* response = reinterpret_cast<struct MessageHead*>(_response_buffer);
+    const uint32_t tag = request->value1.to_int();
+    uint64_t start = 0;
+    uint32_t step = 0;
+
+    int errcode = alloc_segment(tag, &start, &step);
+    if (errcode != 0)
+    {
+        return errcode;
+    }
+    else
+    {
+        _response_size = sizeof(struct MessageHead);
+        response->major_ver = MU_MAJOR_VERSION;
+        response->minor_ver = MU_MINOR_VERSION;
+        response->len = sizeof(struct MessageHead);
+        response->type = RESPONSE_SEGMENT;
+        response->echo = request->echo;
+        response->value1 = tag;
+        response->value2 = step;
+        response->value3 = start;
+        response->update_magic();
+        MYLOG_INFO("%s => %s\n", response->str().c_str(), mooon::net::to_string(_from_addr).c_str());
+        return 0;
+    }
+}
+
 } // namespace muidor {
@@ -0,0 +1,44 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#ifndef MOOON_MUIDOR_MONOTONIC_CLOCK_H
+#define MOOON_MUIDOR_MONOTONIC_CLOCK_H
+#include <stdint.h>
+#include <time.h>
+namespace muidor {
+
+// CLOCK_MONOTONIC的时间，不受系统时间调整的影响，用于计算延迟、超时和负载
+inline uint64_t get_monotonic_nanoseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+inline uint64_t get_monotonic_microseconds()
+{
+    return get_monotonic_nanoseconds() / 1000;
+}
+
+inline uint64_t get_monotonic_milliseconds()
+{
+    return get_monotonic_nanoseconds() / 1000000;
+}
+
+} // namespace muidor {
+#endif // MOOON_MUIDOR_MONOTONIC_CLOCK_H
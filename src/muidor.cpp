@@ -16,40 +16,139 @@
  *
  * Author: eyjian@qq.com or eyjian@gmail.com
  */
+#include "datagram_socket.h"
+#include "id_cache.h"
+#include "monotonic_clock.h"
+#include "probes.h"
 #include "protocol.h"
 #include "muidor/muidor.h"
-#include <iomanip>
+#include <algorithm>
 #include <mooon/net/udp_socket.h>
-#include <mooon/utils/integer_utils.h>
+#include <mooon/sys/lock.h>
 #include <mooon/utils/tokener.h>
 #include <mooon/utils/string_utils.h>
 #include <mooon/sys/utils.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include <time.h>
-#include <sstream>
-
-// 是否检查magic
-#define _CHECK_MAGIC_ 1
+#include <map>
 
 namespace muidor {
 
 struct Metric mu_metric;
 
-// 尽量避免容易碰撞的echo值
-static uint32_t get_echo(uint32_t echo)
+// 线程在一个CMuidor实例上的上下文，每个线程独立，因此多个线程共用一个实例时不需要加锁
+struct ThreadContext
+{
+    uint64_t instance; // CMuidor::_instance，不复用，实例析构后不会再匹配
+    std::vector<CDatagramSocket*> agent_sockets; // 和_agents_addr一一对应，首次发往该agent时创建，线程退出或实例析构时关闭
+    uint32_t cursor; // 轮询选择agent的游标
+    struct IdSlice slice; // 从本地ID缓存取得的seq
+};
+
+enum
+{
+    LATENCY_SUB_BUCKET_BITS = 2, // 每2的幂分为4个桶
+    LATENCY_BUCKETS = 80,        // 可记录到约2^20微秒（1秒），更大的计入最后一个桶
+    LATENCY_SAMPLES = 256,       // 每多少个样本更新一次p95
+    EWMA_SHIFT = 3,              // 延迟和出错率的EWMA系数为1/8
+    STATS_DECAY_MILLISECONDS = 1000, // 未被选中的agent，选择代价每这么久减半，使其能被重新探测
+    BREAKER_FAILURES = 3,        // 连续失败这么多次后熔断
+    BREAKER_OPEN_MILLISECONDS = 1000, // 首次熔断的时长，之后每次半开探测失败加倍
+    BREAKER_OPEN_MAX_SHIFT = 4   // 熔断时长最多加倍到16秒
+};
+
+// check_agent的返回值
+enum
+{
+    AGENT_UNAVAILABLE = 0, // 熔断中，或已有其它请求在做半开探测
+    AGENT_AVAILABLE = 1,
+    AGENT_PROBE = 2        // 熔断到期，由本次请求做半开探测
+};
+
+// 各agent的健康状况，由共用实例的各线程（包括CAsyncMuidor）无锁更新，并发时只是近似值，对选择agent足够了
+struct AgentStats
+{
+    std::atomic<uint32_t> counts[LATENCY_BUCKETS]; // 应答延迟（微秒）的分布
+    std::atomic<uint32_t> num_samples;
+    std::atomic<uint32_t> p95_microseconds; // 为0表示样本还不够
+    std::atomic<uint32_t> ewma_microseconds; // 应答延迟的EWMA，为0表示还没有样本
+    std::atomic<uint32_t> error_permille; // 超时和发送失败率的EWMA，千分比
+    std::atomic<uint32_t> load_permille; // agent应答中附带的负载提示，老版本的agent为0
+    std::atomic<uint64_t> updated_time; // 最近一次更新的时间（单调时钟的毫秒数）
+    std::atomic<uint32_t> consecutive_failures;
+    std::atomic<uint64_t> open_until; // 熔断到期的时间（单调时钟的毫秒数），为0表示未熔断
+    std::atomic<uint32_t> open_times; // 连续熔断的次数，用于加倍熔断时长
+
+    AgentStats()
+        : num_samples(0), p95_microseconds(0), ewma_microseconds(0), error_permille(0), load_permille(0),
+          updated_time(0), consecutive_failures(0), open_until(0), open_times(0)
+    {
+        for (uint32_t i=0; i<LATENCY_BUCKETS; ++i)
+            counts[i].store(0, std::memory_order_relaxed);
+    }
+};
+
+static std::atomic<uint64_t> g_num_instances(0);
+static mooon::sys::CLock g_instances_lock; // 保护g_instances和各实例的_udp_sockets
+static std::map<uint64_t, const CMuidor*> g_instances; // 未析构的实例
+static pthread_key_t g_contexts_key; // 值为tls_contexts，线程退出时由CMuidor::release_thread_contexts释放
+static __thread std::vector<struct ThreadContext>* tls_contexts = NULL;
+static __thread struct ThreadContext* tls_last_context = NULL; // 最近使用的，通常只用一个实例
+
+// 对数线性的延迟桶，同agent的飞行记录器
+static uint32_t get_latency_bucket(uint32_t microseconds)
 {
-    uint32_t echo_ = echo;
+    if (microseconds < (1U << LATENCY_SUB_BUCKET_BITS))
+    {
+        return microseconds;
+    }
+
+    const uint32_t exponent = 31 - __builtin_clz(microseconds);
+    const uint32_t bucket = ((exponent - LATENCY_SUB_BUCKET_BITS + 1) << LATENCY_SUB_BUCKET_BITS) +
+                            ((microseconds >> (exponent - LATENCY_SUB_BUCKET_BITS)) & ((1U << LATENCY_SUB_BUCKET_BITS) - 1));
+    return (bucket < LATENCY_BUCKETS)? bucket: LATENCY_BUCKETS - 1;
+}
 
-    if (echo_ < ECHO_START)
+// 桶的上界
+static uint32_t get_latency_bucket_value(uint32_t bucket)
+{
+    if (bucket < (1U << LATENCY_SUB_BUCKET_BITS))
     {
-        echo_ = ECHO_START + mooon::sys::CUtils::get_random_number(0, 1235U);
+        return bucket;
     }
-    else if (0 == echo_ % 10)
+
+    const uint32_t shift = (bucket >> LATENCY_SUB_BUCKET_BITS) - 1;
+    const uint32_t mantissa = (1U << LATENCY_SUB_BUCKET_BITS) + (bucket & ((1U << LATENCY_SUB_BUCKET_BITS) - 1));
+    return ((mantissa + 1) << shift) - 1;
+}
+
+// 尽量避免容易碰撞的echo值
+static bool valid_echo(uint32_t echo)
+{
+    return (echo >= ECHO_START) && (echo % 10 != 0);
+}
+
+// UUID128中的随机数部分，每个线程独立的xorshift64*，不需要加锁
+static uint64_t get_random64()
+{
+    static __thread uint64_t state = 0;
+
+    if (0 == state)
     {
-        echo_ = echo_ + 1;
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        state = (static_cast<uint64_t>(tv.tv_sec) << 20) ^ static_cast<uint64_t>(tv.tv_usec) ^ reinterpret_cast<uint64_t>(&state);
+        state ^= static_cast<uint64_t>(mooon::sys::CUtils::get_random_number(0, 0x7FFFFFFFU)) << 32;
+        if (0 == state)
+            state = ECHO_START;
     }
 
-    return echo_;
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL;
 }
 
 const char* label2string(uint8_t label, char str[3], bool uppercase)
@@ -68,6 +167,82 @@ std::string label2string(uint8_t label, bool uppercase)
     return str;
 }
 
+//
+// MuError
+//
+static_assert(sizeof(MuError::response) == sizeof(struct MessageHead), "MuError::response must hold a MessageHead");
+
+std::string MuError::str() const
+{
+    std::string message;
+    if (0 == agent_addr.sin_family)
+        message = mooon::utils::CStringUtils::format_string("[muidor] %s", what);
+    else
+        message = mooon::utils::CStringUtils::format_string("[muidor][%s] %s", mooon::net::to_string(agent_addr).c_str(), what);
+    if (has_response)
+        message += mooon::utils::CStringUtils::format_string(": %s|%d",
+                reinterpret_cast<const struct MessageHead*>(response)->str().c_str(), (int)response_type);
+    return message;
+}
+
+static __thread struct MuError* tls_last_error = NULL; // 本线程最近一次出错的上下文，首次使用时创建
+static pthread_key_t g_error_key; // 值为tls_last_error，线程退出时释放
+static const struct MuError g_no_error;
+
+static void release_error_buffer(void* error)
+{
+    if (tls_last_error == error)
+        tls_last_error = NULL;
+    delete static_cast<struct MuError*>(error);
+}
+
+// 取本线程记录出错上下文的位置，try_*在调用前取得，成功时不写入
+static struct MuError* get_error_buffer()
+{
+    if (NULL == tls_last_error)
+    {
+        static const int key_errcode = pthread_key_create(&g_error_key, release_error_buffer);
+        tls_last_error = new struct MuError;
+        if (0 == key_errcode)
+            (void)pthread_setspecific(g_error_key, tls_last_error);
+    }
+    return tls_last_error;
+}
+
+// 记录出错的上下文，返回errcode
+static int set_error(struct MuError* error, int errcode, const char* what, const char* syscall, const struct sockaddr_in* agent_addr=NULL)
+{
+    error->errcode = errcode;
+    error->what = what;
+    error->syscall = syscall;
+    error->has_response = false;
+    if (NULL == agent_addr)
+        error->agent_addr.sin_family = 0;
+    else
+        error->agent_addr = *agent_addr;
+    return errcode;
+}
+
+// 记录出错的应答，只复制消息头，返回errcode
+static int set_response_error(struct MuError* error, int errcode, const char* what, const struct sockaddr_in& agent_addr,
+                              const struct MessageHead* response, uint16_t response_type)
+{
+    (void)set_error(error, errcode, what, NULL, &agent_addr);
+    memcpy(error->response, response, sizeof(struct MessageHead));
+    error->response_type = response_type;
+    error->has_response = true;
+    return errcode;
+}
+
+// 抛异常的接口出错时，按出错的上下文抛出相应的异常
+static void throw_error(const struct MuError& error)
+{
+    if (error.syscall != NULL)
+        THROW_SYSCALL_EXCEPTION(error.str(), error.errcode, error.syscall);
+    else
+        THROW_EXCEPTION(error.str(), error.errcode);
+}
+
 //
 // Metric
 //
@@ -85,7 +260,10 @@ Metric::Metric()
       receive_timeout(0),
       sys_exception(0),
       exception(0),
-      retry_times(0)
+      retry_times(0),
+      hedge_requests(0),
+      hedge_wins(0),
+      circuit_opens(0)
 {
 }
 
@@ -94,16 +272,18 @@ Metric::Metric()
 //
 
 CMuidor::CMuidor(const std::string& agent_nodes, uint32_t timeout_milliseconds, uint8_t retry_times, bool polling)
-    : _echo(ECHO_START),
+    : _instance(++g_num_instances),
+      _echo(ECHO_START),
       _agent_nodes(agent_nodes),
       _timeout_milliseconds(timeout_milliseconds),
       _retry_times(retry_times),
       _polling(polling),
-      _udp_socket(NULL)
+      _id_cache(NULL),
+      _hedge_milliseconds(0),
+      _hedge_p95(false),
+      _agent_stats(NULL)
 {
-    _udp_socket = new mooon::net::CUdpSocket;
-    _echo = ECHO_START + mooon::sys::CUtils::get_random_number(0, 1235U); // 初始化一个随机值，这样不同实例不同
-    _echo = get_echo(_echo);
+    _echo = ECHO_START + 1 + mooon::sys::CUtils::get_random_number(0, 1235U); // 初始化一个随机值，这样不同实例不同
 
     // 限制最大重试次数，这样可以保证后续的“retry+1”不会溢出
     if (_retry_times > RETRY_MAX)
@@ -135,422 +315,259 @@ CMuidor::CMuidor(const std::string& agent_nodes, uint32_t timeout_milliseconds,
         memset(agent_addr.sin_zero, 0, sizeof(agent_addr.sin_zero));
         _agents_addr.push_back(agent_addr);
     }
+
+    _agent_stats = new struct AgentStats[_agents_addr.size()];
+    mooon::sys::LockHelper<mooon::sys::CLock> lh(g_instances_lock);
+    g_instances[_instance] = this;
 }
 
 CMuidor::~CMuidor()
 {
-    delete _udp_socket;
+    // 先停止预取线程，它也使用_udp_sockets中的socket
+    delete _id_cache;
+    delete []_agent_stats;
+
+    // 各线程的上下文在下次未命中时清理
+    mooon::sys::LockHelper<mooon::sys::CLock> lh(g_instances_lock);
+    g_instances.erase(_instance);
+    for (std::vector<CDatagramSocket*>::size_type i=0; i<_udp_sockets.size(); ++i)
+        delete _udp_sockets[i];
+    _udp_sockets.clear();
+}
+
+void CMuidor::enable_id_cache(uint16_t max_batch)
+{
+    if (NULL == _id_cache)
+    {
+        _id_cache = new CIdCache(this, max_batch);
+    }
+}
+
+void CMuidor::enable_hedging(uint32_t delay_milliseconds, bool use_p95)
+{
+    _hedge_milliseconds = delay_milliseconds;
+    _hedge_p95 = use_p95;
 }
 
 uint8_t CMuidor::get_label() const
 {
-    const uint32_t echo = get_echo(_echo);
-    char response_buffer[1 + sizeof(struct MessageHead)]; // 故意多出一字节，以过滤掉包大小不同的脏数据
-    struct MessageHead* response = reinterpret_cast<struct MessageHead*>(response_buffer);
-    struct MessageHead request;
-    request.len = sizeof(request);
-    request.type = REQUEST_LABEL;
-    request.echo = echo;
-    request.value1 = 0;
-    request.value2 = 0;
-    request.value3 = 0;
-    request.update_magic();
-    _echo = echo + 1;
+    uint8_t label = 0;
+    if (try_get_label(&label) != 0)
+        throw_error(*tls_last_error);
+    return label;
+}
 
-    for (uint8_t retry=0; retry<_retry_times+1; ++retry)
-    {
-        const struct sockaddr_in& agent_addr = pick_agent();
+uint32_t CMuidor::get_unqi_seq(uint16_t num) const
+{
+    uint32_t seq = 0;
+    if (try_get_unqi_seq(&seq, num) != 0)
+        throw_error(*tls_last_error);
+    return seq;
+}
 
-        try
-        {
-            struct sockaddr_in from_addr;
-            int bytes = _udp_socket->send_to(&request, sizeof(request), agent_addr);
-            if (bytes != sizeof(request))
-            {
-                ++mu_metric.send_error;
-                THROW_SYSCALL_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s] invalid size", mooon::net::to_string(agent_addr).c_str()),
-                        bytes, "send_to");
-            }
+uint64_t CMuidor::get_uniq_id(uint8_t user, uint64_t current_seconds) const
+{
+    uint64_t uniq_id = 0;
+    if (try_get_uniq_id(&uniq_id, user, current_seconds) != 0)
+        throw_error(*tls_last_error);
+    return uniq_id;
+}
 
-            bytes = _udp_socket->timed_receive_from(response, sizeof(response_buffer), &from_addr, _timeout_milliseconds);
-            if (bytes != sizeof(struct MessageHead))
-            {
-                ++mu_metric.invalid_size;
-                THROW_SYSCALL_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s] invalid size", mooon::net::to_string(from_addr).c_str()),
-                        bytes, "receive_from");
-            }
-            else if (memcmp(&agent_addr, &from_addr, sizeof(struct sockaddr_in)) != 0)
-            {
-                ++mu_metric.error_sockaddr;
-                THROW_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s][AGENT:%s] unexcepted response",
-                                mooon::net::to_string(from_addr).c_str(), mooon::net::to_string(agent_addr).c_str()),
-                        MUE_UNEXCEPTED);
-            }
-            else if (RESPONSE_ERROR == response->type)
-            {
-                ++mu_metric.response_error;
-                THROW_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s] store sequence block error: %s",
-                                mooon::net::to_string(from_addr).c_str(), response->str().c_str()),
-                        static_cast<int>(response->value1.to_int()));
-            }
-            else if (response->type != RESPONSE_LABEL)
-            {
-                ++mu_metric.response_not_label;
-                THROW_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s] error response label: %s",
-                                mooon::net::to_string(from_addr).c_str(), response->str().c_str()),
-                        response->type.to_int());
-            }
-            else if (response->echo.to_int() != echo)
-            {
-                ++mu_metric.mismatch_echo;
-                THROW_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s] mismatch response label: %s|%u",
-                                mooon::net::to_string(from_addr).c_str(), response->str().c_str(), echo),
-                        MUE_MISMATCH);
-            }
-            else
-            {
-#if _CHECK_MAGIC_ == 1
-                const uint32_t magic_ = response->calc_magic();
-                //fprintf(stderr, "%s|%u\n", response->str().c_str(), magic_);
-                if (magic_ != response->magic)
-                {
-                    ++mu_metric.illegal_magic;
-                    THROW_EXCEPTION(
-                            mooon::utils::CStringUtils::format_string("[muidor][%s] illegal response: %s|%u",
-                                    mooon::net::to_string(from_addr).c_str(), response->str().c_str(), magic_),
-                            MUE_ILLEGAL);
-                }
-#endif // _CHECK_MAGIC_
+uint64_t CMuidor::get_local_uniq_id(uint8_t user, uint64_t current_seconds) const
+{
+    uint64_t uniq_id = 0;
+    if (try_get_local_uniq_id(&uniq_id, user, current_seconds) != 0)
+        throw_error(*tls_last_error);
+    return uniq_id;
+}
 
-                const uint32_t label_ = response->value1.to_int();
-                if ((label_ >= 0xFF) || (label_ < 1))
-                {
-                    ++mu_metric.invalid_label;
-                    THROW_EXCEPTION(
-                            mooon::utils::CStringUtils::format_string("[muidor][%s] invalid label from master: %s",
-                                mooon::net::to_string(from_addr).c_str(), response->str().c_str()),
-                        MUE_INVALID_LABEL);
-                }
+void CMuidor::get_local_uniq_id(uint16_t num, std::vector<uint64_t>* id_vec, uint8_t user, uint64_t current_seconds) const
+{
+    if (try_get_local_uniq_id(num, id_vec, user, current_seconds) != 0)
+        throw_error(*tls_last_error);
+}
 
-                return static_cast<uint8_t>(label_);
-            }
-        }
-        catch (mooon::sys::CSyscallException& ex)
-        {
-            if ((0 == _retry_times) || (retry+1 >= _retry_times))
-            {
-                if (ex.errcode() != ETIMEDOUT)
-                {
-                    ++mu_metric.sys_exception;
-                    throw;
-                }
-                else
-                {
-                    ++mu_metric.receive_timeout;
-                    THROW_SYSCALL_EXCEPTION(
-                            mooon::utils::CStringUtils::format_string("[muidor][%s] receive timeout", mooon::net::to_string(agent_addr).c_str()),
-                            ETIMEDOUT, "timed_receive_from");
-                }
-            }
-            else
-            {
-                ++mu_metric.sys_exception;
-                ++mu_metric.retry_times;
-            }
-        }
-        catch (mooon::utils::CException&)
-        {
-            ++mu_metric.exception;
+uint64_t CMuidor::get_sortable_id(uint8_t user, uint64_t current_seconds) const
+{
+    uint64_t sortable_id = 0;
+    if (try_get_sortable_id(&sortable_id, user, current_seconds) != 0)
+        throw_error(*tls_last_error);
+    return sortable_id;
+}
 
-            // 在重试之前不抛出异常
-            if ((0 == _retry_times) || (retry+1 >= _retry_times))
-            {
-                throw;
-            }
-            else
-            {
-                ++mu_metric.retry_times;
-            }
-        }
+uint64_t CMuidor::get_local_sortable_id(uint8_t user, uint64_t current_seconds) const
+{
+    uint64_t sortable_id = 0;
+    if (try_get_local_sortable_id(&sortable_id, user, current_seconds) != 0)
+        throw_error(*tls_last_error);
+    return sortable_id;
+}
+
+void CMuidor::get_local_sortable_id(uint16_t num, std::vector<uint64_t>* id_vec, uint8_t user, uint64_t current_seconds) const
+{
+    if (try_get_local_sortable_id(num, id_vec, user, current_seconds) != 0)
+        throw_error(*tls_last_error);
+}
+
+void CMuidor::get_uuid(struct UUID128* uuid) const
+{
+    get_uuid(1, uuid);
+}
+
+void CMuidor::get_uuid(uint16_t num, struct UUID128* uuid_buffer) const
+{
+    if (try_get_uuid(num, uuid_buffer) != 0)
+        throw_error(*tls_last_error);
+}
+
+void CMuidor::get_label_and_seq(uint8_t* label, uint32_t* seq, uint16_t num) const
+{
+    if (try_get_label_and_seq(label, seq, num) != 0)
+        throw_error(*tls_last_error);
+}
+
+uint64_t CMuidor::get_tag_seq(uint32_t tag, uint16_t num, uint16_t* count) const
+{
+    uint64_t value = 0;
+    if (try_get_tag_seq(&value, tag, num, count) != 0)
+        throw_error(*tls_last_error);
+    return value;
+}
+
+uint64_t CMuidor::inc_counter(const std::string& name, uint16_t num, uint16_t* count) const
+{
+    if (name.empty() || (name.size() > COUNTER_NAME_MAX))
+    {
+        THROW_EXCEPTION(
+                mooon::utils::CStringUtils::format_string("[muidor] invalid counter name: %s", name.c_str()),
+                MUE_PARAMETER);
     }
 
-    return 0;
+    uint64_t value = 0;
+    if (try_inc_counter(&value, name, num, count) != 0)
+        throw_error(*tls_last_error);
+    return value;
 }
 
-uint32_t CMuidor::get_unqi_seq(uint16_t num) const
+//
+// 不抛异常的接口，出错的上下文记录在本线程的tls_last_error中
+//
+
+const struct MuError& CMuidor::get_last_error() noexcept
 {
-    const uint32_t echo = get_echo(_echo);
-    char response_buffer[1 + sizeof(struct MessageHead)]; // 故意多出一字节，以过滤掉包大小不同的脏数据
-    struct MessageHead* response = reinterpret_cast<struct MessageHead*>(response_buffer);
+    return (NULL == tls_last_error)? g_no_error: *tls_last_error;
+}
+
+int CMuidor::try_get_label(uint8_t* label) const noexcept
+{
+    struct MessageHead response;
     struct MessageHead request;
     request.len = sizeof(request);
-    request.type = REQUEST_UNIQ_SEQ;
-    request.echo = echo;
-    request.value1 = num;
+    request.type = REQUEST_LABEL;
+    request.value1 = 0;
     request.value2 = 0;
     request.value3 = 0;
-    request.update_magic();
-    _echo = echo + 1;
 
-    for (uint8_t retry=0; retry<_retry_times+1; ++retry)
-    {
-        const struct sockaddr_in& agent_addr = pick_agent();
+    const int errcode = call_agent(&request, &response, RESPONSE_LABEL, get_error_buffer());
+    if (0 == errcode)
+        *label = static_cast<uint8_t>(response.value1.to_int());
+    return errcode;
+}
 
-        try
-        {
-            struct sockaddr_in from_addr;
-            int bytes = _udp_socket->send_to(&request, sizeof(request), agent_addr);
-            if (bytes != sizeof(request))
-            {
-                ++mu_metric.send_error;
-                THROW_SYSCALL_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s] invalid size", mooon::net::to_string(agent_addr).c_str()),
-                        bytes, "send_to");
-            }
-            bytes = _udp_socket->timed_receive_from(response, sizeof(response_buffer), &from_addr, _timeout_milliseconds);
-            if (bytes != sizeof(struct MessageHead))
-            {
-                ++mu_metric.invalid_size;
-                THROW_SYSCALL_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s] invalid size", mooon::net::to_string(from_addr).c_str()),
-                        bytes, "receive_from");
-            }
-            else if (memcmp(&agent_addr, &from_addr, sizeof(struct sockaddr_in)) != 0)
-            {
-                ++mu_metric.error_sockaddr;
-                THROW_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s][AGENT:%s] unexcepted response",
-                                mooon::net::to_string(from_addr).c_str(), mooon::net::to_string(agent_addr).c_str()),
-                        MUE_UNEXCEPTED);
-            }
-            else if (RESPONSE_ERROR == response->type)
-            {
-                ++mu_metric.response_error;
-                THROW_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s] store sequence block error: %s",
-                                mooon::net::to_string(from_addr).c_str(), response->str().c_str()),
-                        static_cast<int>(response->value1.to_int()));
-            }
-            else if (response->type != RESPONSE_UNIQ_SEQ)
-            {
-                ++mu_metric.error_sequence;
-                THROW_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s] error response sequence: %s",
-                                mooon::net::to_string(from_addr).c_str(), response->str().c_str()),
-                        response->type.to_int());
-            }
-            else if (response->echo.to_int() != echo)
-            {
-                ++mu_metric.mismatch_echo;
-                THROW_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s] mismatch response sequence: %s|%u",
-                                mooon::net::to_string(from_addr).c_str(), response->str().c_str(), echo),
-                        MUE_MISMATCH);
-            }
-            else
-            {
-#if _CHECK_MAGIC_ == 1
-                const uint32_t magic_ = response->calc_magic();
-                //fprintf(stderr, "%s|%u\n", response->str().c_str(), magic_);
-                if (magic_ != response->magic)
-                {
-                    ++mu_metric.illegal_magic;
-                    THROW_EXCEPTION(
-                            mooon::utils::CStringUtils::format_string("[muidor][%s] illegal response: %s|%u",
-                                    mooon::net::to_string(from_addr).c_str(), response->str().c_str(), magic_),
-                            MUE_ILLEGAL);
-                }
-#endif // _CHECK_MAGIC_
+int CMuidor::try_get_unqi_seq(uint32_t* seq, uint16_t num) const noexcept
+{
+    struct MessageHead response;
+    struct MessageHead request;
+    request.len = sizeof(request);
+    request.type = REQUEST_UNIQ_SEQ;
+    request.value1 = num;
+    request.value2 = 0;
+    request.value3 = 0;
 
-                return static_cast<uint32_t>(response->value1.to_int());
-            }
-        }
-        catch (mooon::sys::CSyscallException& ex)
-        {
-            if ((0 == _retry_times) || (retry+1 >= _retry_times))
-            {
-                if (ex.errcode() != ETIMEDOUT)
-                {
-                    ++mu_metric.sys_exception;
-                    throw;
-                }
-                else
-                {
-                    ++mu_metric.receive_timeout;
-                    THROW_SYSCALL_EXCEPTION(
-                            mooon::utils::CStringUtils::format_string("[muidor][%s] receive timeout", mooon::net::to_string(agent_addr).c_str()),
-                            ETIMEDOUT, "timed_receive_from");
-                }
-            }
-            else
-            {
-                ++mu_metric.sys_exception;
-                ++mu_metric.retry_times;
-            }
-        }
-        catch (mooon::utils::CException&)
-        {
-            ++mu_metric.exception;
+    const int errcode = call_agent(&request, &response, RESPONSE_UNIQ_SEQ, get_error_buffer());
+    if (0 == errcode)
+        *seq = static_cast<uint32_t>(response.value1.to_int());
+    return errcode;
+}
 
-            if ((0 == _retry_times) || (retry+1 >= _retry_times))
-            {
-                throw;
-            }
-            else
-            {
-                ++mu_metric.retry_times;
-            }
-        }
-    }
+int CMuidor::try_get_uniq_id(uint64_t* uniq_id, uint8_t user, uint64_t current_seconds) const noexcept
+{
+    return get_uniq_id(uniq_id, user, current_seconds, MU_ENCODING_UNIQ_ID);
+}
 
-    return 0;
+int CMuidor::try_get_sortable_id(uint64_t* sortable_id, uint8_t user, uint64_t current_seconds) const noexcept
+{
+    return get_uniq_id(sortable_id, user, current_seconds, MU_ENCODING_SORTABLE);
 }
 
-uint64_t CMuidor::get_uniq_id(uint8_t user, uint64_t current_seconds) const
+int CMuidor::get_uniq_id(uint64_t* uniq_id, uint8_t user, uint64_t current_seconds, uint32_t encoding) const
 {
-    const uint32_t echo = get_echo(_echo);
-    char response_buffer[1 + sizeof(struct MessageHead)]; // 故意多出一字节，以过滤掉包大小不同的脏数据
-    struct MessageHead* response = reinterpret_cast<struct MessageHead*>(response_buffer);
+    struct MessageHead response;
     struct MessageHead request;
     request.len = sizeof(request);
     request.type = REQUEST_UNIQ_ID;
-    request.echo = echo;
     request.value1 = user;
-    request.value1 = 0;
+    request.value2 = encoding; // 老版本的Agent忽略value2，总是返回UniqID
     request.value3 = current_seconds;
-    request.update_magic();
-    _echo = echo + 1;
 
-    for (uint8_t retry=0; retry<_retry_times+1; ++retry)
-    {
-        const struct sockaddr_in& agent_addr = pick_agent();
+    const int errcode = call_agent(&request, &response, RESPONSE_UNIQ_ID, get_error_buffer());
+    if (0 == errcode)
+        *uniq_id = response.value3.to_int();
+    return errcode;
+}
 
-        try
-        {
-            struct sockaddr_in from_addr;
-            int bytes = _udp_socket->send_to(&request, sizeof(request), agent_addr);
-            if (bytes != sizeof(request))
-            {
-                ++mu_metric.send_error;
-                THROW_SYSCALL_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s] invalid size", mooon::net::to_string(agent_addr).c_str()),
-                        bytes, "send_to");
-            }
+int CMuidor::try_get_local_uniq_id(uint64_t* uniq_id, uint8_t user, uint64_t current_seconds) const noexcept
+{
+    uint8_t label = 0;
+    uint32_t seq = 0;
+    struct tm now;
+    if ((_id_cache != NULL) && (0 == current_seconds))
+    {
+        struct IdSlice* slice = &get_thread_context()->slice;
+        const int errcode = _id_cache->get(slice, time(NULL), &label, &seq, get_error_buffer());
+        if (errcode != 0)
+            return errcode;
+
+        union UniqID uniq_id_;
+        uniq_id_.id.user = user;
+        uniq_id_.id.label = label;
+        uniq_id_.id.year = (slice->tm.tm_year+1900) - MU_BASE_YEAR;
+        uniq_id_.id.month = slice->tm.tm_mon+1;
+        uniq_id_.id.day = slice->tm.tm_mday;
+        uniq_id_.id.hour = slice->tm.tm_hour;
+        uniq_id_.id.seq = seq;
+        *uniq_id = uniq_id_.value;
+        return 0;
+    }
 
-            bytes = _udp_socket->timed_receive_from(response, sizeof(response_buffer), &from_addr, _timeout_milliseconds);
-            if (bytes != sizeof(struct MessageHead))
-            {
-                ++mu_metric.invalid_size;
-                THROW_SYSCALL_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s] invalid size", mooon::net::to_string(from_addr).c_str()),
-                        bytes, "receive_from");
-            }
-            else if (memcmp(&agent_addr, &from_addr, sizeof(struct sockaddr_in)) != 0)
-            {
-                ++mu_metric.error_sockaddr;
-                THROW_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s][AGENT:%s] unexcepted response",
-                                mooon::net::to_string(from_addr).c_str(), mooon::net::to_string(agent_addr).c_str()),
-                        MUE_UNEXCEPTED);
-            }
-            else if (RESPONSE_ERROR == response->type)
-            {
-                ++mu_metric.response_error;
-                THROW_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s] store sequence block error: %s",
-                                mooon::net::to_string(from_addr).c_str(), response->str().c_str()),
-                        static_cast<int>(response->value1.to_int()));
-            }
-            else if (response->type != RESPONSE_UNIQ_ID)
-            {
-                ++mu_metric.error_uniqid;
-                THROW_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s] error response id: %s",
-                                mooon::net::to_string(from_addr).c_str(), response->str().c_str()),
-                        response->type.to_int());
-            }
-            else if (response->echo.to_int() != echo)
-            {
-                ++mu_metric.mismatch_echo;
-                THROW_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s] mismatch response id: %s|%u",
-                                mooon::net::to_string(from_addr).c_str(), response->str().c_str(), echo),
-                        MUE_MISMATCH);
-            }
-            else
-            {
-#if _CHECK_MAGIC_ == 1
-                const uint32_t magic_ = response->calc_magic();
-                //fprintf(stderr, "%s|%u\n", response->str().c_str(), magic_);
-                if (magic_ != response->magic)
-                {
-                    ++mu_metric.illegal_magic;
-                    THROW_EXCEPTION(
-                            mooon::utils::CStringUtils::format_string("[muidor][%s] illegal response: %s|%u",
-                                    mooon::net::to_string(from_addr).c_str(), response->str().c_str(), magic_),
-                            MUE_ILLEGAL);
-                }
-#endif // _CHECK_MAGIC_
+    time_t current_time = (0 == current_seconds)? time(NULL): current_seconds;
+    localtime_r(&current_time, &now);
+    const int errcode = get_label_and_hour_seq(&label, &seq, 1, get_base_hours(now.tm_year+1900, now.tm_mon+1, now.tm_mday, now.tm_hour), get_error_buffer());
+    if (errcode != 0)
+        return errcode;
+
+    union UniqID uniq_id_;
+    uniq_id_.id.user = user;
+    uniq_id_.id.label = label;
+    uniq_id_.id.year = (now.tm_year+1900) - MU_BASE_YEAR;
+    uniq_id_.id.month = now.tm_mon+1;
+    uniq_id_.id.day = now.tm_mday;
+    uniq_id_.id.hour = now.tm_hour;
+    uniq_id_.id.seq = seq;
+    *uniq_id = uniq_id_.value;
+    return 0;
+}
 
-                return response->value3.to_int();
-            }
-        }
-        catch (mooon::sys::CSyscallException& ex)
-        {
-            if ((0 == _retry_times) || (retry+1 >= _retry_times))
-            {
-                if (ex.errcode() != ETIMEDOUT)
-                {
-                    ++mu_metric.sys_exception;
-                    throw;
-                }
-                else
-                {
-                    ++mu_metric.receive_timeout;
-                    THROW_SYSCALL_EXCEPTION(
-                            mooon::utils::CStringUtils::format_string("[muidor][%s] receive timeout", mooon::net::to_string(agent_addr).c_str()),
-                            ETIMEDOUT, "timed_receive_from");
-                }
-            }
-            else
-            {
-                ++mu_metric.sys_exception;
-                ++mu_metric.retry_times;
-            }
-        }
-        catch (mooon::utils::CException&)
-        {
-            ++mu_metric.exception;
-
-            if ((0 == _retry_times) || (retry+1 >= _retry_times))
-            {
-                throw;
-            }
-            else
-            {
-                ++mu_metric.retry_times;
-            }
-        }
-    }
-
-    return 0;
-}
-
-uint64_t CMuidor::get_local_uniq_id(uint8_t user, uint64_t current_seconds) const
+int CMuidor::try_get_local_uniq_id(uint16_t num, std::vector<uint64_t>* id_vec, uint8_t user, uint64_t current_seconds) const noexcept
 {
     uint8_t label = 0;
     uint32_t seq = 0;
-    get_label_and_seq(&label, &seq);
-
     struct tm now;
     time_t current_time = (0 == current_seconds)? time(NULL): current_seconds;
     localtime_r(&current_time, &now);
+    const int errcode = get_label_and_hour_seq(&label, &seq, num, get_base_hours(now.tm_year+1900, now.tm_mon+1, now.tm_mday, now.tm_hour), get_error_buffer());
+    if (errcode != 0)
+        return errcode;
 
     union UniqID uniq_id;
     uniq_id.id.user = user;
@@ -559,147 +576,195 @@ uint64_t CMuidor::get_local_uniq_id(uint8_t user, uint64_t current_seconds) cons
     uniq_id.id.month = now.tm_mon+1;
     uniq_id.id.day = now.tm_mday;
     uniq_id.id.hour = now.tm_hour;
-    uniq_id.id.seq = seq;
 
-    return uniq_id.value;
+    for (uint16_t i=0; i<num; ++i)
+    {
+        uniq_id.id.seq = seq++;
+        id_vec->push_back(uniq_id.value);
+    }
+    return 0;
 }
 
-void CMuidor::get_local_uniq_id(uint16_t num, std::vector<uint64_t>* id_vec, uint8_t user, uint64_t current_seconds) const
+int CMuidor::try_get_local_sortable_id(uint64_t* sortable_id, uint8_t user, uint64_t current_seconds) const noexcept
 {
     uint8_t label = 0;
     uint32_t seq = 0;
-    get_label_and_seq(&label, &seq, num);
+    if ((_id_cache != NULL) && (0 == current_seconds))
+    {
+        struct IdSlice* slice = &get_thread_context()->slice;
+        const int errcode = _id_cache->get(slice, time(NULL), &label, &seq, get_error_buffer());
+        if (errcode != 0)
+            return errcode;
+        *sortable_id = encode_sortable_id(user, label, seq, slice->hour);
+        return 0;
+    }
 
-    struct tm now;
-    time_t current_time = (0 == current_seconds)? time(NULL): current_seconds;
-    localtime_r(&current_time, &now);
+    const uint32_t hour = get_base_hours(current_seconds);
+    const int errcode = get_label_and_hour_seq(&label, &seq, 1, hour, get_error_buffer());
+    if (errcode != 0)
+        return errcode;
 
-    union UniqID uniq_id;
-    uniq_id.id.user = user;
-    uniq_id.id.label = label;
-    uniq_id.id.year = (now.tm_year+1900) - MU_BASE_YEAR;
-    uniq_id.id.month = now.tm_mon+1;
-    uniq_id.id.day = now.tm_mday;
-    uniq_id.id.hour = now.tm_hour;
+    *sortable_id = encode_sortable_id(user, label, seq, hour);
+    return 0;
+}
+
+int CMuidor::try_get_local_sortable_id(uint16_t num, std::vector<uint64_t>* id_vec, uint8_t user, uint64_t current_seconds) const noexcept
+{
+    uint8_t label = 0;
+    uint32_t seq = 0;
+    const uint32_t hour = get_base_hours(current_seconds);
+    const int errcode = get_label_and_hour_seq(&label, &seq, num, hour, get_error_buffer());
+    if (errcode != 0)
+        return errcode;
 
     for (uint16_t i=0; i<num; ++i)
     {
-        uniq_id.id.seq = seq++;
-        id_vec->push_back(uniq_id.value);
+        id_vec->push_back(encode_sortable_id(user, label, seq++, hour));
     }
+    return 0;
 }
 
-void CMuidor::get_label_and_seq(uint8_t* label, uint32_t* seq, uint16_t num) const
+int CMuidor::try_get_uuid(struct UUID128* uuid) const noexcept
+{
+    return try_get_uuid(1, uuid);
+}
+
+int CMuidor::try_get_uuid(uint16_t num, struct UUID128* uuid_buffer) const noexcept
 {
-    const uint32_t echo = get_echo(_echo);
-    char response_buffer[1 + sizeof(struct MessageHead)]; // 故意多出一字节，以过滤掉包大小不同的脏数据
-    struct MessageHead* response = reinterpret_cast<struct MessageHead*>(response_buffer);
+    uint8_t label = 0;
+    uint32_t seq = 0;
+    const int errcode = try_get_label_and_seq(&label, &seq, num);
+    if (errcode != 0)
+        return errcode;
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    const uint64_t milliseconds = static_cast<uint64_t>(tv.tv_sec) * 1000 + tv.tv_usec / 1000;
+
+    // 参数num值为0或1均表示只取一个
+    const uint16_t num_ = (0 == num)? 1: num;
+    for (uint16_t i=0; i<num_; ++i)
+    {
+        encode_uuid(label, seq++, milliseconds, get_random64(), &uuid_buffer[i]);
+    }
+    return 0;
+}
+
+int CMuidor::try_get_label_and_seq(uint8_t* label, uint32_t* seq, uint16_t num) const noexcept
+{
+    struct MessageHead response;
     struct MessageHead request;
     request.len = sizeof(request);
     request.type = REQUEST_LABEL_AND_SEQ;
-    request.echo = echo;
     request.value1 = num;
     request.value2 = 0;
     request.value3 = 0;
-    request.update_magic();
-    _echo = echo + 1;
 
-    for (uint8_t retry=0; retry<_retry_times+1; ++retry)
+    const int errcode = call_agent(&request, &response, RESPONSE_LABEL_AND_SEQ, get_error_buffer());
+    if (0 == errcode)
     {
-        const struct sockaddr_in& agent_addr = pick_agent();
+        *label = static_cast<uint8_t>(response.value1.to_int());
+        *seq = static_cast<uint32_t>(response.value2.to_int());
+    }
+    return errcode;
+}
 
-        try
-        {
-            struct sockaddr_in from_addr;
-            int bytes = _udp_socket->send_to(&request, sizeof(request), agent_addr);
-            if (bytes != sizeof(request))
-            {
-                THROW_SYSCALL_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s] invalid size", mooon::net::to_string(agent_addr).c_str()),
-                        bytes, "send_to");
-            }
+// 从hour（get_base_hours的值）小时的seq中取，每小时有完整的29位，用于组装UniqID和SortableID，
+// 老版本的agent忽略value2和value3，同get_label_and_seq
+int CMuidor::get_label_and_hour_seq(uint8_t* label, uint32_t* seq, uint16_t num, uint32_t hour, struct MuError* error) const
+{
+    struct MessageHead response;
+    struct MessageHead request;
+    request.len = sizeof(request);
+    request.type = REQUEST_LABEL_AND_SEQ;
+    request.value1 = num;
+    request.value2 = SEQ_HOURLY;
+    request.value3 = hour;
 
-            bytes = _udp_socket->timed_receive_from(response, sizeof(response_buffer), &from_addr, _timeout_milliseconds);
-            if (bytes != sizeof(struct MessageHead))
-            {
-                THROW_SYSCALL_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s] invalid size", mooon::net::to_string(from_addr).c_str()),
-                        bytes, "receive_from");
-            }
-            else if (memcmp(&agent_addr, &from_addr, sizeof(struct sockaddr_in)) != 0)
-            {
-                THROW_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s][AGENT:%s] unexcepted response",
-                                mooon::net::to_string(from_addr).c_str(), mooon::net::to_string(agent_addr).c_str()),
-                        MUE_UNEXCEPTED);
-            }
-            else if (RESPONSE_ERROR == response->type)
-            {
-                THROW_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s] store sequence block error: %s",
-                                mooon::net::to_string(from_addr).c_str(), response->str().c_str()),
-                        static_cast<int>(response->value1.to_int()));
-            }
-            else if (response->type != RESPONSE_LABEL_AND_SEQ)
-            {
-                THROW_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s] error response label and sequence: %s",
-                                mooon::net::to_string(from_addr).c_str(), response->str().c_str()),
-                        response->type.to_int());
-            }
-            else if (response->echo.to_int() != echo)
-            {
-                THROW_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s] mismatch response label and sequence: %s|%u",
-                                mooon::net::to_string(from_addr).c_str(), response->str().c_str(), echo),
-                        MUE_MISMATCH);
-            }
-            else
-            {
-#if _CHECK_MAGIC_ == 1
-                const uint32_t magic_ = response->calc_magic();
-                //fprintf(stderr, "%s|%u\n", response->str().c_str(), magic_);
-                if (magic_ != response->magic)
-                {
-                    THROW_EXCEPTION(
-                            mooon::utils::CStringUtils::format_string("[muidor][%s] illegal response: %s|%u",
-                                    mooon::net::to_string(from_addr).c_str(), response->str().c_str(), magic_),
-                            MUE_ILLEGAL);
-                }
-#endif // _CHECK_MAGIC_
+    const int errcode = call_agent(&request, &response, RESPONSE_LABEL_AND_SEQ, error);
+    if (0 == errcode)
+    {
+        *label = static_cast<uint8_t>(response.value1.to_int());
+        *seq = static_cast<uint32_t>(response.value2.to_int());
+    }
+    return errcode;
+}
 
-                const uint32_t label_ = response->value1.to_int();
-                if ((label_ >= 0xFF) || (label_ < 1))
-                {
-                    THROW_EXCEPTION(
-                            mooon::utils::CStringUtils::format_string("[muidor][%s] invalid label from master: %s",
-                                mooon::net::to_string(from_addr).c_str(), response->str().c_str()),
-                        MUE_INVALID_LABEL);
-                }
+int CMuidor::try_get_tag_seq(uint64_t* value, uint32_t tag, uint16_t num, uint16_t* count) const noexcept
+{
+    struct MessageHead response;
+    struct MessageHead request;
+    request.len = sizeof(request);
+    request.type = REQUEST_TAG_SEQ;
+    request.value1 = tag;
+    request.value2 = num;
+    request.value3 = 0;
 
-                *label = static_cast<uint8_t>(label_);
-                *seq = static_cast<uint32_t>(response->value2.to_int());
-                break;
-            }
-        }
-        catch (mooon::sys::CSyscallException& ex)
-        {
-            if ((0 == _retry_times) || (retry+1 >= _retry_times))
-            {
-                if (ex.errcode() != ETIMEDOUT)
-                    throw;
+    const int errcode = call_agent(&request, &response, RESPONSE_TAG_SEQ, get_error_buffer());
+    if (0 == errcode)
+    {
+        if (count != NULL)
+            *count = static_cast<uint16_t>(response.value2.to_int());
+        *value = response.value3.to_int();
+    }
+    return errcode;
+}
 
-                THROW_SYSCALL_EXCEPTION(
-                        mooon::utils::CStringUtils::format_string("[muidor][%s] receive timeout", mooon::net::to_string(agent_addr).c_str()),
-                        ETIMEDOUT, "timed_receive_from");
-            }
-        }
-        catch (mooon::utils::CException&)
+int CMuidor::try_inc_counter(uint64_t* value, const std::string& name, uint16_t num, uint16_t* count) const noexcept
+{
+    if (name.empty() || (name.size() > COUNTER_NAME_MAX))
+    {
+        return set_error(get_error_buffer(), MUE_PARAMETER, "invalid counter name", NULL);
+    }
+
+    struct MessageHead response;
+    struct CounterRequest request;
+    request.head.len = static_cast<uint16_t>(sizeof(request.head) + name.size());
+    request.head.type = REQUEST_COUNTER;
+    request.head.value1 = crc32(0, name.data(), name.size());
+    request.head.value2 = num;
+    request.head.value3 = 0;
+    memcpy(request.name, name.data(), name.size());
+
+    const int errcode = call_agent(&request.head, &response, RESPONSE_COUNTER, get_error_buffer());
+    if (0 == errcode)
+    {
+        if (count != NULL)
+            *count = static_cast<uint16_t>(response.value2.to_int());
+        *value = response.value3.to_int();
+    }
+    return errcode;
+}
+
+// 本线程最近使用的字符串format及其编译结果，连续使用同一format（通常如此）时不再编译，组装时也重复使用同一个batch
+struct TransactionIdCache
+{
+    std::string format;
+    CTransactionIdFormat compiled_format;
+    CTransactionIdBatch batch;
+};
+
+static __thread struct TransactionIdCache* tls_transaction_id_cache = NULL; // 首次使用时创建
+
+// format无效时返回NULL，出错的详情见get_last_error()
+static struct TransactionIdCache* get_transaction_id_cache(const char* format)
+{
+    if (NULL == tls_transaction_id_cache)
+    {
+        tls_transaction_id_cache = new struct TransactionIdCache;
+    }
+
+    struct TransactionIdCache* cache = tls_transaction_id_cache;
+    if (cache->format != format)
+    {
+        if (cache->compiled_format.compile(format) != 0)
         {
-            if ((0 == _retry_times) || (retry+1 >= _retry_times))
-                throw;
+            cache->format.clear(); // 编译失败时compiled_format为空，和空的format一致
+            return NULL;
         }
+        cache->format = format;
     }
+    return cache;
 }
 
 // %Y 年份 %M 月份 %D 日期 %H 小时 %m 分钟 %S Sequence %L Label %d 4字节十进制整数 %s 字符串 %X 十六进制
@@ -715,13 +780,10 @@ std::string CMuidor::get_transaction_id(const char* format, ...) const
 
 std::string CMuidor::vget_transaction_id(const char* format, va_list& va) const
 {
-    std::vector<std::string> id_vec;
-    vget_transaction_id(1, &id_vec, format, va);
-
-    if (!id_vec.empty())
-        return id_vec[0];
-    else
-        return std::string("");
+    std::string transaction_id;
+    if (try_vget_transaction_id(&transaction_id, format, va) != 0)
+        throw_error(*tls_last_error);
+    return transaction_id;
 }
 
 void CMuidor::get_transaction_id(uint16_t num, std::vector<std::string>* id_vec, const char* format, ...) const
@@ -735,141 +797,1075 @@ void CMuidor::get_transaction_id(uint16_t num, std::vector<std::string>* id_vec,
 
 void CMuidor::vget_transaction_id(uint16_t num, std::vector<std::string>* id_vec, const char* format, va_list& va) const
 {
-    char *s;
-    int m, width;
+    if (try_vget_transaction_id(num, id_vec, format, va) != 0)
+        throw_error(*tls_last_error);
+}
+
+void CMuidor::get_transaction_id(uint16_t num, CTransactionIdBatch* batch, const CTransactionIdFormat* format, ...) const
+{
+    va_list ap;
+    va_start(ap, format);
+    mooon::utils::VaListHelper vlh(ap);
+
+    vget_transaction_id(num, batch, format, ap);
+}
+
+void CMuidor::vget_transaction_id(uint16_t num, CTransactionIdBatch* batch, const CTransactionIdFormat* format, va_list& va) const
+{
+    if (try_vget_transaction_id(num, batch, format, va) != 0)
+        throw_error(*tls_last_error);
+}
+
+int CMuidor::try_get_transaction_id(std::string* transaction_id, const char* format, ...) const noexcept
+{
+    va_list ap;
+    va_start(ap, format);
+    mooon::utils::VaListHelper vlh(ap);
+
+    return try_vget_transaction_id(transaction_id, format, ap);
+}
+
+int CMuidor::try_vget_transaction_id(std::string* transaction_id, const char* format, va_list& va) const noexcept
+{
+    std::vector<std::string> id_vec;
+    const int errcode = try_vget_transaction_id(1, &id_vec, format, va);
+    if (0 == errcode)
+        *transaction_id = id_vec.empty()? std::string(""): id_vec[0];
+    return errcode;
+}
+
+int CMuidor::try_get_transaction_id(uint16_t num, std::vector<std::string>* id_vec, const char* format, ...) const noexcept
+{
+    va_list ap;
+    va_start(ap, format);
+    mooon::utils::VaListHelper vlh(ap);
+
+    return try_vget_transaction_id(num, id_vec, format, ap);
+}
+
+// format无效时不向agent取seq
+int CMuidor::try_vget_transaction_id(uint16_t num, std::vector<std::string>* id_vec, const char* format, va_list& va) const noexcept
+{
+    struct TransactionIdCache* cache = get_transaction_id_cache(format);
+    if (NULL == cache)
+        return tls_last_error->errcode;
+
+    const int errcode = try_vget_transaction_id(num, &cache->batch, &cache->compiled_format, va);
+    if (0 == errcode)
+    {
+        const CTransactionIdBatch& batch = cache->batch;
+        id_vec->reserve(id_vec->size() + batch.size());
+        for (size_t i=0; i<batch.size(); ++i)
+            id_vec->push_back(std::string(batch.data(i), batch.length(i)));
+    }
+    return errcode;
+}
+
+int CMuidor::try_get_transaction_id(uint16_t num, CTransactionIdBatch* batch, const CTransactionIdFormat* format, ...) const noexcept
+{
+    va_list ap;
+    va_start(ap, format);
+    mooon::utils::VaListHelper vlh(ap);
+
+    return try_vget_transaction_id(num, batch, format, ap);
+}
+
+int CMuidor::try_vget_transaction_id(uint16_t num, CTransactionIdBatch* batch, const CTransactionIdFormat* format, va_list& va) const noexcept
+{
     uint8_t label;
     uint32_t seq;
-    get_label_and_seq(&label, &seq, num);
+    const int errcode = try_get_label_and_seq(&label, &seq, num);
+    if (0 == errcode)
+        format->vrender(label, seq, num, batch, va);
+    return errcode;
+}
 
-    struct tm now;
-    time_t current_time = time(NULL);
-    localtime_r(&current_time, &now);
+std::string CMuidor::format_transaction_id(uint8_t label, uint32_t seq, const char* format, ...)
+{
+    struct TransactionIdCache* cache = get_transaction_id_cache(format);
+    if (NULL == cache)
+        throw_error(*tls_last_error);
 
-    for (uint16_t i=0; i<num; ++i, ++seq)
+    va_list ap;
+    va_start(ap, format);
+    mooon::utils::VaListHelper vlh(ap);
+
+    cache->compiled_format.vrender(label, seq, 1, &cache->batch, ap);
+    return cache->batch.str(0);
+}
+
+// 在agent的已连接socket上等待echo匹配的应答，直到deadline（单调时钟的毫秒数），
+// 对冲时同时等待两个socket，which返回收到应答的socket的下标。
+// echo不同的是之前超时的请求迟到的应答，丢弃后继续等待；
+// 一个socket出错（如对端端口不可达，内核通过已连接的socket报告）时只等待另一个。
+// 返回应答的字节数，超时返回-1且errno为ETIMEDOUT，都出错时返回-1
+static int wait_response(CDatagramSocket* const* sockets, int num_sockets, uint32_t echo,
+                         char* buffer, size_t buffer_size, uint64_t deadline, int* which)
+{
+    struct pollfd fds[2];
+    int errcode = ETIMEDOUT;
+
+    for (int i=0; i<num_sockets; ++i)
+    {
+        fds[i].fd = sockets[i]->get_fd();
+        fds[i].events = POLLIN;
+        fds[i].revents = 0;
+    }
+    while (true)
+    {
+        // 先不等待地收，有数据时省掉一次poll
+        int num_alive = 0;
+        for (int i=0; i<num_sockets; ++i)
+        {
+            while (fds[i].fd != -1)
+            {
+                const ssize_t bytes = sockets[i]->receive(buffer, buffer_size);
+                if (-1 == bytes)
+                {
+                    if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+                    {
+                        errcode = errno;
+                        fds[i].fd = -1; // poll忽略负的fd
+                    }
+                    break;
+                }
+                if ((bytes >= static_cast<ssize_t>(sizeof(struct MessageHead))) &&
+                    (reinterpret_cast<const struct MessageHead*>(buffer)->echo.to_int() != echo))
+                {
+                    ++mu_metric.mismatch_echo;
+                    continue;
+                }
+
+                *which = i;
+                return static_cast<int>(bytes);
+            }
+            if (fds[i].fd != -1)
+                ++num_alive;
+        }
+        if (0 == num_alive)
+        {
+            errno = errcode;
+            return -1;
+        }
+
+        const uint64_t now = get_monotonic_microseconds() / 1000;
+        if (now >= deadline)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if ((-1 == poll(fds, num_sockets, static_cast<int>(deadline - now))) && (errno != EINTR))
+        {
+            return -1;
+        }
+    }
+}
+
+// 向agent发送请求并接收响应，失败时改从其它agent取，
+// 只有响应类型为response_type且magic正确时才返回0，否则重试，重试完仍失败则返回错误码，出错的上下文记录在error中
+int CMuidor::call_agent(struct MessageHead* request, struct MessageHead* response, uint16_t response_type, struct MuError* error) const
+{
+    struct ThreadContext* context = get_thread_context();
+    const uint32_t echo = get_echo();
+    request->echo = echo;
+    request->update_magic();
+
+    for (uint8_t retry=0; retry<_retry_times+1; ++retry)
     {
-        std::stringstream result;
-        va_list ap;
-        va_copy(ap, va);
-        mooon::utils::VaListHelper vlh(ap);
+        const int errcode = call_agent_once(context, request, response, response_type, retry, error);
+        if (0 == errcode)
+        {
+            MU_PROBE3(client_response, response_type, echo, 0);
+            return 0;
+        }
 
-        const char* format_p = format;
-        while (*format_p != '\0')
+        // 在重试之前不返回错误
+        if ((0 == _retry_times) || (retry+1 >= _retry_times))
         {
-            if (*format_p != '%')
+            MU_PROBE3(client_response, response_type, echo, errcode);
+            if (NULL == error->syscall)
+            {
+                ++mu_metric.exception;
+            }
+            else if (ETIMEDOUT == errcode)
             {
-                result << *format_p++;
+                ++mu_metric.receive_timeout;
+                error->what = "receive timeout";
             }
             else
             {
-                ++format_p; // 跳过'%'
+                ++mu_metric.sys_exception;
+            }
+            return errcode;
+        }
 
-                if ('\0' == *format_p)
+        if (NULL == error->syscall)
+            ++mu_metric.exception;
+        else
+            ++mu_metric.sys_exception;
+        ++mu_metric.retry_times;
+        MU_PROBE4(client_retry, response_type, echo, retry, errcode);
+    }
+
+    return error->errcode;
+}
+
+// 向一个agent（对冲时两个）发出请求并等待应答，成功返回0，
+// 超时、发送失败等系统调用的出错计入agent的出错率，连续多次时熔断
+int CMuidor::call_agent_once(struct ThreadContext* context, const struct MessageHead* request, struct MessageHead* response,
+                             uint16_t response_type, uint8_t retry, struct MuError* error) const
+{
+    char response_buffer[1 + sizeof(struct MessageHead) + sizeof(struct LoadHint)]; // 故意多出一字节，以过滤掉包大小不同的脏数据
+    const struct MessageHead* response_ = reinterpret_cast<const struct MessageHead*>(response_buffer);
+    const uint32_t echo = request->echo.to_int();
+    const uint32_t agent_index = pick_agent(&context->cursor);
+    const struct sockaddr_in& agent_addr = _agents_addr[agent_index];
+    uint32_t hedge_index = agent_index; // 对冲请求发往的agent，不对冲时同agent_index
+    (void)retry; // 只用于探针，没有探针时未使用
+
+    // 下标0为agent_index的socket，1为对冲的
+    CDatagramSocket* sockets[2];
+    int num_sockets = 1;
+    int which = 0;
+    sockets[0] = get_agent_socket(context, agent_index);
+    if (NULL == sockets[0])
+    {
+        return set_error(error, errno, "create socket failed", "socket", &agent_addr);
+    }
+
+    // 请求的消息头后可能还跟着数据（如计数器名），大小以len为准
+    const int request_size = request->len.to_int();
+    const uint64_t send_time = get_monotonic_microseconds();
+    uint64_t hedge_time = 0;
+    MU_PROBE5(client_request, request->type.to_int(), echo, agent_addr.sin_addr.s_addr, agent_addr.sin_port, retry);
+    int bytes = static_cast<int>(sockets[0]->send(request, request_size));
+    if (bytes != request_size)
+    {
+        ++mu_metric.send_error;
+        record_failure(agent_index);
+        return set_error(error, (-1 == bytes)? errno: bytes, "send failed", "send", &agent_addr);
+    }
+
+    const uint64_t deadline = send_time / 1000 + _timeout_milliseconds;
+    const uint32_t hedge_milliseconds = get_hedge_milliseconds(agent_index);
+    if (hedge_milliseconds >= _timeout_milliseconds)
+    {
+        bytes = wait_response(sockets, num_sockets, echo, response_buffer, sizeof(response_buffer), deadline, &which);
+    }
+    else
+    {
+        bytes = wait_response(sockets, num_sockets, echo, response_buffer, sizeof(response_buffer), send_time / 1000 + hedge_milliseconds, &which);
+        if ((-1 == bytes) && (ETIMEDOUT == errno))
+        {
+            // 同一请求（echo不变）再发给之后第一个可用的agent，之后两者的应答都接受，
+            // 发送失败时只计数，仍等待第一个agent，没有可用的agent时不对冲
+            hedge_index = pick_hedge_agent(agent_index);
+            if (hedge_index != agent_index)
+            {
+                sockets[1] = get_agent_socket(context, hedge_index);
+                if (sockets[1] != NULL)
                 {
-                    // format error
-                    THROW_EXCEPTION("[muidor] invalid `format` parameter", MUE_PARAMETER);
+                    hedge_time = get_monotonic_microseconds();
+                    ++num_sockets;
+                    ++mu_metric.hedge_requests;
+                    MU_PROBE4(client_hedge, request->type.to_int(), echo,
+                              _agents_addr[hedge_index].sin_addr.s_addr, _agents_addr[hedge_index].sin_port);
+                    if (sockets[1]->send(request, request_size) != request_size)
+                        ++mu_metric.send_error;
                 }
-                else
-                {
-                    if ((*format_p >= '0') && (*format_p <= '9'))
-                    {
-                        width = *format_p - '0';
-                        ++format_p; // 跳过width
-
-                        if ('S' == *format_p) // Sequence
-                        {
-                            result << std::dec << std::setw(width) << std::setfill('0') << mooon::utils::CIntegerUtils::dec_with_width(seq, width);
-                        }
-                        else if ('d' == *format_p) // integer
-                        {
-                            m = va_arg(ap, int);
-                            result << std::dec << std::setw(width) << std::setfill('0') << mooon::utils::CIntegerUtils::dec_with_width(m, width);
-                        }
-                        else if ('X' == *format_p)
-                        {
-                            m = va_arg(ap, int);
-                            result << std::hex << std::setw(width) << std::setfill('0') << std::uppercase << mooon::utils::CIntegerUtils::hex_with_width(m, width);
-                        }
-                        else
-                        {
-                            // format error
-                            THROW_EXCEPTION("[muidor] invalid `format` parameter", MUE_PARAMETER);
-                        }
-
-                        ++format_p;
-                    }
-                    else
-                    {
-                        switch (*format_p)
-                        {
-                        case 'd': // integer
-                            m = va_arg(ap, int);
-                            result << std::dec << m;
-                            break;
-                        case 'X': // integer
-                            m = va_arg(ap, int);
-                            result << std::hex << std::uppercase << m;
-                            break;
-                        case 's': // string
-                            s = va_arg(ap, char *);
-                            result << s;
-                            break;
-                        case 'S': // Sequence
-                            result << seq;
-                            break;
-                        case 'L': // Label
-                            result << std::hex << std::setw(2) << std::setfill('0') << std::uppercase << (int)label;
-                            break;
-                        case 'Y': // 年
-                            result << std::dec << std::setw(4) << std::setfill('0') << now.tm_year+1900;
-                            break;
-                        case 'M': // 月
-                            result << std::dec << std::setw(2) << std::setfill('0') << now.tm_mon+1;
-                            break;
-                        case 'D': // 天
-                            result << std::dec << std::setw(2) << std::setfill('0') << now.tm_mday;
-                            break;
-                        case 'H': // 小时
-                            result << std::dec << std::setw(2) << std::setfill('0') << now.tm_hour;
-                            break;
-                        case 'm': // 分钟
-                            result << std::dec << std::setw(2) << std::setfill('0') << now.tm_min;
-                            break;
-                        default:
-                            // format error
-                            THROW_EXCEPTION("[muidor] invalid `format` parameter", MUE_PARAMETER);
-                            break;
-                        } // switch
-
-                        ++format_p;
-                    } // if ((*format_p >= '0') && (*format_p <= '9'))
-                } // if ('\0' == *format_p)
-            } // if (*format_p != '%')
-        } // while
-
-        id_vec->push_back(result.str());
-    } // for
-}
-
-const struct sockaddr_in& CMuidor::pick_agent() const
+            }
+            bytes = wait_response(sockets, num_sockets, echo, response_buffer, sizeof(response_buffer), deadline, &which);
+        }
+    }
+
+    const struct sockaddr_in& from_addr = (0 == which)? agent_addr: _agents_addr[hedge_index];
+    if (-1 == bytes)
+    {
+        const int errcode = errno;
+        record_failure(agent_index);
+        if (num_sockets > 1)
+            record_failure(hedge_index);
+        return set_error(error, errcode, "receive failed", "receive", &agent_addr);
+    }
+    if (((bytes != sizeof(struct MessageHead)) && (bytes != sizeof(struct MessageHead) + sizeof(struct LoadHint))) ||
+        (bytes != response_->len.to_int()))
+    {
+        ++mu_metric.invalid_size;
+        record_failure(agent_index);
+        if (num_sockets > 1)
+            record_failure(hedge_index);
+        return set_error(error, bytes, "invalid size", "receive", &from_addr);
+    }
+    if (RESPONSE_ERROR == response_->type)
+    {
+        ++mu_metric.response_error;
+        return set_response_error(error, static_cast<int>(response_->value1.to_int()), "error response", from_addr, response_, response_type);
+    }
+    if (response_->type != response_type)
+    {
+        if (RESPONSE_LABEL == response_type)
+            ++mu_metric.response_not_label;
+        else if (RESPONSE_UNIQ_ID == response_type)
+            ++mu_metric.error_uniqid;
+        else
+            ++mu_metric.error_sequence;
+        return set_response_error(error, response_->type.to_int(), "error response type", from_addr, response_, response_type);
+    }
+#if _CHECK_MAGIC_ == 1
+    if (response_->calc_magic() != response_->magic)
+    {
+        ++mu_metric.illegal_magic;
+        return set_response_error(error, MUE_ILLEGAL, "illegal response", from_addr, response_, response_type);
+    }
+#endif // _CHECK_MAGIC_
+    if ((RESPONSE_LABEL == response_type) || (RESPONSE_LABEL_AND_SEQ == response_type))
+    {
+        const uint32_t label_ = response_->value1.to_int();
+        if ((label_ >= 0xFF) || (label_ < 1))
+        {
+            ++mu_metric.invalid_label;
+            return set_response_error(error, MUE_INVALID_LABEL, "invalid label from master", from_addr, response_, response_type);
+        }
+    }
+
+    // 新版本的agent在消息头之后附带负载提示
+    const uint16_t load = (bytes > static_cast<int>(sizeof(struct MessageHead)))?
+            reinterpret_cast<const struct LoadHint*>(response_buffer + sizeof(struct MessageHead))->busy.to_int(): 0;
+    const uint64_t receive_time = get_monotonic_microseconds();
+
+    if (1 == which)
+    {
+        // 对冲请求胜出时，第一个agent没有及时应答（其socket也可能已报错，如ECONNREFUSED），
+        // 按失败计，不能记入看似成功的延迟，否则故障的agent永远不会被熔断
+        ++mu_metric.hedge_wins;
+        record_failure(agent_index);
+        record_latency(hedge_index, static_cast<uint32_t>(receive_time - hedge_time));
+        record_success(hedge_index, load);
+    }
+    else
+    {
+        record_latency(agent_index, static_cast<uint32_t>(receive_time - send_time));
+        record_success(agent_index, load);
+    }
+
+    *response = *response_;
+    return 0;
+}
+
+uint32_t CMuidor::get_echo() const
+{
+    uint32_t echo;
+    do {
+        echo = _echo.fetch_add(1, std::memory_order_relaxed);
+    } while (!valid_echo(echo));
+    return echo;
+}
+
+// 返回agent在_agents_addr中的下标，cursor为调用者的轮询游标，
+// 跳过熔断中的agent，随机方式时在随机的两个可用agent中选代价小的
+uint32_t CMuidor::pick_agent(uint32_t* cursor) const
 {
     MOOON_ASSERT(!_agents_addr.empty());
+    const uint32_t num_agents = static_cast<uint32_t>(_agents_addr.size());
+
+    if (1 == num_agents)
+    {
+        return 0;
+    }
+
+    const uint64_t now = get_monotonic_microseconds() / 1000;
+    uint32_t first;
+    if (_polling)
+    {
+        first = (*cursor)++ % num_agents;
+        if (check_agent(first, now) != AGENT_UNAVAILABLE)
+            return first;
+    }
+    else
+    {
+        const uint64_t random = get_random64();
+        first = static_cast<uint32_t>(random % num_agents);
+        uint32_t second = static_cast<uint32_t>((random >> 32) % (num_agents - 1));
+        if (second >= first)
+            ++second;
+
+        // 熔断到期的agent先做半开探测
+        const int first_state = check_agent(first, now);
+        if (AGENT_PROBE == first_state)
+            return first;
+        const int second_state = check_agent(second, now);
+        if (AGENT_PROBE == second_state)
+            return second;
+
+        if ((AGENT_AVAILABLE == first_state) && (AGENT_AVAILABLE == second_state))
+            return (get_agent_cost(second, now) < get_agent_cost(first, now))? second: first;
+        else if (AGENT_AVAILABLE == first_state)
+            return first;
+        else if (AGENT_AVAILABLE == second_state)
+            return second;
+    }
+
+    // 选中的不可用，依次找下一个可用的，都不可用时选熔断最早到期的
+    uint32_t earliest = first;
+    for (uint32_t i=1; i<num_agents; ++i)
+    {
+        const uint32_t index = (first + i) % num_agents;
+        if (check_agent(index, now) != AGENT_UNAVAILABLE)
+            return index;
+        if (_agent_stats[index].open_until.load(std::memory_order_relaxed) <
+            _agent_stats[earliest].open_until.load(std::memory_order_relaxed))
+            earliest = index;
+    }
+    return earliest;
+}
+
+// 对冲请求发往agent_index之后第一个可用的agent，没有时返回agent_index
+uint32_t CMuidor::pick_hedge_agent(uint32_t agent_index) const
+{
+    const uint32_t num_agents = static_cast<uint32_t>(_agents_addr.size());
+    const uint64_t now = get_monotonic_microseconds() / 1000;
+
+    for (uint32_t i=1; i<num_agents; ++i)
+    {
+        const uint32_t index = (agent_index + i) % num_agents;
+        if (check_agent(index, now) != AGENT_UNAVAILABLE)
+            return index;
+    }
+    return agent_index;
+}
+
+// 返回AGENT_UNAVAILABLE、AGENT_AVAILABLE或AGENT_PROBE，now为单调时钟的毫秒数，
+// 熔断到期时只有一个请求能成为半开探测（将到期时间推后一个超时），探测的结果到达前其它请求仍跳过它
+int CMuidor::check_agent(uint32_t agent_index, uint64_t now) const
+{
+    struct AgentStats* stats = &_agent_stats[agent_index];
+    uint64_t open_until = stats->open_until.load(std::memory_order_relaxed);
+
+    if (0 == open_until)
+    {
+        return AGENT_AVAILABLE;
+    }
+    if ((now >= open_until) &&
+        stats->open_until.compare_exchange_strong(open_until, now + _timeout_milliseconds, std::memory_order_relaxed))
+    {
+        return AGENT_PROBE;
+    }
+    return AGENT_UNAVAILABLE;
+}
+
+// 选择的代价：延迟加上按超时率折算的等待时间（微秒），再按负载放大（满负载时翻倍），
+// 长时间没有更新的（通常是代价大而未被选中的）每STATS_DECAY_MILLISECONDS减半，使其能被重新选中以刷新状态
+uint64_t CMuidor::get_agent_cost(uint32_t agent_index, uint64_t now) const
+{
+    const struct AgentStats* stats = &_agent_stats[agent_index];
+    const uint64_t ewma_microseconds = stats->ewma_microseconds.load(std::memory_order_relaxed);
+    const uint64_t error_permille = stats->error_permille.load(std::memory_order_relaxed);
+    const uint64_t load_permille = stats->load_permille.load(std::memory_order_relaxed);
+    const uint64_t updated_time = stats->updated_time.load(std::memory_order_relaxed);
+    const uint64_t cost = (ewma_microseconds + error_permille * _timeout_milliseconds) * (1000 + load_permille) / 1000;
+
+    const uint64_t idle_periods = (now > updated_time)? (now - updated_time) / STATS_DECAY_MILLISECONDS: 0;
+    return (idle_periods >= 64)? 0: (cost >> idle_periods);
+}
+
+// 不对冲时返回值不小于_timeout_milliseconds
+uint32_t CMuidor::get_hedge_milliseconds(uint32_t agent_index) const
+{
+    if ((0 == _hedge_milliseconds) || (_agents_addr.size() < 2))
+    {
+        return _timeout_milliseconds;
+    }
+    if (_hedge_p95)
+    {
+        const uint32_t p95_microseconds = _agent_stats[agent_index].p95_microseconds.load(std::memory_order_relaxed);
+        if (p95_microseconds > 0)
+        {
+            const uint32_t milliseconds = (p95_microseconds + 999) / 1000;
+            return std::min(milliseconds, _hedge_milliseconds);
+        }
+    }
+
+    return _hedge_milliseconds;
+}
+
+// 更新延迟的EWMA，并每LATENCY_SAMPLES个样本更新一次p95，同时将各桶的计数减半，使p95跟随最近的延迟变化，
+// 各线程并发更新时只是近似值，对选择agent和对冲的延迟足够了
+void CMuidor::record_latency(uint32_t agent_index, uint32_t microseconds) const
+{
+    struct AgentStats* stats = &_agent_stats[agent_index];
+    const uint32_t ewma_microseconds = stats->ewma_microseconds.load(std::memory_order_relaxed);
+    if (0 == ewma_microseconds)
+        stats->ewma_microseconds.store(std::max(microseconds, 1U), std::memory_order_relaxed);
+    else
+        stats->ewma_microseconds.store(static_cast<uint32_t>(
+                (static_cast<uint64_t>(ewma_microseconds) * ((1U << EWMA_SHIFT) - 1) + microseconds) >> EWMA_SHIFT), std::memory_order_relaxed);
+
+    stats->counts[get_latency_bucket(microseconds)].fetch_add(1, std::memory_order_relaxed);
+    if (0 == (stats->num_samples.fetch_add(1, std::memory_order_relaxed) + 1) % LATENCY_SAMPLES)
+    {
+        uint32_t counts[LATENCY_BUCKETS];
+        uint32_t total = 0;
+        for (uint32_t i=0; i<LATENCY_BUCKETS; ++i)
+        {
+            counts[i] = stats->counts[i].load(std::memory_order_relaxed);
+            stats->counts[i].store(counts[i] / 2, std::memory_order_relaxed);
+            total += counts[i];
+        }
+
+        const uint32_t rank = total - total / 20;
+        uint32_t accumulated = 0;
+        uint32_t i = 0;
+        for (; i<LATENCY_BUCKETS-1; ++i)
+        {
+            accumulated += counts[i];
+            if (accumulated >= rank)
+                break;
+        }
+        stats->p95_microseconds.store(get_latency_bucket_value(i), std::memory_order_relaxed);
+    }
+}
+
+// 收到agent的有效应答，load为应答中的负载提示，出错率衰减，熔断（包括半开探测）结束
+void CMuidor::record_success(uint32_t agent_index, uint16_t load) const
+{
+    struct AgentStats* stats = &_agent_stats[agent_index];
+    const uint32_t error_permille = stats->error_permille.load(std::memory_order_relaxed);
+    stats->error_permille.store(error_permille - ((error_permille + (1U << EWMA_SHIFT) - 1) >> EWMA_SHIFT), std::memory_order_relaxed);
+    stats->load_permille.store(std::min<uint32_t>(load, 1000), std::memory_order_relaxed);
+    stats->updated_time.store(get_monotonic_microseconds() / 1000, std::memory_order_relaxed);
+    stats->consecutive_failures.store(0, std::memory_order_relaxed);
+    if (stats->open_until.load(std::memory_order_relaxed) != 0)
+    {
+        stats->open_until.store(0, std::memory_order_relaxed);
+        stats->open_times.store(0, std::memory_order_relaxed);
+    }
+}
+
+// 超时或发送失败，连续BREAKER_FAILURES次后熔断，
+// 熔断后迟到的失败（熔断前已发出的请求）不会再延长熔断，半开探测失败时熔断时长加倍
+void CMuidor::record_failure(uint32_t agent_index) const
+{
+    struct AgentStats* stats = &_agent_stats[agent_index];
+    const uint64_t now = get_monotonic_microseconds() / 1000;
+    const uint32_t error_permille = stats->error_permille.load(std::memory_order_relaxed);
+    stats->error_permille.store(error_permille + ((1000 - error_permille) >> EWMA_SHIFT), std::memory_order_relaxed);
+    stats->updated_time.store(now, std::memory_order_relaxed);
+
+    if ((stats->consecutive_failures.fetch_add(1, std::memory_order_relaxed) + 1 >= BREAKER_FAILURES) && (_agents_addr.size() > 1))
+    {
+        uint64_t open_until = stats->open_until.load(std::memory_order_relaxed);
+        if (open_until <= now + _timeout_milliseconds)
+        {
+            const uint32_t shift = std::min<uint32_t>(stats->open_times.load(std::memory_order_relaxed), BREAKER_OPEN_MAX_SHIFT);
+            const uint64_t open_milliseconds = std::max<uint64_t>(BREAKER_OPEN_MILLISECONDS << shift, 2 * _timeout_milliseconds);
+            if (stats->open_until.compare_exchange_strong(open_until, now + open_milliseconds, std::memory_order_relaxed))
+            {
+                stats->open_times.fetch_add(1, std::memory_order_relaxed);
+                ++mu_metric.circuit_opens;
+            }
+        }
+    }
+}
+
+// 取当前线程在这个实例上的上下文，首次使用时创建socket，
+// 只在未命中时加锁（每个线程每个实例一次），同时清理已析构实例的上下文
+struct ThreadContext* CMuidor::get_thread_context() const
+{
+    if ((tls_last_context != NULL) && (_instance == tls_last_context->instance))
+    {
+        return tls_last_context;
+    }
+    if (NULL == tls_contexts)
+    {
+        static const int key_errcode = pthread_key_create(&g_contexts_key, release_thread_contexts);
+        tls_contexts = new std::vector<struct ThreadContext>;
+        if (0 == key_errcode)
+            (void)pthread_setspecific(g_contexts_key, tls_contexts);
+    }
+    for (std::vector<struct ThreadContext>::size_type i=0; i<tls_contexts->size(); ++i)
+    {
+        if (_instance == (*tls_contexts)[i].instance)
+        {
+            tls_last_context = &(*tls_contexts)[i];
+            return tls_last_context;
+        }
+    }
+
+    mooon::sys::LockHelper<mooon::sys::CLock> lh(g_instances_lock);
+    for (std::vector<struct ThreadContext>::iterator iter=tls_contexts->begin(); iter!=tls_contexts->end();)
+    {
+        if (g_instances.count(iter->instance) > 0)
+            ++iter;
+        else
+            iter = tls_contexts->erase(iter);
+    }
+
+    struct ThreadContext context;
+    context.instance = _instance;
+    context.agent_sockets.resize(_agents_addr.size(), NULL);
+    context.cursor = static_cast<uint32_t>(get_random64()); // 各线程从不同的agent开始轮询
+    tls_contexts->push_back(context);
+    tls_last_context = &tls_contexts->back();
+    return tls_last_context;
+}
+
+// 线程发往一个agent的socket，非阻塞且connect到该agent，
+// 内核只收来自该agent的报文，发送时也不必每次查路由，创建失败返回NULL并设置errno
+CDatagramSocket* CMuidor::get_agent_socket(struct ThreadContext* context, uint32_t agent_index) const
+{
+    CDatagramSocket* agent_socket = context->agent_sockets[agent_index];
+    if (agent_socket != NULL)
+    {
+        return agent_socket;
+    }
+
+    agent_socket = new CDatagramSocket;
+    if ((-1 == agent_socket->open(true)) || (-1 == agent_socket->connect(_agents_addr[agent_index])))
+    {
+        const int errcode = errno;
+        delete agent_socket;
+        errno = errcode;
+        return NULL;
+    }
+
+    mooon::sys::LockHelper<mooon::sys::CLock> lh(g_instances_lock);
+    _udp_sockets.push_back(agent_socket);
+    context->agent_sockets[agent_index] = agent_socket;
+    return agent_socket;
+}
+
+// 关闭线程在这个实例上的socket并从_udp_sockets中移除，调用时已持有g_instances_lock
+void CMuidor::release_thread_context(struct ThreadContext* context) const
+{
+    for (std::vector<CDatagramSocket*>::size_type i=0; i<context->agent_sockets.size(); ++i)
+    {
+        CDatagramSocket* agent_socket = context->agent_sockets[i];
+        if (agent_socket != NULL)
+        {
+            std::vector<CDatagramSocket*>::iterator iter = std::find(_udp_sockets.begin(), _udp_sockets.end(), agent_socket);
+            if (iter != _udp_sockets.end())
+                _udp_sockets.erase(iter);
+            delete agent_socket;
+        }
+    }
+}
 
-    if (1 == _agents_addr.size())
+// 线程退出时调用（g_contexts_key的析构函数），释放线程的所有上下文，
+// 已析构实例上的socket已由实例关闭，只需关闭未析构实例上的
+void CMuidor::release_thread_contexts(void* contexts)
+{
+    std::vector<struct ThreadContext>* thread_contexts = static_cast<std::vector<struct ThreadContext>*>(contexts);
     {
-        return _agents_addr[0];
+        mooon::sys::LockHelper<mooon::sys::CLock> lh(g_instances_lock);
+        for (std::vector<struct ThreadContext>::size_type i=0; i<thread_contexts->size(); ++i)
+        {
+            std::map<uint64_t, const CMuidor*>::const_iterator iter = g_instances.find((*thread_contexts)[i].instance);
+            if (iter != g_instances.end())
+                iter->second->release_thread_context(&(*thread_contexts)[i]);
+        }
     }
-    else if (_polling)
+
+    // 之后的线程局部对象的析构中仍可能使用CMuidor，届时重新创建
+    if (tls_contexts == thread_contexts)
     {
-        static uint32_t factor = 0;
-        register uint32_t index = factor++;
-        return _agents_addr[index % _agents_addr.size()];
+        tls_contexts = NULL;
+        tls_last_context = NULL;
+    }
+    delete thread_contexts;
+}
+
+//
+// CTransactionIdFormat
+//
+
+// 00到99的两位十进制数字，写十进制数时每次写两位
+static const char g_dec_digit_pairs[] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+static const char g_hex_digits[] = "0123456789ABCDEF";
+
+// 指定宽度时的取模值（同mooon::utils::CIntegerUtils的dec_with_width和hex_with_width），
+// 宽度为N时为N个9（%NX时为0x加N个9），保持和原来的实现相同的结果
+static const uint64_t g_dec_width_mods[] = { 0ULL, 9ULL, 99ULL, 999ULL, 9999ULL, 99999ULL, 999999ULL, 9999999ULL, 99999999ULL, 999999999ULL };
+static const uint64_t g_hex_width_mods[] = { 0x0ULL, 0x9ULL, 0x99ULL, 0x999ULL, 0x9999ULL, 0x99999ULL, 0x999999ULL, 0x9999999ULL, 0x99999999ULL, 0x999999999ULL };
+
+enum
+{
+    MAX_DEC_DIGITS = 10, // uint32_t的十进制最多10位
+    MAX_HEX_DIGITS = 8   // uint32_t的十六进制最多8位
+};
+
+static int count_dec_digits(uint64_t value)
+{
+    int digits = 1;
+    for (; value >= 100; value /= 100)
+        digits += 2;
+    return (value >= 10)? digits+1: digits;
+}
+
+// 写十进制数，不足width位时以0填充，返回写入后的位置
+static char* write_dec(char* p, uint64_t value, int width)
+{
+    const int digits = count_dec_digits(value);
+    char* end = p + ((digits > width)? digits: width);
+    char* q = end;
+
+    for (; value >= 100; value /= 100)
+    {
+        q -= 2;
+        memcpy(q, &g_dec_digit_pairs[(value % 100) * 2], 2);
+    }
+    if (value >= 10)
+    {
+        q -= 2;
+        memcpy(q, &g_dec_digit_pairs[value * 2], 2);
     }
     else
     {
-        static unsigned int i = 0;
-        register std::vector<struct sockaddr_in>::size_type index = mooon::sys::CUtils::get_random_number(i++, _agents_addr.size());
-        return _agents_addr[index];
+        *--q = static_cast<char>('0' + value);
+    }
+    while (q > p)
+        *--q = '0';
+    return end;
+}
+
+// 写大写的十六进制数，不足width位时以0填充，返回写入后的位置
+static char* write_hex(char* p, uint64_t value, int width)
+{
+    int digits = 1;
+    for (uint64_t m=value>>4; m!=0; m>>=4)
+        ++digits;
+    if (digits < width)
+        digits = width;
+
+    char* q = p + digits;
+    do
+    {
+        *--q = g_hex_digits[value & 0xF];
+        value >>= 4;
+    } while (q > p);
+    return p + digits;
+}
+
+CTransactionIdFormat::CTransactionIdFormat()
+    : _has_time(false), _has_minute(false)
+{
+}
+
+CTransactionIdFormat::CTransactionIdFormat(const char* format)
+    : _has_time(false), _has_minute(false)
+{
+    if (compile(format) != 0)
+        throw_error(*tls_last_error);
+}
+
+// 原来的实现以std::stringstream组装，%L和%X将它置为十六进制后，之后不带宽度的%S也输出为十六进制，
+// 直到%d、%NS或时间将它置回十进制，编译时按位置确定每个%S的进制，保持输出不变
+int CTransactionIdFormat::compile(const char* format)
+{
+    bool hex = false; // 原实现中std::stringstream当前的进制
+    const char* format_p = format;
+
+    reset();
+    while (*format_p != '\0')
+    {
+        if (*format_p != '%')
+        {
+            // 相邻的普通字符合并为一个操作
+            const char* literal = format_p;
+            while ((*format_p != '\0') && (*format_p != '%'))
+                ++format_p;
+
+            struct Op op;
+            op.type = OP_LITERAL;
+            op.width = 0;
+            op.offset = static_cast<uint32_t>(_literals.size());
+            op.length = static_cast<uint32_t>(format_p - literal);
+            _literals.append(literal, op.length);
+            _ops.push_back(op);
+            continue;
+        }
+
+        struct Op op;
+        op.width = 0;
+        op.offset = 0;
+        op.length = 0;
+        ++format_p; // 跳过'%'
+
+        if ((*format_p >= '1') && (*format_p <= '9'))
+        {
+            op.width = static_cast<uint8_t>(*format_p - '0');
+            ++format_p; // 跳过width
+
+            if ('S' == *format_p) // Sequence
+            {
+                op.type = OP_SEQ_DEC;
+                hex = false;
+            }
+            else if ('d' == *format_p) // integer
+            {
+                op.type = OP_INT_DEC;
+                hex = false;
+            }
+            else if ('X' == *format_p)
+            {
+                op.type = OP_INT_HEX;
+                hex = true;
+            }
+            else
+            {
+                // format error（包括宽度为0）
+                reset();
+                return set_error(get_error_buffer(), MUE_PARAMETER, "invalid `format` parameter", NULL);
+            }
+        }
+        else
+        {
+            switch (*format_p)
+            {
+            case 'd': // integer
+                op.type = OP_INT_DEC;
+                hex = false;
+                break;
+            case 'X': // integer
+                op.type = OP_INT_HEX;
+                hex = true;
+                break;
+            case 's': // string
+                op.type = OP_STRING;
+                break;
+            case 'S': // Sequence
+                op.type = hex? OP_SEQ_HEX: OP_SEQ_DEC;
+                break;
+            case 'L': // Label
+                op.type = OP_LABEL;
+                hex = true;
+                break;
+            case 'Y': // 年
+                op.type = OP_YEAR;
+                hex = false;
+                _has_time = true;
+                break;
+            case 'M': // 月
+                op.type = OP_MONTH;
+                hex = false;
+                _has_time = true;
+                break;
+            case 'D': // 天
+                op.type = OP_DAY;
+                hex = false;
+                _has_time = true;
+                break;
+            case 'H': // 小时
+                op.type = OP_HOUR;
+                hex = false;
+                _has_time = true;
+                break;
+            case 'm': // 分钟
+                op.type = OP_MINUTE;
+                hex = false;
+                _has_time = true;
+                _has_minute = true;
+                break;
+            default:
+                // format error（包括format以'%'结尾）
+                reset();
+                return set_error(get_error_buffer(), MUE_PARAMETER, "invalid `format` parameter", NULL);
+            }
+        }
+
+        ++format_p;
+        _ops.push_back(op);
+    }
+
+    return 0;
+}
+
+void CTransactionIdFormat::render(uint8_t label, uint32_t seq, uint16_t num, CTransactionIdBatch* batch, ...) const
+{
+    va_list ap;
+    va_start(ap, batch);
+    mooon::utils::VaListHelper vlh(ap);
+
+    vrender(label, seq, num, batch, ap);
+}
+
+// 先将seq之外的部分（参数、Label和时间）写入batch的_stage，记下各seq的位置，
+// 再逐个组装：复制_stage的各段，在seq的位置写seq，每个流水号没有内存分配
+void CTransactionIdFormat::vrender(uint8_t label, uint32_t seq, uint16_t num, CTransactionIdBatch* batch, va_list& va) const
+{
+    char digits[32];
+    const char* time_text = _has_time? batch->get_time_text(_has_minute): NULL;
+    size_t max_seq_digits = 0; // 一个流水号中seq最多占的字节数
+    va_list ap;
+    va_copy(ap, va);
+    mooon::utils::VaListHelper vlh(ap);
+
+    batch->_size = 0;
+    batch->_stage.clear();
+    batch->_slots.clear();
+    for (std::vector<struct Op>::size_type i=0; i<_ops.size(); ++i)
+    {
+        const struct Op& op = _ops[i];
+        int m;
+        const char* s;
+
+        switch (op.type)
+        {
+        case OP_LITERAL:
+            batch->_stage.append(_literals, op.offset, op.length);
+            break;
+        case OP_SEQ_DEC:
+        case OP_SEQ_HEX:
+            {
+                struct CTransactionIdBatch::SeqSlot slot;
+                slot.stage_end = static_cast<uint32_t>(batch->_stage.size());
+                slot.type = op.type;
+                slot.width = op.width;
+                batch->_slots.push_back(slot);
+                const size_t max_digits = (OP_SEQ_DEC == op.type)? MAX_DEC_DIGITS: MAX_HEX_DIGITS;
+                max_seq_digits += (op.width > 0)? static_cast<size_t>(op.width): max_digits;
+            }
+            break;
+        case OP_LABEL:
+            batch->_stage.append(digits, write_hex(digits, label, 2) - digits);
+            break;
+        case OP_INT_DEC:
+            m = va_arg(ap, int);
+            if (op.width > 0)
+                batch->_stage.append(digits, write_dec(digits, static_cast<uint64_t>(static_cast<int64_t>(m)) % g_dec_width_mods[op.width], op.width) - digits);
+            else if (m < 0)
+            {
+                digits[0] = '-';
+                batch->_stage.append(digits, write_dec(digits+1, static_cast<uint64_t>(-static_cast<int64_t>(m)), 0) - digits);
+            }
+            else
+                batch->_stage.append(digits, write_dec(digits, static_cast<uint64_t>(m), 0) - digits);
+            break;
+        case OP_INT_HEX:
+            m = va_arg(ap, int);
+            if (op.width > 0)
+                batch->_stage.append(digits, write_hex(digits, static_cast<uint32_t>(static_cast<uint64_t>(static_cast<int64_t>(m)) % g_hex_width_mods[op.width]), op.width) - digits);
+            else
+                batch->_stage.append(digits, write_hex(digits, static_cast<uint32_t>(m), 0) - digits);
+            break;
+        case OP_STRING:
+            s = va_arg(ap, const char*);
+            if (s != NULL)
+                batch->_stage.append(s);
+            break;
+        case OP_YEAR:
+            batch->_stage.append(time_text, 4);
+            break;
+        case OP_MONTH:
+            batch->_stage.append(time_text+4, 2);
+            break;
+        case OP_DAY:
+            batch->_stage.append(time_text+6, 2);
+            break;
+        case OP_HOUR:
+            batch->_stage.append(time_text+8, 2);
+            break;
+        case OP_MINUTE:
+            batch->_stage.append(time_text+10, 2);
+            break;
+        }
+    }
+    if (0 == num)
+    {
+        return;
+    }
+
+    // 按最长的情况一次准备好内存，batch重复使用时通常已足够
+    const uint32_t stage_size = static_cast<uint32_t>(batch->_stage.size());
+    const size_t max_length = stage_size + max_seq_digits + 1;
+    if (batch->_buffer.size() < max_length * num)
+        batch->_buffer.resize(max_length * num);
+    if (batch->_offsets.size() < static_cast<size_t>(num) + 1)
+        batch->_offsets.resize(static_cast<size_t>(num) + 1);
+
+    char* buffer = &batch->_buffer[0];
+    char* p = buffer;
+    uint32_t* offsets = &batch->_offsets[0];
+    const char* stage = batch->_stage.data();
+    const struct CTransactionIdBatch::SeqSlot* slots = batch->_slots.empty()? NULL: &batch->_slots[0];
+    const size_t num_slots = batch->_slots.size();
+
+    offsets[0] = 0;
+    for (uint16_t i=0; i<num; ++i, ++seq)
+    {
+        uint32_t stage_begin = 0;
+        for (size_t j=0; j<num_slots; ++j)
+        {
+            memcpy(p, stage + stage_begin, slots[j].stage_end - stage_begin);
+            p += slots[j].stage_end - stage_begin;
+            stage_begin = slots[j].stage_end;
+
+            if (OP_SEQ_HEX == slots[j].type)
+                p = write_hex(p, seq, 0);
+            else if (slots[j].width > 0)
+                p = write_dec(p, seq % g_dec_width_mods[slots[j].width], slots[j].width);
+            else
+                p = write_dec(p, seq, 0);
+        }
+
+        memcpy(p, stage + stage_begin, stage_size - stage_begin);
+        p += stage_size - stage_begin;
+        *p++ = '\0';
+        offsets[i+1] = static_cast<uint32_t>(p - buffer);
+    }
+    batch->_size = num;
+}
+
+void CTransactionIdFormat::reset()
+{
+    _ops.clear();
+    _literals.clear();
+    _has_time = false;
+    _has_minute = false;
+}
+
+//
+// CTransactionIdBatch
+//
+CTransactionIdBatch::CTransactionIdBatch()
+    : _size(0), _time_begin(0), _minute_end(0), _hour_end(0)
+{
+    _time_text[0] = '\0';
+}
+
+// 当前时间的YYYYMMDDHHmm，同一分钟（minute为false时为同一小时）内只取一次localtime，
+// 时钟被往回调时也重新取
+const char* CTransactionIdBatch::get_time_text(bool minute)
+{
+    const time_t current_time = time(NULL);
+
+    if ((current_time < _time_begin) || (current_time >= (minute? _minute_end: _hour_end)))
+    {
+        struct tm now;
+        char* p = _time_text;
+
+        localtime_r(&current_time, &now);
+        p = write_dec(p, now.tm_year+1900, 4);
+        p = write_dec(p, now.tm_mon+1, 2);
+        p = write_dec(p, now.tm_mday, 2);
+        p = write_dec(p, now.tm_hour, 2);
+        p = write_dec(p, now.tm_min, 2);
+        *p = '\0';
+
+        _time_begin = current_time;
+        _minute_end = current_time + (60 - now.tm_sec);
+        _hour_end = _minute_end + (59 - now.tm_min) * 60;
     }
+    return _time_text;
 }
 
 } // namespace muidor {
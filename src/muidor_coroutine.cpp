@@ -0,0 +1,120 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#include "muidor/muidor_coroutine.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// 协程接口的示例，用到CCoroutineExecutor的每一种awaiter，
+// 编译器不支持协程时（没有MUIDOR_HAVE_COROUTINE）只输出提示
+
+static void usage();
+
+#if MUIDOR_HAVE_COROUTINE == 1
+static int g_num_errors = 0;
+
+// 逐个co_await每一种awaiter
+static muidor::CCoroutineExecutor::Task get_each(muidor::CCoroutineExecutor* executor)
+{
+    try
+    {
+        const muidor::CCoroutineExecutor::LabelAndSeq label_and_seq = co_await executor->get_label_and_seq();
+        fprintf(stdout, "label: %u, seq: %u\n", (unsigned int)label_and_seq.label, label_and_seq.seq);
+
+        union muidor::UniqID uniq_id;
+        uniq_id.value = co_await executor->get_uniq_id();
+        fprintf(stdout, "uniq_id: %" PRIu64" => %s\n", uniq_id.value, uniq_id.id.str().c_str());
+
+        const uint64_t sortable_id = co_await executor->get_sortable_id();
+        fprintf(stdout, "sortable_id: %" PRIu64"\n", sortable_id);
+
+        uniq_id.value = co_await executor->get_local_uniq_id();
+        fprintf(stdout, "local_uniq_id: %" PRIu64" => %s\n", uniq_id.value, uniq_id.id.str().c_str());
+
+        const std::string transaction_id = co_await executor->get_transaction_id("02%L%Y%M%D%m%8S%s", "##");
+        fprintf(stdout, "transaction_id: %s\n", transaction_id.c_str());
+    }
+    catch (mooon::utils::CException& ex)
+    {
+        ++g_num_errors;
+        fprintf(stderr, "%s\n", ex.str().c_str());
+    }
+}
+
+// get_*返回时已发出请求，先取得多个awaiter再逐个co_await，这些请求同时在途
+static muidor::CCoroutineExecutor::Task get_concurrently(muidor::CCoroutineExecutor* executor)
+{
+    try
+    {
+        muidor::CCoroutineExecutor::CValueAwaiter first = executor->get_uniq_id();
+        muidor::CCoroutineExecutor::CValueAwaiter second = executor->get_sortable_id();
+
+        const uint64_t uniq_id = co_await first;
+        const uint64_t sortable_id = co_await second;
+        fprintf(stdout, "concurrent uniq_id: %" PRIu64", sortable_id: %" PRIu64"\n", uniq_id, sortable_id);
+    }
+    catch (mooon::utils::CException& ex)
+    {
+        ++g_num_errors;
+        fprintf(stderr, "%s\n", ex.str().c_str());
+    }
+}
+#endif // MUIDOR_HAVE_COROUTINE
+
+// Usage: muidor_coroutine agent_nodes
+int main(int argc, char* argv[])
+{
+    if (argc != 2)
+    {
+        usage();
+        exit(1);
+    }
+
+#if MUIDOR_HAVE_COROUTINE == 1
+    try
+    {
+        muidor::CMuidor muidor(argv[1], 200, 3);
+        muidor::CCoroutineExecutor executor(muidor);
+
+        get_each(&executor);
+        get_concurrently(&executor);
+        executor.run();
+    }
+    catch (mooon::sys::CSyscallException& ex)
+    {
+        fprintf(stderr, "%s\n", ex.str().c_str());
+        exit(1);
+    }
+    catch (mooon::utils::CException& ex)
+    {
+        fprintf(stderr, "%s\n", ex.str().c_str());
+        exit(1);
+    }
+
+    return (0 == g_num_errors)? 0: 1;
+#else
+    (void)argv;
+    fprintf(stderr, "coroutine not supported by the compiler\n");
+    return 1;
+#endif // MUIDOR_HAVE_COROUTINE
+}
+
+void usage()
+{
+    fprintf(stderr, "Usage: muidor_coroutine agent_nodes\n");
+}
@@ -0,0 +1,183 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#include "datagram_socket.h"
+#include "protocol.h"
+#include "muidor/muidor.h"
+#include <errno.h>
+#include <mooon/sys/atomic.h>
+#include <mooon/sys/stop_watch.h>
+#include <mooon/sys/thread_engine.h>
+#include <mooon/utils/string_utils.h>
+#include <poll.h>
+#include <string.h>
+
+// 客户端出错路径的微基准测试，比较抛异常的接口和不抛异常的try_*接口每次调用（含重试）的开销：
+// 1) 出错应答，对端为本进程内总是回复RESPONSE_ERROR（MUE_NO_TAG）的线程，模拟agent或master故障
+// 2) 端口不可达，对端端口没有监听，已连接的socket很快收到ECONNREFUSED，模拟agent进程退出
+// 每种情况分别测：抛异常并捕获、try_*只取错误码、try_*再调用get_last_error().str()取出错信息
+
+static void usage();
+static void error_thread(uint16_t port);
+static void bench(const char* name, const std::string& agent_nodes, uint64_t times);
+static void report(const char* name, uint64_t times, unsigned int total_microseconds);
+static const uint32_t BATCH_SIZE = 64; // 同agent一次收发的报文数
+static mooon::sys::CAtomic<bool> g_stop(false);
+
+// Usage1: muidor_error_bench
+// Usage2: muidor_error_bench times
+// Usage3: muidor_error_bench times port
+int main(int argc, char* argv[])
+{
+    if (argc > 3)
+    {
+        usage();
+        exit(1);
+    }
+
+    uint64_t times = 100000;
+    uint16_t port = 16299;
+    if ((argc >= 2) && !mooon::utils::CStringUtils::string2int(argv[1], times))
+        times = 100000;
+    if ((argc >= 3) && !mooon::utils::CStringUtils::string2int(argv[2], port))
+        port = 16299;
+    fprintf(stdout, "times: %" PRIu64", port: %u\n", times, (unsigned int)port);
+
+    try
+    {
+        // 1) 出错应答
+        {
+            mooon::sys::CThreadEngine error(mooon::sys::bind(&error_thread, port));
+            usleep(100000); // 等待出错线程就绪
+            bench("error response", mooon::utils::CStringUtils::format_string("127.0.0.1:%u", (unsigned int)port), times);
+            g_stop = true;
+            error.join();
+        }
+
+        // 2) 端口不可达（出错线程已退出，端口没有监听）
+        bench("connection refused", mooon::utils::CStringUtils::format_string("127.0.0.1:%u", (unsigned int)port), times);
+    }
+    catch (mooon::utils::CException& ex)
+    {
+        fprintf(stderr, "%s\n", ex.str().c_str());
+        exit(1);
+    }
+
+    return 0;
+}
+
+void usage()
+{
+    fprintf(stderr, "Usage1: muidor_error_bench\n");
+    fprintf(stderr, "Usage2: muidor_error_bench times\n");
+    fprintf(stderr, "Usage3: muidor_error_bench times port\n");
+}
+
+// 总是回复出错应答，原地改写收到的请求
+void error_thread(uint16_t port)
+{
+    muidor::CDatagramSocket datagram_socket;
+    muidor::CDatagramBatch requests(BATCH_SIZE, muidor::SOCKET_BUFFER_SIZE);
+
+    if (-1 == datagram_socket.listen("127.0.0.1", port, true))
+    {
+        fprintf(stderr, "listen on %u failed: %s\n", (unsigned int)port, strerror(errno));
+        exit(1);
+    }
+    while (!g_stop)
+    {
+        struct pollfd fds[1];
+        fds[0].fd = datagram_socket.get_fd();
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        if (poll(fds, 1, 100) <= 0)
+            continue;
+
+        const int n = datagram_socket.receive_batch(&requests);
+        for (int i=0; i<n; ++i)
+        {
+            struct muidor::MessageHead* response = reinterpret_cast<struct muidor::MessageHead*>(requests.buffer(i));
+            response->len = sizeof(struct muidor::MessageHead);
+            response->type = muidor::RESPONSE_ERROR;
+            response->value1 = muidor::MUE_NO_TAG;
+            response->update_magic();
+            requests.set(i, sizeof(struct muidor::MessageHead), requests.addr(i));
+        }
+        if (n > 0)
+            (void)datagram_socket.send_batch(&requests, 0, static_cast<uint32_t>(n));
+    }
+}
+
+// 超时100毫秒，重试3次，和默认的参数一样每次调用都会重试到用完次数
+void bench(const char* name, const std::string& agent_nodes, uint64_t times)
+{
+    muidor::CMuidor muidor(agent_nodes, 100, 3);
+    uint64_t num_errors = 0;
+    size_t message_size = 0;
+    std::string title;
+
+    mooon::sys::CStopWatch stop_watch;
+    for (uint64_t i=0; i<times; ++i)
+    {
+        try
+        {
+            (void)muidor.get_tag_seq(1);
+        }
+        catch (mooon::utils::CException& ex)
+        {
+            ++num_errors;
+        }
+    }
+    title = mooon::utils::CStringUtils::format_string("%s: exception", name);
+    report(title.c_str(), times, stop_watch.get_elapsed_microseconds());
+
+    (void)stop_watch.get_elapsed_microseconds(); // 重新计时
+    for (uint64_t i=0; i<times; ++i)
+    {
+        uint64_t value;
+        if (muidor.try_get_tag_seq(&value, 1) != 0)
+            ++num_errors;
+    }
+    title = mooon::utils::CStringUtils::format_string("%s: try_", name);
+    report(title.c_str(), times, stop_watch.get_elapsed_microseconds());
+
+    (void)stop_watch.get_elapsed_microseconds();
+    for (uint64_t i=0; i<times; ++i)
+    {
+        uint64_t value;
+        if (muidor.try_get_tag_seq(&value, 1) != 0)
+        {
+            ++num_errors;
+            message_size += muidor::CMuidor::get_last_error().str().size();
+        }
+    }
+    title = mooon::utils::CStringUtils::format_string("%s: try_ + str()", name);
+    report(title.c_str(), times, stop_watch.get_elapsed_microseconds());
+
+    fprintf(stdout, "errors: %" PRIu64"/%" PRIu64", last error: %s\n",
+            num_errors, times * 3, muidor::CMuidor::get_last_error().str().c_str());
+    (void)message_size;
+}
+
+void report(const char* name, uint64_t times, unsigned int total_microseconds)
+{
+    if (0 == total_microseconds)
+        total_microseconds = 1;
+    fprintf(stdout, "%-40s %.2fms, %.3fus/op, %.2f/s\n", name,
+            (double)total_microseconds/1000, (double)total_microseconds/times, (double)(times*1000000)/total_microseconds);
+}
@@ -0,0 +1,144 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#include "muidor/muidor.h"
+#include <mooon/sys/stop_watch.h>
+#include <mooon/utils/string_utils.h>
+#include <stdlib.h>
+#include <new>
+
+// 流水号组装的微基准测试，不需要agent，label和seq为固定的值：
+// 1) 逐个调用CMuidor::format_transaction_id，每次都解析format并返回std::string
+// 2) 预编译的CTransactionIdFormat每次组装一批到新建的CTransactionIdBatch
+// 3) 预编译的CTransactionIdFormat每次组装一批到重复使用的CTransactionIdBatch
+// 每种情况报告每个流水号的耗时和堆内存分配次数（替换全局的operator new计数）
+
+static void usage();
+static void report(const char* name, uint64_t num_ids, unsigned int total_microseconds, uint64_t num_allocations);
+static const char* FORMAT = "02%L%Y%M%D%H%m%9S%s";
+static uint64_t g_num_allocations = 0;
+
+void* operator new(size_t size)
+{
+    ++g_num_allocations;
+    void* p = malloc((0 == size)? 1: size);
+    if (NULL == p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+// Usage1: muidor_format_bench
+// Usage2: muidor_format_bench batches
+// Usage3: muidor_format_bench batches num
+int main(int argc, char* argv[])
+{
+    if (argc > 3)
+    {
+        usage();
+        exit(1);
+    }
+
+    uint64_t batches = 100;
+    uint16_t num = 10000;
+    if ((argc >= 2) && !mooon::utils::CStringUtils::string2int(argv[1], batches))
+        batches = 100;
+    if ((argc >= 3) && !mooon::utils::CStringUtils::string2int(argv[2], num))
+        num = 10000;
+    if (0 == num)
+        num = 1;
+    fprintf(stdout, "batches: %" PRIu64", num: %u, format: %s\n", batches, (unsigned int)num, FORMAT);
+
+    try
+    {
+        const uint8_t label = 0x1F;
+        const uint64_t num_ids = batches * num;
+        size_t total_bytes = 0;
+        uint64_t num_allocations;
+        muidor::CTransactionIdFormat format(FORMAT);
+        muidor::CTransactionIdBatch reused_batch;
+        mooon::sys::CStopWatch stop_watch;
+
+        // 1) 逐个组装
+        num_allocations = g_num_allocations;
+        (void)stop_watch.get_elapsed_microseconds(); // 重新计时
+        for (uint64_t i=0; i<batches; ++i)
+        {
+            uint32_t seq = 1;
+            for (uint16_t j=0; j<num; ++j)
+                total_bytes += muidor::CMuidor::format_transaction_id(label, seq++, FORMAT, "##").size();
+        }
+        report("format_transaction_id", num_ids, stop_watch.get_elapsed_microseconds(), g_num_allocations-num_allocations);
+
+        // 2) 每批新建CTransactionIdBatch
+        num_allocations = g_num_allocations;
+        (void)stop_watch.get_elapsed_microseconds();
+        for (uint64_t i=0; i<batches; ++i)
+        {
+            muidor::CTransactionIdBatch batch;
+            format.render(label, 1, num, &batch, "##");
+            total_bytes += batch.bytes();
+        }
+        report("render: new batch", num_ids, stop_watch.get_elapsed_microseconds(), g_num_allocations-num_allocations);
+
+        // 3) 重复使用CTransactionIdBatch，先组装一次使其容量足够
+        format.render(label, 1, num, &reused_batch, "##");
+        num_allocations = g_num_allocations;
+        (void)stop_watch.get_elapsed_microseconds();
+        for (uint64_t i=0; i<batches; ++i)
+        {
+            format.render(label, 1, num, &reused_batch, "##");
+            total_bytes += reused_batch.bytes();
+        }
+        report("render: reused batch", num_ids, stop_watch.get_elapsed_microseconds(), g_num_allocations-num_allocations);
+
+        fprintf(stdout, "bytes: %zu, last: %s\n", total_bytes, reused_batch.data(reused_batch.size()-1));
+    }
+    catch (mooon::utils::CException& ex)
+    {
+        fprintf(stderr, "%s\n", ex.str().c_str());
+        exit(1);
+    }
+
+    return 0;
+}
+
+void usage()
+{
+    fprintf(stderr, "Usage1: muidor_format_bench\n");
+    fprintf(stderr, "Usage2: muidor_format_bench batches\n");
+    fprintf(stderr, "Usage3: muidor_format_bench batches num\n");
+}
+
+void report(const char* name, uint64_t num_ids, unsigned int total_microseconds, uint64_t num_allocations)
+{
+    if (0 == total_microseconds)
+        total_microseconds = 1;
+    fprintf(stdout, "%-30s %.2fms, %.3fus/id, %.2f/s, %.4f allocations/id\n", name,
+            (double)total_microseconds/1000, (double)total_microseconds/num_ids,
+            (double)(num_ids*1000000)/total_microseconds, (double)num_allocations/num_ids);
+}
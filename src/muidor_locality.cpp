@@ -0,0 +1,275 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#include "muidor/muidor.h"
+#include <mooon/sys/stop_watch.h>
+#include <mooon/utils/string_utils.h>
+#include <algorithm>
+#include <map>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+
+// B-tree插入局部性测试工具，不需要agent，
+// 模拟多个agent交错产生ID，分别以UniqID和SortableID两种编码插入B-tree的叶子层，
+// 统计页分裂次数、页填充率和插入窗口内涉及的页数（热页数，越小则局部性越好）。
+//
+// 页分裂采用和InnoDB相似的策略：插入点在页尾时新页只放入新记录（顺序插入），否则从中间分裂。
+
+static void usage();
+
+struct Page
+{
+    uint32_t window;            // 最近一次被插入时所在的窗口
+    std::vector<uint64_t> keys; // 有序的键
+};
+
+struct Result
+{
+    uint64_t splits;      // 页分裂次数
+    uint64_t tail_inserts; // 插入在页尾的次数
+    uint64_t pages;       // 最终页数
+    double fill_factor;   // 最终页填充率
+    double hot_pages;     // 平均每个窗口涉及的页数
+    unsigned int microseconds;
+};
+
+class CLeafLevel
+{
+public:
+    CLeafLevel(uint32_t page_keys, uint32_t window_size)
+        : _page_keys(page_keys), _window_size(window_size), _num_inserts(0),
+          _num_windows(0), _hot_pages(0), _splits(0), _tail_inserts(0)
+    {
+    }
+
+    ~CLeafLevel()
+    {
+        for (std::map<uint64_t, Page*>::iterator iter=_pages.begin(); iter!=_pages.end(); ++iter)
+            delete iter->second;
+    }
+
+    void insert(uint64_t key)
+    {
+        const uint32_t window = static_cast<uint32_t>(_num_inserts++ / _window_size) + 1;
+        if (window > _num_windows)
+            _num_windows = window;
+
+        if (_pages.empty())
+        {
+            Page* page = new Page;
+            page->window = 0;
+            _pages.insert(std::make_pair(key, page));
+        }
+
+        // 找到第一个键不大于key的页，如果key比所有页的都小，则插入到第一页
+        std::map<uint64_t, Page*>::iterator iter = _pages.upper_bound(key);
+        if (iter != _pages.begin())
+            --iter;
+        Page* page = iter->second;
+        if (page->window != window)
+        {
+            page->window = window;
+            ++_hot_pages;
+        }
+
+        std::vector<uint64_t>::iterator pos = std::lower_bound(page->keys.begin(), page->keys.end(), key);
+        const bool at_tail = (pos == page->keys.end());
+        if (at_tail)
+            ++_tail_inserts;
+        page->keys.insert(pos, key);
+        if (key < iter->first)
+        {
+            // 页的最小键发生了变化
+            _pages.erase(iter);
+            iter = _pages.insert(std::make_pair(key, page)).first;
+        }
+
+        if (page->keys.size() > _page_keys)
+        {
+            // 顺序插入时新页只放新记录，其它情况从中间分裂
+            const size_t middle = at_tail? page->keys.size()-1: page->keys.size()/2;
+            Page* new_page = new Page;
+            new_page->window = window;
+            new_page->keys.assign(page->keys.begin()+middle, page->keys.end());
+            page->keys.resize(middle);
+            _pages.insert(std::make_pair(new_page->keys[0], new_page));
+            ++_splits;
+        }
+    }
+
+    void get_result(struct Result* result) const
+    {
+        uint64_t num_keys = 0;
+        for (std::map<uint64_t, Page*>::const_iterator iter=_pages.begin(); iter!=_pages.end(); ++iter)
+            num_keys += iter->second->keys.size();
+
+        result->splits = _splits;
+        result->tail_inserts = _tail_inserts;
+        result->pages = _pages.size();
+        result->fill_factor = _pages.empty()? 0: (double)num_keys / (_pages.size() * _page_keys);
+        result->hot_pages = (0 == _num_windows)? 0: (double)_hot_pages / _num_windows;
+    }
+
+private:
+    const uint32_t _page_keys;
+    const uint32_t _window_size;
+    uint64_t _num_inserts;
+    uint32_t _num_windows;
+    uint64_t _hot_pages;
+    uint64_t _splits;
+    uint64_t _tail_inserts;
+    std::map<uint64_t, Page*> _pages;
+};
+
+// 产生模拟的ID序列，
+// 每个agent有自己的seq，起始值随机，多个agent交错产生ID，时间均匀的跨越hours个小时
+// reset_every_hour 为true时每小时seq从1重新开始
+static void generate_ids(std::vector<uint64_t>* ids, uint32_t encoding,
+                         uint64_t num_ids, uint32_t num_agents, uint32_t hours, bool reset_every_hour)
+{
+    std::vector<uint32_t> seqs(num_agents);
+    srandom(2016); // 两种编码使用相同的ID序列
+    for (uint32_t i=0; i<num_agents; ++i)
+        seqs[i] = static_cast<uint32_t>(random() % 0x1FFFFFFF) + 1;
+
+    const time_t start_time = time(NULL) / 3600 * 3600;
+    const uint64_t ids_per_hour = (num_ids + hours - 1) / hours;
+    ids->reserve(num_ids);
+    for (uint64_t i=0; i<num_ids; ++i)
+    {
+        const uint32_t agent = static_cast<uint32_t>(random() % num_agents);
+        const uint64_t current_seconds = start_time + (i / ids_per_hour) * 3600;
+
+        if (reset_every_hour && (i % ids_per_hour == 0))
+        {
+            for (uint32_t j=0; j<num_agents; ++j)
+                seqs[j] = 1;
+        }
+
+        const uint32_t seq = seqs[agent]++ & 0x1FFFFFFF;
+        const uint8_t label = static_cast<uint8_t>(agent % 254 + 1);
+        if (muidor::MU_ENCODING_SORTABLE == encoding)
+        {
+            ids->push_back(muidor::encode_sortable_id(0, label, seq, muidor::get_base_hours(current_seconds)));
+        }
+        else
+        {
+            struct tm now;
+            time_t current_time = static_cast<time_t>(current_seconds);
+            localtime_r(&current_time, &now);
+
+            union muidor::UniqID uniq_id;
+            uniq_id.id.user = 0;
+            uniq_id.id.label = label;
+            uniq_id.id.year = (now.tm_year+1900) - muidor::MU_BASE_YEAR;
+            uniq_id.id.month = now.tm_mon+1;
+            uniq_id.id.day = now.tm_mday;
+            uniq_id.id.hour = now.tm_hour;
+            uniq_id.id.seq = seq;
+            ids->push_back(uniq_id.value);
+        }
+    }
+}
+
+static void run(struct Result* result, uint32_t encoding,
+                uint64_t num_ids, uint32_t num_agents, uint32_t hours, bool reset_every_hour, uint32_t page_keys)
+{
+    std::vector<uint64_t> ids;
+    generate_ids(&ids, encoding, num_ids, num_agents, hours, reset_every_hour);
+
+    CLeafLevel leaf_level(page_keys, 1000);
+    mooon::sys::CStopWatch stop_watch;
+    for (std::vector<uint64_t>::size_type i=0; i<ids.size(); ++i)
+        leaf_level.insert(ids[i]);
+    result->microseconds = stop_watch.get_total_elapsed_microseconds();
+    leaf_level.get_result(result);
+}
+
+static void print_result(const char* name, const struct Result& result, uint64_t num_ids)
+{
+    fprintf(stdout, "%-8s splits: %" PRIu64", tail inserts: %.2f%%, pages: %" PRIu64", fill factor: %.2f%%, hot pages/1000 inserts: %.2f, %.2fms\n",
+            name, result.splits, (double)result.tail_inserts*100/num_ids, result.pages,
+            result.fill_factor*100, result.hot_pages, (double)result.microseconds/1000);
+}
+
+// Usage: muidor_locality [ids] [agents] [hours] [page_keys] [reset]
+int main(int argc, char* argv[])
+{
+    uint64_t num_ids = 1000000;
+    uint32_t num_agents = 8;
+    uint32_t hours = 4;
+    uint32_t page_keys = 100;
+    bool reset_every_hour = false;
+
+    if (argc > 6)
+    {
+        usage();
+        exit(1);
+    }
+    if ((argc > 1) && !mooon::utils::CStringUtils::string2int(argv[1], num_ids))
+    {
+        usage();
+        exit(1);
+    }
+    if ((argc > 2) && !mooon::utils::CStringUtils::string2int(argv[2], num_agents))
+    {
+        usage();
+        exit(1);
+    }
+    if ((argc > 3) && !mooon::utils::CStringUtils::string2int(argv[3], hours))
+    {
+        usage();
+        exit(1);
+    }
+    if ((argc > 4) && !mooon::utils::CStringUtils::string2int(argv[4], page_keys))
+    {
+        usage();
+        exit(1);
+    }
+    if (argc > 5)
+    {
+        reset_every_hour = true;
+    }
+    if ((0 == num_ids) || (0 == num_agents) || (0 == hours) || (page_keys < 2))
+    {
+        usage();
+        exit(1);
+    }
+
+    fprintf(stdout, "ids: %" PRIu64", agents: %u, hours: %u, page keys: %u, reset every hour: %s\n",
+            num_ids, num_agents, hours, page_keys, reset_every_hour? "yes": "no");
+
+    struct Result result;
+    run(&result, muidor::MU_ENCODING_UNIQ_ID, num_ids, num_agents, hours, reset_every_hour, page_keys);
+    print_result("UniqID", result, num_ids);
+    run(&result, muidor::MU_ENCODING_SORTABLE, num_ids, num_agents, hours, reset_every_hour, page_keys);
+    print_result("Sortable", result, num_ids);
+
+    return 0;
+}
+
+void usage()
+{
+    fprintf(stderr, "Usage: muidor_locality [ids] [agents] [hours] [page_keys] [reset]\n");
+    fprintf(stderr, "  ids: number of IDs to insert, default 1000000\n");
+    fprintf(stderr, "  agents: number of agents generating IDs, default 8\n");
+    fprintf(stderr, "  hours: hours the IDs are spread over, default 4\n");
+    fprintf(stderr, "  page_keys: keys per B-tree leaf page, default 100\n");
+    fprintf(stderr, "  reset: if present, sequence restarts from 1 every hour\n");
+}
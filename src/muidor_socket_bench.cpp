@@ -0,0 +1,231 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#include "datagram_socket.h"
+#include "protocol.h"
+#include <errno.h>
+#include <mooon/net/udp_socket.h>
+#include <mooon/sys/atomic.h>
+#include <mooon/sys/stop_watch.h>
+#include <mooon/sys/thread_engine.h>
+#include <mooon/utils/string_utils.h>
+#include <poll.h>
+#include <string.h>
+
+// socket层的微基准测试，在本机回环上比较mooon::net::CUdpSocket和muidor::CDatagramSocket：
+// 1) 一问一答（send_to + timed_receive_from），对端为本进程内的回显线程
+// 2) 超时（timed_receive_from等待0毫秒），CUdpSocket抛异常，CDatagramSocket返回-1
+// 3) 单向发送，CUdpSocket逐个send_to，CDatagramSocket每次sendmmsg发送一批
+
+static void usage();
+static void echo_thread(uint16_t port);
+static void report(const char* name, uint64_t times, unsigned int total_microseconds);
+static const uint32_t BATCH_SIZE = 64; // 同agent一次收发的报文数
+static mooon::sys::CAtomic<bool> g_stop(false);
+
+// Usage1: muidor_socket_bench
+// Usage2: muidor_socket_bench times
+// Usage3: muidor_socket_bench times port
+int main(int argc, char* argv[])
+{
+    if (argc > 3)
+    {
+        usage();
+        exit(1);
+    }
+
+    uint64_t times = 100000;
+    uint16_t port = 16299;
+    if ((argc >= 2) && !mooon::utils::CStringUtils::string2int(argv[1], times))
+        times = 100000;
+    if ((argc >= 3) && !mooon::utils::CStringUtils::string2int(argv[2], port))
+        port = 16299;
+    fprintf(stdout, "times: %" PRIu64", port: %u\n", times, (unsigned int)port);
+
+    struct sockaddr_in echo_addr;
+    memset(&echo_addr, 0, sizeof(echo_addr));
+    echo_addr.sin_family = AF_INET;
+    echo_addr.sin_port = htons(port);
+    echo_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    try
+    {
+        mooon::sys::CThreadEngine echo(mooon::sys::bind(&echo_thread, port));
+        char request[sizeof(struct muidor::MessageHead)];
+        char response[muidor::SOCKET_BUFFER_SIZE];
+        struct sockaddr_in from_addr;
+        memset(request, 0, sizeof(request));
+        usleep(100000); // 等待回显线程就绪
+
+        // 1) 一问一答
+        {
+            mooon::net::CUdpSocket udp_socket;
+            mooon::sys::CStopWatch stop_watch;
+            for (uint64_t i=0; i<times; ++i)
+            {
+                udp_socket.send_to(request, sizeof(request), echo_addr);
+                udp_socket.timed_receive_from(response, sizeof(response), &from_addr, 1000);
+            }
+            report("CUdpSocket round trip", times, stop_watch.get_elapsed_microseconds());
+        }
+        {
+            muidor::CDatagramSocket datagram_socket;
+            if (-1 == datagram_socket.open())
+                THROW_SYSCALL_EXCEPTION(NULL, errno, "socket");
+            mooon::sys::CStopWatch stop_watch;
+            for (uint64_t i=0; i<times; ++i)
+            {
+                if ((-1 == datagram_socket.send_to(request, sizeof(request), echo_addr)) ||
+                    (-1 == datagram_socket.timed_receive_from(response, sizeof(response), &from_addr, 1000)))
+                    THROW_SYSCALL_EXCEPTION(NULL, errno, "round trip");
+            }
+            report("CDatagramSocket round trip", times, stop_watch.get_elapsed_microseconds());
+        }
+        {
+            muidor::CDatagramSocket datagram_socket;
+            if ((-1 == datagram_socket.open()) || (-1 == datagram_socket.connect(echo_addr)))
+                THROW_SYSCALL_EXCEPTION(NULL, errno, "connect");
+            mooon::sys::CStopWatch stop_watch;
+            for (uint64_t i=0; i<times; ++i)
+            {
+                if ((-1 == datagram_socket.send(request, sizeof(request))) ||
+                    (-1 == datagram_socket.timed_receive_from(response, sizeof(response), &from_addr, 1000)))
+                    THROW_SYSCALL_EXCEPTION(NULL, errno, "round trip");
+            }
+            report("CDatagramSocket connected round trip", times, stop_watch.get_elapsed_microseconds());
+        }
+
+        // 2) 超时，次数取十分之一
+        {
+            const uint64_t timeout_times = (times >= 10)? times / 10: 1;
+            mooon::net::CUdpSocket udp_socket;
+            mooon::sys::CStopWatch stop_watch;
+            for (uint64_t i=0; i<timeout_times; ++i)
+            {
+                try
+                {
+                    udp_socket.timed_receive_from(response, sizeof(response), &from_addr, 0);
+                }
+                catch (mooon::sys::CSyscallException& ex)
+                {
+                }
+            }
+            report("CUdpSocket timeout", timeout_times, stop_watch.get_elapsed_microseconds());
+
+            muidor::CDatagramSocket datagram_socket;
+            if (-1 == datagram_socket.open())
+                THROW_SYSCALL_EXCEPTION(NULL, errno, "socket");
+            (void)stop_watch.get_elapsed_microseconds(); // 重新计时
+            for (uint64_t i=0; i<timeout_times; ++i)
+            {
+                (void)datagram_socket.timed_receive_from(response, sizeof(response), &from_addr, 0);
+            }
+            report("CDatagramSocket timeout", timeout_times, stop_watch.get_elapsed_microseconds());
+        }
+
+        g_stop = true;
+        echo.join();
+
+        // 3) 单向发送，接收方不读，缓冲区满后的报文由内核直接丢弃
+        //    （不能发往没有监听的端口，否则ICMP端口不可达会让后续的发送出错）
+        {
+            struct sockaddr_in sink_addr = echo_addr;
+            muidor::CDatagramSocket sink;
+            sink_addr.sin_port = htons(port + 1);
+            if (-1 == sink.listen("127.0.0.1", port + 1))
+                THROW_SYSCALL_EXCEPTION(NULL, errno, "listen");
+
+            mooon::net::CUdpSocket udp_socket;
+            mooon::sys::CStopWatch stop_watch;
+            for (uint64_t i=0; i<times; ++i)
+            {
+                udp_socket.send_to(request, sizeof(request), sink_addr);
+            }
+            report("CUdpSocket send_to", times, stop_watch.get_elapsed_microseconds());
+
+            muidor::CDatagramSocket datagram_socket;
+            muidor::CDatagramBatch batch(BATCH_SIZE, sizeof(request));
+            if (-1 == datagram_socket.open())
+                THROW_SYSCALL_EXCEPTION(NULL, errno, "socket");
+            for (uint32_t i=0; i<batch.capacity(); ++i)
+            {
+                memcpy(batch.buffer(i), request, sizeof(request));
+                batch.set(i, sizeof(request), sink_addr);
+            }
+            (void)stop_watch.get_elapsed_microseconds(); // 重新计时
+            for (uint64_t i=0; i<times; i+=batch.capacity())
+            {
+                if (-1 == datagram_socket.send_batch(&batch, 0, batch.capacity()))
+                    THROW_SYSCALL_EXCEPTION(NULL, errno, "sendmmsg");
+            }
+            report("CDatagramSocket send_batch", times, stop_watch.get_elapsed_microseconds());
+        }
+    }
+    catch (mooon::sys::CSyscallException& ex)
+    {
+        fprintf(stderr, "%s\n", ex.str().c_str());
+        exit(1);
+    }
+
+    return 0;
+}
+
+void usage()
+{
+    fprintf(stderr, "Usage1: muidor_socket_bench\n");
+    fprintf(stderr, "Usage2: muidor_socket_bench times\n");
+    fprintf(stderr, "Usage3: muidor_socket_bench times port\n");
+}
+
+void echo_thread(uint16_t port)
+{
+    muidor::CDatagramSocket datagram_socket;
+    muidor::CDatagramBatch requests(BATCH_SIZE, muidor::SOCKET_BUFFER_SIZE);
+
+    if (-1 == datagram_socket.listen("127.0.0.1", port, true))
+    {
+        fprintf(stderr, "listen on %u failed: %s\n", (unsigned int)port, strerror(errno));
+        exit(1);
+    }
+    while (!g_stop)
+    {
+        struct pollfd fds[1];
+        fds[0].fd = datagram_socket.get_fd();
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        if (poll(fds, 1, 100) <= 0)
+            continue;
+
+        const int n = datagram_socket.receive_batch(&requests);
+        if (n > 0)
+        {
+            // 原地回显：接收时已填好地址和大小
+            for (int i=0; i<n; ++i)
+                requests.set(i, requests.length(i), requests.addr(i));
+            (void)datagram_socket.send_batch(&requests, 0, static_cast<uint32_t>(n));
+        }
+    }
+}
+
+void report(const char* name, uint64_t times, unsigned int total_microseconds)
+{
+    if (0 == total_microseconds)
+        total_microseconds = 1;
+    fprintf(stdout, "%-40s %.2fms, %.3fus/op, %.2f/s\n", name,
+            (double)total_microseconds/1000, (double)total_microseconds/times, (double)(times*1000000)/total_microseconds);
+}
@@ -26,7 +26,7 @@
 // Uidor压力测试工具
 
 static void usage();
-static void thread_proc(uint64_t times, const char* agent_nodes, bool polling);
+static void thread_proc(uint64_t times, const muidor::CMuidor* muidor);
 
 // Usage1: muidor_stress muidor_agent_nodes
 // Usage2: muidor_stress muidor_agent_nodes times
@@ -64,13 +64,20 @@ int main(int argc, char* argv[])
 
     try
     {
+        // 所有线程共用一个实例
+        const uint32_t timeout_milliseconds = 200;
+        const uint8_t retry_times = 5;
+        const std::string agent_nodes_(agent_nodes);
+        muidor::CMuidor muidor(agent_nodes_, timeout_milliseconds, retry_times, polling);
+        const muidor::CMuidor* shared_muidor = &muidor;
+
         uint64_t i = 0;
         mooon::sys::CThreadEngine* thread_engine;
         std::vector<mooon::sys::CThreadEngine*> thread_pool(concurrency);
         mooon::sys::CStopWatch stop_watch;
         for (i=0; i<concurrency; ++i)
         {
-            thread_engine = new mooon::sys::CThreadEngine(mooon::sys::bind(&thread_proc, times, agent_nodes, polling));
+            thread_engine = new mooon::sys::CThreadEngine(mooon::sys::bind(&thread_proc, times, shared_muidor));
             thread_pool[i] = thread_engine;
         }
         for (i=0; i<concurrency; ++i)
@@ -85,6 +92,11 @@ int main(int argc, char* argv[])
         fprintf(stdout, "%.2fms, %0.2fms, %.2f/s\n", (double)total_microseconds/1000, (double)total_microseconds/(1000*times*concurrency), (double)(times*concurrency*1000000)/total_microseconds);
     }
     catch (mooon::sys::CSyscallException& ex)
+    {
+        fprintf(stderr, "%s\n", ex.str().c_str());
+        exit(1);
+    }
+    catch (mooon::utils::CException& ex)
     {
         fprintf(stderr, "%s\n", ex.str().c_str());
         exit(1);
@@ -101,20 +113,16 @@ void usage()
 	fprintf(stderr, "Usage4: muidor_stress muidor_agent_nodes times concurrency poll\n");
 }
 
-void thread_proc(uint64_t times, const char* agent_nodes, bool polling)
+void thread_proc(uint64_t times, const muidor::CMuidor* muidor)
 {
-    uint32_t timeout_milliseconds = 200;
-    uint8_t retry_times = 5;
-
     for (uint64_t i=0; i<times; ++i)
     {
         try
         {
-            muidor::CMuidor muidor(agent_nodes, timeout_milliseconds, retry_times, polling);
 #if 1
-            uint64_t uid = muidor.get_uniq_id();
+            uint64_t uid = muidor->get_uniq_id();
 #else
-            uint64_t uid = muidor.get_local_uniq_id();
+            uint64_t uid = muidor->get_local_uniq_id();
 #endif
             union muidor::UniqID uid_struct;
             uid_struct.value = uid;
@@ -20,6 +20,7 @@
 #include <mooon/sys/stop_watch.h>
 #include <mooon/sys/thread_engine.h>
 #include <mooon/utils/string_utils.h>
+#include <stdarg.h>
 #include <time.h>
 #include <vector>
 
@@ -31,6 +32,14 @@ static void usage();
 // polling 控制取agent的方式，为true表示轮询，否则表示随机
 static void print_transaction_id(const char* agent_nodes, bool polling);
 
+// 检查agent只接受当前小时前后一小时的UniqID请求，未来的小时不能替换掉当前小时的槽，
+// 通过返回true
+static bool check_hour_range(const char* agent_nodes);
+
+// 检查预编译的流水号格式和原来逐个解析format的结果一致（期望值由原实现生成），不需要agent，
+// 通过返回true
+static bool check_transaction_id_format();
+
 // Usage1: uniq_cli agent_nodes
 // Usage2: uniq_cli agent_nodes poll
 int main(int argc, char* argv[])
@@ -47,11 +56,15 @@ int main(int argc, char* argv[])
     {
         polling = true;
     }
+    if (!check_transaction_id_format())
+        return 1;
 
     print_transaction_id(agent_nodes, polling);
     fprintf(stdout, "agent_nodes: %s\n", agent_nodes);
+    if (!check_hour_range(agent_nodes))
+        return 1;
 
-	return 0;
+    return 0;
 }
 
 void usage()
@@ -117,6 +130,15 @@ void print_transaction_id(const char* agent_nodes, bool polling)
         }
         fprintf(stdout, "\n");
 
+        // 批量取128位UUID
+        std::vector<struct muidor::UUID128> uuid_vec(num);
+        muidor.get_uuid(num, &uuid_vec[0]);
+        for (uint16_t i=0; i<num; ++i)
+        {
+            fprintf(stdout, "uuid: %s => ulid: %s\n", uuid_vec[i].str().c_str(), muidor::uuid2ulid(uuid_vec[i]).c_str());
+        }
+        fprintf(stdout, "\n");
+
         for (int i=0; i<2; ++i)
         {
             uint8_t label = 0;
@@ -141,3 +163,137 @@ void print_transaction_id(const char* agent_nodes, bool polling)
         fprintf(stderr, "%s\n", ex.str().c_str());
     }
 }
+
+bool check_hour_range(const char* agent_nodes)
+{
+    try
+    {
+        muidor::CMuidor muidor(agent_nodes, 200, 3);
+        const uint64_t now = static_cast<uint64_t>(time(NULL));
+        uint64_t id = 0;
+
+        // 以前两个未来的小时会替换掉agent的两个槽，之后当前小时返回MUE_OVERFLOW
+        const uint64_t hours[] = { now + 3*3600, now + 4*3600, now - 3*3600 };
+        for (size_t i=0; i<sizeof(hours)/sizeof(hours[0]); ++i)
+        {
+            const int errcode = muidor.try_get_uniq_id(&id, 0, hours[i]);
+            if (errcode != muidor::MUE_PARAMETER)
+            {
+                fprintf(stderr, "hour check failed: %+d hours => %d\n", (int)((int64_t)(hours[i]-now)/3600), errcode);
+                return false;
+            }
+        }
+
+        const int errcode = muidor.try_get_uniq_id(&id, 0, now);
+        if (errcode != 0)
+        {
+            fprintf(stderr, "hour check failed: current hour => %d\n", errcode);
+            return false;
+        }
+
+        fprintf(stdout, "hour check: ok\n");
+        return true;
+    }
+    catch (mooon::utils::CException& ex)
+    {
+        fprintf(stderr, "%s\n", ex.str().c_str());
+        return false;
+    }
+}
+
+// 以label为0x1F组装num个（不超过2个）流水号，和expected比较，可变参数同get_transaction_id
+static bool check_format(const char* format, uint32_t seq, uint16_t num, const char* expected0, const char* expected1, ...)
+{
+    const char* expected[2] = { expected0, expected1 };
+    muidor::CTransactionIdFormat compiled_format;
+    muidor::CTransactionIdBatch batch;
+    if (compiled_format.compile(format) != 0)
+    {
+        fprintf(stderr, "format check failed: [%s] => %s\n", format, muidor::CMuidor::get_last_error().str().c_str());
+        return false;
+    }
+
+    va_list ap;
+    va_start(ap, expected1);
+    compiled_format.vrender(0x1F, seq, num, &batch, ap);
+    va_end(ap);
+    for (uint16_t i=0; i<num; ++i)
+    {
+        if ((batch.str(i) != expected[i]) || (strlen(batch.data(i)) != batch.length(i)))
+        {
+            fprintf(stderr, "format check failed: [%s] seq=%u => [%s], expected: [%s]\n", format, seq+i, batch.data(i), expected[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+// format无效时compile返回MUE_PARAMETER，构造函数抛异常
+static bool check_format_error(const char* format)
+{
+    muidor::CTransactionIdFormat compiled_format;
+    if (compiled_format.compile(format) != muidor::MUE_PARAMETER)
+    {
+        fprintf(stderr, "format check failed: [%s] compiled\n", format);
+        return false;
+    }
+
+    try
+    {
+        muidor::CTransactionIdFormat throwing_format(format);
+        fprintf(stderr, "format check failed: [%s] not thrown\n", format);
+        return false;
+    }
+    catch (mooon::utils::CException& ex)
+    {
+        return muidor::MUE_PARAMETER == ex.errcode();
+    }
+}
+
+bool check_transaction_id_format()
+{
+    bool ok =
+        // %S为十进制，%NS取N位（对N个9取模）不足补0，%NX同理
+        check_format("%S", 123456789, 2, "123456789", "123456790") &&
+        check_format("%S", 4294967295U, 2, "4294967295", "0") &&
+        check_format("%5S", 123456789, 2, "58023", "58024") &&
+        check_format("%5S", 99999, 2, "00000", "00001") &&
+        check_format("02%L%8S%s", 7, 2, "021F00000007##", "021F00000008##", "##") &&
+        check_format("%s02%L%8S", 7, 1, "##021F00000007", NULL, "##") &&
+        check_format("%3d-%S", 7, 1, "009-7", NULL, 9) &&
+        check_format("%2X-%S", 7, 1, "52-7", NULL, 1000) &&
+        check_format("%d|%X|%S", 7, 1, "-5|FF|7", NULL, -5, 255) &&
+        // 紧跟在%L或%X之后的%S为十六进制
+        check_format("%L%S", 123456789, 2, "1F75BCD15", "1F75BCD16") &&
+        check_format("%X%S", 123456789, 2, "FF75BCD15", "FF75BCD16", 255) &&
+        check_format("%L-%5S-%S", 123456789, 2, "1F-58023-123456789", "1F-58024-123456790") &&
+        // 宽度为0或超过9、未知的或不完整的%均为无效的format
+        check_format_error("%0S") &&
+        check_format_error("%0X") &&
+        check_format_error("%10S") &&
+        check_format_error("%10X") &&
+        check_format_error("%12d") &&
+        check_format_error("100%%S") &&
+        check_format_error("%q") &&
+        check_format_error("abc%");
+
+    if (ok)
+    {
+        // 时间取组装时的本地时间，跨小时的那一刻可能不一致，前后各取一次
+        char before[sizeof("YYYYMMDDHH")], after[sizeof("YYYYMMDDHH")];
+        time_t now = time(NULL);
+        struct tm tm;
+        strftime(before, sizeof(before), "%Y%m%d%H", localtime_r(&now, &tm));
+        const std::string id = muidor::CMuidor::format_transaction_id(0x1F, 7, "%Y%M%D%H%L%S");
+        now = time(NULL);
+        strftime(after, sizeof(after), "%Y%m%d%H", localtime_r(&now, &tm));
+        if ((id != std::string(before) + "1F7") && (id != std::string(after) + "1F7"))
+        {
+            fprintf(stderr, "format check failed: [%%Y%%M%%D%%H%%L%%S] => [%s], expected: [%s1F7]\n", id.c_str(), before);
+            ok = false;
+        }
+    }
+
+    fprintf(stdout, "transaction id format check: %s\n", ok? "ok": "FAILED");
+    return ok;
+}
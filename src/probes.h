@@ -0,0 +1,64 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#ifndef MOOON_MUIDOR_PROBES_H
+#define MOOON_MUIDOR_PROBES_H
+
+// USDT静态探针，provider为muidor，
+// 未被跟踪时每个探针只是一条nop指令（参数只作为它的操作数描述，不产生额外的调用），可一直编译在代码中；
+// 被bpftrace等挂上后才触发，用法见tools目录下的脚本。
+//
+// 需要systemtap的sys/sdt.h（CentOS为systemtap-sdt-devel，Ubuntu为systemtap-sdt-dev），
+// 没有时自动退化为空宏，也可定义MUIDOR_NO_SDT强制关闭。
+//
+// agent的探针：
+//   request_receive(type, echo, ip, port, size)  收到请求，ip和port为网络字节序
+//   request_dispatch(type, echo, errcode)        请求处理完成，errcode为0表示成功
+//   reply_send(num, sent)                        一批应答发出，sent为-1表示出错
+//   request_drop(num, total)                     发现内核因接收队列满丢弃了num个请求，total为内核的累计数
+//   sequence_inc(seq, num, high_water)           分配seq，high_water为已预留的上限
+//   hour_seq_inc(hour, seq, num, high_water)     分配按小时的seq（UniqID和SortableID），hour为get_base_hours的值
+//   sequence_store(generation, sequence, sync)   开始写序列文件的槽
+//   sequence_stored(generation, ok)              写完序列文件的槽（sync时含fdatasync）
+//   label_change(old_label, new_label)
+//
+// 客户端（CMuidor）的探针：
+//   client_request(type, echo, ip, port, retry)  向agent发出请求
+//   client_response(type, echo, errcode)         收到有效应答（errcode为0）或最终出错，type为期望的应答类型
+//   client_retry(type, echo, retry, errcode)     重试前，type同client_response
+//   client_hedge(type, echo, ip, port)           等待超过对冲延迟，将同一请求再发给另一个agent
+#if !defined(MUIDOR_NO_SDT) && defined(__has_include)
+#   if __has_include(<sys/sdt.h>)
+#       define MUIDOR_HAVE_SDT 1
+#   endif
+#endif
+
+#if MUIDOR_HAVE_SDT == 1
+#include <sys/sdt.h>
+#define MU_PROBE2(name, a1, a2) DTRACE_PROBE2(muidor, name, a1, a2)
+#define MU_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(muidor, name, a1, a2, a3)
+#define MU_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(muidor, name, a1, a2, a3, a4)
+#define MU_PROBE5(name, a1, a2, a3, a4, a5) DTRACE_PROBE5(muidor, name, a1, a2, a3, a4, a5)
+#else
+#define MU_PROBE2(name, a1, a2) do {} while(false)
+#define MU_PROBE3(name, a1, a2, a3) do {} while(false)
+#define MU_PROBE4(name, a1, a2, a3, a4) do {} while(false)
+#define MU_PROBE5(name, a1, a2, a3, a4, a5) do {} while(false)
+#endif // MUIDOR_HAVE_SDT
+
+#endif // MOOON_MUIDOR_PROBES_H
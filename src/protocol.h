@@ -22,6 +22,10 @@
 #include "muidor/muidor.h"
 #include <mooon/net/inttypes.h>
 #include <mooon/utils/string_utils.h>
+
+// 客户端（CMuidor和CAsyncMuidor）是否检查应答的magic
+#define _CHECK_MAGIC_ 1
+
 namespace muidor {
 
 // 常量
@@ -38,7 +42,13 @@ enum
     LABEL_MAX = 254,                      // Label最大的取值（不包含0，从1开始），注意只能为254，不能为更大的值
     LABEL_EXPIRED_SECONDS = (3600*24*15), // Label多少小秒过期，默认15天
     ECHO_START = 1357, // echo起始值，为0容易恰好碰上
-    RETRY_MAX = 128 // 最多重试次数，如果超过则会置为128
+    RETRY_MAX = 128, // 最多重试次数，如果超过则会置为128
+    COUNTER_NAME_MAX = 64, // 计数器名的最大字节数，名字紧跟在消息头之后
+    HOUR_SEQ_MAX = 0x20000000, // UniqID和SortableID的seq为29位，每小时的seq从0开始，最多这么多个
+    SEQ_HOURLY = 1, // REQUEST_LABEL_AND_SEQ的value2，表示从value3指定小时的seq中分配，用于在本地组装UniqID和SortableID
+    LOAD_HINT_MINOR_VERSION = 5, // 请求的次版本号不小于它时，agent在应答后附加LoadHint
+    ENCODING_MINOR_VERSION = 6, // 请求的次版本号不小于它时，REQUEST_UNIQ_ID的value2才是ID的编码方式
+    HOUR_SEQ_MINOR_VERSION = 6 // 请求的次版本号小于它时，agent拒绝REQUEST_LABEL_AND_SEQ，见prepare_response_get_label_and_seq
 };
 
 // 命令字
@@ -47,13 +57,21 @@ enum
     REQUEST_LABEL = 1,
     REQUEST_UNIQ_ID = 2,
     REQUEST_UNIQ_SEQ = 3,
-    REQUEST_LABEL_AND_SEQ = 4,
+    REQUEST_LABEL_AND_SEQ = 4, // value1为个数，value2为SEQ_HOURLY时value3为get_base_hours的值
+    REQUEST_SEGMENT = 5,  // agent向master取号段，value1为tag，value2为agent的label
+    REQUEST_TAG_SEQ = 6,  // 按tag取号，value1为tag，value2为个数
+    REQUEST_COUNTER = 7,  // 递增命名计数器，value1为计数器名的crc32，value2为个数，计数器名跟在消息头之后
+    REQUEST_REPLICATE = 8, // agent向peer复制sequence的上限，value1为agent的监听端口，value3为上限，为0表示只查询
 
     RESPONSE_ERROR = 100,
     RESPONSE_LABEL = 101,
     RESPONSE_UNIQ_ID = 102,
     RESPONSE_UNIQ_SEQ = 103,
-    RESPONSE_LABEL_AND_SEQ = 104
+    RESPONSE_LABEL_AND_SEQ = 104,
+    RESPONSE_SEGMENT = 105, // value1为tag，value2为号段大小，value3为号段的起始值
+    RESPONSE_TAG_SEQ = 106, // value1为tag，value2为实际取得的个数，value3为起始值
+    RESPONSE_COUNTER = 107, // value1为计数器名的crc32，value2为实际取得的个数，value3为起始值
+    RESPONSE_REPLICATE = 108 // value3为peer上保存的上限
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -112,6 +130,21 @@ struct MessageHead
     }
 };
 
+// 命名计数器请求，len为消息头大小加上计数器名的实际长度
+struct CounterRequest
+{
+    struct MessageHead head;
+    char name[COUNTER_NAME_MAX];
+};
+
+// agent的负载提示，附加在应答的消息头之后（计入len），
+// 只对客户端的请求且请求的minor_ver不小于LOAD_HINT_MINOR_VERSION时附加，老版本的客户端不受影响
+struct LoadHint
+{
+    nuint16_t busy;     // 数据线程最近的忙碌程度，千分比，接收队列有丢弃时为1000
+    nuint16_t reserved;
+};
+
 #pragma pack()
 
 } // namespace muidor {
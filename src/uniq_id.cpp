@@ -0,0 +1,200 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#include "muidor/muidor.h"
+#include <time.h>
+namespace muidor {
+
+// 从公元元年起的天数（前推格里高利历），用于计算两个日期间相差的天数
+static int64_t days_from_civil(int year, int month, int day)
+{
+    year -= (month <= 2)? 1: 0;
+    const int64_t era = year / 400;
+    const int64_t yoe = year - era * 400;
+    const int64_t doy = (153 * (month + ((month > 2)? -3: 9)) + 2) / 5 + day - 1;
+    const int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe;
+}
+
+uint32_t get_base_hours(uint64_t current_seconds)
+{
+    struct tm now;
+    time_t current_time = (0 == current_seconds)? time(NULL): static_cast<time_t>(current_seconds);
+    localtime_r(&current_time, &now);
+    return get_base_hours(now.tm_year+1900, now.tm_mon+1, now.tm_mday, now.tm_hour);
+}
+
+uint32_t get_base_hours(int year, int month, int day, int hour)
+{
+    const int64_t days = days_from_civil(year, month, day) - days_from_civil(MU_BASE_YEAR, 1, 1);
+    return (days < 0)? 0: static_cast<uint32_t>(days * 24 + hour);
+}
+
+uint64_t encode_sortable_id(uint8_t user, uint8_t label, uint32_t seq, uint32_t hour)
+{
+    union SortableID sortable_id;
+    sortable_id.id.user = user;
+    sortable_id.id.label = label;
+    sortable_id.id.seq = seq;
+    sortable_id.id.hour = hour;
+    return sortable_id.value;
+}
+
+void decode_sortable_id(uint64_t sortable_id, uint8_t* user, uint8_t* label, uint32_t* seq, uint32_t* hour)
+{
+    union SortableID sortable_id_;
+    sortable_id_.value = sortable_id;
+    if (user != NULL)
+        *user = static_cast<uint8_t>(sortable_id_.id.user);
+    if (label != NULL)
+        *label = static_cast<uint8_t>(sortable_id_.id.label);
+    if (seq != NULL)
+        *seq = static_cast<uint32_t>(sortable_id_.id.seq);
+    if (hour != NULL)
+        *hour = static_cast<uint32_t>(sortable_id_.id.hour);
+}
+
+uint64_t uniq_id2sortable_id(uint64_t uniq_id)
+{
+    union UniqID uniq_id_;
+    uniq_id_.value = uniq_id;
+
+    const uint32_t hour = get_base_hours(
+            (int)uniq_id_.id.year+MU_BASE_YEAR, (int)uniq_id_.id.month, (int)uniq_id_.id.day, (int)uniq_id_.id.hour);
+    return encode_sortable_id(uniq_id_.id.user, uniq_id_.id.label, uniq_id_.id.seq, hour);
+}
+
+uint64_t sortable_id2uniq_id(uint64_t sortable_id)
+{
+    union SortableID sortable_id_;
+    sortable_id_.value = sortable_id;
+
+    // hour是日历计算的结果，反推日期时同样只做日历计算
+    const int64_t days = days_from_civil(MU_BASE_YEAR, 1, 1) + sortable_id_.id.hour / 24;
+    const int64_t era = days / 146097;
+    const int64_t doe = days - era * 146097;
+    const int64_t yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+    const int64_t doy = doe - (365*yoe + yoe/4 - yoe/100);
+    const int64_t mp = (5*doy + 2) / 153;
+    const int day = static_cast<int>(doy - (153*mp + 2)/5 + 1);
+    const int month = static_cast<int>((mp < 10)? mp+3: mp-9);
+    const int year = static_cast<int>(yoe + era * 400 + ((month <= 2)? 1: 0));
+
+    union UniqID uniq_id;
+    uniq_id.id.user = sortable_id_.id.user;
+    uniq_id.id.label = sortable_id_.id.label;
+    uniq_id.id.year = year - MU_BASE_YEAR;
+    uniq_id.id.month = month;
+    uniq_id.id.day = day;
+    uniq_id.id.hour = sortable_id_.id.hour % 24;
+    uniq_id.id.seq = sortable_id_.id.seq;
+    return uniq_id.value;
+}
+
+void encode_uuid(uint8_t label, uint32_t seq, uint64_t milliseconds, uint64_t random, struct UUID128* uuid)
+{
+    // 高64位：48位时间戳、4位版本号、8位label和4位随机数
+    const uint64_t high = ((milliseconds & 0xFFFFFFFFFFFFULL) << 16) | (0x7ULL << 12) | (static_cast<uint64_t>(label) << 4) | (random >> 60);
+    // 低64位：2位变体、32位seq和30位随机数
+    const uint64_t low = (0x2ULL << 62) | (static_cast<uint64_t>(seq) << 30) | (random & 0x3FFFFFFFULL);
+
+    for (int i=0; i<8; ++i)
+    {
+        uuid->bytes[i] = static_cast<uint8_t>(high >> (56 - i*8));
+        uuid->bytes[i+8] = static_cast<uint8_t>(low >> (56 - i*8));
+    }
+}
+
+void decode_uuid(const struct UUID128& uuid, uint8_t* label, uint32_t* seq, uint64_t* milliseconds)
+{
+    uint64_t high = 0;
+    uint64_t low = 0;
+
+    for (int i=0; i<8; ++i)
+    {
+        high = (high << 8) | uuid.bytes[i];
+        low = (low << 8) | uuid.bytes[i+8];
+    }
+    if (label != NULL)
+        *label = static_cast<uint8_t>(high >> 4);
+    if (seq != NULL)
+        *seq = static_cast<uint32_t>(low >> 30);
+    if (milliseconds != NULL)
+        *milliseconds = high >> 16;
+}
+
+const char* uuid2string(const struct UUID128& uuid, char str[37], bool uppercase)
+{
+    const char* digits = uppercase? "0123456789ABCDEF": "0123456789abcdef";
+    char* p = str;
+
+    for (int i=0; i<16; ++i)
+    {
+        if ((4 == i) || (6 == i) || (8 == i) || (10 == i))
+            *p++ = '-';
+        *p++ = digits[uuid.bytes[i] >> 4];
+        *p++ = digits[uuid.bytes[i] & 0x0F];
+    }
+
+    *p = '\0';
+    return str;
+}
+
+std::string uuid2string(const struct UUID128& uuid, bool uppercase)
+{
+    char str[37];
+    return std::string(uuid2string(uuid, str, uppercase), 36);
+}
+
+const char* uuid2ulid(const struct UUID128& uuid, char str[27])
+{
+    static const char digits[] = "0123456789ABCDEFGHJKMNPQRSTVWXYZ";
+    uint64_t high = 0;
+    uint64_t low = 0;
+
+    for (int i=0; i<8; ++i)
+    {
+        high = (high << 8) | uuid.bytes[i];
+        low = (low << 8) | uuid.bytes[i+8];
+    }
+
+    // 128位从低到高每5位一个字符，最高的字符只有3位
+    for (int i=25; i>0; --i)
+    {
+        str[i] = digits[low & 0x1F];
+        low = (low >> 5) | (high << 59);
+        high >>= 5;
+    }
+
+    str[0] = digits[low & 0x07];
+    str[26] = '\0';
+    return str;
+}
+
+std::string uuid2ulid(const struct UUID128& uuid)
+{
+    char str[27];
+    return std::string(uuid2ulid(uuid, str), 26);
+}
+
+std::string UUID128::str() const
+{
+    return uuid2string(*this);
+}
+
+} // namespace muidor {